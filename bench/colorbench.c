@@ -0,0 +1,503 @@
+#include "../src/main.h"
+
+#include <inttypes.h>
+#include <time.h>
+
+#include "../src/colorizer.h"
+#include "../src/mode.h"
+
+//
+// Colorizer Benchmark.
+//  -> Runs every language mode over a set of corpora and reports throughput.
+//  -> Generated corpora are deterministic; their style output is hashed and
+//      checked against bench/golden.txt so that colorizer changes can be
+//      verified to not alter highlighting.
+//  -> Files given on the command line are timed but not checked.
+//
+// Usage: colorbench [-u] [-m MB] [-g golden] [-d corpus] [files...]
+//  -u  rewrite the golden file instead of checking it.
+//  -m  size of each generated corpus in megabytes (default 4); at least the
+//      golden prefix is always generated.
+//  -g  golden file path (default bench/golden.txt).
+//  -d  dump styles of a generated corpus (first mode) to stdout.
+//
+
+
+//
+// Corpus.
+//
+
+typedef struct {
+    const char* name;
+    uint32_t* chars;
+    uint32_t size;
+    uint32_t capacity;
+    uint32_t lines;
+    uint64_t bytes;
+    bool golden;
+} Corpus;
+
+static
+void corpus_init (Corpus* corpus, const char* name, bool golden) {
+    corpus->name = name;
+    corpus->capacity = 1 << 16;
+    corpus->chars = malloc(corpus->capacity * sizeof(uint32_t));
+    corpus->size = 0;
+    corpus->lines = 0;
+    corpus->bytes = 0;
+    corpus->golden = golden;
+}
+
+static
+void corpus_fini (Corpus* corpus) {
+    free(corpus->chars);
+}
+
+static
+void corpus_put (Corpus* corpus, uint32_t ch) {
+    if (corpus->size >= corpus->capacity) {
+        corpus->capacity *= 2;
+        corpus->chars = realloc(corpus->chars, corpus->capacity * sizeof(uint32_t));
+    }
+    corpus->chars[corpus->size++] = ch;
+    corpus->bytes += ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+    if (ch == '\n') corpus->lines++;
+}
+
+static
+void corpus_str (Corpus* corpus, const char* str) {
+    while (*str) corpus_put(corpus, (unsigned char) *str++);
+}
+
+static
+bool corpus_read (Corpus* corpus, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return false;
+
+    int c;
+    while ((c = getc(f)) != EOF) {
+        // Latin-1 is close enough for timing purposes.
+        corpus_put(corpus, (unsigned char) c);
+    }
+    fclose(f);
+    return true;
+}
+
+
+//
+// Corpus Generators.
+//  -> A fixed-seed LCG keeps the output identical across runs and machines.
+//
+
+static uint32_t rng_state;
+
+static
+uint32_t rng (uint32_t n) {
+    rng_state = rng_state * 1103515245u + 12345u;
+    return (rng_state >> 16) % n;
+}
+
+static const char* words[] = {
+    "int", "long", "char", "unsigned", "static", "const", "struct", "return",
+    "if", "else", "while", "for", "sizeof", "typedef", "void", "bool",
+    "ifeq", "endif", "include", "wildcard", "patsubst", "filter-out", "shell",
+    "node", "buffer", "Rope", "State", "Colorizer", "i", "x", "len", "data",
+    "NODE_CONTENT_SIZE", "array_add", "rope_len", "intoverride", "returned",
+};
+
+static const char* symbols[] = {
+    "(", ")", "[", "]", "{", "}", ";", ":", ",", ".", "->", "?", "=", "+",
+    "*", "&", "|", "%", "$", "$<", "$^", "@", "<", ">", "!", "-", "/", "\\",
+};
+
+static
+void put_word (Corpus* corpus) {
+    corpus_str(corpus, words[rng(sizeof(words)/sizeof(words[0]))]);
+}
+
+static
+void put_symbol (Corpus* corpus) {
+    corpus_str(corpus, symbols[rng(sizeof(symbols)/sizeof(symbols[0]))]);
+}
+
+static
+void put_indent (Corpus* corpus) {
+    uint32_t depth = rng(4);
+    for (int i = 0; i < depth; i++)
+        corpus_put(corpus, rng(4) == 0 ? '\t' : ' ');
+}
+
+// Deeply nested and multi-line block comments, mixed with line comments.
+static
+void gen_nested_comments (Corpus* corpus, uint64_t bytes) {
+    while (corpus->bytes < bytes) {
+        put_indent(corpus);
+        uint32_t n = rng(12);
+        for (int i = 0; i < n; i++) {
+            switch (rng(10)) {
+                case 0: corpus_str(corpus, "/*"); break;
+                case 1: corpus_str(corpus, "*/"); break;
+                case 2: corpus_str(corpus, "/* /* "); break;
+                case 3: corpus_str(corpus, " */ */"); break;
+                case 4: corpus_str(corpus, "// "); break;
+                case 5: corpus_str(corpus, "# "); break;
+                case 6: put_symbol(corpus); break;
+                default: put_word(corpus); break;
+            }
+            corpus_put(corpus, ' ');
+        }
+        corpus_put(corpus, '\n');
+    }
+}
+
+// Long string and character literals with escapes.
+static
+void gen_long_strings (Corpus* corpus, uint64_t bytes) {
+    while (corpus->bytes < bytes) {
+        put_indent(corpus);
+        put_word(corpus);
+        corpus_str(corpus, " = \"");
+        uint32_t n = 20 + rng(400);
+        for (int i = 0; i < n; i++) {
+            switch (rng(24)) {
+                case 0: corpus_str(corpus, "\\\""); break;
+                case 1: corpus_str(corpus, "\\\\"); break;
+                case 2: corpus_str(corpus, "'"); break;
+                case 3: corpus_str(corpus, "/*"); break;
+                case 4: corpus_put(corpus, 0xE9); break;
+                case 5: corpus_put(corpus, 0x263A); break;
+                case 6: put_word(corpus); break;
+                default: corpus_put(corpus, 'a' + rng(26)); break;
+            }
+        }
+        // Occasionally leave the string open across lines.
+        if (rng(8) != 0) corpus_put(corpus, '"');
+        corpus_str(corpus, rng(2) ? " + '\\'';" : ";");
+        corpus_put(corpus, '\n');
+    }
+}
+
+// Very long lines of dense code with no whitespace.
+static
+void gen_minified (Corpus* corpus, uint64_t bytes) {
+    while (corpus->bytes < bytes) {
+        uint32_t n = 20000 + rng(40000);
+        for (int i = 0; i < n; i++) {
+            if (rng(3) == 0) put_word(corpus);
+            else put_symbol(corpus);
+            if (rng(50) == 0) corpus_str(corpus, "\"s\"");
+        }
+        corpus_put(corpus, '\n');
+    }
+}
+
+// Ordinary keyword-dense source lines.
+static
+void gen_keywords (Corpus* corpus, uint64_t bytes) {
+    while (corpus->bytes < bytes) {
+        put_indent(corpus);
+        uint32_t n = 2 + rng(10);
+        for (int i = 0; i < n; i++) {
+            put_word(corpus);
+            if (rng(3) == 0) put_symbol(corpus);
+            corpus_put(corpus, ' ');
+        }
+        corpus_put(corpus, '\n');
+    }
+}
+
+
+//
+// Colorizer Driver.
+//  -> Mirrors the per-line loop in textview_draw, including tab expansion.
+//
+
+typedef struct {
+    double seconds;
+    double seconds_fast;
+    uint64_t transitions;
+    uint64_t hash;
+} Result;
+
+// Only lines starting within this prefix are hashed, so golden hashes
+//  do not depend on the corpus size; generated corpora always hold it.
+#define GOLDEN_CHARS (1 << 20)
+
+static
+uint64_t hash_style (uint64_t hash, int32_t* style, uint32_t len) {
+    // FNV-1a.
+    for (int i = 0; i < len; i++) {
+        hash ^= (uint32_t) style[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= '\n';
+    hash *= 1099511628211ull;
+    return hash;
+}
+
+static
+void dump_style (uint32_t* chars, int32_t* style, uint32_t len, uint32_t tab_width) {
+    // One line of text followed by one line of style codes.
+    //  Style codes: '.' plain, then the lowest set style bit as a letter.
+    static const char codes[] = "sckn\"'";
+    uint32_t col = 0;
+    for (int i = 0; i < len; i++) {
+        uint32_t ch = chars[i];
+        if (ch == '\t') {
+            do putchar(' '); while (++col % tab_width);
+        } else {
+            putchar(ch < 32 || ch > 126 ? '?' : ch);
+            col++;
+        }
+    }
+    putchar('\n');
+    for (int c = 0; c < col; c++) {
+        int32_t s = style[c] >> 2;
+        int bit = 0;
+        while (s && !(s & 1)) { s >>= 1; bit++; }
+        putchar(s ? codes[bit] : '.');
+    }
+    putchar('\n');
+}
+
+static
+void run_mode (Mode* mode, Corpus* corpus, Result* result, bool dump) {
+    const uint32_t tab_width = 4;
+
+    // Style buffer large enough for the longest (tab-expanded) line.
+    uint32_t width = 0, line_len = 0;
+    for (int i = 0; i < corpus->size; i++) {
+        line_len += corpus->chars[i] == '\t' ? tab_width : 1;
+        if (corpus->chars[i] == '\n') {
+            width = MAX(width, line_len);
+            line_len = 0;
+        }
+    }
+    width = MAX(width, line_len) + 1;
+    int32_t* style = malloc(width * sizeof(int32_t));
+
+    // Full path: styles are produced and hashed.
+    Colorizer colorizer = { .mode = mode };
+    LineState start_state = {0};
+    uint64_t hash = 14695981039346656037ull;
+    uint64_t transitions = 0;
+
+    double t0 = now();
+    for (int i = 0; i < corpus->size;) {
+        int j = i;
+        while (j < corpus->size && corpus->chars[j] != '\n') j++;
+
+        memset(style, 0, width * sizeof(int32_t));
+        colorize_begin_line(&colorizer, &start_state);
+
+        uint32_t col = 0;
+        for (int x = i; x <= j; x++) {
+            uint32_t ch = x < j ? corpus->chars[x] : '\n';
+            if (ch == '\t') col += tab_width - (col % tab_width);
+            else col++;
+
+            State* before = colorizer.state;
+            colorize_next_char(&colorizer, ch, col, 0, width, style);
+            if (colorizer.state != before) transitions++;
+        }
+        colorize_end_line(&colorizer, &start_state);
+
+        if (i < GOLDEN_CHARS) hash = hash_style(hash, style, col);
+        if (dump) dump_style(corpus->chars + i, style, j - i, tab_width);
+
+        i = j + 1;
+    }
+    double t1 = now();
+
+    // Fast path: line states only.
+    start_state = (LineState) {0};
+    for (int i = 0; i < corpus->size;) {
+        colorize_begin_line(&colorizer, &start_state);
+        while (i < corpus->size && corpus->chars[i] != '\n') {
+            colorize_next_char_fast(&colorizer, corpus->chars[i]);
+            i++;
+        }
+        colorize_next_char_fast(&colorizer, '\n');
+        colorize_end_line(&colorizer, &start_state);
+        i++;
+    }
+    double t2 = now();
+
+    free(style);
+
+    result->seconds = t1 - t0;
+    result->seconds_fast = t2 - t1;
+    result->transitions = transitions;
+    result->hash = hash;
+}
+
+
+//
+// Golden File.
+//  -> One line per generated corpus and mode: "<mode> <corpus> <hash>".
+//
+
+typedef struct {
+    char mode[64];
+    char corpus[64];
+    uint64_t hash;
+} Golden;
+
+static
+uint32_t golden_read (const char* path, Golden* golden, uint32_t max) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) return 0;
+
+    uint32_t n = 0;
+    char line[256];
+    while (n < max && fgets(line, sizeof line, f) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        Golden* g = &golden[n];
+        if (sscanf(line, "%63s %63s %" SCNx64, g->mode, g->corpus, &g->hash) == 3) n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static
+Golden* golden_find (Golden* golden, uint32_t n, const char* mode, const char* corpus) {
+    for (int i = 0; i < n; i++) {
+        if (strcmp(golden[i].mode, mode) == 0 && strcmp(golden[i].corpus, corpus) == 0)
+            return &golden[i];
+    }
+    return NULL;
+}
+
+
+//
+// Main.
+//
+
+static const char* bench_mode_files[] = { "bench.c", "makefile", "bench.sh" };
+#define BENCH_MODES (sizeof(bench_mode_files)/sizeof(bench_mode_files[0]))
+static Mode* bench_modes[BENCH_MODES];
+
+int main (int argc, char** argv) {
+    bool update = false;
+    uint64_t size = 4;
+    const char* golden_path = "bench/golden.txt";
+    const char* dump = NULL;
+
+    int argi = 1;
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+        if (strcmp(argv[argi], "-u") == 0) {
+            update = true;
+        } else if (strcmp(argv[argi], "-m") == 0 && argi + 1 < argc) {
+            size = strtoul(argv[++argi], NULL, 10);
+        } else if (strcmp(argv[argi], "-g") == 0 && argi + 1 < argc) {
+            golden_path = argv[++argi];
+        } else if (strcmp(argv[argi], "-d") == 0 && argi + 1 < argc) {
+            dump = argv[++argi];
+        } else {
+            fprintf(stderr, "usage: %s [-u] [-m MB] [-g golden] [-d corpus] [files...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    for (int i = 0; i < BENCH_MODES; i++) {
+        bench_modes[i] = get_language_mode(bench_mode_files[i], NULL, 0);
+        assert(bench_modes[i] != NULL);
+    }
+
+    // Build Corpora.
+    uint32_t corpus_count = 4 + (argc - argi);
+    Corpus corpora[corpus_count];
+    {
+        uint64_t bytes = size << 20;
+        void (*generators[])(Corpus*, uint64_t) = {
+            gen_nested_comments, gen_long_strings, gen_minified, gen_keywords,
+        };
+        const char* names[] = { "nested-comments", "long-strings", "minified", "keywords" };
+        for (int i = 0; i < 4; i++) {
+            rng_state = 0x7A7Lu + i;
+            corpus_init(&corpora[i], names[i], true);
+            generators[i](&corpora[i], bytes);
+            // A line at a time past the size asked for, when that is short
+            //  of the hashed prefix.
+            while (corpora[i].size < GOLDEN_CHARS) generators[i](&corpora[i], corpora[i].bytes + 1);
+        }
+        for (int i = argi; i < argc; i++) {
+            Corpus* c = &corpora[4 + i - argi];
+            corpus_init(c, argv[i], false);
+            if (!corpus_read(c, argv[i])) {
+                fprintf(stderr, "colorbench: cannot read %s\n", argv[i]);
+                return 2;
+            }
+        }
+    }
+
+    // Dump styles.
+    if (dump != NULL) {
+        for (int i = 0; i < corpus_count; i++) {
+            if (strcmp(corpora[i].name, dump) == 0) {
+                Result r;
+                run_mode(bench_modes[0], &corpora[i], &r, true);
+            }
+        }
+        return 0;
+    }
+
+    Golden golden[64];
+    uint32_t golden_count = update ? 0 : golden_read(golden_path, golden, 64);
+
+    FILE* out = NULL;
+    if (update) {
+        out = fopen(golden_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "colorbench: cannot write %s\n", golden_path);
+            return 2;
+        }
+        fprintf(out, "# Colorizer golden style hashes. Regenerate with: make bench-update\n");
+    }
+
+    // Run.
+    uint32_t failures = 0;
+    printf("%-10s %-24s %10s %10s %10s %12s  %s\n",
+            "mode", "corpus", "MB", "MB/s", "fast MB/s", "trans/line", "golden");
+    for (int m = 0; m < BENCH_MODES; m++) {
+        Mode* mode = bench_modes[m];
+        for (int i = 0; i < corpus_count; i++) {
+            Corpus* corpus = &corpora[i];
+            Result r;
+            run_mode(mode, corpus, &r, false);
+
+            double mb = corpus->bytes / (double) (1 << 20);
+            const char* status = "-";
+            if (corpus->golden) {
+                if (update) {
+                    fprintf(out, "%s %s %016" PRIx64 "\n", mode->name, corpus->name, r.hash);
+                    status = "updated";
+                } else {
+                    Golden* g = golden_find(golden, golden_count, mode->name, corpus->name);
+                    if (g == NULL) {
+                        status = "missing";
+                        failures++;
+                    } else if (g->hash != r.hash) {
+                        status = "MISMATCH";
+                        failures++;
+                    } else {
+                        status = "ok";
+                    }
+                }
+            }
+
+            printf("%-10s %-24.24s %10.2f %10.2f %10.2f %12.2f  %s\n",
+                    mode->name, corpus->name, mb, mb / r.seconds, mb / r.seconds_fast,
+                    r.transitions / (double) (corpus->lines + 1), status);
+        }
+    }
+
+    if (out != NULL) fclose(out);
+    for (int i = 0; i < corpus_count; i++) corpus_fini(&corpora[i]);
+
+    if (failures > 0) {
+        fprintf(stderr, "colorbench: %d golden mismatch(es)\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -1,5 +1,9 @@
 #include "character.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 //
 // Character Type.
@@ -60,14 +64,14 @@ int32_t chars_to_codepoint (char* buffer, uint32_t len, uint32_t* code) {
         return 1;
     }
 
-    if ((buffer[0] & 0xC0) == 0xC0) {
+    if ((buffer[0] & 0xE0) == 0xC0) {
         if (len < 2) return 0;
         *code = (((unsigned char) buffer[0] ^ 0xC0) << 6)
             |    ((unsigned char) buffer[1] ^ 0x80);
         return 2;
     }
 
-    if ((buffer[0] & 0xE0) == 0xE0) {
+    if ((buffer[0] & 0xF0) == 0xE0) {
         if (len < 3) return 0;
         *code = (((unsigned char) buffer[0] & ~0xE0) << 12)
             |   (((unsigned char) buffer[1] & ~0x80) << 6)
@@ -75,7 +79,7 @@ int32_t chars_to_codepoint (char* buffer, uint32_t len, uint32_t* code) {
         return 3;
     }
 
-    if ((buffer[0] & 0xF0) == 0xF0) {
+    if ((buffer[0] & 0xF8) == 0xF0) {
         if (len < 4) return 0;
         *code = (((unsigned char) buffer[0] & ~0xF0) << 18)
             |   (((unsigned char) buffer[1] & ~0x80) << 12)
@@ -86,3 +90,112 @@ int32_t chars_to_codepoint (char* buffer, uint32_t len, uint32_t* code) {
 
     return 0;
 }
+
+
+//
+// Bulk Conversion.
+//  -> ASCII, most of any source file, is narrowed or widened 16 characters
+//      at a time; the rest goes through codepoint_to_chars, or a validating
+//      decoder that rejects overlong forms, surrogates and stray
+//      continuation bytes.
+//
+
+size_t utf8_encode (const uint32_t* chars, uint32_t n, char* out) {
+    size_t size = 0;
+    uint32_t i = 0;
+
+    while (i < n) {
+#ifdef __SSE2__
+        __m128i high = _mm_set1_epi32(~0x7F);
+        __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*) (chars + i));
+            __m128i b = _mm_loadu_si128((const __m128i*) (chars + i + 4));
+            __m128i c = _mm_loadu_si128((const __m128i*) (chars + i + 8));
+            __m128i d = _mm_loadu_si128((const __m128i*) (chars + i + 12));
+            __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(any, high), zero)) != 0xFFFF) break;
+
+            __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+            _mm_storeu_si128((__m128i*) (out + size), bytes);
+            size += 16;
+        }
+        if (i == n) break;
+#endif
+
+        // Sixteen with something wider, one at a time.
+        uint32_t end = n - i < 16 ? n : i + 16;
+        for (; i < end; i++) {
+            if (chars[i] < 0x80) out[size++] = chars[i];
+            else size += codepoint_to_chars(out + size, chars[i]);
+        }
+    }
+
+    return size;
+}
+
+
+size_t utf8_decode (const char* text, size_t size, uint32_t* out, uint32_t capacity, uint32_t* n, uint32_t* newlines) {
+    const uint8_t* s = (const uint8_t*) text;
+    size_t i = 0;
+    uint32_t k = 0;
+    uint32_t nls = 0;
+
+    while (i < size && k < capacity) {
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        __m128i nl = _mm_set1_epi8('\n');
+        while (i + 16 <= size && k + 16 <= capacity) {
+            __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+            if (_mm_movemask_epi8(v) != 0) break;
+
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            _mm_storeu_si128((__m128i*) (out + k), _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128((__m128i*) (out + k + 4), _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128((__m128i*) (out + k + 8), _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128((__m128i*) (out + k + 12), _mm_unpackhi_epi16(hi, zero));
+            nls += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+            i += 16;
+            k += 16;
+        }
+        if (i == size || k == capacity) break;
+#endif
+
+        uint8_t b = s[i];
+        if (b < 0x80) {
+            out[k++] = b;
+            if (b == '\n') nls++;
+            i++;
+            continue;
+        }
+
+        uint32_t len, ch, min;
+        if ((b & 0xE0) == 0xC0) len = 2, ch = b & 0x1F, min = 0x80;
+        else if ((b & 0xF0) == 0xE0) len = 3, ch = b & 0x0F, min = 0x800;
+        else if ((b & 0xF8) == 0xF0) len = 4, ch = b & 0x07, min = 0x10000;
+        else {
+            i++;
+            continue;
+        }
+
+        uint32_t x = 1;
+        while (x < len && i + x < size && (s[i + x] & 0xC0) == 0x80) {
+            ch = (ch << 6) | (s[i + x] & 0x3F);
+            x++;
+        }
+        // Cut off: the rest may come with the next block.
+        if (x < len && i + x == size) break;
+        if (x < len || ch < min || ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF)) {
+            i++;
+            continue;
+        }
+
+        out[k++] = ch;
+        i += len;
+    }
+
+    *n = k;
+    *newlines = nls;
+    return i;
+}
@@ -16,3 +16,12 @@ uint32_t chartype (int32_t ch);
 int32_t codepoint_to_chars (char* buffer, uint32_t code);
 
 int32_t chars_to_codepoint (char* buffer, uint32_t len, uint32_t* code);
+
+// Decode UTF-8 into at most 'capacity' characters, skipping invalid bytes.
+//  -> Returns the bytes read, short of a sequence cut off by the end; *n is
+//      set to the characters written and *newlines to the newlines among them.
+size_t utf8_decode (const char* text, size_t size, uint32_t* out, uint32_t capacity, uint32_t* n, uint32_t* newlines);
+
+// Encode 'n' characters into 'out', which needs room for 4 bytes each.
+//  -> Returns the bytes written.
+size_t utf8_encode (const uint32_t* chars, uint32_t n, char* out);
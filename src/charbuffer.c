@@ -41,6 +41,16 @@ static void charbuffer_expand (CharBuffer* cb, uint32_t new_capacity) {
     cb->capacity = new_capacity;
 }
 
+// Make room for n more characters.
+void charbuffer_reserve (CharBuffer* cb, uint32_t n) {
+    uint32_t cap = cb->capacity;
+    while (cap <= cb->size + n + 1)
+        cap *= 2;
+
+    if (cap > cb->capacity)
+        charbuffer_expand(cb, cap);
+}
+
 // Append Character.
 void charbuffer_achar (CharBuffer* cb, char ch) {
     if (cb->capacity <= cb->size + 2)
@@ -84,6 +94,20 @@ void charbuffer_astr (CharBuffer* cb, const char* str) {
     cb->damage = true;
 }
 
+// Append String as a single file name.
+//  -> '%' and '/' are escaped as "%25" and "%2F", so distinct strings stay distinct.
+void charbuffer_aname (CharBuffer* cb, const char* str) {
+    for (const char* c = str; *c != '\0'; c++) {
+        if (*c == '%') {
+            charbuffer_astr(cb, "%25");
+        } else if (*c == '/') {
+            charbuffer_astr(cb, "%2F");
+        } else {
+            charbuffer_achar(cb, *c);
+        }
+    }
+}
+
 // Insert Character.
 void charbuffer_ichar (CharBuffer* cb, char ch, uint32_t i) {
     if (i >= cb->size) {
@@ -20,6 +20,8 @@ void charbuffer_destroy (CharBuffer* cb);
 
 void charbuffer_clear (CharBuffer* cb);
 
+void charbuffer_reserve (CharBuffer* cb, uint32_t n);
+
 
 void charbuffer_achar (CharBuffer* cb, char ch);
 
@@ -27,6 +29,8 @@ void charbuffer_achars (CharBuffer* cb, CharBuffer* src);
 
 void charbuffer_astr (CharBuffer* cb, const char* str);
 
+void charbuffer_aname (CharBuffer* cb, const char* str);
+
 
 void charbuffer_ichar (CharBuffer* cb, char ch, uint32_t i);
 
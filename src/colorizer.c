@@ -78,11 +78,174 @@ State* next_state (State* current, int32_t ch) {
 }
 
 
+//
+// Keyword Sets.
+//
+
+// Seeded FNV-1a with a final avalanche so that low bits are usable.
+static inline
+uint32_t keyword_hash (int32_t* word, uint32_t len, uint32_t seed) {
+    uint32_t h = 2166136261u ^ (seed * 0x9E3779B9u);
+    for (int i = 0; i < len; i++) {
+        h ^= (uint32_t) word[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static
+uint32_t pow2_ceil (uint32_t n) {
+    uint32_t p = 1;
+    while (p < n) p *= 2;
+    return p;
+}
+
+// Place buckets largest first, searching for a displacement that sends
+//  every word in the bucket to a distinct free slot.
+//  -> Returns false if some bucket finds none, for a retry with more slots.
+static
+bool keywords_place (Keywords* keywords, const char** words, uint32_t count, int32_t (*cps)[KEYWORD_MAX_LEN], uint32_t* lens,
+                     uint32_t* bucket_of, uint32_t* bucket_size, uint32_t largest) {
+    uint32_t buckets = keywords->bucket_mask + 1;
+    uint32_t* placed = malloc(MAX(1, largest) * sizeof(uint32_t));
+    bool all = true;
+
+    for (uint32_t size = largest; size > 0 && all; size--) {
+        for (int b = 0; b < buckets && all; b++) {
+            if (bucket_size[b] != size) continue;
+
+            uint32_t d = 1;
+            for (; d <= UINT16_MAX; d++) {
+                uint32_t n = 0;
+                bool ok = true;
+                for (int i = 0; i < count && ok; i++) {
+                    if (bucket_of[i] != b) continue;
+                    uint32_t slot = keyword_hash(cps[i], lens[i], d) & keywords->slot_mask;
+                    if (keywords->slots[slot] != NULL) ok = false;
+                    for (int x = 0; x < n && ok; x++)
+                        if (placed[x] == slot) ok = false;
+                    placed[n++] = slot;
+                }
+                if (ok) break;
+            }
+            if (d > UINT16_MAX) {
+                all = false;
+                break;
+            }
+
+            keywords->displace[b] = d;
+            for (int i = 0; i < count; i++) {
+                if (bucket_of[i] != b) continue;
+                uint32_t slot = keyword_hash(cps[i], lens[i], d) & keywords->slot_mask;
+                keywords->slots[slot] = words[i];
+                keywords->lengths[slot] = lens[i];
+            }
+        }
+    }
+
+    free(placed);
+    return all;
+}
+
+Keywords* keywords_create (const char** words, uint32_t count) {
+    Keywords* keywords = malloc(sizeof(Keywords));
+    keywords->count = 0;
+    keywords->max_len = 0;
+
+    uint32_t buckets = pow2_ceil(MAX(1, count / 2));
+    uint32_t slots = pow2_ceil(MAX(2, count * 2));
+    keywords->bucket_mask = buckets - 1;
+    keywords->displace = calloc(buckets, sizeof(uint16_t));
+
+    // Words as codepoints, and their buckets; a duplicate is left out, with
+    //  UINT32_MAX for its bucket.
+    int32_t (*cps)[KEYWORD_MAX_LEN] = calloc(MAX(1, count), sizeof(*cps));
+    uint32_t* lens = calloc(MAX(1, count), sizeof(uint32_t));
+    uint32_t* bucket_of = calloc(MAX(1, count), sizeof(uint32_t));
+    uint32_t* bucket_size = calloc(buckets, sizeof(uint32_t));
+    uint32_t largest = 0;
+    for (int i = 0; i < count; i++) {
+        lens[i] = strlen(words[i]);
+        assert(lens[i] > 0 && lens[i] <= KEYWORD_MAX_LEN && "Invalid keyword length");
+        for (int c = 0; c < lens[i]; c++)
+            cps[i][c] = (unsigned char) words[i][c];
+        bucket_of[i] = keyword_hash(cps[i], lens[i], 0) & keywords->bucket_mask;
+
+        bool duplicate = false;
+        for (int k = 0; k < i && !duplicate; k++)
+            duplicate = bucket_of[k] == bucket_of[i] && strcmp(words[k], words[i]) == 0;
+        assert(!duplicate && "Duplicate keyword");
+        if (duplicate) {
+            bucket_of[i] = UINT32_MAX;
+            continue;
+        }
+
+        keywords->count++;
+        keywords->max_len = MAX(keywords->max_len, lens[i]);
+        largest = MAX(largest, ++bucket_size[bucket_of[i]]);
+    }
+
+    // Each failure doubles the slots, making room for every bucket in the end.
+    while (true) {
+        keywords->slot_mask = slots - 1;
+        keywords->slots = calloc(slots, sizeof(const char*));
+        keywords->lengths = calloc(slots, sizeof(uint8_t));
+        if (keywords_place(keywords, words, count, cps, lens, bucket_of, bucket_size, largest)) break;
+
+        free(keywords->slots);
+        free(keywords->lengths);
+        memset(keywords->displace, 0, buckets * sizeof(uint16_t));
+        slots *= 2;
+    }
+
+    free(cps);
+    free(lens);
+    free(bucket_of);
+    free(bucket_size);
+    return keywords;
+}
+
+void keywords_destroy (Keywords* keywords) {
+    free(keywords->displace);
+    free(keywords->slots);
+    free(keywords->lengths);
+    free(keywords);
+}
+
+bool keywords_find (Keywords* keywords, int32_t* word, uint32_t len) {
+    if (keywords == NULL || len == 0 || len > keywords->max_len) return false;
+
+    uint32_t b = keyword_hash(word, len, 0) & keywords->bucket_mask;
+    uint32_t d = keywords->displace[b];
+    if (d == 0) return false;
+
+    uint32_t slot = keyword_hash(word, len, d) & keywords->slot_mask;
+    const char* kw = keywords->slots[slot];
+    if (kw == NULL || keywords->lengths[slot] != len) return false;
+
+    for (int i = 0; i < len; i++)
+        if ((unsigned char) kw[i] != word[i]) return false;
+    return true;
+}
+
+
 //
 // Colorizer Logic.
 //
 
-void colorize_begin_line (Colorizer* colorizer, int32_t comment_depth) {
+// start is the state at the end of the previous line, or NULL for the first line.
+void colorize_begin_line (Colorizer* colorizer, LineState* start) {
+    // Bracket depth is tracked without a mode too, so it is always consistent.
+    colorizer->bracket_depth = start != NULL ? start->bracket_depth : 0;
+    colorizer->bracket_min = colorizer->bracket_depth;
+    colorizer->bracket = 0;
+    colorizer->comment_depth = start != NULL ? start->comment_depth : 0;
+
     // No language mode: colorizer disabled.
     if (colorizer->mode == NULL) {
         return;
@@ -92,12 +255,17 @@ void colorize_begin_line (Colorizer* colorizer, int32_t comment_depth) {
     colorizer->state = colorizer->mode->colorizer_state;
     colorizer->col_last = 0;
     colorizer->string_type = 0;
-    colorizer->comment_depth = comment_depth;
     colorizer->text_len = 0;
     colorizer->line_comment = false;
     colorizer->saw_slash = false;
 }
 
+void colorize_end_line (Colorizer* colorizer, LineState* end) {
+    end->comment_depth = colorizer->comment_depth;
+    end->bracket_depth = colorizer->bracket_depth;
+    end->bracket_min = colorizer->bracket_min;
+}
+
 static
 void apply_color (int32_t color_mask, uint32_t col, uint32_t col_last, uint32_t col_start, uint32_t col_end, int32_t* style) {
     if (style == NULL) return;
@@ -129,6 +297,8 @@ uint32_t get_color (Colorizer* colorizer, uint32_t default_color) {
 // NOTE: col represents the column immediatly after the emited char, not the column of the char itself
 //  (This is because of tabs, see textview.c) 
 void colorize_next_char (Colorizer* colorizer, int32_t ch, uint32_t col, uint32_t col_start, uint32_t col_end, int32_t* style) {
+    colorizer->bracket = 0;
+
     // No language mode: colorizer disabled.
     if (colorizer->mode == NULL) {
         return;
@@ -162,11 +332,14 @@ void colorize_next_char (Colorizer* colorizer, int32_t ch, uint32_t col, uint32_
         if (colorizer->text_len == 0 && 'A' <= ch && ch <= 'Z') {
             colorizer->text_caps = true;
         }
+        if (colorizer->text_len < KEYWORD_MAX_LEN) {
+            colorizer->word[colorizer->text_len] = ch;
+        }
         colorizer->text_len++;
     } 
     // -> part 2. apply color at end of word.
     else {
-        if (state->terminal && state->type == STATE_KEYWORD && state->depth == colorizer->text_len) {
+        if (keywords_find(colorizer->mode->keywords, colorizer->word, colorizer->text_len)) {
             apply_color(get_color(colorizer, STYLE_KEYWORD), col - 1, col - colorizer->text_len - 1, col_start, col_end, style);
             colorizer->col_last = col - 1;
         } else if (colorizer->text_caps && colorizer->mode->color_capitals) {
@@ -238,6 +411,21 @@ void colorize_next_char (Colorizer* colorizer, int32_t ch, uint32_t col, uint32_
                     default_color = STYLE_SYMBOL;
                     break;
                 }
+                case STATE_OPEN_BRACKET: {
+                    default_color = STYLE_SYMBOL;
+                    if (colorizer->string_type != 0 || colorizer->comment_depth > 0) break;
+                    colorizer->bracket_depth += 1;
+                    colorizer->bracket = 1;
+                    break;
+                }
+                case STATE_CLOSE_BRACKET: {
+                    default_color = STYLE_SYMBOL;
+                    if (colorizer->string_type != 0 || colorizer->comment_depth > 0) break;
+                    colorizer->bracket_depth -= 1;
+                    colorizer->bracket_min = MIN(colorizer->bracket_min, colorizer->bracket_depth);
+                    colorizer->bracket = -1;
+                    break;
+                }
             }
             apply_color(get_color(colorizer, default_color), col, colorizer->col_last, col_start, col_end, style);
             colorizer->col_last = col;
@@ -11,6 +11,7 @@ enum {
     STYLE_NAME = 32,
     STYLE_STRING = 64,
     STYLE_CHAR = 128,
+    STYLE_MATCH = 256,
 };
 
 enum {
@@ -22,11 +23,16 @@ enum {
     STATE_POP_COMMENT,
     STATE_STRING,
     STATE_CHAR,
-    STATE_KEYWORD,
     STATE_SYMBOL,
+    STATE_OPEN_BRACKET,
+    STATE_CLOSE_BRACKET,
 };
 
 
+// Longest keyword a Keywords table accepts.
+#define KEYWORD_MAX_LEN 32
+
+
 struct state {
     int32_t ch;
     uint32_t type;
@@ -36,6 +42,30 @@ struct state {
     Array* next_state;
 };
 
+// Whole-word keyword set.
+//  -> Perfect hash (hash and displace): a word's bucket selects a displacement,
+//      which selects a unique slot. Lookup is two hashes and one compare.
+struct keywords {
+    uint32_t count;
+    uint32_t max_len;
+
+    uint32_t bucket_mask;
+    uint16_t* displace;
+
+    uint32_t slot_mask;
+    const char** slots;
+    uint8_t* lengths;
+};
+
+// State carried from the end of one line to the start of the next.
+//  -> bracket_min is the lowest bracket depth reached anywhere on the line,
+//      including its start, so unmatched closing brackets show up as a dip.
+struct line_state {
+    int32_t comment_depth;
+    int32_t bracket_depth;
+    int32_t bracket_min;
+};
+
 struct colorizer {
     Mode* mode;
     State* state;
@@ -47,6 +77,15 @@ struct colorizer {
     bool text_caps;
     bool line_comment;
     bool saw_slash;
+
+    // Current word, for keyword lookup (only the first KEYWORD_MAX_LEN chars).
+    int32_t word[KEYWORD_MAX_LEN];
+
+    // Bracket nesting.
+    //  -> bracket is +1/-1 if the last char opened/closed a bracket, else 0.
+    int32_t bracket_depth;
+    int32_t bracket_min;
+    int32_t bracket;
 };
 
 State* state_create ();
@@ -59,7 +98,16 @@ void state_append (State* state, const char* str, uint32_t type);
 void state_print (State* state, uint32_t lvl);
 
 
-void colorize_begin_line (Colorizer* colorizer, int32_t comment_depth);
+Keywords* keywords_create (const char** words, uint32_t count);
+
+void keywords_destroy (Keywords* keywords);
+
+bool keywords_find (Keywords* keywords, int32_t* word, uint32_t len);
+
+
+void colorize_begin_line (Colorizer* colorizer, LineState* start);
+
+void colorize_end_line (Colorizer* colorizer, LineState* end);
 
 void colorize_next_char (Colorizer* colorizer, int32_t ch, uint32_t col, uint32_t col_start, uint32_t col_end, int32_t* style);
 
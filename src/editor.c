@@ -4,13 +4,20 @@
 #include "charbuffer.h"
 #include "rope.h"
 #include "textbuffer.h"
+#include "matchindex.h"
+#include "multifind.h"
+#include "threadpool.h"
 #include "textview.h"
 #include "textaction.h"
 #include "filebuffer.h"
 #include "search.h"
+#include "fileindex.h"
+#include "grep.h"
 #include "input.h"
 #include "output.h"
 
+#include <errno.h>
+
 enum {
     ALT_NONE = 0,
     ALT_OPEN,
@@ -18,6 +25,8 @@ enum {
     ALT_SEARCH,
     ALT_FIND,
     ALT_REPLACE,
+    ALT_FIND_ALL,
+    ALT_GREP,
 };
 
 void editor_init (Editor* editor, Array* filenames) {
@@ -32,6 +41,23 @@ void editor_init (Editor* editor, Array* filenames) {
     editor->findbuffer = textbuffer_create(rope_create(NULL));
     editor->findview = textview_create(editor->findbuffer);
     editor->findview->linenos = false;
+    editor->find_regex = false;
+    editor->find_query = NULL;
+    editor->find_query_regex = false;
+    editor->find_target = NULL;
+    editor->find_target_query = NULL;
+    editor->find_target_regex = false;
+    editor->find_all_query = NULL;
+    editor->find_all_buffers = array_create();
+    editor->find_all_texts = array_create();
+    editor->find_results = NULL;
+    editor->find_results_size = 0;
+    editor->find_result = -1;
+    editor->find_all_batch = NULL;
+    editor->find_all_stale = array_create();
+    editor->find_all_searched = 0;
+    editor->find_all_pending = 0;
+    editor->pool = NULL;
 
     editor->replacebuffer = textbuffer_create(rope_create(NULL));
     editor->replaceview = textview_create(editor->replacebuffer);
@@ -39,13 +65,19 @@ void editor_init (Editor* editor, Array* filenames) {
 
     editor->clipboard = array_create();
     editor->dir = charbuffer_create();
+    editor->message = charbuffer_create();
     editor->tab_scroll = 0;
     editor->tab_scroll_dmg = false;
 
-    editor->search_files = array_create();
+    editor->search = NULL;
+    editor->file_index = NULL;
+    editor->file_index_busy = false;
     editor->search_selection = 0;
     editor->search_scroll = 0;
     editor->search_scroll_dmg = false;
+    editor->grep = NULL;
+    editor->grep_query = NULL;
+    editor->grep_regex = false;
 
     char* cwd = getcwd(NULL, 0);
     assert(*cwd == '/');
@@ -77,16 +109,32 @@ void editor_fini (Editor* editor) {
 
     textview_destroy(editor->findview);
     textbuffer_destroy(editor->findbuffer);
+    if (editor->find_query != NULL) rope_destroy(editor->find_query);
+    if (editor->find_target != NULL) {
+        find_target_destroy(editor->find_target);
+        rope_destroy(editor->find_target_query);
+    }
+    if (editor->find_all_query != NULL) rope_destroy(editor->find_all_query);
+    array_destroy(editor->find_all_buffers);
+    array_destroy_callback(editor->find_all_texts, (array_callback) rope_destroy);
+    free(editor->find_results);
+    if (editor->find_all_batch != NULL) array_add(editor->find_all_stale, editor->find_all_batch);
+    for (int i = 0; i < editor->find_all_stale->size; i++) multi_find_cancel(editor->find_all_stale->data[i]);
+    array_destroy_callback(editor->find_all_stale, (array_callback) multi_find_batch_destroy);
 
     textview_destroy(editor->replaceview);
     textbuffer_destroy(editor->replacebuffer);
 
-    search_unload_files(editor->search_files);
-    array_destroy(editor->search_files);
+    if (editor->file_index != NULL) file_index_destroy(editor->file_index);
+    if (editor->search != NULL) search_destroy(editor->search);
+    if (editor->grep != NULL) grep_destroy(editor->grep);
+    if (editor->grep_query != NULL) rope_destroy(editor->grep_query);
+    if (editor->pool != NULL) thread_pool_destroy(editor->pool);
 
     array_destroy(editor->buffers);
     array_destroy(editor->clipboard);
     charbuffer_destroy(editor->dir);
+    charbuffer_destroy(editor->message);
 }
 
 
@@ -96,19 +144,63 @@ FileBuffer* get_buffer(Editor* editor) {
     return editor->buffers->data[editor->current_buffer];
 }
 
+// Worker threads, started on first use.
+static
+ThreadPool* get_pool (Editor* editor) {
+    if (editor->pool == NULL) editor->pool = thread_pool_create(0);
+    return editor->pool;
+}
+
 
 //
 // Update Editor State.
 //
 
+static bool search_poll (Editor* editor);
+static bool find_all_poll (Editor* editor);
+
+// Background work between events.
+//  -> Returns true if there is more to do.
+bool editor_idle (Editor* editor) {
+    if (editor->buffers->size == 0) return false;
+
+    bool more = false;
+    for (int i = 0; i < editor->buffers->size; i++) {
+        FileBuffer* fb = editor->buffers->data[i];
+        textbuffer_history_sync(fb->buffer);
+
+        int error;
+        if (filebuffer_write_poll(fb, false, &error)) more = true;
+        if (error != 0) {
+            charbuffer_clear(editor->message);
+            charbuffer_astr(editor->message, " Save failed: ");
+            charbuffer_astr(editor->message, strerror(error));
+            charbuffer_astr(editor->message, " ");
+        }
+    }
+
+    more |= search_poll(editor);
+    more |= find_all_poll(editor);
+
+    FileBuffer* fb = get_buffer(editor);
+    return textbuffer_idle(fb->buffer) || more;
+}
+
 static bool altbuffer_event (Editor* editor, InputEvent* event);
 static bool search_event (Editor* editor, InputEvent* event);
 static bool find_event (Editor* editor, InputEvent* event);
 static bool replace_event (Editor* editor, InputEvent* event);
+static bool find_all_event (Editor* editor, InputEvent* event);
+static bool grep_event (Editor* editor, InputEvent* event);
+static void find_sync (Editor* editor);
 
 bool editor_event (Editor* editor, InputEvent* event) {
+    charbuffer_clear(editor->message);
+
     if (editor->altmode) {
-        return altbuffer_event(editor, event);
+        bool result = altbuffer_event(editor, event);
+        find_sync(editor);
+        return result;
     }
 
     FileBuffer* fb = get_buffer(editor);
@@ -155,7 +247,10 @@ bool editor_event (Editor* editor, InputEvent* event) {
 
         KEY_ALT_ENTER {
             textbuffer_set_contents(editor->altbuffer, NULL);
-            search_load_files(editor->search_files, editor->dir->buffer);
+            if (editor->file_index == NULL) editor->file_index = file_index_create(get_pool(editor), editor->dir->buffer);
+            if (editor->search == NULL) editor->search = search_create(get_pool(editor));
+            search_load_files(editor->search, editor->file_index);
+            search_rank_files(editor->search, "");
             editor->altmode = ALT_SEARCH;
             editor->search_selection = 0;
             editor->search_scroll = 0;
@@ -174,6 +269,23 @@ bool editor_event (Editor* editor, InputEvent* event) {
             break;
         }
 
+        KEY_ALT('f') {
+            textbuffer_set_contents(editor->altbuffer, NULL);
+            editor->altmode = ALT_FIND_ALL;
+            editor->find_result = -1;
+            break;
+        }
+
+        KEY_ALT('g') {
+            textbuffer_set_contents(editor->altbuffer, NULL);
+            if (editor->file_index == NULL) editor->file_index = file_index_create(get_pool(editor), editor->dir->buffer);
+            if (editor->grep == NULL) editor->grep = grep_create(get_pool(editor));
+            editor->altmode = ALT_GREP;
+            editor->search_selection = 0;
+            editor->search_scroll = 0;
+            break;
+        }
+
         KEY_ALT('t') {
             editor->current_buffer++;
             editor->tab_scroll_dmg = true;
@@ -213,6 +325,12 @@ bool altbuffer_event (Editor* editor, InputEvent* event) {
         case ALT_REPLACE: {
             return replace_event(editor, event);
         }
+        case ALT_FIND_ALL: {
+            return find_all_event(editor, event);
+        }
+        case ALT_GREP: {
+            return grep_event(editor, event);
+        }
     }
 
     ON_KEY(event) {
@@ -248,7 +366,11 @@ bool altbuffer_event (Editor* editor, InputEvent* event) {
                     textbuffer_get_contents(editor->altbuffer, filename);
 
                     FileBuffer* fb = get_buffer(editor);
-                    filebuffer_write(fb, filename->buffer);
+                    if (!filebuffer_write_start(fb, filename->buffer)) {
+                        charbuffer_astr(editor->message, " Save failed: ");
+                        charbuffer_astr(editor->message, strerror(errno));
+                        charbuffer_astr(editor->message, " ");
+                    }
 
                     charbuffer_destroy(filename);
                     break;
@@ -270,57 +392,116 @@ bool altbuffer_event (Editor* editor, InputEvent* event) {
 
 // -- Search-Mode Event Handler -- //
 
+// Switch to the buffer of 'path', reading it into a new one (or the current
+//  one, if that is empty) unless it is already open.
+static
+void open_path (Editor* editor, const char* path) {
+    for (int i = 0; i < editor->buffers->size; i++) {
+        FileBuffer* fb = editor->buffers->data[i];
+        if (strcmp(path, fb->longpath->buffer) == 0) {
+            editor->current_buffer = i;
+            editor->tab_scroll_dmg = true;
+            return;
+        }
+    }
+
+    FileBuffer* fb = get_buffer(editor);
+    if (rope_len(fb->buffer->text) > 0 || fb->longpath->size > 0) {
+        fb = filebuffer_create();
+        array_add(editor->buffers, fb);
+        editor->current_buffer = editor->buffers->size - 1;
+        editor->tab_scroll_dmg = true;
+    }
+
+    filebuffer_read(fb, path);
+}
+
+// Drop the dialog's files; the index stays.
+static
+void search_close (Editor* editor) {
+    search_unload_files(editor->search);
+}
+
+// Keep the file index fresh, and the open dialog with it, ranked by the
+//  current query.
+//  -> Returns true while the index is still scanning, or the dialog ranking.
+static
+bool search_poll (Editor* editor) {
+    if (editor->file_index == NULL) return false;
+
+    Array* added = array_create();
+    bool changed;
+    editor->file_index_busy = file_index_poll(editor->file_index, added, &changed);
+    if (editor->file_index->watch_error != 0) {
+        charbuffer_clear(editor->message);
+        charbuffer_astr(editor->message, " Not watching every directory: ");
+        charbuffer_astr(editor->message, strerror(editor->file_index->watch_error));
+        charbuffer_astr(editor->message, " ");
+        editor->file_index->watch_error = 0;
+    }
+
+    if (editor->altmode == ALT_SEARCH && (changed || added->size > 0)) {
+        if (changed) {
+            search_unload_files(editor->search);
+            search_load_files(editor->search, editor->file_index);
+        } else {
+            for (int i = 0; i < added->size; i++) search_add_files(editor->search, editor->file_index, added->data[i]);
+        }
+
+        CharBuffer* query = charbuffer_create();
+        textbuffer_get_contents(editor->altbuffer, query);
+        search_rank_files(editor->search, query->buffer);
+        charbuffer_destroy(query);
+    }
+    array_destroy(added);
+
+    bool ranking = false;
+    if (editor->altmode == ALT_SEARCH) {
+        ranking = search_rank_poll(editor->search, 0);
+        editor->search_selection = MIN(editor->search_selection, MAX(0, (int32_t) editor->search->top_size - 1));
+    }
+
+    // Stopped grep jobs are swept here too, so poll even outside grep mode.
+    bool grepping = editor->grep != NULL && grep_poll(editor->grep);
+
+    return editor->file_index_busy || ranking || grepping;
+}
+
 static
 bool search_event (Editor* editor, InputEvent* event) {
     ON_KEY(event) {
         KEY_CTRL('Q') {
-            search_unload_files(editor->search_files);
+            search_close(editor);
             return false;
         }
 
         KEY_ESC {
-            search_unload_files(editor->search_files);
+            search_close(editor);
             editor->altmode = 0;
             break;
         }
 
         KEY_ENTER {
-            FileEntry* entry = editor->search_files->data[editor->search_selection];
-
-            // Check if file is already open.
-            for (int i = 0; i < editor->buffers->size; i++) {
-                FileBuffer* fb = editor->buffers->data[i];
-                if (strcmp(entry->path->buffer, fb->longpath->buffer) == 0) {
-                    editor->current_buffer = i;
-                    search_unload_files(editor->search_files);
-                    editor->altmode = 0;
-                    goto brck;
-                }
-            }
-
-            // Otherwise open new file.
-            FileBuffer* fb = get_buffer(editor);
-            if (rope_len(fb->buffer->text) > 0 || fb->longpath->size > 0) {
-                fb = filebuffer_create();
-                array_add(editor->buffers, fb);
-                editor->current_buffer = editor->buffers->size - 1;
-            }
-
-            filebuffer_read(fb, entry->path->buffer);
+            // Open what the query finds, not what the last one did.
+            search_rank_poll(editor->search, -1);
+            if (editor->search->top_size == 0) break;
+            open_path(editor, search_path(editor->search, editor->search_selection));
 
-            search_unload_files(editor->search_files);
+            search_close(editor);
             editor->altmode = 0;
-            brck: break;
+            break;
         }
 
         KEY_UP {
-            editor->search_selection = MOD(editor->search_selection - 1, editor->search_files->size);
+            if (editor->search->job != NULL || editor->search->top_size == 0) break;
+            editor->search_selection = MOD(editor->search_selection - 1, editor->search->top_size);
             editor->search_scroll_dmg = true;
             break;
         }
 
         KEY_DOWN {
-            editor->search_selection = MOD(editor->search_selection + 1, editor->search_files->size);
+            if (editor->search->job != NULL || editor->search->top_size == 0) break;
+            editor->search_selection = MOD(editor->search_selection + 1, editor->search->top_size);
             editor->search_scroll_dmg = true;
             break;
         }
@@ -341,8 +522,10 @@ bool search_event (Editor* editor, InputEvent* event) {
             textaction(event, editor->altbuffer, 1, editor->clipboard);
             CharBuffer* query = charbuffer_create();
             textbuffer_get_contents(editor->altbuffer, query);
-            search_rank_files(editor->search_files, query->buffer);
+            search_rank_files(editor->search, query->buffer);
             charbuffer_destroy(query);
+            // Most rankings are done by then; the rest show at idle.
+            search_rank_poll(editor->search, SEARCH_RANK_WAIT);
             editor->search_selection = 0;
             editor->search_scroll = 0;
             break;
@@ -354,6 +537,64 @@ bool search_event (Editor* editor, InputEvent* event) {
 
 // -- Find-Mode Event Handler -- //
 
+// Point the current buffer's match index at the find query, dropping it
+//  elsewhere and outside of find and replace.
+static
+void find_sync (Editor* editor) {
+    Rope* query = NULL;
+    if (editor->altmode == ALT_FIND) query = editor->altbuffer->text;
+    if (editor->altmode == ALT_REPLACE) query = editor->findbuffer->text;
+    if (query != NULL && rope_len(query) == 0) query = NULL;
+
+    FileBuffer* current = get_buffer(editor);
+    for (int i = 0; i < editor->buffers->size; i++) {
+        FileBuffer* fb = editor->buffers->data[i];
+        if (fb != current && fb->buffer->matches != NULL) textbuffer_find_index(fb->buffer, NULL);
+    }
+
+    // Ropes are immutable: an edited query is a different rope.
+    bool same = query == NULL ? editor->find_query == NULL : editor->find_query != NULL && rope_same(query, editor->find_query);
+    if (same && editor->find_regex == editor->find_query_regex
+        && (query == NULL) == (current->buffer->matches == NULL)) return;
+
+    if (editor->find_query != NULL) rope_destroy(editor->find_query);
+    editor->find_query = query == NULL ? NULL : rope_copy(query);
+    editor->find_query_regex = editor->find_regex;
+
+    FindTarget* target = NULL;
+    if (query != NULL) target = editor->find_regex ? find_target_create_regex(query, NULL) : find_target_create(query);
+    textbuffer_find_index(current->buffer, target);
+}
+
+// Target for a find query, literal or as a regex; NULL (with a message
+//  shown) for an invalid pattern.
+//  -> Kept until the query or the mode changes, so repeated finds only search.
+static
+FindTarget* find_target (Editor* editor, Rope* query) {
+    if (editor->find_target != NULL && rope_same(query, editor->find_target_query) && editor->find_regex == editor->find_target_regex)
+        return editor->find_target;
+
+    if (editor->find_target != NULL) {
+        find_target_destroy(editor->find_target);
+        rope_destroy(editor->find_target_query);
+        editor->find_target = NULL;
+    }
+
+    const char* error = NULL;
+    FindTarget* target = editor->find_regex ? find_target_create_regex(query, &error) : find_target_create(query);
+    if (target == NULL) {
+        charbuffer_astr(editor->message, " Regex: ");
+        charbuffer_astr(editor->message, error);
+        charbuffer_astr(editor->message, " ");
+        return NULL;
+    }
+
+    editor->find_target = target;
+    editor->find_target_query = rope_copy(query);
+    editor->find_target_regex = editor->find_regex;
+    return target;
+}
+
 static
 bool find_event (Editor* editor, InputEvent* event) {
     FileBuffer* fb = get_buffer(editor);    
@@ -368,10 +609,22 @@ bool find_event (Editor* editor, InputEvent* event) {
         }
 
         KEY_CTRL('R') {
+            // Keep the query while the replacement is typed.
+            CharBuffer* query = charbuffer_create();
+            textbuffer_get_contents(editor->altbuffer, query);
+            textbuffer_set_contents(editor->findbuffer, query);
+            charbuffer_destroy(query);
+
+            textbuffer_set_contents(editor->altbuffer, NULL);
             editor->altmode = ALT_REPLACE;
             break;
         }
 
+        KEY_ALT('r') {
+            editor->find_regex = !editor->find_regex;
+            break;
+        }
+
         // Don't Pass these keys to textaction.
         KEY_UP { break; }
         KEY_DOWN { break; }
@@ -392,9 +645,9 @@ bool find_event (Editor* editor, InputEvent* event) {
         KEY_CTRL('F')
         KEY_ALT_RIGHT {
             if (rope_len(editor->altbuffer->text) <= 0) break;
-            FindTarget* target = find_target_create(editor->altbuffer->text);
+            FindTarget* target = find_target(editor, editor->altbuffer->text);
+            if (target == NULL) break;
             textbuffer_find_next(fb->buffer, target, 1);
-            find_target_destroy(target);
             break;
         }
 
@@ -402,27 +655,27 @@ bool find_event (Editor* editor, InputEvent* event) {
         KEY_CTRL('G')
         KEY_ALT_LEFT {
             if (rope_len(editor->altbuffer->text) <= 0) break;
-            FindTarget* target = find_target_create(editor->altbuffer->text);
+            FindTarget* target = find_target(editor, editor->altbuffer->text);
+            if (target == NULL) break;
             textbuffer_find_next(fb->buffer, target, -1);
-            find_target_destroy(target);
             break;
         }
 
         // Find+Add Next:
         KEY_SHIFT_ALT_RIGHT {
             if (rope_len(editor->altbuffer->text) <= 0) break;
-            FindTarget* target = find_target_create(editor->altbuffer->text);
+            FindTarget* target = find_target(editor, editor->altbuffer->text);
+            if (target == NULL) break;
             textbuffer_find_add_next(fb->buffer, target, 1);
-            find_target_destroy(target);
             break;
         }
 
         // Find+Add Previous:
         KEY_SHIFT_ALT_LEFT {
             if (rope_len(editor->altbuffer->text) <= 0) break;
-            FindTarget* target = find_target_create(editor->altbuffer->text);
+            FindTarget* target = find_target(editor, editor->altbuffer->text);
+            if (target == NULL) break;
             textbuffer_find_add_next(fb->buffer, target, -1);
-            find_target_destroy(target);
             break;
         }
 
@@ -451,20 +704,247 @@ bool replace_event (Editor* editor, InputEvent* event) {
         }
 
         KEY_CTRL('F') {
+            CharBuffer* query = charbuffer_create();
+            textbuffer_get_contents(editor->findbuffer, query);
+            textbuffer_set_contents(editor->altbuffer, query);
+            charbuffer_destroy(query);
+
             editor->altmode = ALT_FIND;
             break;
         }
 
+        // Replace every occurrence of the find query.
+        KEY_ALT_ENTER {
+            if (rope_len(editor->findbuffer->text) <= 0) break;
+            FindTarget* target = find_target(editor, editor->findbuffer->text);
+            if (target == NULL) break;
+            uint32_t count = textbuffer_replace_all(fb->buffer, target, editor->altbuffer->text);
+
+            char buf[64];
+            snprintf(buf, sizeof buf, " Replaced %u occurrence%s ", count, count == 1 ? "" : "s");
+            charbuffer_astr(editor->message, buf);
+            editor->altmode = 0;
+            break;
+        }
+
+        // Replace the selections, expanding groups of a regex query.
         KEY_ENTER {
             Array* contents = array_create();
-            // textbuffer_edit_yank(fb->buffer, contents, false);
-            // // ... Pattern Replace
-            
-            // Temporary static replace.
-            array_add(contents, editor->altbuffer->text);
+            if (editor->find_regex && rope_len(editor->findbuffer->text) > 0) {
+                FindTarget* target = find_target(editor, editor->findbuffer->text);
+                if (target == NULL) {
+                    array_destroy(contents);
+                    break;
+                }
+                textbuffer_find_expand(fb->buffer, target, editor->altbuffer->text, contents);
+            } else {
+                array_add(contents, rope_copy(editor->altbuffer->text));
+            }
             textbuffer_edit_replace(fb->buffer, contents, 1);
 
-            array_destroy(contents);
+            array_destroy_callback(contents, (array_callback) rope_destroy);
+            editor->altmode = 0;
+            break;
+        }
+
+        KEY_ALT('r') {
+            editor->find_regex = !editor->find_regex;
+            break;
+        }
+
+        // Don't Pass these keys to textaction.
+        KEY_UP { break; }
+        KEY_DOWN { break; }
+        KEY_SHIFT_UP { break; }
+        KEY_SHIFT_DOWN { break; }
+        KEY_CTRL_UP { break; }
+        KEY_CTRL_DOWN { break; }
+        KEY_SHIFT_CTRL_UP { break; }
+        KEY_SHIFT_CTRL_DOWN { break; }
+        KEY_ALT_UP { break; }
+        KEY_ALT_DOWN { break; }
+        KEY_SHIFT_ALT_UP { break; }
+        KEY_SHIFT_ALT_DOWN { break; }
+
+        default: {
+            textaction(event, editor->altbuffer, 1, editor->clipboard);
+            break;
+        }
+    }
+
+    return true;
+}
+
+
+// -- Find-All-Mode Event Handler -- //
+
+// Whether find-all results are out of date: the query changed, or a
+//  buffer was opened, closed, or edited since the search.
+static
+bool find_all_stale (Editor* editor, Rope* query) {
+    if (editor->find_all_query == NULL || !rope_same(query, editor->find_all_query)) return true;
+    if (editor->find_all_buffers->size != editor->buffers->size) return true;
+    for (int i = 0; i < editor->buffers->size; i++) {
+        FileBuffer* fb = editor->buffers->data[i];
+        if (fb != editor->find_all_buffers->data[i]) return true;
+        if (!rope_same(fb->buffer->text, editor->find_all_texts->data[i])) return true;
+    }
+    return false;
+}
+
+// Search every open buffer for every space-separated word of the query, in
+//  one pass per buffer, on the thread pool.
+//  -> Results stream in from find_all_poll, in buffer order.
+static
+void find_all_search (Editor* editor, Rope* query) {
+    if (editor->find_all_query != NULL) rope_destroy(editor->find_all_query);
+    editor->find_all_query = rope_copy(query);
+    array_clear(editor->find_all_buffers);
+    for (int i = 0; i < editor->find_all_texts->size; i++) rope_destroy(editor->find_all_texts->data[i]);
+    array_clear(editor->find_all_texts);
+    free(editor->find_results);
+    editor->find_results = NULL;
+    editor->find_results_size = 0;
+    editor->find_result = -1;
+    editor->find_all_searched = 0;
+    if (editor->find_all_batch != NULL) {
+        multi_find_cancel(editor->find_all_batch);
+        array_add(editor->find_all_stale, editor->find_all_batch);
+        editor->find_all_batch = NULL;
+    }
+
+    Array* patterns = array_create();
+    uint32_t len = rope_len(query);
+    for (uint32_t i = 0, j = 0; j <= len; j++) {
+        if (j < len && rope_get_char(query, j) != ' ') continue;
+        if (j > i) array_add(patterns, rope_substr(query, i, j));
+        i = j + 1;
+    }
+
+    // Snapshots: the workers read these while the buffers stay editable.
+    for (int i = 0; i < editor->buffers->size; i++) {
+        FileBuffer* fb = editor->buffers->data[i];
+        array_add(editor->find_all_buffers, fb);
+        array_add(editor->find_all_texts, rope_copy(fb->buffer->text));
+    }
+
+    if (patterns->size > 0) {
+        MultiFind* finder = multi_find_create(patterns);
+        editor->find_all_batch = multi_find_start(finder, get_pool(editor), (Rope**) editor->find_all_texts->data, editor->buffers->size);
+    }
+
+    array_destroy_callback(patterns, (array_callback) rope_destroy);
+}
+
+// Whether the results in so far settle a jump in direction 'i' from 'pos'
+//  in buffer 'current': the search is done, or a result lies that way
+//  without wrapping around, with every buffer before it searched.
+static
+bool find_all_ready (Editor* editor, int32_t i, uint32_t current, uint32_t pos) {
+    if (editor->find_all_batch == NULL) return true;
+
+    uint32_t n = editor->find_results_size;
+    if (n == 0) return false;
+    FindResult* r = &editor->find_results[i > 0 ? n - 1 : 0];
+    if (i > 0) return r->buffer > current || (r->buffer == current && r->start > pos);
+    return editor->find_all_searched > current && (r->buffer < current || (r->buffer == current && r->start < pos));
+}
+
+// Select the next result after (i > 0) or before (i < 0) the cursor,
+//  in buffer order, wrapping around.
+//  -> Waits for the results that decide it, as find_all_pending, while the
+//      search streams them in.
+static
+void find_all_jump (Editor* editor, int32_t i) {
+    Rope* query = editor->altbuffer->text;
+    if (rope_len(query) == 0) return;
+    if (find_all_stale(editor, query)) find_all_search(editor, query);
+
+    FileBuffer* fb = get_buffer(editor);
+    Selection* sel = &fb->buffer->selections->data[0];
+    for (int x = 0; x < fb->buffer->selections->size; x++)
+        if (fb->buffer->selections->data[x].primary) sel = &fb->buffer->selections->data[x];
+    uint32_t pos = MIN(sel->cursor, sel->anchor);
+    uint32_t current = editor->current_buffer;
+
+    editor->find_all_pending = 0;
+    if (!find_all_ready(editor, i, current, pos)) {
+        editor->find_all_pending = i;
+        return;
+    }
+    if (editor->find_results_size == 0) {
+        charbuffer_astr(editor->message, " No results ");
+        return;
+    }
+
+    // Results are in buffer order, then by start.
+    uint32_t n = editor->find_results_size;
+    uint32_t k = 0;
+    while (k < n) {
+        FindResult* r = &editor->find_results[k];
+        if (r->buffer > current || (r->buffer == current && (i > 0 ? r->start > pos : r->start >= pos))) break;
+        k++;
+    }
+    k = i > 0 ? k % n : (k + n - 1) % n;
+
+    FindResult* r = &editor->find_results[k];
+    editor->current_buffer = r->buffer;
+    editor->tab_scroll_dmg = true;
+    editor->find_result = k;
+
+    TextBuffer* buffer = get_buffer(editor)->buffer;
+    Point start = rope_index_to_point(buffer->text, r->start);
+    Point end = rope_index_to_point(buffer->text, r->end);
+    textbuffer_cursor_goto(buffer, start.row, start.col, false);
+    textbuffer_cursor_goto(buffer, end.row, end.col, true);
+}
+
+// Take in the results of buffers searched since the last poll, and make a
+//  waiting jump once they settle it.
+//  -> Returns true while a search is running, or a cancelled one.
+static
+bool find_all_poll (Editor* editor) {
+    int n = 0;
+    for (int i = 0; i < editor->find_all_stale->size; i++) {
+        MultiFindBatch* batch = editor->find_all_stale->data[i];
+        if (multi_find_done(batch)) multi_find_batch_destroy(batch);
+        else editor->find_all_stale->data[n++] = batch;
+    }
+    editor->find_all_stale->size = n;
+
+    MultiFindBatch* batch = editor->find_all_batch;
+    if (batch == NULL) return editor->find_all_stale->size > 0;
+
+    // Checked first, so that once done every text is taken below.
+    bool done = multi_find_done(batch);
+    uint32_t k, size;
+    uint32_t* bounds;
+    while (multi_find_next(batch, false, &k, &bounds, &size)) {
+        editor->find_results = realloc(editor->find_results, MAX(1, editor->find_results_size + size) * sizeof(FindResult));
+        for (uint32_t m = 0; m < size; m++)
+            editor->find_results[editor->find_results_size++] = (FindResult) { k, bounds[2*m], bounds[2*m + 1] };
+        free(bounds);
+        editor->find_all_searched = k + 1;
+    }
+    if (done) {
+        multi_find_batch_destroy(batch);
+        editor->find_all_batch = NULL;
+    }
+
+    if (editor->altmode != ALT_FIND_ALL) editor->find_all_pending = 0;
+    if (editor->find_all_pending != 0) find_all_jump(editor, editor->find_all_pending);
+
+    return editor->find_all_batch != NULL || editor->find_all_stale->size > 0;
+}
+
+static
+bool find_all_event (Editor* editor, InputEvent* event) {
+    ON_KEY(event) {
+        KEY_CTRL('Q') {
+            return false;
+        }
+
+        KEY_ESC {
             editor->altmode = 0;
             break;
         }
@@ -483,6 +963,132 @@ bool replace_event (Editor* editor, InputEvent* event) {
         KEY_SHIFT_ALT_UP { break; }
         KEY_SHIFT_ALT_DOWN { break; }
 
+        // Next Result:
+        KEY_ENTER
+        KEY_CTRL('F')
+        KEY_ALT_RIGHT {
+            find_all_jump(editor, 1);
+            break;
+        }
+
+        // Previous Result:
+        KEY_CTRL('G')
+        KEY_ALT_LEFT {
+            find_all_jump(editor, -1);
+            break;
+        }
+
+        default: {
+            textaction(event, editor->altbuffer, 1, editor->clipboard);
+            editor->find_result = -1;
+            editor->find_all_pending = 0;
+            break;
+        }
+    }
+
+    return true;
+}
+
+
+// -- Grep-Mode Event Handler -- //
+
+static
+void grep_close (Editor* editor) {
+    grep_stop(editor->grep);
+    if (editor->grep_query != NULL) rope_destroy(editor->grep_query);
+    editor->grep_query = NULL;
+}
+
+// Start grepping the project for the query, unless its results are already
+//  the ones shown.
+//  -> Returns true if a search was started.
+static
+bool grep_query (Editor* editor) {
+    Rope* query = editor->altbuffer->text;
+    if (rope_len(query) == 0) return false;
+    if (editor->grep_query != NULL && rope_same(query, editor->grep_query) && editor->find_regex == editor->grep_regex) return false;
+
+    const char* error = NULL;
+    if (!grep_start(editor->grep, editor->file_index, query, editor->find_regex, &error)) {
+        charbuffer_astr(editor->message, " Regex: ");
+        charbuffer_astr(editor->message, error);
+        charbuffer_astr(editor->message, " ");
+        return true;
+    }
+
+    if (editor->grep_query != NULL) rope_destroy(editor->grep_query);
+    editor->grep_query = rope_copy(query);
+    editor->grep_regex = editor->find_regex;
+    editor->search_selection = 0;
+    editor->search_scroll = 0;
+    return true;
+}
+
+static
+bool grep_event (Editor* editor, InputEvent* event) {
+    Grep* grep = editor->grep;
+
+    ON_KEY(event) {
+        KEY_CTRL('Q') {
+            grep_close(editor);
+            return false;
+        }
+
+        KEY_ESC {
+            grep_close(editor);
+            editor->altmode = 0;
+            break;
+        }
+
+        KEY_ALT('r') {
+            editor->find_regex = !editor->find_regex;
+            break;
+        }
+
+        // Search on the first Enter, open the selected result on the next.
+        KEY_ENTER {
+            if (grep_query(editor) || grep->results_size == 0) break;
+
+            GrepResult result = grep->results[editor->search_selection];
+            CharBuffer* path = charbuffer_create();
+            charbuffer_astr(path, grep_path(grep, &result));
+            grep_close(editor);
+            editor->altmode = 0;
+
+            open_path(editor, path->buffer);
+            TextBuffer* buffer = get_buffer(editor)->buffer;
+            textbuffer_cursor_goto(buffer, result.start.row, result.start.col, false);
+            textbuffer_cursor_goto(buffer, result.end.row, result.end.col, true);
+            charbuffer_destroy(path);
+            break;
+        }
+
+        KEY_UP {
+            if (grep->results_size == 0) break;
+            editor->search_selection = MOD(editor->search_selection - 1, grep->results_size);
+            editor->search_scroll_dmg = true;
+            break;
+        }
+
+        KEY_DOWN {
+            if (grep->results_size == 0) break;
+            editor->search_selection = MOD(editor->search_selection + 1, grep->results_size);
+            editor->search_scroll_dmg = true;
+            break;
+        }
+
+        // Don't Pass these keys to textaction.
+        KEY_SHIFT_UP { break; }
+        KEY_SHIFT_DOWN { break; }
+        KEY_CTRL_UP { break; }
+        KEY_CTRL_DOWN { break; }
+        KEY_SHIFT_CTRL_UP { break; }
+        KEY_SHIFT_CTRL_DOWN { break; }
+        KEY_ALT_UP { break; }
+        KEY_ALT_DOWN { break; }
+        KEY_SHIFT_ALT_UP { break; }
+        KEY_SHIFT_ALT_DOWN { break; }
+
         default: {
             textaction(event, editor->altbuffer, 1, editor->clipboard);
             break;
@@ -501,6 +1107,28 @@ static void build_tab_bar (Editor* editor, uint32_t width, CharBuffer* tab_bar);
 static void draw_tab_bar (Editor* editor, Box* window, CharBuffer* tab_bar, MouseEvent* mev);
 static void draw_search (Editor* editor, Box* window, MouseEvent* mev);
 
+// "Match i of N", or "N matches" when no match is selected; N is a lower
+//  bound until the index is complete.
+static
+void find_count (TextBuffer* buffer, char* out, size_t size) {
+    MatchIndex* matches = buffer->matches;
+    const char* more = matches->complete ? "" : "+";
+
+    Selection* sel = &buffer->selections->data[0];
+    for (int i = 0; i < buffer->selections->size; i++)
+        if (buffer->selections->data[i].primary) sel = &buffer->selections->data[i];
+    uint32_t start = MIN(sel->cursor, sel->anchor);
+    uint32_t end = MAX(sel->cursor, sel->anchor);
+
+    uint32_t k = match_index_find(matches, start);
+    while (k < matches->size && matches->bounds[2*k] < start) k++;
+    if (k < matches->size && matches->bounds[2*k] == start && matches->bounds[2*k + 1] == end) {
+        snprintf(out, size, " Match %u of %u%s ", k + 1, matches->size, more);
+    } else {
+        snprintf(out, size, " %u match%s%s ", matches->size, more, matches->size == 1 && !*more ? "" : "es");
+    }
+}
+
 static
 const char* prompt_string (Editor* editor) {
     switch(editor->altmode) {
@@ -511,9 +1139,13 @@ const char* prompt_string (Editor* editor) {
         case ALT_SEARCH:
             return " (SEARCH) ";
         case ALT_FIND:
-            return " (FIND) ";
+            return editor->find_regex ? " (FIND REGEX) " : " (FIND) ";
         case ALT_REPLACE:
-            return " (REPLACE) ";
+            return editor->find_regex ? " (REPLACE REGEX) " : " (REPLACE) ";
+        case ALT_FIND_ALL:
+            return " (FIND ALL) ";
+        case ALT_GREP:
+            return editor->find_regex ? " (GREP REGEX) " : " (GREP) ";
         default:
             return "";
     }
@@ -522,7 +1154,7 @@ const char* prompt_string (Editor* editor) {
 void editor_draw (Editor* editor, Box* window, MouseEvent* m_event) {
     int header_size = 3;
     int altbuffer_size =  1; // editor->altmode == 0 ? 0 : 1;
-    int search_window_size = editor->altmode == ALT_SEARCH ? (window->height - header_size)/2 : 0;
+    int search_window_size = editor->altmode == ALT_SEARCH || editor->altmode == ALT_GREP ? (window->height - header_size)/2 : 0;
 
     // Header & Tab-Bar.
     {
@@ -570,12 +1202,44 @@ void editor_draw (Editor* editor, Box* window, MouseEvent* m_event) {
                 window->width - prompt_ln, altbuffer_size };
             textview_draw(editor->altview, &alt_window, m_event);
 
+            // Messages, or the match count, go at the right end of the prompt line.
+            char count[64] = "";
+            MatchIndex* matches = get_buffer(editor)->buffer->matches;
+            if (matches != NULL) find_count(get_buffer(editor)->buffer, count, sizeof count);
+            if (editor->altmode == ALT_FIND_ALL && editor->find_result >= 0)
+                snprintf(count, sizeof count, " Result %d of %u ", editor->find_result + 1, editor->find_results_size);
+            if (editor->altmode == ALT_SEARCH) {
+                FileSearch* search = editor->search;
+                const char* busy = editor->file_index_busy || search->job != NULL ? "+" : "";
+                if (search->job == NULL && search->query->size > 0) snprintf(count, sizeof count, " %u of %u files%s ", search->matches_size, search->files_size, busy);
+                else snprintf(count, sizeof count, " %u files%s ", search->files_size, busy);
+            }
+            if (editor->altmode == ALT_GREP && editor->grep_query != NULL) {
+                Grep* grep = editor->grep;
+                const char* busy = grep->running ? "+" : "";
+                snprintf(count, sizeof count, " %u result%s%s%s ", grep->results_size, grep->results_size == 1 ? "" : "s",
+                    grep->truncated ? " (limit)" : "", busy);
+            }
+            const char* note = editor->message->size > 0 ? editor->message->buffer : count;
+            int note_ln = strlen(note);
+            if (note_ln > 0 && note_ln < alt_window.width) {
+                output_bold();
+                output_cup(alt_window.y, window->x + window->width - note_ln);
+                output_str(note);
+                output_normal();
+            }
+
             if (search_window_size > 0) {
                 Box search_window = {
                     window->x + prompt_ln - 1, window->y + window->height - search_window_size,
                     window->width - prompt_ln, search_window_size };
                 draw_search(editor, &search_window, m_event);
             }
+        } else if (editor->message->size > 0) {
+            output_bold();
+            output_cup(window->y + window->height - altbuffer_size, window->x);
+            output_str(editor->message->buffer);
+            output_normal();
         }
     }
 }
@@ -763,6 +1427,32 @@ void build_tab_bar (Editor* editor, uint32_t width, CharBuffer* tab_bar) {
 
 // -- Search Window -- //
 
+// Grep results, as "path:line:col: snippet" with the path from the root.
+static
+void draw_grep (Editor* editor, Box* window) {
+    Grep* grep = editor->grep;
+    uint32_t prefix = editor->dir->size + 1;
+
+    for (int i = 0; i < window->height; i++) {
+        int32_t n = i + editor->search_scroll;
+        if (n >= grep->results_size) break;
+
+        GrepResult* result = &grep->results[n];
+        char buf[window->width + 1];
+        snprintf(buf, window->width + 1, " %s:%d:%d: %s ", grep_path(grep, result) + prefix,
+            result->start.row + 1, result->start.col + 1, result->snippet);
+
+        output_cup(window->y + i, window->x);
+        if (n == editor->search_selection) {
+            output_setbg(12);
+            output_str(buf);
+            output_normal();
+        } else {
+            output_str(buf);
+        }
+    }
+}
+
 static
 void draw_search (Editor* editor, Box* window, MouseEvent* mev) {
     // Mouse Input.
@@ -782,14 +1472,20 @@ void draw_search (Editor* editor, Box* window, MouseEvent* mev) {
         editor->search_scroll_dmg = false;
     }
 
+    if (editor->altmode == ALT_GREP) {
+        draw_grep(editor, window);
+        return;
+    }
+
+    // Results of an older query are not shown while the current one ranks.
+    if (editor->search->job != NULL) return;
+
     for (int i = 0; i < window->height; i++) {
         int32_t n = i + editor->search_scroll;
-        if (n >= editor->search_files->size) break;
-
-        FileEntry* file = editor->search_files->data[n];
+        if (n >= editor->search->top_size) break;
 
         char buf[window->width + 1];
-        snprintf(buf, window->width + 1 ," %s ", file->path->buffer + file->prefix + 1);
+        snprintf(buf, window->width + 1 ," %s ", search_path(editor->search, n) + editor->search->prefix + 1);
 
         output_cup(window->y + i, window->x);
         if (n == editor->search_selection) {
@@ -2,6 +2,13 @@
 
 #include "main.h"
 
+// A match of find-all, in one of the open buffers.
+typedef struct {
+    uint32_t buffer;
+    uint32_t start;
+    uint32_t end;
+} FindResult;
+
 struct editor {
     Array* buffers;
     uint32_t current_buffer;
@@ -12,21 +19,61 @@ struct editor {
 
     TextBuffer* findbuffer;
     TextView* findview;
+    // Find and replace take the query as a regular expression.
+    bool find_regex;
+    // Query the current buffer's matches were indexed for.
+    Rope* find_query;
+    bool find_query_regex;
+    // Compiled query for find and replace keys, and what it was compiled from.
+    FindTarget* find_target;
+    Rope* find_target_query;
+    bool find_target_regex;
+
+    // Find-all results, from searching 'find_all_texts', snapshots of the
+    //  texts of 'find_all_buffers', for 'find_all_query'.
+    Rope* find_all_query;
+    Array* find_all_buffers;
+    Array* find_all_texts;
+    FindResult* find_results;
+    uint32_t find_results_size;
+    // Result last jumped to, or -1.
+    int32_t find_result;
+    // Search still streaming results in, and cancelled ones not yet done.
+    MultiFindBatch* find_all_batch;
+    Array* find_all_stale;
+    // Buffers whose results are in.
+    uint32_t find_all_searched;
+    // Direction of a jump waiting on results, or 0.
+    int32_t find_all_pending;
+    ThreadPool* pool;
 
     TextBuffer* replacebuffer;
     TextView* replaceview;
 
     CharBuffer* dir;
 
+    // Shown on the prompt line until the next event.
+    CharBuffer* message;
+
     Array* clipboard;
 
     int32_t tab_scroll;
     int32_t tab_scroll_dmg;
 
-    Array* search_files;
+    // Files under 'dir', kept from first use on.
+    FileIndex* file_index;
+    bool file_index_busy;
+
+    FileSearch* search;
     int32_t search_selection;
     int32_t search_scroll;
     bool search_scroll_dmg;
+
+    // Project grep, shown in the search window, and the query and mode its
+    //  results are for.
+    Grep* grep;
+    Rope* grep_query;
+    bool grep_regex;
 };
 
 
@@ -37,4 +84,6 @@ void editor_fini (Editor* editor);
 
 bool editor_event (Editor* editor, InputEvent* event);
 
+bool editor_idle (Editor* editor);
+
 void editor_draw (Editor* editor, Box* window, MouseEvent* mev);
@@ -1,7 +1,7 @@
 #include "filebuffer.h"
 
 #include "charbuffer.h"
-#include "intbuffer.h"
+#include "histlog.h"
 #include "rope.h"
 #include "textbuffer.h"
 #include "textview.h"
@@ -9,6 +9,12 @@
 #include "output.h"
 #include "mode.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
 
 FileBuffer* filebuffer_create () {
     FileBuffer* fb = malloc(sizeof(FileBuffer));
@@ -20,11 +26,15 @@ FileBuffer* filebuffer_create () {
 
     charbuffer_astr(fb->title, "Untitled");
     charbuffer_astr(fb->shortpath, "[Untitled]");
+    fb->save = NULL;
 
     return fb;
 }
 
 void filebuffer_destroy (FileBuffer* fb) {
+    int error;
+    filebuffer_write_poll(fb, true, &error);
+
     textbuffer_destroy(fb->buffer);
     textview_destroy(fb->view);
     charbuffer_destroy(fb->title);
@@ -80,6 +90,39 @@ const char* set_path (FileBuffer* fb, const char* path) {
     return fb->longpath->buffer;
 }
 
+// History log: "$XDG_STATE_HOME/tatl/history/<escaped path>.tatl", kept out
+//  of the project. False if there's no state directory, or the name would be
+//  too long for one, in which case the buffer keeps no log.
+static
+bool history_path (FileBuffer* fb, CharBuffer* out) {
+    const char* path = fb->longpath->buffer;
+    if (*path != '/') return false;
+
+    charbuffer_clear(out);
+    const char* base = getenv("XDG_STATE_HOME");
+    if (base != NULL && *base == '/') {
+        charbuffer_astr(out, base);
+    } else {
+        const char* home = getenv("HOME");
+        if (home == NULL || *home != '/') return false;
+        charbuffer_astr(out, home);
+        charbuffer_astr(out, "/.local");
+        mkdir(out->buffer, 0700);
+        charbuffer_astr(out, "/state");
+    }
+    mkdir(out->buffer, 0700);
+    charbuffer_astr(out, "/tatl");
+    mkdir(out->buffer, 0700);
+    charbuffer_astr(out, "/history");
+    mkdir(out->buffer, 0700);
+
+    charbuffer_achar(out, '/');
+    uint32_t name = out->size;
+    charbuffer_aname(out, path);
+    charbuffer_astr(out, ".tatl");
+    return out->size - name <= NAME_MAX;
+}
+
 static
 void filebuffer_unsaved_read (FileBuffer* fb, const char* path) {
     // In The case where the read file does not exist:
@@ -102,32 +145,77 @@ void filebuffer_unsaved_read (FileBuffer* fb, const char* path) {
     charbuffer_clear(fb->title);
     charbuffer_astr(fb->title, title_of(path));
 
-    textbuffer_set_mode(fb->buffer, get_language_mode(fb->title->buffer));
+    textbuffer_set_mode(fb->buffer, get_language_mode(fb->title->buffer, NULL, 0));
+}
+
+// Decode what can't be mapped, a block at a time.
+static
+void read_blocks (int fd, const char* title, RopeBuilder* builder, HistHash* hash, Mode** mode) {
+    char* block = malloc(FILE_READ_BLOCK);
+    // Bytes carried to the next block: a sequence cut off by this one, or a
+    //  newline that may end the file.
+    size_t held = 0;
+    bool first = true;
+
+    ssize_t r;
+    while ((r = read(fd, block + held, FILE_READ_BLOCK - held)) > 0) {
+        histlog_hash_update(hash, block + held, r);
+        size_t size = held + r;
+        if (first) *mode = get_language_mode(title, block, size);
+        first = false;
+
+        size_t end = block[size - 1] == '\n' ? size - 1 : size;
+        size_t used = rope_builder_put_utf8(builder, block, end);
+        held = size - used;
+        memmove(block, block + used, held);
+    }
+    if (first) *mode = get_language_mode(title, block, 0);
+
+    // Whatever is left is the ending newline, or was cut off by the end.
+    free(block);
 }
 
 bool filebuffer_read (FileBuffer* fb, const char* path) {
+    // A save in flight would finish onto the new file's path.
+    int error;
+    filebuffer_write_poll(fb, true, &error);
+
     const char* filepath = set_path(fb, path);
 
-    FILE* f = fopen(filepath, "r");
-    if (f == NULL) {
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         filebuffer_unsaved_read(fb, filepath);
         return false;
     }
 
-    CharBuffer* chars = charbuffer_create();
-    charbuffer_read(chars, f);
-    fclose(f);
-
-    IntBuffer* chars32 = intbuffer_create();
-    intbuffer_put_text(chars32, 0, chars);
-    charbuffer_destroy(chars);
-
-    if (chars32->data[chars32->size - 1] == '\n') {
-        chars32->size--; // Remove Ending Newline.
+    // Identifies the contents to the history log.
+    HistHash hash;
+    histlog_hash_init(&hash);
+    Mode* mode = NULL;
+
+    // Decoded straight into the rope: mapped pages are the file's own, so
+    //  nothing but the rope is allocated for the text.
+    RopeBuilder* builder = rope_builder_create();
+    struct stat st;
+    char* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+        size_t size = st.st_size;
+        madvise(map, size, MADV_SEQUENTIAL);
+        histlog_hash_update(&hash, map, size);
+        mode = get_language_mode(fb->title->buffer, map, size);
+
+        // Remove Ending Newline.
+        rope_builder_put_utf8(builder, map, map[size - 1] == '\n' ? size - 1 : size);
+        munmap(map, size);
+    } else {
+        read_blocks(fd, fb->title->buffer, builder, &hash, &mode);
     }
+    close(fd);
 
-    Rope* text = rope_create(chars32);
-    intbuffer_destroy(chars32);
+    Rope* text = rope_builder_finish(builder);
 
     textbuffer_destroy(fb->buffer);
     fb->buffer = textbuffer_create(text);
@@ -135,34 +223,217 @@ bool filebuffer_read (FileBuffer* fb, const char* path) {
     textview_destroy(fb->view);
     fb->view = textview_create(fb->buffer);
 
-    textbuffer_set_mode(fb->buffer, get_language_mode(fb->title->buffer));
+    textbuffer_set_mode(fb->buffer, mode);
+
+    // Restore undo history.
+    if (stat(filepath, &st) == 0) {
+        CharBuffer* hpath = charbuffer_create();
+        if (history_path(fb, hpath))
+            textbuffer_history_attach(fb->buffer, hpath->buffer, &st, histlog_hash_final(&hash));
+        charbuffer_destroy(hpath);
+    }
 
     return true;
 }
 
+struct save_job {
+    pthread_t thread;
+
+    // Snapshot being saved: ropes are immutable, so editing goes on.
+    Rope* text;
+    // Path as given, and the file it names.
+    char* path;
+    char* target;
+    mode_t mask;
+
+    // Characters written so far, for the status line.
+    atomic_uint done;
+    uint32_t total;
+
+    // Set by the thread when it is done; the rest is read only after.
+    atomic_bool finished;
+    bool ok;
+    int error;
+    HistHash hash;
+};
+
+struct rope_write_data {
+    SaveJob* job;
+    int fd;
+    char* block;
+    size_t size;
+    bool ok;
+};
+
 static
-bool rope_write (uint32_t i, uint32_t ch, void* data) {
-    FILE* file = data;
-    char buf[5] = {0};
-    codepoint_to_chars(buf, ch);
-    fputs(buf, file);
+bool write_block (struct rope_write_data* out) {
+    histlog_hash_update(&out->job->hash, out->block, out->size);
+    for (size_t done = 0; done < out->size;) {
+        ssize_t r = write(out->fd, out->block + done, out->size - done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return out->ok = false;
+        done += r;
+    }
+    out->size = 0;
+    return true;
+}
 
+static
+bool rope_write (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
+    struct rope_write_data* out = data;
+    // Always leaves room for the ending newline.
+    if (out->size + 4 * n >= FILE_WRITE_BLOCK && !write_block(out)) return false;
+    out->size += utf8_encode(chars, n, out->block + out->size);
+    atomic_store_explicit(&out->job->done, i + n, memory_order_relaxed);
     return true;
 }
 
-bool filebuffer_write (FileBuffer* fb, const char* path) {
-    FILE* f = fopen(path, "w");
-    if (f == NULL) return false;
+// Written to a temporary file beside the target, synced, then renamed over
+//  it: a crash leaves the old contents or the new, never a torn file.
+static
+bool save_text (SaveJob* job) {
+    const char* target = job->target;
+    const char* slash = strrchr(target, '/');
+
+    CharBuffer* temp = charbuffer_create();
+    if (slash != NULL) for (const char* c = target; c <= slash; c++) charbuffer_achar(temp, *c);
+    charbuffer_astr(temp, ".");
+    charbuffer_astr(temp, slash == NULL ? target : slash + 1);
+    charbuffer_astr(temp, ".XXXXXX");
+
+    int fd = mkstemp(temp->buffer);
+    if (fd < 0) {
+        charbuffer_destroy(temp);
+        return false;
+    }
 
-    rope_foreach(fb->buffer->text, rope_write, f);
-    fputc('\n', f); // Put Back Ending Newline.
-    fclose(f);
+    // The old file's permissions and, where allowed, owner; else the default.
+    struct stat st;
+    if (stat(target, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+        if (fchown(fd, st.st_uid, st.st_gid) != 0) {}
+    } else {
+        fchmod(fd, 0666 & ~job->mask);
+    }
 
-    set_path(fb, path);
-    fb->buffer->text_dmg = false;
+    struct rope_write_data out = { .job = job, .fd = fd, .block = malloc(FILE_WRITE_BLOCK), .size = 0, .ok = true };
+    rope_foreach_chunk(job->text, rope_write, &out);
+    out.block[out.size++] = '\n'; // Put Back Ending Newline.
+
+    bool ok = out.ok && write_block(&out) && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    ok = ok && rename(temp->buffer, target) == 0;
+    int error = errno;
+    free(out.block);
+
+    if (!ok) {
+        unlink(temp->buffer);
+        charbuffer_destroy(temp);
+        errno = error;
+        return false;
+    }
+
+    // The rename itself, made durable.
+    charbuffer_clear(temp);
+    if (slash == NULL) charbuffer_astr(temp, ".");
+    else for (const char* c = target; c == target || c < slash; c++) charbuffer_achar(temp, *c);
+    int dir = open(temp->buffer, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+    charbuffer_destroy(temp);
     return true;
 }
 
+static
+void* save_run (void* data) {
+    SaveJob* job = data;
+    job->ok = save_text(job);
+    job->error = job->ok ? 0 : errno;
+    atomic_store(&job->finished, true);
+    return NULL;
+}
+
+bool filebuffer_write_start (FileBuffer* fb, const char* path) {
+    int error;
+    filebuffer_write_poll(fb, true, &error);
+
+    SaveJob* job = malloc(sizeof(SaveJob));
+    job->text = rope_copy(fb->buffer->text);
+    job->path = strdup(path);
+    // Through symlinks, to the file itself.
+    job->target = realpath(path, NULL);
+    if (job->target == NULL) job->target = strdup(path);
+    // umask can only be read by setting it, so not on the thread.
+    job->mask = umask(0);
+    umask(job->mask);
+
+    atomic_init(&job->done, 0);
+    job->total = rope_len(job->text);
+    atomic_init(&job->finished, false);
+    job->ok = false;
+    job->error = 0;
+    histlog_hash_init(&job->hash);
+
+    error = pthread_create(&job->thread, NULL, save_run, job);
+    if (error != 0) {
+        rope_destroy(job->text);
+        free(job->path);
+        free(job->target);
+        free(job);
+        errno = error;
+        return false;
+    }
+
+    fb->save = job;
+    return true;
+}
+
+bool filebuffer_write_poll (FileBuffer* fb, bool wait, int* error) {
+    SaveJob* job = fb->save;
+    *error = 0;
+    if (job == NULL) return false;
+    if (!wait && !atomic_load(&job->finished)) return true;
+
+    pthread_join(job->thread, NULL);
+    fb->save = NULL;
+
+    if (job->ok) {
+        set_path(fb, job->path);
+
+        // Edits made during the save are not in the file: the buffer stays
+        //  modified, and its history unmarked.
+        struct stat st;
+        if (rope_same(job->text, fb->buffer->text) && stat(job->target, &st) == 0) {
+            fb->buffer->text_dmg = false;
+
+            // Mark the saved state in the undo history log.
+            CharBuffer* hpath = charbuffer_create();
+            if (history_path(fb, hpath))
+                textbuffer_history_saved(fb->buffer, hpath->buffer, &st, histlog_hash_final(&job->hash));
+            charbuffer_destroy(hpath);
+        }
+    } else {
+        *error = job->error;
+    }
+
+    rope_destroy(job->text);
+    free(job->path);
+    free(job->target);
+    free(job);
+    return false;
+}
+
+bool filebuffer_write (FileBuffer* fb, const char* path) {
+    if (!filebuffer_write_start(fb, path)) return false;
+
+    int error;
+    filebuffer_write_poll(fb, true, &error);
+    errno = error;
+    return error == 0;
+}
+
 
 void filebuffer_draw (FileBuffer* fb, Box* window, MouseEvent* mev) {
     // Make sure window is big enough.
@@ -185,6 +456,12 @@ void filebuffer_draw (FileBuffer* fb, Box* window, MouseEvent* mev) {
         Point P = {};
         textbuffer_primary_point(fb->buffer, &P);
         snprintf(left, width + 1, "%s%s  %d:%d", mode_name, fb->buffer->hard_tabs ? "  [\\t]" : "", P.row + 1, P.col + 1);
+        if (fb->save != NULL) {
+            SaveJob* job = fb->save;
+            uint32_t done = atomic_load_explicit(&job->done, memory_order_relaxed);
+            size_t n = strlen(left);
+            snprintf(left + n, width + 1 - n, "  Saving %u%%", job->total == 0 ? 100 : (uint32_t) (100.0 * done / job->total));
+        }
 
         output_cup(line, window->x);
         output_setfg(13);
@@ -7,6 +7,8 @@
 #include "textaction.h"
 
 
+typedef struct save_job SaveJob;
+
 struct filebuffer {
 
     TextBuffer* buffer;
@@ -16,6 +18,8 @@ struct filebuffer {
     CharBuffer* longpath;
     CharBuffer* shortpath;
 
+    // Save running in the background, or NULL.
+    SaveJob* save;
 };
 
 
@@ -26,7 +30,19 @@ void filebuffer_destroy (FileBuffer* fb);
 
 bool filebuffer_read (FileBuffer* fb, const char* path);
 
+// Save to 'path', waiting for it.
+//  -> Returns false, with errno set, on failure.
 bool filebuffer_write (FileBuffer* fb, const char* path);
 
+// Start saving a snapshot of the text to 'path' on its own thread, after
+//  any save already running; editing may go on meanwhile.
+//  -> Returns false, with errno set, if the thread could not start.
+bool filebuffer_write_start (FileBuffer* fb, const char* path);
+
+// Finish the running save if it is done, or if 'wait', once it is.
+//  -> Returns true while it is still running; otherwise *error is the
+//      errno it failed with, or zero.
+bool filebuffer_write_poll (FileBuffer* fb, bool wait, int* error);
+
 
 void filebuffer_draw (FileBuffer* fb, Box* window, MouseEvent* mev);
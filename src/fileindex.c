@@ -0,0 +1,867 @@
+#include "fileindex.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "array.h"
+#include "charbuffer.h"
+#include "ignore.h"
+#include "ring.h"
+#include "threadpool.h"
+
+
+// Writes are watched only for ignore files.
+#define INDEX_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// A directory for a worker: 'check' compares its mtime first, and only
+//  reads it if it moved, checking its subdirectories in turn; 'reread'
+//  reads it and all below, as the rules above changed.
+//  -> 'rules' are its parent's, held for the job.
+typedef struct {
+    IndexDir* dir;
+    bool check;
+    bool reread;
+    IgnoreRules* rules;
+} IndexJob;
+
+// What a worker found, for the main thread to apply.
+typedef struct {
+    IndexDir* dir;
+    int wd;
+
+    // Why the watch failed, if for want of watches rather than of the directory.
+    int watch_error;
+
+    // A new listing; otherwise only the watch is news.
+    bool listed;
+    char* files;
+    uint32_t files_size;
+    uint32_t file_count;
+    Array* subdirs;
+    // Old subdirectories that are gone.
+    Array* removed;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+
+    // The directory's rules, if it could be opened.
+    IgnoreRules* ignore;
+    uint32_t ignore_hash;
+} IndexUpdate;
+
+
+// -- Tree -- //
+
+static
+IndexDir* dir_create (IndexDir* parent, const char* name) {
+    IndexDir* dir = malloc(sizeof(IndexDir));
+    dir->parent = parent;
+    dir->name = strdup(name);
+    dir->files = NULL;
+    dir->files_size = 0;
+    dir->file_count = 0;
+    dir->mapped = false;
+    dir->listed = false;
+    dir->removed = false;
+    dir->subdirs = array_create();
+    dir->mtime_sec = 0;
+    dir->mtime_nsec = 0;
+    dir->wd = -1;
+    dir->ignore = NULL;
+    dir->ignore_hash = 0;
+    return dir;
+}
+
+static
+void dir_destroy (FileIndex* index, IndexDir* dir) {
+    for (int i = 0; i < dir->subdirs->size; i++) dir_destroy(index, dir->subdirs->data[i]);
+    array_destroy(dir->subdirs);
+
+    if (dir->wd >= 0 && dir->wd < index->watched_size && index->watched[dir->wd] == dir) {
+        index->watched[dir->wd] = NULL;
+        inotify_rm_watch(index->inotify, dir->wd);
+    }
+    if (!dir->mapped) free(dir->files);
+    ignore_unref(dir->ignore);
+    free(dir->name);
+    free(dir);
+}
+
+// Path relative to the root; "" for the root.
+static
+void dir_relative (IndexDir* dir, CharBuffer* out) {
+    if (dir->parent == NULL) return;
+    dir_relative(dir->parent, out);
+    if (dir->parent->parent != NULL) charbuffer_achar(out, '/');
+    charbuffer_astr(out, dir->name);
+}
+
+void file_index_path (FileIndex* index, IndexDir* dir, CharBuffer* out) {
+    charbuffer_clear(out);
+    charbuffer_astr(out, index->root);
+    if (dir->parent == NULL) return;
+
+    if (out->size == 0 || out->buffer[out->size - 1] != '/') charbuffer_achar(out, '/');
+    dir_relative(dir, out);
+}
+
+static
+bool dir_detached (IndexDir* dir) {
+    for (; dir != NULL; dir = dir->parent)
+        if (dir->removed) return true;
+    return false;
+}
+
+
+// -- Scanning -- //
+
+// Take a job: newest of our own, else the oldest of someone else's.
+static
+IndexJob* index_take (FileIndex* index, uint32_t worker) {
+    for (uint32_t k = 0; k < index->workers; k++) {
+        uint32_t w = (worker + k) % index->workers;
+        pthread_mutex_lock(&index->locks[w]);
+        IndexJob* job = NULL;
+        if (index->queues[w]->size > 0) job = k == 0 ? ring_pop(index->queues[w]) : ring_shift(index->queues[w]);
+        pthread_mutex_unlock(&index->locks[w]);
+        if (job != NULL) return job;
+    }
+    return NULL;
+}
+
+static
+IndexJob* job_create (IndexDir* dir, bool check, bool reread, IgnoreRules* rules) {
+    IndexJob* job = malloc(sizeof(IndexJob));
+    job->dir = dir;
+    job->check = check;
+    job->reread = reread;
+    job->rules = ignore_ref(rules);
+    return job;
+}
+
+static
+void job_destroy (IndexJob* job) {
+    ignore_unref(job->rules);
+    free(job);
+}
+
+static
+void index_give (FileIndex* index, uint32_t worker, IndexDir* dir, bool check, bool reread, IgnoreRules* rules) {
+    IndexJob* job = job_create(dir, check, reread, rules);
+
+    // Counted before it can be taken, so a thief never counts it down first.
+    pthread_mutex_lock(&index->lock);
+    index->pending++;
+    index->queued++;
+
+    pthread_mutex_lock(&index->locks[worker]);
+    ring_push(index->queues[worker], job);
+    pthread_mutex_unlock(&index->locks[worker]);
+
+    pthread_cond_signal(&index->wake);
+    pthread_mutex_unlock(&index->lock);
+}
+
+static
+int subdir_compare (const void* a, const void* b) {
+    return strcmp((*(IndexDir**) a)->name, (*(IndexDir**) b)->name);
+}
+
+static
+int subdir_find (const void* key, const void* item) {
+    return strcmp(key, (*(IndexDir**) item)->name);
+}
+
+// Read a directory's entries into 'update', matching subdirectories to the
+//  ones already known, and leaving out what 'rules' ignore.
+//  -> 'path' is the directory's, relative to the root; 'reread' has every
+//      subdirectory read again too.
+static
+void index_read (FileIndex* index, uint32_t worker, IndexJob* job, int fd, CharBuffer* path, IgnoreRules* rules, bool reread, IndexUpdate* update) {
+    IndexDir* dir = job->dir;
+
+    uint32_t base = path->size == 0 ? 0 : path->size + 1;
+    // Each entry's path, for the rules; names are at most 255 bytes.
+    char* entry_path = malloc(base + 256);
+    memcpy(entry_path, path->buffer, path->size);
+    if (base > 0) entry_path[path->size] = '/';
+
+    uint32_t old_size = dir->subdirs->size;
+    IndexDir** old = malloc(MAX(1, old_size) * sizeof(IndexDir*));
+    memcpy(old, dir->subdirs->data, old_size * sizeof(IndexDir*));
+    qsort(old, old_size, sizeof(IndexDir*), subdir_compare);
+    bool* seen = calloc(MAX(1, old_size), sizeof(bool));
+
+    uint32_t capacity = 256;
+    update->files = malloc(capacity);
+    update->subdirs = array_create();
+    update->removed = array_create();
+
+    char buf[INDEX_DENTS_SIZE];
+    // Zero once the end is reached.
+    long n = -1;
+    while (!atomic_load(&index->cancel) && (n = syscall(SYS_getdents64, fd, buf, sizeof buf)) > 0) {
+        for (long off = 0; off < n;) {
+            struct linux_dirent64* entry = (struct linux_dirent64*) (buf + off);
+            off += entry->d_reclen;
+
+            const char* name = entry->d_name;
+            if (*name == '.') continue;
+
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                if (S_ISDIR(st.st_mode)) type = DT_DIR;
+                if (S_ISREG(st.st_mode)) type = DT_REG;
+            }
+            if (type != DT_DIR && type != DT_REG) continue;
+
+            uint32_t name_size = strlen(name);
+            memcpy(entry_path + base, name, name_size + 1);
+            if (ignore_match(rules, entry_path, base + name_size, type == DT_DIR)) continue;
+
+            if (type == DT_DIR) {
+                IndexDir** found = bsearch(name, old, old_size, sizeof(IndexDir*), subdir_find);
+                if (found != NULL) {
+                    seen[found - old] = true;
+                    array_add(update->subdirs, *found);
+                    if (reread) index_give(index, worker, *found, false, true, rules);
+                    else if (job->check) index_give(index, worker, *found, true, false, rules);
+                } else {
+                    IndexDir* sub = dir_create(dir, name);
+                    array_add(update->subdirs, sub);
+                    index_give(index, worker, sub, false, false, rules);
+                }
+            } else {
+                uint32_t len = name_size + 1;
+                if (update->files_size + len > capacity) {
+                    while (update->files_size + len > capacity) capacity *= 2;
+                    update->files = realloc(update->files, capacity);
+                }
+                memcpy(update->files + update->files_size, name, len);
+                update->files_size += len;
+                update->file_count++;
+            }
+        }
+    }
+
+    // Cut short: keep what was read and what was there, but have the next
+    //  check read it again.
+    bool whole = n == 0;
+    if (!whole) {
+        update->mtime_sec = 0;
+        update->mtime_nsec = 0;
+    }
+
+    for (uint32_t k = 0; k < old_size; k++)
+        if (!seen[k]) array_add(whole ? update->removed : update->subdirs, old[k]);
+    free(old);
+    free(seen);
+    free(entry_path);
+}
+
+static
+void index_scan (FileIndex* index, uint32_t worker, IndexJob* job) {
+    IndexDir* dir = job->dir;
+    IndexUpdate* update = calloc(1, sizeof(IndexUpdate));
+    update->dir = dir;
+
+    // Watch first, so no change slips in between the read and the watch.
+    CharBuffer* path = charbuffer_create();
+    file_index_path(index, dir, path);
+    update->wd = inotify_add_watch(index->inotify, path->buffer, INDEX_WATCH_MASK);
+    if (update->wd < 0 && errno != ENOENT && errno != ENOTDIR && errno != EACCES) update->watch_error = errno;
+    charbuffer_clear(path);
+    dir_relative(dir, path);
+    int fd = openat(index->fd, path->size == 0 ? "." : path->buffer, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    // Changed rules here make this and every directory below read again.
+    bool reread = job->reread;
+    if (fd >= 0) {
+        update->ignore = ignore_load(job->rules, fd, path->size, &update->ignore_hash);
+        reread |= update->ignore_hash != dir->ignore_hash;
+    }
+
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        // Gone: its parent's rescan drops it.
+        update->listed = true;
+        update->subdirs = array_create();
+        update->removed = array_create();
+        for (int i = 0; i < dir->subdirs->size; i++) array_add(update->removed, dir->subdirs->data[i]);
+    } else if (job->check && !reread && dir->listed && st.st_mtim.tv_sec == dir->mtime_sec && st.st_mtim.tv_nsec == dir->mtime_nsec) {
+        for (int i = 0; i < dir->subdirs->size; i++) index_give(index, worker, dir->subdirs->data[i], true, false, update->ignore);
+    } else {
+        update->listed = true;
+        update->mtime_sec = st.st_mtim.tv_sec;
+        update->mtime_nsec = st.st_mtim.tv_nsec;
+        index_read(index, worker, job, fd, path, update->ignore, reread, update);
+    }
+    if (fd >= 0) close(fd);
+    charbuffer_destroy(path);
+
+    pthread_mutex_lock(&index->lock);
+    array_add(index->updates, update);
+    pthread_mutex_unlock(&index->lock);
+}
+
+typedef struct {
+    FileIndex* index;
+    uint32_t worker;
+} IndexWorker;
+
+static
+void index_run (void* data) {
+    IndexWorker* task = data;
+    FileIndex* index = task->index;
+    uint32_t worker = task->worker;
+    free(task);
+
+    while (true) {
+        IndexJob* job = index_take(index, worker);
+        if (job == NULL) {
+            // Nothing to steal: wait for more, unless the scan is over.
+            pthread_mutex_lock(&index->lock);
+            while (!atomic_load(&index->cancel) && index->pending > 0 && index->queued == 0) pthread_cond_wait(&index->wake, &index->lock);
+            bool over = atomic_load(&index->cancel) || index->pending == 0;
+            pthread_mutex_unlock(&index->lock);
+            if (over) break;
+            continue;
+        }
+
+        pthread_mutex_lock(&index->lock);
+        index->queued--;
+        pthread_mutex_unlock(&index->lock);
+
+        if (!atomic_load(&index->cancel)) index_scan(index, worker, job);
+        job_destroy(job);
+
+        pthread_mutex_lock(&index->lock);
+        if (--index->pending == 0) pthread_cond_broadcast(&index->wake);
+        pthread_mutex_unlock(&index->lock);
+    }
+
+    pthread_mutex_lock(&index->lock);
+    if (--index->running == 0) pthread_cond_broadcast(&index->done);
+    pthread_mutex_unlock(&index->lock);
+}
+
+// Queue a job from the main thread; only while no workers run.
+static
+void index_queue (FileIndex* index, IndexDir* dir, bool check) {
+    // The parent's rules, if a scan got to them yet.
+    IgnoreRules* rules = dir->parent != NULL && dir->parent->ignore != NULL ? dir->parent->ignore : index->ignore;
+    IndexJob* job = job_create(dir, check, false, rules);
+    ring_push(index->queues[0], job);
+    index->pending++;
+    index->queued++;
+}
+
+static
+void index_start (FileIndex* index) {
+    if (index->pending == 0) return;
+
+    index->running = index->workers;
+    for (uint32_t w = 0; w < index->workers; w++) {
+        IndexWorker* task = malloc(sizeof(IndexWorker));
+        task->index = index;
+        task->worker = w;
+        thread_pool_submit(index->pool, index_run, task);
+    }
+}
+
+
+// -- Updates -- //
+
+static
+void index_apply (FileIndex* index, IndexUpdate* update, Array* added, bool* changed) {
+    IndexDir* dir = update->dir;
+
+    if (update->wd >= 0) {
+        if (update->wd >= index->watched_size) {
+            uint32_t size = MAX(64, 2 * update->wd);
+            index->watched = realloc(index->watched, size * sizeof(IndexDir*));
+            memset(index->watched + index->watched_size, 0, (size - index->watched_size) * sizeof(IndexDir*));
+            index->watched_size = size;
+        }
+        // A directory made again under the same name has a new watch.
+        if (dir->wd >= 0 && dir->wd != update->wd && index->watched[dir->wd] == dir) index->watched[dir->wd] = NULL;
+        index->watched[update->wd] = dir;
+        dir->wd = update->wd;
+    }
+    if (update->watch_error != 0) {
+        if (!index->unwatched) index->watch_error = update->watch_error;
+        index->unwatched = true;
+    }
+
+    if (update->ignore != NULL) {
+        ignore_unref(dir->ignore);
+        dir->ignore = update->ignore;
+        if (dir->ignore_hash != update->ignore_hash) index->modified = true;
+        dir->ignore_hash = update->ignore_hash;
+    }
+
+    if (update->listed) {
+        if (dir->listed) *changed = true;
+        else if (added != NULL) array_add(added, dir);
+
+        if (!dir->mapped) free(dir->files);
+        dir->files = update->files;
+        dir->files_size = update->files_size;
+        dir->file_count = update->file_count;
+        dir->mapped = false;
+        dir->listed = true;
+        dir->mtime_sec = update->mtime_sec;
+        dir->mtime_nsec = update->mtime_nsec;
+
+        array_destroy(dir->subdirs);
+        dir->subdirs = update->subdirs;
+
+        // Freed once no worker can be looking at them.
+        for (int i = 0; i < update->removed->size; i++) {
+            IndexDir* gone = update->removed->data[i];
+            gone->removed = true;
+            array_add(index->graveyard, gone);
+            *changed = true;
+        }
+        array_destroy(update->removed);
+        index->modified = true;
+    }
+
+    free(update);
+}
+
+static
+void index_read_events (FileIndex* index) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(index->inotify, buf, sizeof buf)) > 0) {
+        for (char* p = buf; p < buf + n;) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                array_add(index->dirty, (void*) (intptr_t) -1);
+                continue;
+            }
+            if (event->mask & IN_IGNORED) continue;
+            // The walk skips hidden names, history logs among them, but
+            //  ignore files change what it keeps; of writes, only theirs count.
+            bool rules = event->len > 0 && (strcmp(event->name, ".gitignore") == 0 || strcmp(event->name, ".tatlignore") == 0);
+            if (!rules && event->len > 0 && event->name[0] == '.') continue;
+            if (!rules && (event->mask & ~IN_ISDIR) == IN_CLOSE_WRITE) continue;
+
+            void* wd = (void*) (intptr_t) event->wd;
+            if (index->dirty->size == 0 || array_peek(index->dirty) != wd) array_add(index->dirty, wd);
+        }
+    }
+}
+
+static
+int wd_compare (const void* a, const void* b) {
+    intptr_t x = *(intptr_t*) a;
+    intptr_t y = *(intptr_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static
+int dir_compare (const void* a, const void* b) {
+    uintptr_t x = (uintptr_t) *(IndexDir**) a;
+    uintptr_t y = (uintptr_t) *(IndexDir**) b;
+    return x < y ? -1 : x > y;
+}
+
+// Rescan directories that changed; a lost event means checking them all.
+//  -> One below another that changed is left to a check from that one,
+//      which reaches everything below it. A directory read by two jobs in
+//      one scan would have its listing replaced under the other, and its
+//      new subdirectories made twice.
+static
+void index_start_dirty (FileIndex* index) {
+    qsort(index->dirty->data, index->dirty->size, sizeof(void*), wd_compare);
+
+    if (index->dirty->size > 0 && (intptr_t) index->dirty->data[0] == -1) {
+        // Every directory is visited, so every watch is tried again.
+        index->unwatched = false;
+        index->checked = now();
+        index_queue(index, index->tree, true);
+    } else {
+        Array* dirs = array_create();
+        for (int i = 0; i < index->dirty->size; i++) {
+            intptr_t wd = (intptr_t) index->dirty->data[i];
+            if (wd < 0 || wd >= index->watched_size) continue;
+
+            IndexDir* dir = index->watched[wd];
+            if (dir == NULL || dir_detached(dir)) continue;
+            array_add(dirs, dir);
+        }
+        qsort(dirs->data, dirs->size, sizeof(void*), dir_compare);
+
+        uint32_t n = 0;
+        for (int i = 0; i < dirs->size; i++)
+            if (n == 0 || dirs->data[i] != dirs->data[n - 1]) dirs->data[n++] = dirs->data[i];
+        dirs->size = n;
+
+        // The topmost changed ancestor of each, if any, covers it.
+        bool* check = calloc(MAX(1, n), sizeof(bool));
+        bool* covered = calloc(MAX(1, n), sizeof(bool));
+        for (uint32_t i = 0; i < n; i++) {
+            IndexDir* dir = dirs->data[i];
+            IndexDir** top = NULL;
+            for (IndexDir* up = dir->parent; up != NULL; up = up->parent) {
+                IndexDir** found = bsearch(&up, dirs->data, n, sizeof(void*), dir_compare);
+                if (found != NULL) top = found;
+            }
+            if (top != NULL) {
+                covered[i] = true;
+                check[top - (IndexDir**) dirs->data] = true;
+            }
+        }
+        for (uint32_t i = 0; i < n; i++)
+            if (!covered[i]) index_queue(index, dirs->data[i], check[i]);
+
+        free(check);
+        free(covered);
+        array_destroy(dirs);
+    }
+    array_clear(index->dirty);
+    index_start(index);
+}
+
+static void cache_save (FileIndex* index);
+
+bool file_index_poll (FileIndex* index, Array* added, bool* changed) {
+    *changed = false;
+
+    if (index->settled) {
+        for (int i = 0; i < index->graveyard->size; i++) dir_destroy(index, index->graveyard->data[i]);
+        array_clear(index->graveyard);
+    }
+
+    index_read_events(index);
+
+    pthread_mutex_lock(&index->lock);
+    bool idle = index->running == 0;
+    Array* updates = index->updates;
+    index->updates = array_create();
+    pthread_mutex_unlock(&index->lock);
+
+    for (int i = 0; i < updates->size; i++) index_apply(index, updates->data[i], added, changed);
+    array_destroy(updates);
+
+    // Changes in directories without a watch are only found by looking.
+    double t = now();
+    if (idle && index->unwatched && t - index->checked >= INDEX_RECHECK_DELAY) array_add(index->dirty, (void*) (intptr_t) -1);
+
+    if (idle && index->dirty->size > 0) index_start_dirty(index);
+    index->settled = idle && index->running == 0;
+
+    // Saved along the way, so a crash doesn't cost the next start a full scan.
+    if (index->settled && index->modified && index->fd >= 0 && t - index->saved >= INDEX_SAVE_DELAY) {
+        cache_save(index);
+        index->modified = false;
+        index->saved = t;
+    }
+    return !index->settled;
+}
+
+
+//
+// Cache File.
+//  -> Header: magic, version, directory count, string bytes.
+//  -> Directory records in pre-order, so parents come first.
+//  -> Strings: names and file blocks, offsets into which the records hold.
+//      Integers are host order.
+//
+
+static const char INDEX_MAGIC[8] = "TATLINDX";
+#define INDEX_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t dir_count;
+    uint64_t strings_size;
+} IndexHeader;
+
+typedef struct {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t parent;
+    uint32_t name;
+    uint32_t files;
+    uint32_t files_size;
+    uint32_t file_count;
+    uint32_t listed;
+    uint32_t ignore_hash;
+    // Keeps records a multiple of 8 bytes.
+    uint32_t unused;
+} IndexRecord;
+
+// "$XDG_CACHE_HOME/tatl/<root, escaped>.index": kept out of the project,
+//  since writing there would move the root's mtime.
+//  -> '%' and '/' are escaped as in history log names, so no two roots share
+//      a cache. False if there is no cache directory, or the name is too long.
+static
+bool cache_path (FileIndex* index, CharBuffer* out) {
+    charbuffer_clear(out);
+    const char* base = getenv("XDG_CACHE_HOME");
+    if (base != NULL && *base == '/') {
+        charbuffer_astr(out, base);
+    } else {
+        const char* home = getenv("HOME");
+        if (home == NULL || *home != '/') return false;
+        charbuffer_astr(out, home);
+        charbuffer_astr(out, "/.cache");
+    }
+    mkdir(out->buffer, 0700);
+    charbuffer_astr(out, "/tatl");
+    mkdir(out->buffer, 0700);
+
+    charbuffer_achar(out, '/');
+    uint32_t name = out->size;
+    charbuffer_aname(out, index->root);
+    charbuffer_astr(out, ".index");
+    return out->size - name <= NAME_MAX;
+}
+
+// Build the tree from the mapped cache; false if it doesn't hold together.
+static
+bool cache_load (FileIndex* index) {
+    CharBuffer* path = charbuffer_create();
+    int fd = cache_path(index, path) ? open(path->buffer, O_RDONLY | O_CLOEXEC) : -1;
+    charbuffer_destroy(path);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(IndexHeader)) {
+        close(fd);
+        return false;
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    IndexHeader header;
+    memcpy(&header, map, sizeof header);
+    uint64_t records_size = (uint64_t) header.dir_count * sizeof(IndexRecord);
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof INDEX_MAGIC) != 0 || header.version != INDEX_VERSION || header.dir_count == 0
+        || sizeof(IndexHeader) + records_size + header.strings_size != st.st_size) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    IndexRecord* records = (IndexRecord*) (map + sizeof(IndexHeader));
+    char* strings = map + sizeof(IndexHeader) + records_size;
+    IndexDir** dirs = malloc(header.dir_count * sizeof(IndexDir*));
+    uint32_t count = 0;
+    bool ok = true;
+    for (; count < header.dir_count; count++) {
+        IndexRecord* r = &records[count];
+        bool root = count == 0;
+        ok = (root ? r->parent == UINT32_MAX : r->parent < count)
+            && r->name < header.strings_size && memchr(strings + r->name, '\0', header.strings_size - r->name) != NULL
+            && (uint64_t) r->files + r->files_size <= header.strings_size
+            && (r->files_size == 0 || strings[r->files + r->files_size - 1] == '\0');
+        if (ok) {
+            // Names must be exactly 'file_count' NUL-terminated strings.
+            uint32_t n = 0;
+            for (uint32_t k = 0; k < r->files_size; k++) n += strings[r->files + k] == '\0';
+            ok = n == r->file_count;
+        }
+        if (!ok) break;
+
+        IndexDir* dir = dir_create(root ? NULL : dirs[r->parent], strings + r->name);
+        dir->files = strings + r->files;
+        dir->files_size = r->files_size;
+        dir->file_count = r->file_count;
+        dir->mapped = true;
+        dir->listed = r->listed;
+        dir->mtime_sec = r->mtime_sec;
+        dir->mtime_nsec = r->mtime_nsec;
+        dir->ignore_hash = r->ignore_hash;
+        if (!root) array_add(dirs[r->parent]->subdirs, dir);
+        dirs[count] = dir;
+    }
+
+    if (count > 0) index->tree = dirs[0];
+    free(dirs);
+    if (!ok) {
+        // Drop the mapped names before the mapping.
+        if (index->tree != NULL) dir_destroy(index, index->tree);
+        index->tree = NULL;
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    index->map = map;
+    index->map_size = st.st_size;
+    return true;
+}
+
+static
+void cache_collect (IndexDir* dir, uint32_t parent, Array* order, Array* parents) {
+    uint32_t self = order->size;
+    array_add(order, dir);
+    array_add(parents, (void*) (uintptr_t) parent);
+    for (int i = 0; i < dir->subdirs->size; i++) cache_collect(dir->subdirs->data[i], self, order, parents);
+}
+
+// Written beside, then renamed over, so a reader never sees half a cache.
+static
+void cache_save (FileIndex* index) {
+    Array* order = array_create();
+    Array* parents = array_create();
+    cache_collect(index->tree, UINT32_MAX, order, parents);
+
+    CharBuffer* path = charbuffer_create();
+    CharBuffer* temp = charbuffer_create();
+    bool named = cache_path(index, path);
+    charbuffer_astr(temp, path->buffer);
+    charbuffer_astr(temp, ".tmp");
+
+    FILE* file = named ? fopen(temp->buffer, "wb") : NULL;
+    if (file != NULL) {
+        IndexHeader header = { .version = INDEX_VERSION, .dir_count = order->size, .strings_size = 0 };
+        memcpy(header.magic, INDEX_MAGIC, sizeof INDEX_MAGIC);
+        for (int i = 0; i < order->size; i++) {
+            IndexDir* dir = order->data[i];
+            header.strings_size += strlen(dir->name) + 1 + dir->files_size;
+        }
+
+        bool ok = header.strings_size <= UINT32_MAX && fwrite(&header, sizeof header, 1, file) == 1;
+        uint64_t offset = 0;
+        for (int i = 0; ok && i < order->size; i++) {
+            IndexDir* dir = order->data[i];
+            IndexRecord r = {
+                .mtime_sec = dir->mtime_sec, .mtime_nsec = dir->mtime_nsec,
+                .parent = (uintptr_t) parents->data[i],
+                .name = offset, .files = offset + strlen(dir->name) + 1,
+                .files_size = dir->files_size, .file_count = dir->file_count,
+                .listed = dir->listed, .ignore_hash = dir->ignore_hash };
+            offset = r.files + r.files_size;
+            ok = fwrite(&r, sizeof r, 1, file) == 1;
+        }
+        for (int i = 0; ok && i < order->size; i++) {
+            IndexDir* dir = order->data[i];
+            ok = fwrite(dir->name, strlen(dir->name) + 1, 1, file) == 1
+                && (dir->files_size == 0 || fwrite(dir->files, dir->files_size, 1, file) == 1);
+        }
+
+        if (fclose(file) == 0 && ok) rename(temp->buffer, path->buffer);
+        else unlink(temp->buffer);
+    }
+
+    charbuffer_destroy(path);
+    charbuffer_destroy(temp);
+    array_destroy(order);
+    array_destroy(parents);
+}
+
+
+//
+// Index.
+//
+
+FileIndex* file_index_create (ThreadPool* pool, const char* root) {
+    FileIndex* index = malloc(sizeof(FileIndex));
+    index->root = strdup(root);
+    index->fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    index->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    index->map = NULL;
+    index->map_size = 0;
+    index->tree = NULL;
+    index->watched = NULL;
+    index->watched_size = 0;
+    index->dirty = array_create();
+    index->graveyard = array_create();
+    index->modified = false;
+    index->saved = now() - INDEX_SAVE_DELAY;
+    index->unwatched = false;
+    index->checked = now();
+    index->watch_error = 0;
+    index->settled = false;
+    index->ignore = ignore_create_defaults();
+
+    // Leave a thread for other work while a big tree is scanned; with just
+    //  one, scanning would hold it, so the index takes one of its own.
+    index->own_pool = pool->count < 2 ? thread_pool_create(1) : NULL;
+    index->pool = index->own_pool != NULL ? index->own_pool : pool;
+    index->workers = MAX(1, (int32_t) pool->count - 1);
+    index->queues = malloc(index->workers * sizeof(Ring*));
+    index->locks = malloc(index->workers * sizeof(pthread_mutex_t));
+    for (uint32_t w = 0; w < index->workers; w++) {
+        index->queues[w] = ring_create();
+        pthread_mutex_init(&index->locks[w], NULL);
+    }
+    pthread_mutex_init(&index->lock, NULL);
+    pthread_cond_init(&index->wake, NULL);
+    pthread_cond_init(&index->done, NULL);
+    index->updates = array_create();
+    index->pending = 0;
+    index->queued = 0;
+    index->running = 0;
+    atomic_store(&index->cancel, false);
+
+    // A cached tree shows at once, then gets checked; otherwise scan.
+    bool cached = cache_load(index);
+    if (!cached) index->tree = dir_create(NULL, "");
+    if (index->fd >= 0) {
+        index_queue(index, index->tree, cached);
+        index_start(index);
+    }
+    return index;
+}
+
+void file_index_destroy (FileIndex* index) {
+    pthread_mutex_lock(&index->lock);
+    atomic_store(&index->cancel, true);
+    pthread_cond_broadcast(&index->wake);
+    while (index->running > 0) pthread_cond_wait(&index->done, &index->lock);
+    pthread_mutex_unlock(&index->lock);
+    if (index->own_pool != NULL) thread_pool_destroy(index->own_pool);
+
+    // Apply what was found, so every directory made is in the tree.
+    bool changed;
+    for (int i = 0; i < index->updates->size; i++) index_apply(index, index->updates->data[i], NULL, &changed);
+    array_destroy(index->updates);
+    for (int i = 0; i < index->graveyard->size; i++) dir_destroy(index, index->graveyard->data[i]);
+    array_destroy(index->graveyard);
+
+    // Directories the scan didn't reach are saved unlisted, to be read next time.
+    if (index->modified && index->fd >= 0) cache_save(index);
+
+    for (uint32_t w = 0; w < index->workers; w++) {
+        while (index->queues[w]->size > 0) job_destroy(ring_pop(index->queues[w]));
+        ring_destroy(index->queues[w]);
+        pthread_mutex_destroy(&index->locks[w]);
+    }
+    free(index->queues);
+    free(index->locks);
+    pthread_mutex_destroy(&index->lock);
+    pthread_cond_destroy(&index->wake);
+    pthread_cond_destroy(&index->done);
+
+    dir_destroy(index, index->tree);
+    ignore_unref(index->ignore);
+    if (index->map != NULL) munmap(index->map, index->map_size);
+    free(index->watched);
+    array_destroy(index->dirty);
+    if (index->inotify >= 0) close(index->inotify);
+    if (index->fd >= 0) close(index->fd);
+    free(index->root);
+    free(index);
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "main.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+//
+// File Index.
+//  -> Every file under a project root, as a tree of directories, each with
+//      its file names packed into one block.
+//  -> Kept between runs in a cache file. Loading maps the file and uses the
+//      names in place; a background check then rescans only the directories
+//      whose mtime moved.
+//  -> While the editor runs, inotify watches every directory, and a change
+//      rescans just that directory. Without enough watches, the whole tree
+//      is checked now and then instead.
+//  -> The cache is saved when a scan that changed the tree settles, at most
+//      every INDEX_SAVE_DELAY seconds, and on exit.
+//  -> Ignore rules apply while reading, so an ignored directory is never
+//      opened. When a directory's ignore files change, its whole subtree is
+//      read again.
+//  -> Scans run on the thread pool with work stealing: each worker takes
+//      its own newest directory, and when out of work the oldest of another's.
+//      Workers never change the tree; they post updates, which
+//      file_index_poll applies on the main thread.
+//
+
+struct index_dir {
+    IndexDir* parent;
+    // Name within the parent; "" for the root.
+    char* name;
+
+    // File names, each NUL-terminated, back to back.
+    char* files;
+    uint32_t files_size;
+    uint32_t file_count;
+    // 'files' points into the mapped cache rather than the heap.
+    bool mapped;
+    // Has been read, or came listed from the cache.
+    bool listed;
+    // Cut from the tree, waiting to be freed.
+    bool removed;
+
+    Array* subdirs;
+
+    // When the listing was read; zero if never.
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int wd;
+
+    // Rules for what is inside, and the hash of its own ignore files, both
+    //  as of the last scan.
+    IgnoreRules* ignore;
+    uint32_t ignore_hash;
+};
+
+struct file_index {
+    char* root;
+    int fd;
+    int inotify;
+
+    // The cache file, mapped, or NULL.
+    char* map;
+    size_t map_size;
+
+    IndexDir* tree;
+    // Watched directories, by watch descriptor.
+    IndexDir** watched;
+    uint32_t watched_size;
+    // Watch descriptors of directories changed during a scan, to rescan
+    //  after it; -1 asks for a check of the whole tree.
+    Array* dirty;
+    // Directories cut from the tree, freed once the scan that cut them is over.
+    Array* graveyard;
+    // No scan ran during the last poll.
+    bool settled;
+    // Changed since the cache was loaded or last saved.
+    bool modified;
+    // When the cache was last saved; at first, as if INDEX_SAVE_DELAY ago.
+    double saved;
+    // A directory could not be watched, say for want of inotify watches, so
+    //  the whole tree is checked every INDEX_RECHECK_DELAY seconds instead.
+    bool unwatched;
+    double checked;
+    // Why the first such watch failed, until the editor reports and clears it.
+    int watch_error;
+    // Rules above the root's own.
+    IgnoreRules* ignore;
+
+    // -- Scanning -- //
+    ThreadPool* pool;
+    // A thread of its own, when the shared pool has only one.
+    ThreadPool* own_pool;
+    uint32_t workers;
+    Ring** queues;
+    pthread_mutex_t* locks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    // Posted by workers for the main thread.
+    Array* updates;
+    // Directories queued or being read; queued ones; workers not yet exited.
+    uint32_t pending;
+    uint32_t queued;
+    uint32_t running;
+    // Read by workers without the lock.
+    atomic_bool cancel;
+};
+
+
+// Loads the cache for 'root' if there is one, and starts scanning.
+FileIndex* file_index_create (ThreadPool* pool, const char* root);
+
+// Stops scanning and saves the cache if anything changed.
+void file_index_destroy (FileIndex* index);
+
+
+// Apply what the workers found, and start rescans for inotify events.
+//  -> Directories listed for the first time are added to 'added'; *changed
+//      is set if listings already there changed or went away.
+//  -> Returns true while scans are still going.
+bool file_index_poll (FileIndex* index, Array* added, bool* changed);
+
+// Absolute path of a directory, without a trailing slash (except for "/").
+void file_index_path (FileIndex* index, IndexDir* dir, CharBuffer* out);
@@ -0,0 +1,493 @@
+#include "grep.h"
+
+#include "array.h"
+#include "character.h"
+#include "charbuffer.h"
+#include "fileindex.h"
+#include "regex.h"
+#include "rope.h"
+#include "threadpool.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+struct grep_job {
+    // The query as UTF-8, and its length in characters; and as characters
+    //  for a regex, which each worker compiles for itself, a regex's lazy
+    //  DFA not being safe to share.
+    char* literal;
+    uint32_t literal_size;
+    uint32_t literal_chars;
+    uint32_t* pattern;
+    uint32_t pattern_size;
+    bool regex;
+
+    // Paths of the files, back to back, and where each starts.
+    char* paths;
+    uint64_t* offsets;
+    uint32_t files;
+    // Next file for a worker to take.
+    atomic_uint next;
+
+    pthread_mutex_t lock;
+    // Results not yet taken by grep_poll.
+    GrepResult* posted;
+    uint32_t posted_size;
+    uint32_t posted_capacity;
+    uint32_t found;
+    bool truncated;
+    // Workers not yet done, signalling 'done' when none are left.
+    uint32_t left;
+    pthread_cond_t done;
+    // Read by workers without the lock.
+    atomic_bool cancel;
+};
+
+typedef struct {
+    GrepResult* data;
+    uint32_t size;
+    uint32_t capacity;
+} ResultList;
+
+static
+void result_add (ResultList* list, GrepResult* result) {
+    if (list->size == list->capacity) {
+        list->capacity = MAX(16, 2 * list->capacity);
+        list->data = realloc(list->data, list->capacity * sizeof(GrepResult));
+    }
+    list->data[list->size++] = *result;
+}
+
+
+//
+// Text.
+//
+
+// Characters in text[0, n), decoded as the editor does when it reads a file.
+static
+uint32_t count_chars (const char* text, size_t n) {
+    uint32_t chars[256];
+    uint32_t count = 0;
+    for (size_t i = 0; i < n;) {
+        uint32_t k, newlines;
+        size_t r = utf8_decode(text + i, n - i, chars, sizeof chars / sizeof *chars, &k, &newlines);
+        if (r == 0) break;
+        count += k;
+        i += r;
+    }
+    return count;
+}
+
+// Trimmed copy of a line, cut at GREP_SNIPPET bytes without splitting a
+//  character, with tabs and other control characters as spaces.
+static
+char* snippet_create (const char* line, size_t n) {
+    while (n > 0 && (*line == ' ' || *line == '\t')) line++, n--;
+    if (n > 0 && line[n - 1] == '\r') n--;
+    if (n > GREP_SNIPPET) {
+        n = GREP_SNIPPET;
+        while (n > 0 && ((unsigned char) line[n] & 0xC0) == 0x80) n--;
+    }
+
+    char* snippet = malloc(n + 1);
+    for (size_t i = 0; i < n; i++) snippet[i] = (unsigned char) line[i] < ' ' || line[i] == 0x7F ? ' ' : line[i];
+    snippet[n] = '\0';
+    return snippet;
+}
+
+// First 'needle' in text[from, size), or -1.
+static
+int64_t find_literal (const char* text, size_t size, size_t from, const char* needle, size_t n) {
+    if (n == 0 || size < n) return -1;
+    size_t i = from;
+
+#ifdef __SSE2__
+    // Positions where the first and last bytes both match, 16 at a time.
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[n - 1]);
+    for (; i + n - 1 + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (text + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (text + i + n - 1));
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            uint32_t bit = __builtin_ctz(mask);
+            if (memcmp(text + i + bit, needle, n) == 0) return i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    while (i + n <= size) {
+        const char* p = memchr(text + i, needle[0], size - n + 1 - i);
+        if (p == NULL) return -1;
+        if (memcmp(p, needle, n) == 0) return p - text;
+        i = p - text + 1;
+    }
+    return -1;
+}
+
+
+//
+// Searching.
+//
+
+// Every match, none overlapping.
+static
+void grep_literal (GrepJob* job, uint32_t file, const char* text, size_t size, ResultList* out) {
+    uint32_t row = 0;
+    size_t line = 0;
+    // End of the line, once found; zero before.
+    size_t line_end = 0;
+    // Characters of the line before 'mark', so hits on one line count on
+    //  from the last. Newlines are counted up to 'mark' too, so each byte is
+    //  scanned once however many hits a line has.
+    size_t mark = 0;
+    uint32_t col = 0;
+
+    for (size_t from = 0; from < size && !atomic_load(&job->cancel);) {
+        int64_t m = find_literal(text, size, from, job->literal, job->literal_size);
+        if (m < 0) break;
+
+        // Lines up to the match.
+        for (const char* nl; (nl = memchr(text + mark, '\n', m - mark)) != NULL;) {
+            row++;
+            line = mark = nl - text + 1;
+            col = 0;
+        }
+        col += count_chars(text + mark, m - mark);
+        mark = m;
+        if (line_end <= m) {
+            const char* nl = memchr(text + m, '\n', size - m);
+            line_end = nl == NULL ? size : nl - text;
+        }
+
+        GrepResult result = { .file = file };
+        result.start = (Point) {row, col};
+        result.end = (Point) {row, col + job->literal_chars};
+        result.snippet = snippet_create(text + line, line_end - line);
+        result_add(out, &result);
+
+        from = m + job->literal_size;
+    }
+}
+
+typedef struct {
+    char* out;
+    size_t size;
+} SnippetRead;
+
+static
+bool snippet_char (uint32_t i, uint32_t ch, void* data) {
+    SnippetRead* read = data;
+    if (ch == '\n' || read->size + 4 > GREP_SNIPPET) return false;
+    read->size += codepoint_to_chars(read->out + read->size, ch);
+    return true;
+}
+
+// Every match, none overlapping; an empty one ends the search of its line.
+//  -> The file is decoded GREP_REGEX_BLOCK bytes of whole lines at a time,
+//      each block searched on its own.
+static
+void grep_regex (GrepJob* job, Regex* regex, uint32_t file, const char* text, size_t size, ResultList* out) {
+    uint32_t row = 0;
+
+    for (size_t block = 0; block < size && !atomic_load(&job->cancel);) {
+        size_t block_end = MIN(size, block + GREP_REGEX_BLOCK);
+        const char* nl = block_end < size ? memchr(text + block_end - 1, '\n', size - block_end + 1) : NULL;
+        if (block_end < size) block_end = nl == NULL ? size : nl - text + 1;
+
+        RopeBuilder* builder = rope_builder_create();
+        rope_builder_put_utf8(builder, text + block, block_end - block);
+        Rope* rope = rope_builder_finish(builder);
+        uint32_t len = rope_len(rope);
+
+        uint32_t start, end;
+        for (uint32_t from = 0; from <= len && !atomic_load(&job->cancel) && regex_search(regex, rope, from, &start, &end);) {
+            // The end of a block is the start of the next one's first line.
+            if (start == len && block_end < size) break;
+
+            GrepResult result = { .file = file };
+            result.start = rope_index_to_point(rope, start);
+            result.end = rope_index_to_point(rope, end);
+
+            char line[GREP_SNIPPET];
+            SnippetRead read = { line, 0 };
+            uint32_t line_start = start - result.start.col;
+            rope_foreach_substr(rope, line_start, len, snippet_char, &read);
+            result.snippet = snippet_create(line, read.size);
+            result.start.row += row;
+            result.end.row += row;
+            result_add(out, &result);
+
+            if (end > start) {
+                from = end;
+            } else {
+                from = rope_point_to_index(rope, (Point) {result.start.row - row + 1, 0});
+                if (from <= start) break;
+            }
+        }
+        row += rope_lines(rope);
+        rope_destroy(rope);
+        block = block_end;
+    }
+}
+
+// Map a file and search it, unless it looks binary.
+static
+void grep_file (GrepJob* job, Regex* regex, uint32_t file, ResultList* out) {
+    int fd = open(job->paths + job->offsets[file], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    char* text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) return;
+
+    if (memchr(text, '\0', MIN(size, GREP_BINARY_PROBE)) == NULL) {
+        if (regex == NULL) grep_literal(job, file, text, size, out);
+        else grep_regex(job, regex, file, text, size, out);
+    }
+    munmap(text, size);
+}
+
+static
+void grep_run (void* data) {
+    GrepJob* job = data;
+    Regex* regex = job->regex ? regex_create(job->pattern, job->pattern_size, NULL) : NULL;
+    ResultList found = {0};
+
+    while (!atomic_load(&job->cancel)) {
+        uint32_t first = atomic_fetch_add(&job->next, GREP_BATCH);
+        if (first >= job->files) break;
+
+        for (uint32_t f = first; f < MIN(job->files, first + GREP_BATCH) && !atomic_load(&job->cancel); f++) {
+            found.size = 0;
+            grep_file(job, regex, f, &found);
+            if (found.size == 0) continue;
+
+            pthread_mutex_lock(&job->lock);
+            uint32_t room = job->found < GREP_RESULT_LIMIT ? GREP_RESULT_LIMIT - job->found : 0;
+            for (uint32_t k = 0; k < found.size; k++) {
+                if (k < room) {
+                    if (job->posted_size == job->posted_capacity) {
+                        job->posted_capacity = MAX(64, 2 * job->posted_capacity);
+                        job->posted = realloc(job->posted, job->posted_capacity * sizeof(GrepResult));
+                    }
+                    job->posted[job->posted_size++] = found.data[k];
+                } else {
+                    free(found.data[k].snippet);
+                }
+            }
+            job->found += MIN(room, found.size);
+            if (job->found >= GREP_RESULT_LIMIT) {
+                job->truncated = true;
+                atomic_store(&job->cancel, true);
+            }
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+
+    free(found.data);
+    if (regex != NULL) regex_destroy(regex);
+
+    pthread_mutex_lock(&job->lock);
+    if (--job->left == 0) pthread_cond_signal(&job->done);
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+//
+// Jobs.
+//
+
+static
+bool rope_char (uint32_t i, uint32_t ch, void* data) {
+    uint32_t** chars = data;
+    *(*chars)++ = ch;
+    return true;
+}
+
+// Paths of every file in the index, snapshotted for the workers.
+static
+void collect_paths (GrepJob* job, FileIndex* index, IndexDir* dir, CharBuffer* path, uint64_t* size, uint64_t* capacity) {
+    file_index_path(index, dir, path);
+    if (path->size == 0 || path->buffer[path->size - 1] != '/') charbuffer_achar(path, '/');
+
+    job->offsets = realloc(job->offsets, (job->files + dir->file_count) * sizeof(uint64_t));
+    while (*size + (uint64_t) dir->file_count * path->size + dir->files_size > *capacity) *capacity *= 2;
+    job->paths = realloc(job->paths, *capacity);
+
+    const char* name = dir->files;
+    for (uint32_t i = 0; i < dir->file_count; i++) {
+        uint32_t n = strlen(name) + 1;
+        job->offsets[job->files++] = *size;
+        memcpy(job->paths + *size, path->buffer, path->size);
+        memcpy(job->paths + *size + path->size, name, n);
+        *size += path->size + n;
+        name += n;
+    }
+
+    for (int i = 0; i < dir->subdirs->size; i++) collect_paths(job, index, dir->subdirs->data[i], path, size, capacity);
+}
+
+// Whether the job's workers are done; with 'wait', once they are.
+static
+bool job_done (GrepJob* job, bool wait) {
+    pthread_mutex_lock(&job->lock);
+    while (wait && job->left > 0) pthread_cond_wait(&job->done, &job->lock);
+    bool done = job->left == 0;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
+
+static
+void results_free (GrepResult* results, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) free(results[i].snippet);
+}
+
+// Free a job whose workers are done.
+static
+void job_destroy (GrepJob* job) {
+    results_free(job->posted, job->posted_size);
+    free(job->posted);
+    free(job->literal);
+    free(job->pattern);
+    free(job->paths);
+    free(job->offsets);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->done);
+    free(job);
+}
+
+// Free the stale jobs that are done, or wait for all of them.
+static
+void stale_sweep (Grep* grep, bool wait) {
+    int n = 0;
+    for (int i = 0; i < grep->stale->size; i++) {
+        GrepJob* job = grep->stale->data[i];
+        if (job_done(job, wait)) job_destroy(job);
+        else grep->stale->data[n++] = job;
+    }
+    grep->stale->size = n;
+}
+
+
+//
+// Grep.
+//
+
+Grep* grep_create (ThreadPool* pool) {
+    Grep* grep = malloc(sizeof(Grep));
+    grep->pool = pool;
+    grep->job = NULL;
+    grep->stale = array_create();
+    grep->results = NULL;
+    grep->results_size = 0;
+    grep->results_capacity = 0;
+    grep->truncated = false;
+    grep->running = false;
+    return grep;
+}
+
+void grep_destroy (Grep* grep) {
+    grep_stop(grep);
+    stale_sweep(grep, true);
+    array_destroy(grep->stale);
+    free(grep->results);
+    free(grep);
+}
+
+void grep_stop (Grep* grep) {
+    if (grep->job != NULL) {
+        atomic_store(&grep->job->cancel, true);
+        array_add(grep->stale, grep->job);
+        grep->job = NULL;
+    }
+    results_free(grep->results, grep->results_size);
+    grep->results_size = 0;
+    grep->truncated = false;
+    grep->running = false;
+}
+
+bool grep_start (Grep* grep, FileIndex* index, Rope* query, bool regex, const char** error) {
+    uint32_t len = rope_len(query);
+    uint32_t* pattern = malloc(MAX(1, len) * sizeof(uint32_t));
+    uint32_t* p = pattern;
+    rope_foreach(query, rope_char, &p);
+
+    if (regex) {
+        Regex* check = regex_create(pattern, len, error);
+        if (check == NULL) {
+            free(pattern);
+            return false;
+        }
+        regex_destroy(check);
+    }
+
+    grep_stop(grep);
+    stale_sweep(grep, false);
+
+    GrepJob* job = calloc(1, sizeof(GrepJob));
+    job->regex = regex;
+    job->pattern = pattern;
+    job->pattern_size = len;
+    job->literal = malloc(4 * len + 1);
+    for (uint32_t i = 0; i < len; i++) job->literal_size += codepoint_to_chars(job->literal + job->literal_size, pattern[i]);
+    job->literal_chars = len;
+
+    CharBuffer* path = charbuffer_create();
+    uint64_t size = 0, capacity = 1 << 16;
+    job->paths = malloc(capacity);
+    collect_paths(job, index, index->tree, path, &size, &capacity);
+    charbuffer_destroy(path);
+
+    atomic_init(&job->next, 0);
+    atomic_init(&job->cancel, false);
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
+    // Leave a thread for other work, as the index does.
+    uint32_t workers = MAX(1, (int32_t) grep->pool->count - 1);
+    job->left = workers;
+    grep->job = job;
+    grep->running = true;
+    for (uint32_t w = 0; w < workers; w++) thread_pool_submit(grep->pool, grep_run, job);
+    return true;
+}
+
+bool grep_poll (Grep* grep) {
+    stale_sweep(grep, false);
+    GrepJob* job = grep->job;
+    if (job == NULL) return grep->stale->size > 0;
+
+    pthread_mutex_lock(&job->lock);
+    uint32_t size = job->posted_size;
+    if (grep->results_size + size > grep->results_capacity) {
+        grep->results_capacity = MAX(64, MAX(2 * grep->results_capacity, grep->results_size + size));
+        grep->results = realloc(grep->results, grep->results_capacity * sizeof(GrepResult));
+    }
+    memcpy(grep->results + grep->results_size, job->posted, size * sizeof(GrepResult));
+    grep->results_size += size;
+    job->posted_size = 0;
+    grep->truncated = job->truncated;
+    grep->running = job->left > 0;
+    pthread_mutex_unlock(&job->lock);
+
+    return grep->running || grep->stale->size > 0;
+}
+
+const char* grep_path (Grep* grep, GrepResult* result) {
+    return grep->job->paths + grep->job->offsets[result->file];
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "main.h"
+#include "rope.h"
+
+//
+// Project Grep.
+//  -> Searches every file of the file index for a literal or a regex, on
+//      the thread pool; workers take a few files at a time.
+//  -> Files are mapped, not read, and those with a NUL near the start are
+//      taken as binary and skipped.
+//  -> A literal is found with SSE2: only where both its first and last
+//      bytes match, checked 16 positions at a time, is it compared in full.
+//  -> A regex works on ropes, so a file is decoded into one a block of
+//      whole lines at a time; a match can't reach past its block.
+//  -> A result for every match, so a line may have several. Results stream:
+//      workers post each file's as they finish it, and grep_poll takes them
+//      in that order.
+//
+
+typedef struct grep_job GrepJob;
+
+typedef struct {
+    // File, as an index into the job's paths.
+    uint32_t file;
+    // Where the match starts and ends, in characters.
+    Point start;
+    Point end;
+    // The line, trimmed, cut at GREP_SNIPPET bytes.
+    char* snippet;
+} GrepResult;
+
+struct grep {
+    ThreadPool* pool;
+
+    // Search the results are from, or NULL; cancelled ones still running.
+    GrepJob* job;
+    Array* stale;
+
+    GrepResult* results;
+    uint32_t results_size;
+    uint32_t results_capacity;
+    // Stopped at GREP_RESULT_LIMIT.
+    bool truncated;
+    // Workers are still searching, as of the last poll.
+    bool running;
+};
+
+
+Grep* grep_create (ThreadPool* pool);
+
+void grep_destroy (Grep* grep);
+
+
+// Search the files of 'index' for 'query', replacing any earlier search.
+//  -> Returns false, with *error set, for an invalid regex.
+bool grep_start (Grep* grep, FileIndex* index, Rope* query, bool regex, const char** error);
+
+// Cancel the search and drop its results.
+void grep_stop (Grep* grep);
+
+// Take in results posted since the last poll.
+//  -> Returns true while the search is still running.
+bool grep_poll (Grep* grep);
+
+
+// Absolute path of a result's file.
+const char* grep_path (Grep* grep, GrepResult* result);
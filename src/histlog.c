@@ -0,0 +1,473 @@
+#include "histlog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "array.h"
+#include "charbuffer.h"
+#include "character.h"
+#include "intbuffer.h"
+#include "rope.h"
+#include "selection.h"
+#include "textbuffer.h"
+
+
+//
+// File Format.
+//  -> Header: magic and version.
+//  -> Records: u32 type, u32 payload length, payload. Integers are host order.
+//  -> A record cut short (a crash mid-append) ends the log.
+//
+
+static const char HISTLOG_MAGIC[8] = "TATLHIST";
+#define HISTLOG_VERSION 2
+#define HISTLOG_HEADER_SIZE 12
+
+
+// -- Encoding -- //
+
+static inline
+void put_bytes (CharBuffer* out, const void* data, uint32_t n) {
+    charbuffer_reserve(out, n);
+    memcpy(out->buffer + out->size, data, n);
+    out->size += n;
+}
+
+static inline
+void put_u32 (CharBuffer* out, uint32_t x) {
+    put_bytes(out, &x, sizeof x);
+}
+
+static inline
+void set_u32 (CharBuffer* out, uint32_t i, uint32_t x) {
+    memcpy(out->buffer + i, &x, sizeof x);
+}
+
+static
+bool put_utf8 (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
+    CharBuffer* out = data;
+    charbuffer_reserve(out, 4 * n);
+    out->size += utf8_encode(chars, n, out->buffer + out->size);
+    return true;
+}
+
+// Rope as a byte length followed by UTF-8.
+static
+void put_rope (CharBuffer* out, Rope* rope) {
+    uint32_t at = out->size;
+    put_u32(out, 0);
+    if (rope != NULL) rope_foreach_chunk(rope, put_utf8, out);
+    set_u32(out, at, out->size - at - sizeof(uint32_t));
+}
+
+static
+void put_selections (CharBuffer* out, SelectionArray* selections) {
+    put_u32(out, selections->size);
+    for (int i = 0; i < selections->size; i++) {
+        Selection* sel = &selections->data[i];
+        put_u32(out, sel->cursor);
+        put_u32(out, sel->anchor);
+        put_u32(out, sel->primary);
+    }
+}
+
+
+// -- Decoding -- //
+//  -> Every read is checked against the end of its record, which may be
+//      damaged or not ours; one that doesn't fit returns false.
+
+static inline
+bool get_u32 (const uint8_t** p, const uint8_t* end, uint32_t* x) {
+    if ((size_t) (end - *p) < sizeof *x) return false;
+    memcpy(x, *p, sizeof *x);
+    *p += sizeof *x;
+    return true;
+}
+
+// Length of a rope and a pointer to its UTF-8, skipped over.
+static
+bool get_rope_bytes (const uint8_t** p, const uint8_t* end, const uint8_t** bytes, uint32_t* n) {
+    if (!get_u32(p, end, n) || *n > (size_t) (end - *p)) return false;
+    *bytes = *p;
+    *p += *n;
+    return true;
+}
+
+static
+bool get_rope (const uint8_t** p, const uint8_t* end, Rope** rope) {
+    const uint8_t* bytes;
+    uint32_t n;
+    *rope = NULL;
+    if (!get_rope_bytes(p, end, &bytes, &n)) return false;
+    if (n == 0) return true;
+
+    IntBuffer* chars = intbuffer_create();
+    for (uint32_t i = 0; i < n;) {
+        uint32_t ch = 0;
+        int r = chars_to_codepoint((char*) bytes + i, n - i, &ch);
+        if (r == 0) break;
+        intbuffer_put_char(chars, chars->size, ch);
+        i += r;
+    }
+
+    *rope = rope_create(chars);
+    intbuffer_destroy(chars);
+    return true;
+}
+
+#define SELECTION_SIZE (3 * sizeof(uint32_t))
+
+// Selections, or with NULL just skipped over.
+static
+bool get_selections (const uint8_t** p, const uint8_t* end, SelectionArray* selections) {
+    uint32_t n;
+    if (!get_u32(p, end, &n) || n > (size_t) (end - *p) / SELECTION_SIZE) return false;
+    if (selections == NULL) {
+        *p += n * SELECTION_SIZE;
+        return true;
+    }
+
+    for (int i = 0; i < n; i++) {
+        uint32_t cursor, anchor, primary;
+        get_u32(p, end, &cursor);
+        get_u32(p, end, &anchor);
+        get_u32(p, end, &primary);
+        Selection sel = { .cursor = cursor, .anchor = anchor, .primary = primary, .col_mem = 0 };
+        selection_array_push_back(selections, sel);
+    }
+    return true;
+}
+
+// Whether an action payload holds together: every count and length within it.
+static
+bool action_valid (const uint8_t* p, const uint8_t* end) {
+    if (!get_selections(&p, end, NULL) || !get_selections(&p, end, NULL)) return false;
+
+    // Each delta takes at least 12 bytes, so this ends within the record.
+    uint32_t n, pos, len;
+    const uint8_t* bytes;
+    if (!get_u32(&p, end, &n)) return false;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!get_u32(&p, end, &pos) || !get_rope_bytes(&p, end, &bytes, &len) || !get_rope_bytes(&p, end, &bytes, &len)) return false;
+    }
+    return true;
+}
+
+
+//
+// Log Object.
+//
+
+static
+void write_all (int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t r = write(fd, data, n);
+        if (r <= 0) return;
+        data += r;
+        n -= r;
+    }
+}
+
+static
+void write_header (HistLog* log) {
+    char header[HISTLOG_HEADER_SIZE];
+    uint32_t version = HISTLOG_VERSION;
+    memcpy(header, HISTLOG_MAGIC, sizeof HISTLOG_MAGIC);
+    memcpy(header + sizeof HISTLOG_MAGIC, &version, sizeof version);
+    write_all(log->fd, header, sizeof header);
+}
+
+HistLog* histlog_open (const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return NULL;
+
+    HistLog* log = malloc(sizeof(HistLog));
+    log->path = charbuffer_create();
+    charbuffer_astr(log->path, path);
+    log->fd = fd;
+    log->map = NULL;
+    log->map_size = 0;
+    log->cursor = HISTLOG_HEADER_SIZE;
+    log->out = charbuffer_create();
+    log->unsynced = 0;
+    log->unsynced_since = 0;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= HISTLOG_HEADER_SIZE) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            log->map = map;
+            log->map_size = st.st_size;
+        }
+    }
+
+    // Unknown contents: kept aside, and start over.
+    uint32_t version = 0;
+    if (log->map != NULL) memcpy(&version, log->map + sizeof HISTLOG_MAGIC, sizeof version);
+    if (log->map == NULL || memcmp(log->map, HISTLOG_MAGIC, sizeof HISTLOG_MAGIC) != 0 || version != HISTLOG_VERSION) {
+        if (st.st_size > 0 && !histlog_set_aside(log)) {
+            histlog_close(log);
+            return NULL;
+        }
+        histlog_reset(log);
+    }
+
+    return log;
+}
+
+void histlog_close (HistLog* log) {
+    histlog_sync(log, true);
+    if (log->map != NULL) munmap(log->map, log->map_size);
+    close(log->fd);
+    charbuffer_destroy(log->path);
+    charbuffer_destroy(log->out);
+    free(log);
+}
+
+// Move the log's file to the first free "<path>.<n>" and start an empty one
+//  at its path, so contents that can't be dropped survive a restart.
+//  -> Returns false, leaving the log as it was, if there is nowhere to put it.
+bool histlog_set_aside (HistLog* log) {
+    CharBuffer* aside = charbuffer_create();
+    bool moved = false;
+    for (int n = 1; n <= HISTLOG_ASIDE_MAX && !moved; n++) {
+        char suffix[16];
+        snprintf(suffix, sizeof suffix, ".%d", n);
+        charbuffer_clear(aside);
+        charbuffer_astr(aside, log->path->buffer);
+        charbuffer_astr(aside, suffix);
+
+        // link() never replaces an existing file, unlike rename().
+        if (link(log->path->buffer, aside->buffer) == 0) moved = true;
+        else if (errno != EEXIST) break;
+    }
+    charbuffer_destroy(aside);
+    if (!moved) return false;
+
+    int fd = -1;
+    if (unlink(log->path->buffer) == 0) fd = open(log->path->buffer, O_RDWR | O_CREAT | O_EXCL | O_APPEND, 0644);
+    if (fd < 0) return false;
+    histlog_sync(log, true);
+    close(log->fd);
+    log->fd = fd;
+    histlog_reset(log);
+    return true;
+}
+
+// Whether the log ends away from a saved state without a clean close: the
+//  unsaved edits of a session that died, which only the log holds.
+//  -> Reads the mapping from the start, leaving the cursor alone.
+bool histlog_pending (HistLog* log) {
+    size_t cursor = log->cursor;
+    log->cursor = HISTLOG_HEADER_SIZE;
+
+    uint32_t position = HISTLOG_NONE;
+    uint32_t saved = HISTLOG_NONE;
+    HistRecord rec;
+    while (histlog_next(log, &rec)) {
+        position = rec.type == HISTLOG_CLOSE ? HISTLOG_NONE : rec.seq;
+        if (rec.type == HISTLOG_SAVE) saved = rec.seq;
+    }
+
+    log->cursor = cursor;
+    return position != HISTLOG_NONE && position != saved;
+}
+
+// Truncate to an empty log.
+//  -> Drops the mapping, so payloads from histlog_next become invalid.
+void histlog_reset (HistLog* log) {
+    if (log->map != NULL) munmap(log->map, log->map_size);
+    log->map = NULL;
+    log->map_size = 0;
+    log->cursor = HISTLOG_HEADER_SIZE;
+
+    if (ftruncate(log->fd, 0) == 0) write_header(log);
+}
+
+
+//
+// Reading.
+//
+
+// Next record of the mapped contents, in log order.
+//  -> A record that is cut short or doesn't hold together ends the log.
+bool histlog_next (HistLog* log, HistRecord* rec) {
+    if (log->map == NULL) return false;
+
+    const uint8_t* p = log->map + log->cursor;
+    const uint8_t* end = log->map + log->map_size;
+    uint32_t type, len;
+    if (!get_u32(&p, end, &type) || !get_u32(&p, end, &len) || len > (size_t) (end - p)) return false;
+    end = p + len;
+
+    rec->type = type;
+    if (!get_u32(&p, end, &rec->seq)) return false;
+    if (type == HISTLOG_ACTION) {
+        if (!get_u32(&p, end, &rec->parent) || !action_valid(p, end)) return false;
+        rec->payload = p;
+        rec->end = end;
+    } else if (type == HISTLOG_SAVE) {
+        if (end - p < 32) return false;
+        memcpy(&rec->size, p, sizeof rec->size);
+        memcpy(&rec->mtime_sec, p + 8, sizeof rec->mtime_sec);
+        memcpy(&rec->mtime_nsec, p + 16, sizeof rec->mtime_nsec);
+        memcpy(&rec->hash, p + 24, sizeof rec->hash);
+    }
+
+    log->cursor = end - log->map;
+    return true;
+}
+
+// Decode an action payload, [payload, end) as from histlog_next.
+//  -> Returns false, having decoded what came before, if it doesn't hold
+//      together; histlog_next has checked that it does.
+bool histlog_read_action (const uint8_t* payload, const uint8_t* end, Array* deltas, SelectionArray* selections, SelectionArray* pre_selections) {
+    const uint8_t* p = payload;
+    if (!get_selections(&p, end, selections) || !get_selections(&p, end, pre_selections)) return false;
+
+    uint32_t n;
+    if (!get_u32(&p, end, &n)) return false;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t pos;
+        Rope* removed;
+        Rope* inserted;
+        if (!get_u32(&p, end, &pos) || !get_rope(&p, end, &removed)) return false;
+        if (!get_rope(&p, end, &inserted)) {
+            if (removed != NULL) rope_destroy(removed);
+            return false;
+        }
+
+        Delta* delta = malloc(sizeof(Delta));
+        delta->pos = pos;
+        delta->removed = removed;
+        delta->inserted = inserted;
+        array_add(deltas, delta);
+    }
+    return true;
+}
+
+
+//
+// Writing.
+//
+
+static
+void begin_record (HistLog* log, uint32_t type, uint32_t seq) {
+    charbuffer_clear(log->out);
+    put_u32(log->out, type);
+    put_u32(log->out, 0);
+    put_u32(log->out, seq);
+}
+
+static
+void end_record (HistLog* log) {
+    set_u32(log->out, sizeof(uint32_t), log->out->size - 2 * sizeof(uint32_t));
+    write_all(log->fd, log->out->buffer, log->out->size);
+
+    if (log->unsynced++ == 0) log->unsynced_since = now();
+    histlog_sync(log, log->unsynced >= HISTLOG_SYNC_RECORDS);
+}
+
+void histlog_append_action (HistLog* log, uint32_t seq, uint32_t parent, Array* deltas, SelectionArray* selections, SelectionArray* pre_selections) {
+    begin_record(log, HISTLOG_ACTION, seq);
+    put_u32(log->out, parent);
+
+    put_selections(log->out, selections);
+    put_selections(log->out, pre_selections);
+
+    put_u32(log->out, deltas->size);
+    for (int i = 0; i < deltas->size; i++) {
+        Delta* delta = deltas->data[i];
+        put_u32(log->out, delta->pos);
+        put_rope(log->out, delta->removed);
+        put_rope(log->out, delta->inserted);
+    }
+
+    end_record(log);
+}
+
+void histlog_append_save (HistLog* log, uint32_t seq, struct stat* st, uint64_t hash) {
+    begin_record(log, HISTLOG_SAVE, seq);
+
+    uint64_t size = st->st_size;
+    int64_t sec = st->st_mtim.tv_sec;
+    int64_t nsec = st->st_mtim.tv_nsec;
+    put_bytes(log->out, &size, sizeof size);
+    put_bytes(log->out, &sec, sizeof sec);
+    put_bytes(log->out, &nsec, sizeof nsec);
+    put_bytes(log->out, &hash, sizeof hash);
+
+    end_record(log);
+}
+
+// The buffer moved to state 'seq' (HISTLOG_NONE: a state not in the log).
+void histlog_append_goto (HistLog* log, uint32_t seq) {
+    begin_record(log, HISTLOG_GOTO, seq);
+    end_record(log);
+}
+
+// The session ended normally; nothing after the last save needs recovery.
+void histlog_append_close (HistLog* log, uint32_t seq) {
+    begin_record(log, HISTLOG_CLOSE, seq);
+    end_record(log);
+}
+
+// Flush appended records to disk.
+//  -> Unless forced, waits until the oldest unsynced record is
+//      HISTLOG_SYNC_DELAY seconds old, so a burst of edits costs one fsync.
+void histlog_sync (HistLog* log, bool force) {
+    if (log->unsynced == 0) return;
+    if (!force && now() - log->unsynced_since < HISTLOG_SYNC_DELAY) return;
+
+    fdatasync(log->fd);
+    log->unsynced = 0;
+}
+
+
+//
+// Content Hash.
+//  -> FNV-1a over four interleaved lanes (by byte offset), so pieces of any
+//      size give the same result and the lanes' multiplies overlap.
+//
+
+#define HASH_PRIME 0x100000001b3ull
+
+void histlog_hash_init (HistHash* hash) {
+    for (int i = 0; i < 4; i++) hash->lanes[i] = 0xcbf29ce484222325ull + i;
+    hash->size = 0;
+}
+
+void histlog_hash_update (HistHash* hash, const void* data, size_t n) {
+    const uint8_t* bytes = data;
+    uint64_t* lanes = hash->lanes;
+    size_t i = 0;
+
+    // Align to lane 0, then four bytes per step.
+    for (; i < n && (hash->size + i) % 4 != 0; i++) {
+        uint64_t* lane = &lanes[(hash->size + i) % 4];
+        *lane = (*lane ^ bytes[i]) * HASH_PRIME;
+    }
+    for (; i + 4 <= n; i += 4) {
+        lanes[0] = (lanes[0] ^ bytes[i]) * HASH_PRIME;
+        lanes[1] = (lanes[1] ^ bytes[i+1]) * HASH_PRIME;
+        lanes[2] = (lanes[2] ^ bytes[i+2]) * HASH_PRIME;
+        lanes[3] = (lanes[3] ^ bytes[i+3]) * HASH_PRIME;
+    }
+    for (; i < n; i++) {
+        uint64_t* lane = &lanes[(hash->size + i) % 4];
+        *lane = (*lane ^ bytes[i]) * HASH_PRIME;
+    }
+
+    hash->size += n;
+}
+
+uint64_t histlog_hash_final (HistHash* hash) {
+    uint64_t h = hash->size;
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ hash->lanes[i]) * HASH_PRIME;
+        h ^= h >> 32;
+    }
+    return h;
+}
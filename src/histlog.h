@@ -0,0 +1,102 @@
+#pragma once
+
+#include "main.h"
+
+#include <sys/stat.h>
+
+//
+// History Log.
+//  -> Append-only file holding a buffer's undo tree across sessions, kept
+//      under the user's state directory.
+//  -> ACTION records hold one state: its parent, selections and deltas.
+//  -> SAVE records mark which state matches the file on disk (size, mtime and
+//      content hash; size and hash decide).
+//  -> GOTO records follow undo/redo, and CLOSE ends a session cleanly. A log
+//      whose last position is not a saved state holds unsaved edits to recover.
+//  -> Appends go straight to the file; fsync is batched by count and age.
+//  -> Existing contents are memory-mapped on open; an action's payload is only
+//      decoded when its state is first visited.
+//
+
+enum {
+    HISTLOG_ACTION = 1,
+    HISTLOG_SAVE = 2,
+    HISTLOG_GOTO = 3,
+    HISTLOG_CLOSE = 4,
+};
+
+// Parent of a root state.
+#define HISTLOG_NONE UINT32_MAX
+
+struct hist_record {
+    uint32_t type;
+    uint32_t seq;
+
+    // Action: its payload is [payload, end).
+    uint32_t parent;
+    const uint8_t* payload;
+    const uint8_t* end;
+
+    // Save.
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t hash;
+};
+
+// Content hash of a file, fed in pieces.
+struct hist_hash {
+    uint64_t lanes[4];
+    uint64_t size;
+};
+
+struct hist_log {
+    CharBuffer* path;
+    int fd;
+
+    // Contents at open.
+    uint8_t* map;
+    size_t map_size;
+    size_t cursor;
+
+    // Encoding scratch space.
+    CharBuffer* out;
+
+    // Records written since the last fsync, and when the first of them was.
+    uint32_t unsynced;
+    double unsynced_since;
+};
+
+
+HistLog* histlog_open (const char* path);
+
+void histlog_close (HistLog* log);
+
+void histlog_reset (HistLog* log);
+
+bool histlog_set_aside (HistLog* log);
+
+bool histlog_pending (HistLog* log);
+
+
+bool histlog_next (HistLog* log, HistRecord* rec);
+
+bool histlog_read_action (const uint8_t* payload, const uint8_t* end, Array* deltas, SelectionArray* selections, SelectionArray* pre_selections);
+
+
+void histlog_append_action (HistLog* log, uint32_t seq, uint32_t parent, Array* deltas, SelectionArray* selections, SelectionArray* pre_selections);
+
+void histlog_append_save (HistLog* log, uint32_t seq, struct stat* st, uint64_t hash);
+
+void histlog_append_goto (HistLog* log, uint32_t seq);
+
+void histlog_append_close (HistLog* log, uint32_t seq);
+
+void histlog_sync (HistLog* log, bool force);
+
+
+void histlog_hash_init (HistHash* hash);
+
+void histlog_hash_update (HistHash* hash, const void* data, size_t n);
+
+uint64_t histlog_hash_final (HistHash* hash);
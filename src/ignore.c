@@ -0,0 +1,279 @@
+#include "ignore.h"
+
+#include <fcntl.h>
+
+
+enum {
+    // Compared with the whole text.
+    IGNORE_LITERAL,
+    // "*" then a literal: compared with the end of a name.
+    IGNORE_SUFFIX,
+    IGNORE_GLOB,
+};
+
+// Read from the root only, before the others.
+static const char* IGNORE_ROOT_FILES[] = { ".git/info/exclude" };
+static const char* IGNORE_FILES[] = { ".gitignore", ".tatlignore" };
+
+static const char IGNORE_DEFAULTS[] = "*.o\n*.a\n*.so\n";
+
+
+//
+// Glob Matching.
+//
+
+// Match 'ch' against the class starting at p ('['), setting *end past it.
+//  -> Returns -1 if the class is never closed.
+static
+int class_match (const char* p, char ch, const char** end) {
+    const char* c = p + 1;
+    bool negate = *c == '!' || *c == '^';
+    if (negate) c++;
+
+    bool found = false;
+    for (bool first = true; *c != '\0' && (*c != ']' || first); c++) {
+        first = false;
+        char lo = *c;
+        if (lo == '\\' && c[1] != '\0') lo = *++c;
+        char hi = lo;
+        if (c[1] == '-' && c[2] != ']' && c[2] != '\0') {
+            c += 2;
+            hi = *c;
+            if (hi == '\\' && c[1] != '\0') hi = *++c;
+        }
+        if (ch >= lo && ch <= hi) found = true;
+    }
+    if (*c != ']') return -1;
+
+    *end = c + 1;
+    return found != negate;
+}
+
+// '*', '?' and classes stop at '/'; '**' crosses it, and "**/" may match
+//  no directories at all.
+static
+bool glob_match (const char* p, const char* t) {
+    while (*p != '\0') {
+        if (*p == '*') {
+            bool deep = p[1] == '*';
+            while (*p == '*') p++;
+            if (deep && *p == '/' && glob_match(p + 1, t)) return true;
+            if (*p == '\0') return deep || strchr(t, '/') == NULL;
+
+            for (; *t != '\0'; t++) {
+                if (glob_match(p, t)) return true;
+                if (!deep && *t == '/') return false;
+            }
+            return false;
+        }
+
+        if (*t == '\0') return false;
+        if (*p == '?') {
+            if (*t == '/') return false;
+            p++, t++;
+            continue;
+        }
+        if (*p == '[') {
+            const char* end;
+            int hit = class_match(p, *t, &end);
+            if (hit >= 0) {
+                if (hit == 0 || *t == '/') return false;
+                p = end, t++;
+                continue;
+            }
+            // Unclosed: a plain '['.
+        }
+        if (*p == '\\' && p[1] != '\0') p++;
+        if (*p != *t) return false;
+        p++, t++;
+    }
+    return *t == '\0';
+}
+
+
+//
+// Loading.
+//
+
+static
+void rules_add (IgnoreRules* rules, uint32_t* capacity, uint32_t* strings_size, const char* line, uint32_t n) {
+    // Trailing spaces go, unless escaped.
+    while (n > 0 && (line[n - 1] == ' ' || line[n - 1] == '\t') && !(n > 1 && line[n - 2] == '\\')) n--;
+    if (n == 0 || line[0] == '#') return;
+
+    IgnoreRule rule = {0};
+    if (line[0] == '!') {
+        rule.negate = true;
+        line++, n--;
+    }
+    if (n > 0 && line[n - 1] == '/') {
+        rule.dir_only = true;
+        n--;
+    }
+    for (uint32_t i = 0; i < n; i++)
+        if (line[i] == '/') rule.anchored = true;
+    if (n > 0 && line[0] == '/') line++, n--;
+    if (n == 0) return;
+
+    bool wild = false, tail_wild = false;
+    for (uint32_t i = 0; i < n; i++) {
+        bool w = line[i] == '*' || line[i] == '?' || line[i] == '[' || line[i] == '\\';
+        wild |= w;
+        if (i > 0) tail_wild |= w;
+    }
+    rule.kind = !wild ? IGNORE_LITERAL
+        : line[0] == '*' && !tail_wild && !rule.anchored ? IGNORE_SUFFIX
+        : IGNORE_GLOB;
+
+    rules->strings = realloc(rules->strings, *strings_size + n + 1);
+    memcpy(rules->strings + *strings_size, line, n);
+    rules->strings[*strings_size + n] = '\0';
+    rule.pattern = *strings_size;
+    rule.size = n;
+    *strings_size += n + 1;
+
+    if (rules->size == *capacity) {
+        *capacity = MAX(8, 2 * *capacity);
+        rules->rules = realloc(rules->rules, *capacity * sizeof(IgnoreRule));
+    }
+    rules->rules[rules->size++] = rule;
+}
+
+static
+void rules_parse (IgnoreRules* rules, uint32_t* capacity, uint32_t* strings_size, const char* text, size_t size) {
+    for (size_t i = 0; i < size;) {
+        size_t j = i;
+        while (j < size && text[j] != '\n') j++;
+        size_t n = j - i;
+        if (n > 0 && text[i + n - 1] == '\r') n--;
+        rules_add(rules, capacity, strings_size, text + i, n);
+        i = j + 1;
+    }
+}
+
+static
+IgnoreRules* rules_create (IgnoreRules* parent, uint32_t base) {
+    IgnoreRules* rules = malloc(sizeof(IgnoreRules));
+    rules->parent = parent;
+    rules->base = base;
+    rules->rules = NULL;
+    rules->size = 0;
+    rules->strings = NULL;
+    atomic_init(&rules->refs, 1);
+    return rules;
+}
+
+// Whole contents of 'name' under 'fd', or NULL.
+static
+char* read_at (int fd, const char* name, size_t* size) {
+    int file = openat(fd, name, O_RDONLY | O_CLOEXEC);
+    if (file < 0) return NULL;
+
+    size_t capacity = 4096;
+    char* text = malloc(capacity);
+    *size = 0;
+    ssize_t n;
+    while ((n = read(file, text + *size, capacity - *size)) > 0) {
+        *size += n;
+        if (*size == capacity) text = realloc(text, capacity *= 2);
+    }
+    close(file);
+    return text;
+}
+
+IgnoreRules* ignore_create_defaults () {
+    IgnoreRules* rules = rules_create(NULL, 0);
+    uint32_t capacity = 0, strings_size = 0;
+    rules_parse(rules, &capacity, &strings_size, IGNORE_DEFAULTS, sizeof IGNORE_DEFAULTS - 1);
+    return rules;
+}
+
+IgnoreRules* ignore_load (IgnoreRules* parent, int fd, uint32_t size, uint32_t* hash) {
+    IgnoreRules* rules = NULL;
+    uint32_t capacity = 0, strings_size = 0;
+    // FNV-1a, over the names and contents of the files read.
+    uint32_t h = 2166136261u;
+    bool found = false;
+
+    uint32_t root_count = size == 0 ? sizeof IGNORE_ROOT_FILES / sizeof *IGNORE_ROOT_FILES : 0;
+    uint32_t count = sizeof IGNORE_FILES / sizeof *IGNORE_FILES;
+    for (uint32_t k = 0; k < root_count + count; k++) {
+        const char* name = k < root_count ? IGNORE_ROOT_FILES[k] : IGNORE_FILES[k - root_count];
+        size_t text_size;
+        char* text = read_at(fd, name, &text_size);
+        if (text == NULL) continue;
+
+        found = true;
+        for (const char* c = name; *c != '\0'; c++) h = (h ^ (uint8_t) *c) * 16777619u;
+        for (size_t i = 0; i < text_size; i++) h = (h ^ (uint8_t) text[i]) * 16777619u;
+
+        if (rules == NULL) rules = rules_create(parent, size == 0 ? 0 : size + 1);
+        rules_parse(rules, &capacity, &strings_size, text, text_size);
+        free(text);
+    }
+
+    *hash = !found ? 0 : h == 0 ? 1 : h;
+    // Only comments: share the parent's, though the hash still tells.
+    if (rules != NULL && rules->size == 0) {
+        free(rules->strings);
+        free(rules);
+        rules = NULL;
+    }
+    if (rules == NULL) return ignore_ref(parent);
+
+    // The node holds its parent.
+    ignore_ref(parent);
+    return rules;
+}
+
+IgnoreRules* ignore_ref (IgnoreRules* rules) {
+    if (rules != NULL) atomic_fetch_add(&rules->refs, 1);
+    return rules;
+}
+
+void ignore_unref (IgnoreRules* rules) {
+    while (rules != NULL && atomic_fetch_sub(&rules->refs, 1) == 1) {
+        IgnoreRules* parent = rules->parent;
+        free(rules->rules);
+        free(rules->strings);
+        free(rules);
+        rules = parent;
+    }
+}
+
+
+//
+// Matching.
+//
+
+bool ignore_match (IgnoreRules* rules, const char* path, uint32_t size, bool dir) {
+    const char* name = strrchr(path, '/');
+    name = name == NULL ? path : name + 1;
+    uint32_t name_size = path + size - name;
+
+    for (IgnoreRules* r = rules; r != NULL; r = r->parent) {
+        for (int32_t i = r->size - 1; i >= 0; i--) {
+            IgnoreRule* rule = &r->rules[i];
+            if (rule->dir_only && !dir) continue;
+
+            const char* text = rule->anchored ? path + r->base : name;
+            uint32_t text_size = rule->anchored ? size - r->base : name_size;
+            const char* pattern = r->strings + rule->pattern;
+
+            bool hit;
+            switch (rule->kind) {
+                case IGNORE_LITERAL:
+                    hit = text_size == rule->size && memcmp(text, pattern, text_size) == 0;
+                    break;
+                case IGNORE_SUFFIX:
+                    hit = text_size >= rule->size - 1 && memcmp(text + text_size - (rule->size - 1), pattern + 1, rule->size - 1) == 0;
+                    break;
+                default:
+                    hit = glob_match(pattern, text);
+                    break;
+            }
+            if (hit) return !rule->negate;
+        }
+    }
+    return false;
+}
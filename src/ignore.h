@@ -0,0 +1,63 @@
+#pragma once
+
+#include "main.h"
+
+#include <stdatomic.h>
+
+//
+// Ignore Rules.
+//  -> Patterns with .gitignore semantics: '*', '?' and '[...]' within a
+//      name, '**' across directories, '!' to re-include, a trailing '/' for
+//      directories only, and a leading or middle '/' to anchor the pattern
+//      to the directory it was read in; otherwise it matches names at any
+//      depth.
+//  -> Read from ".gitignore" and the project's own ".tatlignore", which
+//      comes after and so wins; at the root, ".git/info/exclude" before both.
+//  -> Compiled on load: plain names and "*.ext" suffixes compare directly,
+//      and only the rest go through the glob matcher.
+//  -> One node per directory with ignore files, pointing at the rules above
+//      it; directories without any share their parent's node. The last
+//      matching rule of the deepest node decides.
+//  -> Nodes are shared by the file index's workers, so counted atomically.
+//
+
+typedef struct {
+    // Offset of the pattern in 'strings', and its length.
+    uint32_t pattern;
+    uint32_t size;
+    uint8_t kind;
+
+    bool negate;
+    bool dir_only;
+    bool anchored;
+} IgnoreRule;
+
+struct ignore_rules {
+    IgnoreRules* parent;
+    // Where paths below the rules' directory start, relative to the root.
+    uint32_t base;
+
+    IgnoreRule* rules;
+    uint32_t size;
+    char* strings;
+
+    atomic_uint refs;
+};
+
+
+// Rules that apply everywhere: build products the editor can't open.
+IgnoreRules* ignore_create_defaults ();
+
+// Rules for the directory 'fd', whose path relative to the root is 'size'
+//  long, under 'parent'.
+//  -> Returns 'parent', with a new reference, if the directory has none.
+//  -> *hash identifies the ignore files read, zero if none.
+IgnoreRules* ignore_load (IgnoreRules* parent, int fd, uint32_t size, uint32_t* hash);
+
+IgnoreRules* ignore_ref (IgnoreRules* rules);
+
+void ignore_unref (IgnoreRules* rules);
+
+
+// Whether 'path', relative to the root, is ignored.
+bool ignore_match (IgnoreRules* rules, const char* path, uint32_t size, bool dir);
@@ -114,7 +114,7 @@ bool nextkey (int32_t timeout, InputEvent* event, int32_t* debug) {
     }
 
     struct pollfd pollfd = { .fd = 0, .events = POLLIN };
-    int status = poll(&pollfd, 1, 500);
+    int status = poll(&pollfd, 1, timeout);
     if (status > 0) {
         char buffer[64];
         int n = read(0, buffer, 64);
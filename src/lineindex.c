@@ -0,0 +1,187 @@
+#include "lineindex.h"
+
+#include "colorizer.h"
+
+
+//
+// Segment Tree.
+//  -> Implicit binary tree: node n has children 2n and 2n+1; leaves start at capacity.
+//  -> Leaves at or beyond size may be stale, so queries only visit nodes that
+//      lie completely inside [0, size).
+//
+
+static
+void tree_update (LineIndex* index, uint32_t i) {
+    uint32_t n = i + index->capacity;
+    index->tree[n] = index->lines[i].bracket_min;
+    for (n /= 2; n >= 1; n /= 2) {
+        index->tree[n] = MIN(index->tree[2*n], index->tree[2*n + 1]);
+    }
+}
+
+static
+void line_index_expand (LineIndex* index) {
+    uint32_t new_capacity = index->capacity * 2;
+
+    LineState* new_lines = calloc(new_capacity, sizeof(LineState));
+    for (int i = 0; i < index->size; i++)
+        new_lines[i] = index->lines[i];
+
+    free(index->lines);
+    free(index->tree);
+    index->lines = new_lines;
+    index->capacity = new_capacity;
+
+    // Rebuild tree bottom-up.
+    index->tree = calloc(2 * new_capacity, sizeof(int32_t));
+    for (int i = 0; i < index->size; i++)
+        index->tree[i + new_capacity] = index->lines[i].bracket_min;
+    for (int n = new_capacity - 1; n >= 1; n--)
+        index->tree[n] = MIN(index->tree[2*n], index->tree[2*n + 1]);
+}
+
+
+//
+// Line Index Object.
+//
+
+LineIndex* line_index_create () {
+    LineIndex* index = malloc(sizeof(LineIndex));
+    index->size = 0;
+    index->capacity = 64;
+    index->lines = calloc(index->capacity, sizeof(LineState));
+    index->tree = calloc(2 * index->capacity, sizeof(int32_t));
+
+    index->checks = NULL;
+    index->check_valid = NULL;
+    index->checks_capacity = 0;
+
+    return index;
+}
+
+void line_index_destroy (LineIndex* index) {
+    free(index->lines);
+    free(index->tree);
+    free(index->checks);
+    free(index->check_valid);
+    free(index);
+}
+
+
+void line_index_clear (LineIndex* index) {
+    index->size = 0;
+    if (index->checks_capacity > 0)
+        memset(index->check_valid, 0, index->checks_capacity * sizeof(bool));
+}
+
+void line_index_truncate (LineIndex* index, uint32_t size) {
+    if (size < index->size) index->size = size;
+
+    // Checkpoints at or below 'size' only depend on lines before it.
+    for (uint32_t k = size / LINE_CHECKPOINT + 1; k < index->checks_capacity; k++)
+        index->check_valid[k] = false;
+}
+
+void line_index_push (LineIndex* index, LineState* state) {
+    if (index->size >= index->capacity) line_index_expand(index);
+
+    index->lines[index->size] = *state;
+    tree_update(index, index->size);
+    index->size++;
+}
+
+LineState* line_index_get (LineIndex* index, int32_t line) {
+    if (line < 0 || line >= index->size) return NULL;
+
+    return &index->lines[line];
+}
+
+
+//
+// Checkpoints.
+//
+
+// Approximate start state of 'line' if it is a checkpoint line that has been set.
+LineState* line_index_check_get (LineIndex* index, int32_t line) {
+    if (line < 0 || line % LINE_CHECKPOINT != 0) return NULL;
+
+    uint32_t k = line / LINE_CHECKPOINT;
+    if (k >= index->checks_capacity || !index->check_valid[k]) return NULL;
+
+    return &index->checks[k];
+}
+
+void line_index_check_set (LineIndex* index, int32_t line, LineState* state) {
+    if (line < 0 || line % LINE_CHECKPOINT != 0) return;
+
+    uint32_t k = line / LINE_CHECKPOINT;
+    if (k >= index->checks_capacity) {
+        uint32_t new_capacity = MAX(64, index->checks_capacity);
+        while (new_capacity <= k) new_capacity *= 2;
+
+        index->checks = realloc(index->checks, new_capacity * sizeof(LineState));
+        index->check_valid = realloc(index->check_valid, new_capacity * sizeof(bool));
+        memset(index->check_valid + index->checks_capacity, 0, (new_capacity - index->checks_capacity) * sizeof(bool));
+        index->checks_capacity = new_capacity;
+    }
+
+    index->checks[k] = *state;
+    index->check_valid[k] = true;
+}
+
+
+//
+// Queries.
+//
+
+// Descend from node n to the first (or last) leaf with value <= depth.
+static
+int32_t tree_descend (LineIndex* index, uint32_t n, int32_t depth, bool first) {
+    while (n < index->capacity) {
+        uint32_t a = first ? 2*n : 2*n + 1;
+        uint32_t b = first ? 2*n + 1 : 2*n;
+        n = index->tree[a] <= depth ? a : b;
+    }
+    return n - index->capacity;
+}
+
+// First line in [line, size) whose bracket_min <= depth, or -1.
+int32_t line_index_next_below (LineIndex* index, int32_t line, int32_t depth) {
+    if (line < 0) line = 0;
+    if (line >= index->size) return -1;
+
+    // Canonical cover of [line, size): left nodes in order, right nodes reversed.
+    uint32_t left[64], right[64];
+    uint32_t nl = 0, nr = 0;
+    for (uint32_t l = line + index->capacity, r = index->size + index->capacity; l < r; l /= 2, r /= 2) {
+        if (l & 1) left[nl++] = l++;
+        if (r & 1) right[nr++] = --r;
+    }
+
+    for (int i = 0; i < nl; i++)
+        if (index->tree[left[i]] <= depth) return tree_descend(index, left[i], depth, true);
+    for (int i = nr - 1; i >= 0; i--)
+        if (index->tree[right[i]] <= depth) return tree_descend(index, right[i], depth, true);
+
+    return -1;
+}
+
+// Last line in [0, line] whose bracket_min <= depth, or -1.
+int32_t line_index_prev_below (LineIndex* index, int32_t line, int32_t depth) {
+    if (line >= (int32_t) index->size) line = index->size - 1;
+    if (line < 0) return -1;
+
+    uint32_t left[64], right[64];
+    uint32_t nl = 0, nr = 0;
+    for (uint32_t l = index->capacity, r = line + 1 + index->capacity; l < r; l /= 2, r /= 2) {
+        if (l & 1) left[nl++] = l++;
+        if (r & 1) right[nr++] = --r;
+    }
+
+    for (int i = 0; i < nr; i++)
+        if (index->tree[right[i]] <= depth) return tree_descend(index, right[i], depth, false);
+    for (int i = nl - 1; i >= 0; i--)
+        if (index->tree[left[i]] <= depth) return tree_descend(index, left[i], depth, false);
+
+    return -1;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "main.h"
+
+//
+// Line Index.
+//  -> Per-line colorizer end states, filled lazily from the top of the buffer.
+//  -> A min segment tree over bracket_min answers "next/previous line that
+//      dips to bracket depth d" in O(log n), for bracket matching.
+//  -> Beyond the filled prefix, checkpoints every LINE_CHECKPOINT lines hold
+//      approximate start states, so the view can draw far down without
+//      colorizing everything above it.
+//
+
+struct line_index {
+    LineState* lines;
+    uint32_t size;
+    uint32_t capacity;
+
+    int32_t* tree;
+
+    // Checkpoint k is the start state of line k * LINE_CHECKPOINT.
+    LineState* checks;
+    bool* check_valid;
+    uint32_t checks_capacity;
+};
+
+
+LineIndex* line_index_create ();
+
+void line_index_destroy (LineIndex* index);
+
+
+void line_index_clear (LineIndex* index);
+
+void line_index_truncate (LineIndex* index, uint32_t size);
+
+void line_index_push (LineIndex* index, LineState* state);
+
+LineState* line_index_get (LineIndex* index, int32_t line);
+
+
+LineState* line_index_check_get (LineIndex* index, int32_t line);
+
+void line_index_check_set (LineIndex* index, int32_t line, LineState* state);
+
+
+int32_t line_index_next_below (LineIndex* index, int32_t line, int32_t depth);
+
+int32_t line_index_prev_below (LineIndex* index, int32_t line, int32_t depth);
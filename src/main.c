@@ -1,6 +1,7 @@
 #include "main.h"
 
 #include <sys/ioctl.h>
+#include <time.h>
 #undef CTRL
 
 #include "array.h"
@@ -41,16 +42,24 @@ int main (int argc, char** argv) {
     int width = 0, height = 0;
 
     bool exit = false;
+    bool more = false;
+    double blink_time = now();
     while (!exit) {
+        // Wake up sooner while idle work remains.
         int32_t debug[32] = {0};
-        bool has_event = nextkey(10, &event, debug);
+        bool has_event = nextkey(more ? IDLE_TICK : CURSOR_BLINK, &event, debug);
         if (has_event) {
             exit = !editor_event(&editor, &event);
             cursor_blink = false;
-        } else {
+            blink_time = now();
+        } else if (now() - blink_time >= (CURSOR_BLINK - IDLE_TICK) / 1000.0) {
             cursor_blink = !cursor_blink;
+            blink_time = now();
         }
 
+        // Idle work runs after events too, so typing doesn't hold it off.
+        if (!exit) more = editor_idle(&editor);
+
         if (ioctl(0, TIOCGWINSZ, &size) == 0) {
             width = size.ws_col;
             height = size.ws_row;
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
 
 //
 // Type Listing.
@@ -21,17 +22,32 @@ typedef struct editor Editor;
 typedef struct filebuffer FileBuffer;
 typedef struct colorizer Colorizer;
 typedef struct state State;
+typedef struct keywords Keywords;
 typedef struct mode Mode;
+typedef struct line_state LineState;
+typedef struct line_index LineIndex;
 
 typedef struct textbuffer TextBuffer;
 typedef struct selection Selection;
+typedef struct selection_array SelectionArray;
 typedef struct find_target FindTarget;
+typedef struct regex Regex;
+typedef struct match_index MatchIndex;
+typedef struct multi_find MultiFind;
+typedef struct multi_find_batch MultiFindBatch;
+typedef struct delta Delta;
+typedef struct hist_log HistLog;
+typedef struct hist_record HistRecord;
+typedef struct hist_hash HistHash;
 typedef struct textview TextView;
 
 typedef struct rope Rope;
+typedef struct rope_builder RopeBuilder;
 typedef struct point Point;
 
 typedef struct array Array;
+typedef struct ring Ring;
+typedef struct thread_pool ThreadPool;
 typedef struct charbuffer CharBuffer;
 typedef struct intbuffer IntBuffer;
 
@@ -39,6 +55,11 @@ typedef struct input_event InputEvent;
 typedef struct mouse_event MouseEvent;
 
 typedef struct file_entry FileEntry;
+typedef struct file_search FileSearch;
+typedef struct file_index FileIndex;
+typedef struct index_dir IndexDir;
+typedef struct ignore_rules IgnoreRules;
+typedef struct grep Grep;
 
 typedef struct box Box;
 
@@ -62,8 +83,81 @@ static inline int32_t ABS (int32_t a) {
     return a < 0 ? -a : a;
 }
 
+// Seconds on a clock that only moves forward, for delays and timeouts.
+static inline double now () {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double) t.tv_sec + (double) t.tv_nsec / 1000000000.0;
+}
+
 //
 // Defines.
 //
 #define NODE_CONTENT_SIZE 128
-#define HIST_LIMIT 1024
+// Bytes read at a time from files that can't be mapped.
+#define FILE_READ_BLOCK (1 << 20)
+// Bytes encoded before each write when saving.
+#define FILE_WRITE_BLOCK (1 << 20)
+// Default bytes of undo history kept per buffer.
+#define HIST_BUDGET (16 << 20)
+// Delta bytes between full-text undo snapshots.
+#define HIST_SNAPSHOT_BYTES (64 << 10)
+// Actions with more deltas than this keep snapshots instead.
+#define HIST_SNAPSHOT_DELTAS 256
+// Deltas past which undo/redo rebuilds the text in one pass.
+#define HIST_SPLICE_DELTAS 16
+// Discarded undo states held for freeing at idle.
+#define HIST_GARBAGE_LIMIT 4096
+// History log records between fsyncs, at most.
+#define HISTLOG_SYNC_RECORDS 256
+// Seconds an appended history log record may wait for its fsync.
+#define HISTLOG_SYNC_DELAY 0.5
+// Seconds, and edits, an action may stay open before it goes to the log.
+#define HISTLOG_ACTION_DELAY 2.0
+#define HISTLOG_ACTION_EDITS 1024
+// Old history logs kept beside one, as "<log>.1" and so on.
+#define HISTLOG_ASIDE_MAX 16
+
+// Characters searched per idle tick while indexing find matches.
+#define MATCH_IDLE_BUDGET (1 << 18)
+
+// Characters per task when searching one text on several threads.
+#define MULTI_FIND_SPLIT (1 << 20)
+
+// Bytes of directory entries read per getdents64 call while indexing files.
+#define INDEX_DENTS_SIZE (32 << 10)
+// Seconds between saves of the file index cache, at least.
+#define INDEX_SAVE_DELAY 30.0
+// Seconds between checks of the whole index when some directory isn't watched.
+#define INDEX_RECHECK_DELAY 10.0
+
+// Best matches kept in order by the file-open dialog.
+#define SEARCH_TOP_K 512
+// Files per task when ranking the file search on several threads.
+#define SEARCH_RANK_SPLIT (1 << 14)
+// Milliseconds a keystroke waits for the file search to rank before drawing.
+#define SEARCH_RANK_WAIT 8
+
+// Results of a project grep before it stops.
+#define GREP_RESULT_LIMIT 10000
+// Files a grep worker takes at a time.
+#define GREP_BATCH 16
+// Bytes of a matching line kept to show with a grep result.
+#define GREP_SNIPPET 160
+// Leading bytes of a file checked for a NUL, which marks it binary.
+#define GREP_BINARY_PROBE 8192
+// Bytes of a file, rounded up to whole lines, a regex grep decodes at a time.
+#define GREP_REGEX_BLOCK (1 << 16)
+
+// Cached states per regex DFA before the cache is dropped and rebuilt.
+#define REGEX_DFA_STATES 1024
+
+// Lines between colorizer checkpoints; bounds the work of a far scroll.
+#define LINE_CHECKPOINT 256
+// Lines of exact colorizer state filled per idle tick.
+#define LINE_IDLE_BUDGET 4096
+
+// Milliseconds the cursor stays on or off while blinking.
+#define CURSOR_BLINK 500
+// Milliseconds between idle ticks while idle work remains.
+#define IDLE_TICK 10
@@ -0,0 +1,181 @@
+#include "matchindex.h"
+
+#include "rope.h"
+#include "textbuffer.h"
+
+
+MatchIndex* match_index_create (FindTarget* target) {
+    MatchIndex* index = malloc(sizeof(MatchIndex));
+    index->target = target;
+    index->capacity = 64;
+    index->bounds = malloc(2 * index->capacity * sizeof(uint32_t));
+    index->size = 0;
+    index->scanned = 0;
+    index->complete = false;
+    return index;
+}
+
+void match_index_destroy (MatchIndex* index) {
+    find_target_destroy(index->target);
+    free(index->bounds);
+    free(index);
+}
+
+void match_index_reset (MatchIndex* index) {
+    index->size = 0;
+    index->scanned = 0;
+    index->complete = false;
+}
+
+
+//
+// Storage.
+//
+
+static
+void match_index_reserve (MatchIndex* index, uint32_t size) {
+    if (size <= index->capacity) return;
+    while (index->capacity < size) index->capacity *= 2;
+    index->bounds = realloc(index->bounds, 2 * index->capacity * sizeof(uint32_t));
+}
+
+// First match starting at or after 'pos'.
+static
+uint32_t match_index_lower (MatchIndex* index, uint32_t pos) {
+    uint32_t lo = 0, hi = index->size;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index->bounds[2*mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+uint32_t match_index_find (MatchIndex* index, uint32_t pos) {
+    // Ends rise with starts: literal matches share a length, regex ones don't overlap.
+    uint32_t lo = 0, hi = index->size;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (index->bounds[2*mid + 1] <= pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+
+//
+// Scanning.
+//
+
+static
+uint32_t line_end (Rope* text, uint32_t i) {
+    int32_t row = rope_index_to_point(text, i).row;
+    return rope_point_to_index(text, (Point) {row, INT_MAX});
+}
+
+static
+uint32_t line_start (Rope* text, uint32_t i) {
+    int32_t row = rope_index_to_point(text, i).row;
+    return rope_point_to_index(text, (Point) {row, 0});
+}
+
+// Matches starting in [a, c), found in [a, end) of the text, put in place
+//  of matches [lo, hi) of the index.
+static
+void match_index_collect (MatchIndex* index, Rope* text, uint32_t a, uint32_t c, uint32_t end, uint32_t lo, uint32_t hi) {
+    FindTarget* target = index->target;
+    Rope* window = rope_substr(text, a, end);
+
+    // Found matches go at the end first, then move into place.
+    uint32_t tail = index->size - hi;
+    uint32_t found = index->size;
+    uint32_t from = 0;
+    uint32_t start, stop;
+    while (from < c - a && find_target_next(target, window, from, &start, &stop) && start < c - a) {
+        if (target->regex == NULL) {
+            from = start + 1;
+        } else {
+            from = stop > start ? stop : stop + 1;
+            if (stop == start) continue;
+        }
+
+        match_index_reserve(index, found + 1);
+        index->bounds[2*found] = a + start;
+        index->bounds[2*found + 1] = a + stop;
+        found++;
+    }
+    rope_destroy(window);
+
+    uint32_t n = found - index->size;
+    if (n == 0) {
+        memmove(index->bounds + 2*lo, index->bounds + 2*hi, 2 * tail * sizeof(uint32_t));
+        index->size = lo + tail;
+        return;
+    }
+
+    // Rotate: [lo, hi) drops out, the found matches land at lo.
+    uint32_t* moved = malloc(2 * n * sizeof(uint32_t));
+    memcpy(moved, index->bounds + 2*index->size, 2 * n * sizeof(uint32_t));
+    memmove(index->bounds + 2*(lo + n), index->bounds + 2*hi, 2 * tail * sizeof(uint32_t));
+    memcpy(index->bounds + 2*lo, moved, 2 * n * sizeof(uint32_t));
+    free(moved);
+    index->size = lo + n + tail;
+}
+
+bool match_index_scan (MatchIndex* index, Rope* text, uint32_t budget) {
+    if (index->complete) return false;
+
+    uint32_t len = rope_len(text);
+    uint32_t a = index->scanned;
+    uint32_t c = MIN(len, a + budget);
+    uint32_t end;
+    if (index->target->regex == NULL) {
+        end = MIN(len, c + index->target->size - 1);
+    } else {
+        // Regex slices end at line ends; 'scanned' stays at a line start.
+        c = end = line_end(text, c);
+    }
+
+    match_index_collect(index, text, a, c, end, index->size, index->size);
+
+    index->scanned = index->target->regex != NULL && c < len ? c + 1 : c;
+    index->complete = index->scanned >= len;
+    return !index->complete;
+}
+
+void match_index_edit (MatchIndex* index, Rope* text, uint32_t pos, uint32_t removed, uint32_t inserted) {
+    FindTarget* target = index->target;
+    uint32_t len = rope_len(text);
+    int32_t delta = inserted - removed;
+
+    // Matches starting in [a, c) may have changed; deciding them takes [a, end).
+    uint32_t a, c, end;
+    if (target->regex == NULL) {
+        a = pos >= target->size - 1 ? pos - (target->size - 1) : 0;
+        c = pos + inserted;
+        end = MIN(len, c + target->size - 1);
+    } else {
+        a = line_start(text, pos);
+        c = end = line_end(text, pos + inserted);
+    }
+    if (!index->complete && a >= index->scanned) return;
+
+    uint32_t lo = match_index_lower(index, a);
+    uint32_t c_old = c - delta;
+    if (!index->complete && c_old > index->scanned) {
+        // Reaches text not yet scanned: scan again from 'a'.
+        index->size = lo;
+        index->scanned = a;
+        index->complete = false;
+        return;
+    }
+
+    uint32_t hi = match_index_lower(index, c_old);
+    for (uint32_t k = hi; k < index->size; k++) {
+        index->bounds[2*k] += delta;
+        index->bounds[2*k + 1] += delta;
+    }
+    index->scanned += delta;
+
+    match_index_collect(index, text, a, c, end, lo, hi);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "main.h"
+
+//
+// Match Index.
+//  -> Every match of a find target in a buffer, sorted by start, for counts
+//      and highlighting.
+//  -> Built from the top at idle, MATCH_IDLE_BUDGET characters a tick, and
+//      patched on edits by rescanning only the text around them.
+//  -> Literal matches may overlap, as find-next steps over them. Regex
+//      matches are found line by line, left to right; empty ones are left out.
+//
+
+struct match_index {
+    FindTarget* target;
+
+    // Match k is [bounds[2k], bounds[2k + 1]).
+    uint32_t* bounds;
+    uint32_t size;
+    uint32_t capacity;
+
+    // Matches starting before 'scanned' are all in the index.
+    uint32_t scanned;
+    bool complete;
+};
+
+
+// Takes ownership of 'target'.
+MatchIndex* match_index_create (FindTarget* target);
+
+void match_index_destroy (MatchIndex* index);
+
+
+// Forget all matches, for text replaced wholesale.
+void match_index_reset (MatchIndex* index);
+
+// Index up to 'budget' more characters; returns true if text remains.
+bool match_index_scan (MatchIndex* index, Rope* text, uint32_t budget);
+
+// [pos, pos + removed) of the old text became 'inserted' characters of 'text'.
+void match_index_edit (MatchIndex* index, Rope* text, uint32_t pos, uint32_t removed, uint32_t inserted);
+
+
+// First match ending after 'pos' (index->size if none).
+uint32_t match_index_find (MatchIndex* index, uint32_t pos);
@@ -2,6 +2,8 @@
 
 #include "colorizer.h"
 
+#include <strings.h>
+
 //
 // Language Modes.
 //  -> Functions which intialize the modes as needed.
@@ -14,6 +16,14 @@
 
 // - C Mode - //
 
+static const char* c_keywords[] = {
+    "int", "long", "short", "float", "double", "bool", "char", "signed", "unsigned",
+    "true", "false", "void", "if", "else", "switch", "case", "default", "do",
+    "for", "while", "break", "continue", "return", "goto", "auto", "register",
+    "static", "extern", "const", "volitile", "sizeof", "struct", "union", "enum",
+    "typedef", "inline", "restrict",
+};
+
 static
 Mode* c_mode () {
     static Mode mode = { .name = "C", .strict_words = true, .color_capitals = true };
@@ -26,50 +36,14 @@ Mode* c_mode () {
     state_append(state, "\"", STATE_STRING);
     state_append(state, "'",  STATE_CHAR);
 
-    state_append(state, "int", STATE_KEYWORD); 
-    state_append(state, "long", STATE_KEYWORD);
-    state_append(state, "short", STATE_KEYWORD);
-    state_append(state, "float", STATE_KEYWORD);
-    state_append(state, "double", STATE_KEYWORD);
-    state_append(state, "bool", STATE_KEYWORD);
-    state_append(state, "char", STATE_KEYWORD);
-    state_append(state, "signed", STATE_KEYWORD);
-    state_append(state, "unsigned", STATE_KEYWORD);
-    state_append(state, "true", STATE_KEYWORD);
-    state_append(state, "false", STATE_KEYWORD);
-    state_append(state, "void", STATE_KEYWORD);
-    state_append(state, "if", STATE_KEYWORD);
-    state_append(state, "else", STATE_KEYWORD);
-    state_append(state, "switch", STATE_KEYWORD);
-    state_append(state, "case", STATE_KEYWORD);
-    state_append(state, "default", STATE_KEYWORD);
-    state_append(state, "do", STATE_KEYWORD);
-    state_append(state, "for", STATE_KEYWORD);
-    state_append(state, "while", STATE_KEYWORD);
-    state_append(state, "break", STATE_KEYWORD);
-    state_append(state, "continue", STATE_KEYWORD);
-    state_append(state, "return", STATE_KEYWORD);
-    state_append(state, "goto", STATE_KEYWORD);
-    state_append(state, "auto", STATE_KEYWORD);
-    state_append(state, "register", STATE_KEYWORD);
-    state_append(state, "static", STATE_KEYWORD);
-    state_append(state, "extern", STATE_KEYWORD);
-    state_append(state, "const", STATE_KEYWORD);
-    state_append(state, "volitile", STATE_KEYWORD);
-    state_append(state, "sizeof", STATE_KEYWORD);
-    state_append(state, "struct", STATE_KEYWORD);
-    state_append(state, "union", STATE_KEYWORD);
-    state_append(state, "enum", STATE_KEYWORD);
-    state_append(state, "typedef", STATE_KEYWORD);
-    state_append(state, "inline", STATE_KEYWORD);
-    state_append(state, "restrict", STATE_KEYWORD);
-
-    state_append(state, "(", STATE_SYMBOL);
-    state_append(state, ")", STATE_SYMBOL);
-    state_append(state, "[", STATE_SYMBOL);
-    state_append(state, "]", STATE_SYMBOL);
-    state_append(state, "{", STATE_SYMBOL);
-    state_append(state, "}", STATE_SYMBOL);
+    mode.keywords = keywords_create(c_keywords, sizeof(c_keywords)/sizeof(char*));
+
+    state_append(state, "(", STATE_OPEN_BRACKET);
+    state_append(state, ")", STATE_CLOSE_BRACKET);
+    state_append(state, "[", STATE_OPEN_BRACKET);
+    state_append(state, "]", STATE_CLOSE_BRACKET);
+    state_append(state, "{", STATE_OPEN_BRACKET);
+    state_append(state, "}", STATE_CLOSE_BRACKET);
     //state_append(state, "#", STATE_SYMBOL);
     state_append(state, ";", STATE_SYMBOL);
     state_append(state, ":", STATE_SYMBOL);
@@ -88,6 +62,12 @@ Mode* c_mode () {
 
 // - Makefile Mode - //
 
+static const char* make_keywords[] = {
+    "include", "ifeq", "ifneq", "ifdef", "ifndef", "else", "endif", "define",
+    "enddef", "export", "unexport", "override", "wildcard", "shell", "subst",
+    "patsubst", "foreach", "filter", "filter-out", "eval",
+};
+
 static
 Mode* make_mode () {
     static Mode mode = { .name = "Makefile", .force_hard_tabs = true , .color_capitals = true };
@@ -98,27 +78,8 @@ Mode* make_mode () {
     state_append(state, "\"", STATE_STRING);
     state_append(state, "'",  STATE_CHAR);
 
-    state_append(state, "include", STATE_KEYWORD); 
-    state_append(state, "ifeq", STATE_KEYWORD);
-    state_append(state, "ifneq", STATE_KEYWORD);
-    state_append(state, "ifdef", STATE_KEYWORD);
-    state_append(state, "ifndef", STATE_KEYWORD);
-    state_append(state, "else", STATE_KEYWORD);
-    state_append(state, "endif", STATE_KEYWORD);
-    state_append(state, "define", STATE_KEYWORD);
-    state_append(state, "enddef", STATE_KEYWORD);
-    state_append(state, "export", STATE_KEYWORD);
-    state_append(state, "unexport", STATE_KEYWORD);
-    state_append(state, "override", STATE_KEYWORD);
-
-    state_append(state, "wildcard", STATE_KEYWORD);
-    state_append(state, "shell", STATE_KEYWORD);
-    state_append(state, "subst", STATE_KEYWORD);
-    state_append(state, "patsubst", STATE_KEYWORD);
-    state_append(state, "foreach", STATE_KEYWORD);
-    state_append(state, "filter", STATE_KEYWORD);
-    state_append(state, "filter-out", STATE_KEYWORD);
-    state_append(state, "eval", STATE_KEYWORD);
+    mode.keywords = keywords_create(make_keywords, sizeof(make_keywords)/sizeof(char*));
+
 
     state_append(state, "%", STATE_SYMBOL);
     state_append(state, "$", STATE_SYMBOL);
@@ -127,12 +88,12 @@ Mode* make_mode () {
     state_append(state, "$?", STATE_SYMBOL);
     state_append(state, "$*", STATE_SYMBOL);
     state_append(state, "@", STATE_SYMBOL);
-    state_append(state, "(", STATE_SYMBOL);
-    state_append(state, ")", STATE_SYMBOL);
-    state_append(state, "[", STATE_SYMBOL);
-    state_append(state, "]", STATE_SYMBOL);
-    state_append(state, "{", STATE_SYMBOL);
-    state_append(state, "}", STATE_SYMBOL);
+    state_append(state, "(", STATE_OPEN_BRACKET);
+    state_append(state, ")", STATE_CLOSE_BRACKET);
+    state_append(state, "[", STATE_OPEN_BRACKET);
+    state_append(state, "]", STATE_CLOSE_BRACKET);
+    state_append(state, "{", STATE_OPEN_BRACKET);
+    state_append(state, "}", STATE_CLOSE_BRACKET);
     state_append(state, ":", STATE_SYMBOL);
     state_append(state, ";", STATE_SYMBOL);
     state_append(state, ",", STATE_SYMBOL);
@@ -144,13 +105,52 @@ Mode* make_mode () {
 
 // - Bash Mode - //
 
+static const char* bash_keywords[] = {
+    "if", "then", "else", "elif", "fi", "case", "esac", "for", "while", "until",
+    "do", "done", "in", "select", "function", "return", "break", "continue",
+    "exit", "local", "export", "readonly", "declare", "source", "set", "shift",
+};
+
+static
+Mode* bash_mode () {
+    static Mode mode = { .name = "Bash", .color_capitals = true };
+    INIT_GUARD(mode)
+
+    State* state = state_create();
+    state_append(state, "#",  STATE_LINE_COMMENT);
+    state_append(state, "\"", STATE_STRING);
+    state_append(state, "'",  STATE_CHAR);
+
+    mode.keywords = keywords_create(bash_keywords, sizeof(bash_keywords)/sizeof(char*));
+
+    state_append(state, "$", STATE_SYMBOL);
+    state_append(state, "(", STATE_OPEN_BRACKET);
+    state_append(state, ")", STATE_CLOSE_BRACKET);
+    state_append(state, "[", STATE_OPEN_BRACKET);
+    state_append(state, "]", STATE_CLOSE_BRACKET);
+    state_append(state, "{", STATE_OPEN_BRACKET);
+    state_append(state, "}", STATE_CLOSE_BRACKET);
+    state_append(state, ";", STATE_SYMBOL);
+    state_append(state, "|", STATE_SYMBOL);
+    state_append(state, "&", STATE_SYMBOL);
+    state_append(state, "<", STATE_SYMBOL);
+    state_append(state, ">", STATE_SYMBOL);
+    state_append(state, "=", STATE_SYMBOL);
+    state_append(state, "`", STATE_SYMBOL);
+
+    mode.colorizer_state = state;
+    return &mode;
+}
+
 
 //
 // Get Language mode from filename.
+//  -> Keys are whole filenames, extensions (with the dot) and filename stems.
+//  -> Looked up in a hash table built on first use.
 //
 
 typedef struct {
-    const char* ext;
+    const char* key;
     Mode* (*mode_fn)();
 } ModeExt;
 
@@ -160,26 +160,155 @@ static ModeExt mode_list[] = {
     {".h", c_mode},
     {"makefile", make_mode },
     {"Makefile", make_mode },
+    {"GNUmakefile", make_mode },
+    {".mk", make_mode },
+    {".mak", make_mode },
+    {".sh", bash_mode },
+    {".bash", bash_mode },
+    {".bashrc", bash_mode },
+    {".bash_profile", bash_mode },
+    {".profile", bash_mode },
 };
 
+// Interpreters named by a shebang line (or an Emacs mode tag).
+static ModeExt interp_list[] = {
+    {"sh", bash_mode },
+    {"bash", bash_mode },
+    {"dash", bash_mode },
+    {"zsh", bash_mode },
+    {"ksh", bash_mode },
+    {"make", make_mode },
+    {"makefile", make_mode },
+    {"c", c_mode },
+};
+
+#define MODE_TABLE_SIZE 64
+#define MODE_SNIFF_LIMIT 256
+
+static ModeExt* mode_table[MODE_TABLE_SIZE];
+
+// FNV-1a over the first len chars (or up to the terminator).
 static
-const char* get_ext (const char* filename) {
-    int32_t i = 0;
-    int32_t r = 0;
-    while (filename[i] != '\0') {
-        if (filename[i] == '.') r = i;
-        i++;
+uint32_t mode_hash (const char* key, uint32_t len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len && key[i] != '\0'; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
     }
-    return filename + r;
+    return hash;
 }
 
-Mode* get_language_mode (const char* filename) {
-    const char* ext = get_ext(filename);
+static
+void mode_table_init () {
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
 
     for (int i = 0; i < sizeof(mode_list)/sizeof(ModeExt); i++) {
-        ModeExt modex = mode_list[i];
-        if (strcmp(ext, modex.ext) == 0) return modex.mode_fn();
+        uint32_t h = mode_hash(mode_list[i].key, UINT32_MAX);
+        while (mode_table[h % MODE_TABLE_SIZE] != NULL) h++;
+        mode_table[h % MODE_TABLE_SIZE] = &mode_list[i];
+    }
+}
+
+static
+ModeExt* mode_table_find (const char* key, uint32_t len) {
+    if (len == 0) return NULL;
+
+    for (uint32_t h = mode_hash(key, len);; h++) {
+        ModeExt* modex = mode_table[h % MODE_TABLE_SIZE];
+        if (modex == NULL) return NULL;
+        if (strncmp(modex->key, key, len) == 0 && modex->key[len] == '\0') return modex;
+    }
+}
+
+static
+Mode* interp_mode (const char* name, uint32_t len) {
+    for (int i = 0; i < sizeof(interp_list)/sizeof(ModeExt); i++) {
+        ModeExt modex = interp_list[i];
+        if (strncmp(modex.key, name, len) == 0 && modex.key[len] == '\0') return modex.mode_fn();
+    }
+    return NULL;
+}
+
+// Mode from the first line of the content.
+//  -> "#!/bin/sh", "#!/usr/bin/env bash", "#!/usr/bin/make -f" and "-*- mode: c -*-".
+static
+Mode* sniff_mode (const char* head, uint32_t len) {
+    len = MIN(len, MODE_SNIFF_LIMIT);
+    uint32_t end = 0;
+    while (end < len && head[end] != '\n') end++;
+
+    // Shebang.
+    if (end >= 2 && head[0] == '#' && head[1] == '!') {
+        uint32_t i = 2;
+        bool after_env = false;
+        for (;;) {
+            // Next word.
+            while (i < end && (head[i] == ' ' || head[i] == '\t')) i++;
+            uint32_t w = i;
+            while (i < end && head[i] != ' ' && head[i] != '\t' && head[i] != '\r') i++;
+            if (w == i) return NULL;
+
+            // Basename.
+            uint32_t b = w;
+            for (uint32_t x = w; x < i; x++)
+                if (head[x] == '/') b = x + 1;
+
+            // Skip env, its options and variable assignments.
+            if (!after_env && i - b == 3 && strncmp(head + b, "env", 3) == 0) {
+                after_env = true;
+                continue;
+            }
+            if (after_env && (head[w] == '-' || memchr(head + w, '=', i - w) != NULL)) continue;
+
+            // Strip a version suffix ("bash5", "python3.11").
+            uint32_t e = i;
+            while (e > b && (('0' <= head[e-1] && head[e-1] <= '9') || head[e-1] == '.')) e--;
+            return interp_mode(head + b, e - b);
+        }
     }
 
+    // Emacs mode tag.
+    for (uint32_t i = 0; i + 3 <= end; i++) {
+        if (strncmp(head + i, "-*-", 3) != 0) continue;
+        i += 3;
+        while (i < end && head[i] == ' ') i++;
+        if (end - i >= 5 && strncasecmp(head + i, "mode:", 5) == 0) i += 5;
+        while (i < end && head[i] == ' ') i++;
+        uint32_t w = i;
+        while (i < end && head[i] != ' ' && head[i] != ';' && head[i] != '-') i++;
+
+        char name[32] = {0};
+        for (uint32_t x = 0; x < i - w && x < sizeof(name) - 1; x++)
+            name[x] = head[w + x] | 0x20;
+        return interp_mode(name, strlen(name));
+    }
+
+    return NULL;
+}
+
+// Language mode from a filename and, optionally, the start of its content.
+//  -> Filename matches win: the whole name, then the extension, then the stem
+//      (so "Makefile.am" is a Makefile).
+Mode* get_language_mode (const char* filename, const char* head, uint32_t len) {
+    mode_table_init();
+
+    uint32_t size = strlen(filename);
+    uint32_t first_dot = size, last_dot = size;
+    for (int i = size - 1; i > 0; i--) {
+        if (filename[i] == '.') {
+            if (last_dot == size) last_dot = i;
+            first_dot = i;
+        }
+    }
+
+    ModeExt* modex = mode_table_find(filename, size);
+    if (modex == NULL) modex = mode_table_find(filename + last_dot, size - last_dot);
+    if (modex == NULL) modex = mode_table_find(filename, first_dot);
+    if (modex != NULL) return modex->mode_fn();
+
+    if (head != NULL) return sniff_mode(head, len);
+
     return NULL;
 }
@@ -6,10 +6,11 @@
 struct mode {
     const char* name;
     State* colorizer_state;
+    Keywords* keywords;
     bool force_hard_tabs;
     bool color_capitals;
     bool strict_words;
 };
 
 
-Mode* get_language_mode (const char* filename);
+Mode* get_language_mode (const char* filename, const char* head, uint32_t len);
@@ -0,0 +1,369 @@
+#include "multifind.h"
+
+#include <stdatomic.h>
+
+#include "array.h"
+#include "ring.h"
+#include "rope.h"
+#include "threadpool.h"
+
+
+#define MULTI_FIND_ASCII 128
+
+struct multi_find_state {
+    // Next state for ASCII characters: trie edges, and once built, failures.
+    int32_t next[MULTI_FIND_ASCII];
+
+    // Trie edges for other characters, as (character, state) pairs.
+    uint32_t* wide;
+    uint32_t wide_size;
+
+    uint32_t fail;
+    // Longest pattern ending here (-1 if none), and the nearest state on
+    //  the failure chain that ends a pattern (0 if none).
+    int32_t pattern;
+    uint32_t dict;
+};
+
+
+//
+// Automaton.
+//
+
+static
+uint32_t state_new (MultiFind* finder) {
+    if (finder->size == finder->capacity) {
+        finder->capacity *= 2;
+        finder->states = realloc(finder->states, finder->capacity * sizeof(MultiFindState));
+    }
+
+    MultiFindState* state = &finder->states[finder->size];
+    memset(state->next, -1, sizeof state->next);
+    state->wide = NULL;
+    state->wide_size = 0;
+    state->fail = 0;
+    state->pattern = -1;
+    state->dict = 0;
+    return finder->size++;
+}
+
+static
+int32_t wide_get (MultiFindState* state, uint32_t ch) {
+    for (uint32_t k = 0; k < state->wide_size; k += 2)
+        if (state->wide[k] == ch) return state->wide[k + 1];
+    return -1;
+}
+
+static
+void wide_set (MultiFindState* state, uint32_t ch, uint32_t to) {
+    state->wide = realloc(state->wide, (state->wide_size + 2) * sizeof(uint32_t));
+    state->wide[state->wide_size++] = ch;
+    state->wide[state->wide_size++] = to;
+}
+
+static
+bool pattern_insert (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
+    MultiFind* finder = ((void**) data)[0];
+    uint32_t* s = ((void**) data)[1];
+
+    for (uint32_t x = 0; x < n; x++) {
+        uint32_t ch = chars[x];
+        int32_t t = ch < MULTI_FIND_ASCII ? finder->states[*s].next[ch] : wide_get(&finder->states[*s], ch);
+        if (t < 0) {
+            t = state_new(finder);
+            if (ch < MULTI_FIND_ASCII) finder->states[*s].next[ch] = t;
+            else wide_set(&finder->states[*s], ch, t);
+        }
+        *s = t;
+    }
+    return true;
+}
+
+// Transition for a non-ASCII character, through failure links.
+static inline
+uint32_t step_wide (MultiFind* finder, uint32_t s, uint32_t ch) {
+    while (true) {
+        int32_t t = wide_get(&finder->states[s], ch);
+        if (t >= 0) return t;
+        if (s == 0) return 0;
+        s = finder->states[s].fail;
+    }
+}
+
+MultiFind* multi_find_create (Array* patterns) {
+    MultiFind* finder = malloc(sizeof(MultiFind));
+    finder->capacity = 64;
+    finder->states = malloc(finder->capacity * sizeof(MultiFindState));
+    finder->size = 0;
+    finder->patterns = patterns->size;
+    finder->lengths = malloc(MAX(1, patterns->size) * sizeof(uint32_t));
+    finder->longest = 0;
+    state_new(finder);
+
+    // Trie.
+    for (int p = 0; p < patterns->size; p++) {
+        Rope* pattern = patterns->data[p];
+        uint32_t s = 0;
+        void* data[2] = { finder, &s };
+        rope_foreach_chunk(pattern, pattern_insert, data);
+
+        // Duplicates: the first one counts.
+        if (finder->states[s].pattern < 0) finder->states[s].pattern = p;
+        finder->lengths[p] = rope_len(pattern);
+        finder->longest = MAX(finder->longest, finder->lengths[p]);
+    }
+
+    // Failure links, breadth first, so a state's failure is done before it.
+    Ring* queue = ring_create();
+    for (uint32_t c = 0; c < MULTI_FIND_ASCII; c++) {
+        int32_t t = finder->states[0].next[c];
+        if (t < 0) finder->states[0].next[c] = 0;
+        else ring_push(queue, (void*) (uintptr_t) t);
+    }
+    for (uint32_t k = 0; k < finder->states[0].wide_size; k += 2)
+        ring_push(queue, (void*) (uintptr_t) finder->states[0].wide[k + 1]);
+
+    while (queue->size > 0) {
+        uint32_t s = (uintptr_t) ring_shift(queue);
+        MultiFindState* state = &finder->states[s];
+        MultiFindState* fail = &finder->states[state->fail];
+        state->dict = fail->pattern >= 0 ? state->fail : fail->dict;
+
+        for (uint32_t c = 0; c < MULTI_FIND_ASCII; c++) {
+            int32_t t = state->next[c];
+            if (t < 0) {
+                state->next[c] = fail->next[c];
+            } else {
+                finder->states[t].fail = fail->next[c];
+                ring_push(queue, (void*) (uintptr_t) t);
+            }
+        }
+        for (uint32_t k = 0; k < state->wide_size; k += 2) {
+            uint32_t t = state->wide[k + 1];
+            finder->states[t].fail = s == 0 ? 0 : step_wide(finder, state->fail, state->wide[k]);
+            ring_push(queue, (void*) (uintptr_t) t);
+        }
+    }
+    ring_destroy(queue);
+
+    return finder;
+}
+
+void multi_find_destroy (MultiFind* finder) {
+    for (uint32_t s = 0; s < finder->size; s++) free(finder->states[s].wide);
+    free(finder->states);
+    free(finder->lengths);
+    free(finder);
+}
+
+
+//
+// Scanning.
+//
+
+typedef struct {
+    MultiFind* finder;
+    uint32_t s;
+    // Matches must end after this.
+    uint32_t after;
+
+    multi_find_fn fn;
+    void* data;
+} Scan;
+
+static
+bool scan_chunk (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
+    Scan* scan = data;
+    MultiFind* finder = scan->finder;
+    MultiFindState* states = finder->states;
+    uint32_t s = scan->s;
+
+    for (uint32_t x = 0; x < n; x++) {
+        uint32_t ch = chars[x];
+        s = ch < MULTI_FIND_ASCII ? states[s].next[ch] : step_wide(finder, s, ch);
+
+        if (states[s].pattern < 0 && states[s].dict == 0) continue;
+        uint32_t end = i + x + 1;
+        if (end <= scan->after) continue;
+
+        for (uint32_t d = states[s].pattern >= 0 ? s : states[s].dict; d != 0; d = states[d].dict) {
+            uint32_t p = states[d].pattern;
+            if (!scan->fn(end - finder->lengths[p], end, p, scan->data)) return false;
+        }
+    }
+
+    scan->s = s;
+    return true;
+}
+
+void multi_find_scan (MultiFind* finder, Rope* text, uint32_t i, uint32_t j, multi_find_fn fn, void* data) {
+    // Start early enough to see the longest pattern ending just after i.
+    uint32_t from = i > finder->longest ? i - finder->longest : 0;
+    Scan scan = { .finder = finder, .after = i, .fn = fn, .data = data };
+    rope_foreach_chunk_substr(text, from, MIN(j, rope_len(text)), scan_chunk, &scan);
+}
+
+
+// -- Parallel -- //
+
+typedef struct {
+    MultiFindBatch* batch;
+    uint32_t k;
+    uint32_t i, j;
+
+    uint32_t* bounds;
+    uint32_t size;
+    uint32_t capacity;
+} FindTask;
+
+// Tasks of one multi_find_start call; the pool may be running others too.
+struct multi_find_batch {
+    MultiFind* finder;
+    Rope** texts;
+    uint32_t count;
+    // In text order, each text's pieces in order.
+    Array* tasks;
+
+    pthread_mutex_t lock;
+    // Tasks not yet done, in all and per text, signalling 'done' as a text
+    //  is finished.
+    uint32_t left;
+    uint32_t* text_left;
+    pthread_cond_t done;
+    // Read by tasks without the lock.
+    atomic_bool cancel;
+
+    // Next text, and its first task, for multi_find_next.
+    uint32_t next;
+    int next_task;
+};
+
+static
+bool task_match (uint32_t start, uint32_t end, uint32_t pattern, void* data) {
+    FindTask* task = data;
+    if (task->size == task->capacity) {
+        task->capacity = MAX(16, 2 * task->capacity);
+        task->bounds = realloc(task->bounds, 2 * task->capacity * sizeof(uint32_t));
+    }
+    task->bounds[2*task->size] = start;
+    task->bounds[2*task->size + 1] = end;
+    task->size++;
+    return !atomic_load(&task->batch->cancel);
+}
+
+static
+void task_run (void* data) {
+    FindTask* task = data;
+    MultiFindBatch* batch = task->batch;
+    if (!atomic_load(&batch->cancel)) multi_find_scan(batch->finder, batch->texts[task->k], task->i, task->j, task_match, task);
+
+    pthread_mutex_lock(&batch->lock);
+    batch->left--;
+    if (--batch->text_left[task->k] == 0) pthread_cond_broadcast(&batch->done);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static
+int bounds_compare (const void* a, const void* b) {
+    const uint32_t* x = a;
+    const uint32_t* y = b;
+    if (x[0] != y[0]) return x[0] < y[0] ? -1 : 1;
+    return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+MultiFindBatch* multi_find_start (MultiFind* finder, ThreadPool* pool, Rope** texts, uint32_t count) {
+    MultiFindBatch* batch = malloc(sizeof(MultiFindBatch));
+    batch->finder = finder;
+    batch->texts = malloc(MAX(1, count) * sizeof(Rope*));
+    batch->count = count;
+    batch->tasks = array_create();
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->done, NULL);
+    batch->text_left = calloc(MAX(1, count), sizeof(uint32_t));
+    atomic_init(&batch->cancel, false);
+    batch->next = 0;
+    batch->next_task = 0;
+
+    // Long texts are split so one big buffer still spreads over the threads.
+    for (uint32_t k = 0; k < count; k++) {
+        batch->texts[k] = rope_copy(texts[k]);
+        uint32_t len = rope_len(texts[k]);
+        for (uint32_t i = 0; i == 0 || i < len; i += MULTI_FIND_SPLIT) {
+            FindTask* task = calloc(1, sizeof(FindTask));
+            task->batch = batch;
+            task->k = k;
+            task->i = i;
+            task->j = MIN(len, i + MULTI_FIND_SPLIT);
+            array_add(batch->tasks, task);
+            batch->text_left[k]++;
+        }
+    }
+
+    // Counted in full first, so no text looks done while its pieces go out.
+    batch->left = batch->tasks->size;
+    for (int t = 0; t < batch->tasks->size; t++) thread_pool_submit(pool, task_run, batch->tasks->data[t]);
+    return batch;
+}
+
+bool multi_find_next (MultiFindBatch* batch, bool wait, uint32_t* k, uint32_t** bounds, uint32_t* size) {
+    if (batch->next == batch->count) return false;
+
+    pthread_mutex_lock(&batch->lock);
+    while (wait && batch->text_left[batch->next] > 0) pthread_cond_wait(&batch->done, &batch->lock);
+    bool ready = batch->text_left[batch->next] == 0;
+    pthread_mutex_unlock(&batch->lock);
+    if (!ready) return false;
+
+    // Join the text's pieces, in order.
+    int t = batch->next_task;
+    uint32_t total = 0;
+    for (int u = t; u < batch->tasks->size && ((FindTask*) batch->tasks->data[u])->k == batch->next; u++)
+        total += ((FindTask*) batch->tasks->data[u])->size;
+
+    *k = batch->next;
+    *bounds = malloc(MAX(1, 2 * total) * sizeof(uint32_t));
+    *size = 0;
+    for (; t < batch->tasks->size && ((FindTask*) batch->tasks->data[t])->k == batch->next; t++) {
+        FindTask* task = batch->tasks->data[t];
+        memcpy(*bounds + 2 * *size, task->bounds, 2 * task->size * sizeof(uint32_t));
+        *size += task->size;
+        free(task->bounds);
+        task->bounds = NULL;
+    }
+    qsort(*bounds, *size, 2 * sizeof(uint32_t), bounds_compare);
+
+    batch->next++;
+    batch->next_task = t;
+    return true;
+}
+
+bool multi_find_done (MultiFindBatch* batch) {
+    pthread_mutex_lock(&batch->lock);
+    bool done = batch->left == 0;
+    pthread_mutex_unlock(&batch->lock);
+    return done;
+}
+
+void multi_find_cancel (MultiFindBatch* batch) {
+    atomic_store(&batch->cancel, true);
+}
+
+void multi_find_batch_destroy (MultiFindBatch* batch) {
+    pthread_mutex_lock(&batch->lock);
+    while (batch->left > 0) pthread_cond_wait(&batch->done, &batch->lock);
+    pthread_mutex_unlock(&batch->lock);
+
+    for (int t = 0; t < batch->tasks->size; t++) {
+        FindTask* task = batch->tasks->data[t];
+        free(task->bounds);
+        free(task);
+    }
+    array_destroy(batch->tasks);
+    for (uint32_t k = 0; k < batch->count; k++) rope_destroy(batch->texts[k]);
+    free(batch->texts);
+    free(batch->text_left);
+    multi_find_destroy(batch->finder);
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->done);
+    free(batch);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "main.h"
+
+//
+// Multi-Pattern Find.
+//  -> An Aho-Corasick automaton over several literal patterns: one pass over
+//      the text finds every occurrence of every pattern, however many there are.
+//  -> ASCII transitions are a full table per state; others follow failure
+//      links through sparse edges.
+//  -> Searching only reads the automaton, so one can be shared by threads.
+//
+
+typedef struct multi_find_state MultiFindState;
+
+struct multi_find {
+    MultiFindState* states;
+    uint32_t size;
+    uint32_t capacity;
+
+    uint32_t patterns;
+    uint32_t* lengths;
+    uint32_t longest;
+};
+
+// Called for each match; return false to stop.
+typedef bool (*multi_find_fn) (uint32_t start, uint32_t end, uint32_t pattern, void* data);
+
+
+// Patterns are non-empty ropes.
+MultiFind* multi_find_create (Array* patterns);
+
+void multi_find_destroy (MultiFind* finder);
+
+
+// Matches ending in (i, j] of the text, in order of their ends.
+void multi_find_scan (MultiFind* finder, Rope* text, uint32_t i, uint32_t j, multi_find_fn fn, void* data);
+
+// Start finding matches in each of 'count' texts, in parallel on 'pool'.
+//  -> Takes the finder, and its own rope_copy snapshots of the texts.
+MultiFindBatch* multi_find_start (MultiFind* finder, ThreadPool* pool, Rope** texts, uint32_t count);
+
+// Matches of the next text, in text order, once its search is done; with
+//  'wait', blocks until it is. Returns false if it isn't, or none is left.
+//  -> Sets 'k' to the text, and 'bounds' to a malloc'd array of 'size'
+//      [start, end) pairs, sorted by start.
+bool multi_find_next (MultiFindBatch* batch, bool wait, uint32_t* k, uint32_t** bounds, uint32_t* size);
+
+// Whether every task has finished.
+bool multi_find_done (MultiFindBatch* batch);
+
+// Stop collecting matches; tasks still queued return at once.
+void multi_find_cancel (MultiFindBatch* batch);
+
+// Waits for every task to finish.
+void multi_find_batch_destroy (MultiFindBatch* batch);
@@ -0,0 +1,1158 @@
+#include "regex.h"
+
+#include "array.h"
+#include "rope.h"
+
+
+//
+// Program.
+//  -> Thompson NFA: consuming instructions (CHAR, ANY, CLASS) step over one
+//      character; the rest are followed without consuming.
+//  -> SPLIT prefers x over y, which is how priority (greedy or lazy, left
+//      alternative first) is expressed.
+//
+
+enum {
+    OP_CHAR,
+    OP_ANY,
+    OP_CLASS,
+    OP_SPLIT,
+    OP_JMP,
+    OP_SAVE,
+    OP_BOL,
+    OP_EOL,
+    OP_MATCH,
+};
+
+typedef struct {
+    uint32_t op;
+    uint32_t x;
+    uint32_t y;
+} Inst;
+
+typedef struct {
+    uint32_t* ranges;
+    uint32_t size;
+    bool negate;
+} Class;
+
+typedef struct {
+    Inst* insts;
+    uint32_t size;
+    uint32_t capacity;
+} Prog;
+
+// End of text, as a character: it ends a line but is never consumed.
+#define CH_EOT UINT32_MAX
+
+#define REGEX_MAX_INSTS (1 << 16)
+#define REGEX_MAX_REPEAT 1000
+
+
+//
+// Syntax Tree.
+//
+
+enum {
+    AST_EMPTY,
+    AST_CHAR,
+    AST_ANY,
+    AST_CLASS,
+    AST_BOL,
+    AST_EOL,
+    AST_CAT,
+    AST_ALT,
+    AST_GROUP,
+    AST_REPEAT,
+};
+
+typedef struct ast Ast;
+struct ast {
+    uint32_t type;
+    uint32_t c;
+    Ast* a;
+    Ast* b;
+
+    // Group index (0 for non-capturing), or repeat bounds (max -1: unbounded).
+    int32_t group;
+    int32_t min, max;
+    bool greedy;
+};
+
+typedef struct {
+    const uint32_t* p;
+    uint32_t len;
+    uint32_t i;
+
+    Array* nodes;
+    Array* classes;
+    uint32_t groups;
+
+    const char* error;
+} Parser;
+
+static
+Ast* ast_new (Parser* ps, uint32_t type) {
+    Ast* node = calloc(1, sizeof(Ast));
+    node->type = type;
+    array_add(ps->nodes, node);
+    return node;
+}
+
+static
+Ast* ast_pair (Parser* ps, uint32_t type, Ast* a, Ast* b) {
+    Ast* node = ast_new(ps, type);
+    node->a = a;
+    node->b = b;
+    return node;
+}
+
+
+// -- Classes -- //
+
+static
+Class* class_new (Parser* ps) {
+    Class* cls = calloc(1, sizeof(Class));
+    array_add(ps->classes, cls);
+    return cls;
+}
+
+static
+void class_add (Class* cls, uint32_t lo, uint32_t hi) {
+    cls->ranges = realloc(cls->ranges, (cls->size + 2) * sizeof(uint32_t));
+    cls->ranges[cls->size++] = lo;
+    cls->ranges[cls->size++] = hi;
+}
+
+static
+bool class_has (Class* cls, uint32_t ch) {
+    bool in = false;
+    for (uint32_t i = 0; i < cls->size && !in; i += 2)
+        in = ch >= cls->ranges[i] && ch <= cls->ranges[i+1];
+    return in != cls->negate;
+}
+
+// Ranges of \d, \w or \s (negated by their capitals, via 'negate').
+static
+bool class_add_shorthand (Class* cls, uint32_t c, bool* negate) {
+    switch (c) {
+        case 'd': case 'D':
+            class_add(cls, '0', '9');
+            break;
+        case 'w': case 'W':
+            class_add(cls, '0', '9');
+            class_add(cls, 'A', 'Z');
+            class_add(cls, 'a', 'z');
+            class_add(cls, '_', '_');
+            break;
+        case 's': case 'S':
+            class_add(cls, ' ', ' ');
+            class_add(cls, '\t', '\r');
+            break;
+        default:
+            return false;
+    }
+    *negate = c >= 'A' && c <= 'Z';
+    return true;
+}
+
+static
+uint32_t unescape (uint32_t c) {
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        default: return c;
+    }
+}
+
+
+// -- Parser -- //
+
+static Ast* parse_alt (Parser* ps);
+
+static inline
+bool more (Parser* ps) {
+    return ps->error == NULL && ps->i < ps->len;
+}
+
+static inline
+uint32_t peek (Parser* ps) {
+    return ps->i < ps->len ? ps->p[ps->i] : 0;
+}
+
+static
+Ast* parse_class (Parser* ps) {
+    Class* cls = class_new(ps);
+    Ast* node = ast_new(ps, AST_CLASS);
+    node->c = ps->classes->size - 1;
+
+    if (peek(ps) == '^') {
+        cls->negate = true;
+        ps->i++;
+    }
+
+    bool first = true;
+    while (more(ps) && (peek(ps) != ']' || first)) {
+        first = false;
+        uint32_t lo = ps->p[ps->i++];
+
+        if (lo == '\\') {
+            if (!more(ps)) break;
+            uint32_t c = ps->p[ps->i++];
+
+            // Shorthands inside a class: only the positive forms.
+            bool negate;
+            Class tmp = {};
+            if (class_add_shorthand(&tmp, c, &negate)) {
+                if (negate) ps->error = "Negated shorthand in a class";
+                for (uint32_t r = 0; r < tmp.size; r += 2) class_add(cls, tmp.ranges[r], tmp.ranges[r+1]);
+                free(tmp.ranges);
+                continue;
+            }
+            lo = unescape(c);
+        }
+
+        uint32_t hi = lo;
+        if (peek(ps) == '-' && ps->i + 1 < ps->len && ps->p[ps->i+1] != ']') {
+            ps->i++;
+            hi = ps->p[ps->i++];
+            if (hi == '\\' && ps->i < ps->len) hi = unescape(ps->p[ps->i++]);
+            if (hi < lo) ps->error = "Invalid class range";
+        }
+        class_add(cls, lo, hi);
+    }
+
+    if (peek(ps) != ']') {
+        if (ps->error == NULL) ps->error = "Missing ]";
+        return node;
+    }
+    ps->i++;
+    return node;
+}
+
+static
+Ast* parse_atom (Parser* ps) {
+    uint32_t c = ps->p[ps->i++];
+
+    switch (c) {
+        case '(': {
+            Ast* node = ast_new(ps, AST_GROUP);
+            if (peek(ps) == '?' && ps->i + 1 < ps->len && ps->p[ps->i+1] == ':') {
+                ps->i += 2;
+            } else {
+                node->group = ps->groups++;
+            }
+
+            node->a = parse_alt(ps);
+            if (peek(ps) != ')') {
+                if (ps->error == NULL) ps->error = "Missing )";
+            } else {
+                ps->i++;
+            }
+            return node;
+        }
+        case '[':
+            return parse_class(ps);
+        case '.':
+            return ast_new(ps, AST_ANY);
+        case '^':
+            return ast_new(ps, AST_BOL);
+        case '$':
+            return ast_new(ps, AST_EOL);
+        case '*': case '+': case '?':
+            ps->error = "Nothing to repeat";
+            return ast_new(ps, AST_EMPTY);
+        case '\\': {
+            if (ps->i >= ps->len) {
+                ps->error = "Trailing \\";
+                return ast_new(ps, AST_EMPTY);
+            }
+            uint32_t e = ps->p[ps->i++];
+
+            Class tmp = {};
+            bool negate;
+            if (class_add_shorthand(&tmp, e, &negate)) {
+                Class* cls = class_new(ps);
+                *cls = tmp;
+                cls->negate = negate;
+                Ast* node = ast_new(ps, AST_CLASS);
+                node->c = ps->classes->size - 1;
+                return node;
+            }
+
+            Ast* node = ast_new(ps, AST_CHAR);
+            node->c = unescape(e);
+            return node;
+        }
+        default: {
+            Ast* node = ast_new(ps, AST_CHAR);
+            node->c = c;
+            return node;
+        }
+    }
+}
+
+static
+bool parse_int (Parser* ps, int32_t* out) {
+    uint32_t start = ps->i;
+    int32_t n = 0;
+    while (ps->i < ps->len && peek(ps) >= '0' && peek(ps) <= '9' && n <= REGEX_MAX_REPEAT)
+        n = n * 10 + (ps->p[ps->i++] - '0');
+    *out = n;
+    return ps->i > start;
+}
+
+// Bounds of a {m}, {m,} or {m,n} repeat; false (consuming nothing) if not one.
+static
+bool parse_bounds (Parser* ps, int32_t* min, int32_t* max) {
+    uint32_t start = ps->i;
+    ps->i++;
+
+    if (!parse_int(ps, min)) {
+        ps->i = start;
+        return false;
+    }
+    *max = *min;
+    if (peek(ps) == ',') {
+        ps->i++;
+        if (!parse_int(ps, max)) *max = -1;
+    }
+    if (peek(ps) != '}') {
+        ps->i = start;
+        return false;
+    }
+    ps->i++;
+
+    if (*min > REGEX_MAX_REPEAT || *max > REGEX_MAX_REPEAT) ps->error = "Repeat count too large";
+    if (*max >= 0 && *max < *min) ps->error = "Invalid repeat bounds";
+    return true;
+}
+
+static
+Ast* parse_repeat (Parser* ps) {
+    Ast* node = parse_atom(ps);
+
+    while (more(ps)) {
+        int32_t min, max;
+        uint32_t c = peek(ps);
+        if (c == '*') {
+            min = 0, max = -1;
+            ps->i++;
+        } else if (c == '+') {
+            min = 1, max = -1;
+            ps->i++;
+        } else if (c == '?') {
+            min = 0, max = 1;
+            ps->i++;
+        } else if (c == '{' && parse_bounds(ps, &min, &max)) {
+        } else {
+            break;
+        }
+
+        if (node->type == AST_BOL || node->type == AST_EOL) ps->error = "Nothing to repeat";
+
+        Ast* rep = ast_new(ps, AST_REPEAT);
+        rep->a = node;
+        rep->min = min;
+        rep->max = max;
+        rep->greedy = true;
+        if (peek(ps) == '?') {
+            rep->greedy = false;
+            ps->i++;
+        }
+        node = rep;
+    }
+
+    return node;
+}
+
+static
+Ast* parse_cat (Parser* ps) {
+    Ast* node = NULL;
+    while (more(ps) && peek(ps) != '|' && peek(ps) != ')') {
+        Ast* next = parse_repeat(ps);
+        node = node == NULL ? next : ast_pair(ps, AST_CAT, node, next);
+    }
+    return node == NULL ? ast_new(ps, AST_EMPTY) : node;
+}
+
+static
+Ast* parse_alt (Parser* ps) {
+    Ast* node = parse_cat(ps);
+    while (more(ps) && peek(ps) == '|') {
+        ps->i++;
+        node = ast_pair(ps, AST_ALT, node, parse_cat(ps));
+    }
+    return node;
+}
+
+
+// -- Compiler -- //
+
+static
+uint32_t emit (Prog* prog, uint32_t op, uint32_t x, uint32_t y) {
+    if (prog->size == prog->capacity) {
+        prog->capacity = MAX(16, prog->capacity * 2);
+        prog->insts = realloc(prog->insts, prog->capacity * sizeof(Inst));
+    }
+    prog->insts[prog->size] = (Inst) { op, x, y };
+    return prog->size++;
+}
+
+// Emit 'node'; reversed programs match the reversed language (and have no groups).
+static
+bool compile (Prog* prog, Ast* node, bool reverse) {
+    if (prog->size > REGEX_MAX_INSTS) return false;
+
+    switch (node->type) {
+        case AST_EMPTY:
+            break;
+        case AST_CHAR:
+            emit(prog, OP_CHAR, node->c, 0);
+            break;
+        case AST_ANY:
+            emit(prog, OP_ANY, 0, 0);
+            break;
+        case AST_CLASS:
+            emit(prog, OP_CLASS, node->c, 0);
+            break;
+        case AST_BOL:
+            emit(prog, reverse ? OP_EOL : OP_BOL, 0, 0);
+            break;
+        case AST_EOL:
+            emit(prog, reverse ? OP_BOL : OP_EOL, 0, 0);
+            break;
+        case AST_CAT:
+            if (!compile(prog, reverse ? node->b : node->a, reverse)) return false;
+            if (!compile(prog, reverse ? node->a : node->b, reverse)) return false;
+            break;
+        case AST_ALT: {
+            uint32_t split = emit(prog, OP_SPLIT, 0, 0);
+            prog->insts[split].x = prog->size;
+            if (!compile(prog, node->a, reverse)) return false;
+            uint32_t jmp = emit(prog, OP_JMP, 0, 0);
+            prog->insts[split].y = prog->size;
+            if (!compile(prog, node->b, reverse)) return false;
+            prog->insts[jmp].x = prog->size;
+            break;
+        }
+        case AST_GROUP:
+            if (node->group > 0 && !reverse) emit(prog, OP_SAVE, 2 * node->group, 0);
+            if (!compile(prog, node->a, reverse)) return false;
+            if (node->group > 0 && !reverse) emit(prog, OP_SAVE, 2 * node->group + 1, 0);
+            break;
+        case AST_REPEAT: {
+            for (int i = 0; i < node->min; i++)
+                if (!compile(prog, node->a, reverse)) return false;
+
+            if (node->max < 0) {
+                // Loop: split to the body or out, then back.
+                uint32_t split = emit(prog, OP_SPLIT, 0, 0);
+                uint32_t body = prog->size;
+                if (!compile(prog, node->a, reverse)) return false;
+                emit(prog, OP_JMP, split, 0);
+                uint32_t out = prog->size;
+                prog->insts[split].x = node->greedy ? body : out;
+                prog->insts[split].y = node->greedy ? out : body;
+            } else {
+                // Optional copies, each skipping to the end.
+                Array* splits = array_create();
+                for (int i = node->min; i < node->max; i++) {
+                    uint32_t split = emit(prog, OP_SPLIT, 0, 0);
+                    array_add(splits, (void*) (uintptr_t) split);
+                    if (!compile(prog, node->a, reverse)) {
+                        array_destroy(splits);
+                        return false;
+                    }
+                }
+                for (int i = 0; i < splits->size; i++) {
+                    uint32_t split = (uintptr_t) splits->data[i];
+                    prog->insts[split].x = node->greedy ? split + 1 : prog->size;
+                    prog->insts[split].y = node->greedy ? prog->size : split + 1;
+                }
+                array_destroy(splits);
+            }
+            break;
+        }
+    }
+
+    return prog->size <= REGEX_MAX_INSTS;
+}
+
+
+//
+// Lazy DFA.
+//  -> A state is an ordered list of NFA threads, highest priority first,
+//      taken before following the non-consuming instructions: those depend
+//      on the next character (for $), which is only known on the step.
+//  -> With leftmost-first matching, threads after a MATCH are cut, and an
+//      unanchored search stops starting new threads once something matched.
+//  -> Transitions are cached per state for ASCII; others are computed each
+//      time. A full cache is dropped and rebuilt as the search goes on.
+//
+
+#define DFA_ASCII 128
+
+enum {
+    DFA_BOL = 1,  // Previous character ended a line.
+    DFA_STOP = 2, // Matched: no more starting threads.
+};
+
+typedef struct {
+    uint32_t* pcs;
+    uint32_t size;
+    uint32_t flags;
+    bool dead;
+
+    // (next state << 1) | matched-before-the-character, or -1.
+    int32_t next[DFA_ASCII];
+    int8_t matched_eot;
+} DfaState;
+
+typedef struct {
+    Prog* prog;
+    Array* classes;
+    bool anchored;
+    bool longest;
+
+    Array* states;
+    int32_t* table;
+    uint32_t table_capacity;
+
+    // Scratch.
+    uint32_t* marks;
+    uint32_t mark;
+    uint32_t* stack;
+    uint32_t* list;
+    uint32_t* raw;
+} Dfa;
+
+static
+Dfa* dfa_create (Prog* prog, Array* classes, bool anchored, bool longest) {
+    Dfa* dfa = malloc(sizeof(Dfa));
+    dfa->prog = prog;
+    dfa->classes = classes;
+    dfa->anchored = anchored;
+    dfa->longest = longest;
+    dfa->states = array_create();
+    dfa->table_capacity = 64;
+    dfa->table = malloc(dfa->table_capacity * sizeof(int32_t));
+    memset(dfa->table, -1, dfa->table_capacity * sizeof(int32_t));
+
+    // Each list holds a pc at most once, plus a starting thread.
+    uint32_t n = prog->size + 1;
+    dfa->marks = calloc(n, sizeof(uint32_t));
+    dfa->mark = 0;
+    dfa->stack = malloc(n * sizeof(uint32_t));
+    dfa->list = malloc(n * sizeof(uint32_t));
+    dfa->raw = malloc(n * sizeof(uint32_t));
+    return dfa;
+}
+
+static
+void dfa_clear (Dfa* dfa) {
+    for (int i = 0; i < dfa->states->size; i++) {
+        DfaState* state = dfa->states->data[i];
+        free(state->pcs);
+        free(state);
+    }
+    array_clear(dfa->states);
+    memset(dfa->table, -1, dfa->table_capacity * sizeof(int32_t));
+}
+
+static
+void dfa_destroy (Dfa* dfa) {
+    dfa_clear(dfa);
+    array_destroy(dfa->states);
+    free(dfa->table);
+    free(dfa->marks);
+    free(dfa->stack);
+    free(dfa->list);
+    free(dfa->raw);
+    free(dfa);
+}
+
+static
+uint32_t dfa_hash (uint32_t* pcs, uint32_t size, uint32_t flags) {
+    uint32_t h = 2166136261u ^ flags;
+    for (uint32_t i = 0; i < size; i++) h = (h ^ pcs[i]) * 16777619u;
+    return h;
+}
+
+static
+int32_t dfa_find (Dfa* dfa, uint32_t* pcs, uint32_t size, uint32_t flags, uint32_t* slot) {
+    uint32_t mask = dfa->table_capacity - 1;
+    uint32_t h = dfa_hash(pcs, size, flags) & mask;
+    for (;; h = (h + 1) & mask) {
+        int32_t s = dfa->table[h];
+        *slot = h;
+        if (s < 0) return -1;
+
+        DfaState* state = dfa->states->data[s];
+        if (state->size == size && state->flags == flags && memcmp(state->pcs, pcs, size * sizeof(uint32_t)) == 0) return s;
+    }
+}
+
+// State for a thread list; sets *flushed if the cache had to be dropped first.
+static
+int32_t dfa_intern (Dfa* dfa, uint32_t* pcs, uint32_t size, uint32_t flags, bool* flushed) {
+    uint32_t slot;
+    int32_t s = dfa_find(dfa, pcs, size, flags, &slot);
+    if (s >= 0) return s;
+
+    if (dfa->states->size >= REGEX_DFA_STATES) {
+        dfa_clear(dfa);
+        *flushed = true;
+        dfa_find(dfa, pcs, size, flags, &slot);
+    }
+
+    DfaState* state = malloc(sizeof(DfaState));
+    state->pcs = malloc(MAX(1, size) * sizeof(uint32_t));
+    memcpy(state->pcs, pcs, size * sizeof(uint32_t));
+    state->size = size;
+    state->flags = flags;
+    state->dead = size == 0 && (dfa->anchored || (flags & DFA_STOP));
+    memset(state->next, -1, sizeof state->next);
+    state->matched_eot = -1;
+
+    s = dfa->states->size;
+    array_add(dfa->states, state);
+    dfa->table[slot] = s;
+
+    // Keep the table at most half full.
+    if (2 * dfa->states->size > dfa->table_capacity) {
+        dfa->table_capacity *= 2;
+        dfa->table = realloc(dfa->table, dfa->table_capacity * sizeof(int32_t));
+        memset(dfa->table, -1, dfa->table_capacity * sizeof(int32_t));
+        for (int i = 0; i < dfa->states->size; i++) {
+            DfaState* st = dfa->states->data[i];
+            dfa_find(dfa, st->pcs, st->size, st->flags, &slot);
+            dfa->table[slot] = i;
+        }
+    }
+
+    return s;
+}
+
+static
+int32_t dfa_start (Dfa* dfa, bool bol) {
+    bool flushed = false;
+    uint32_t start = 0;
+    return dfa_intern(dfa, &start, dfa->anchored ? 1 : 0, bol ? DFA_BOL : 0, &flushed);
+}
+
+static inline
+bool inst_consumes (Inst* inst, Array* classes, uint32_t ch) {
+    switch (inst->op) {
+        case OP_CHAR: return ch == inst->x;
+        case OP_ANY: return ch != '\n' && ch != CH_EOT;
+        case OP_CLASS: return ch != CH_EOT && class_has(classes->data[inst->x], ch);
+        default: return false;
+    }
+}
+
+// Follow non-consuming instructions from 'raw', in priority order, into
+//  dfa->list. Returns the list's size; *matched if it reached a MATCH.
+static
+uint32_t dfa_closure (Dfa* dfa, uint32_t* raw, uint32_t nraw, bool bol, bool eol, bool* matched) {
+    Inst* insts = dfa->prog->insts;
+    uint32_t n = 0;
+    *matched = false;
+    dfa->mark++;
+
+    for (uint32_t r = 0; r < nraw; r++) {
+        uint32_t top = 0;
+        dfa->stack[top++] = raw[r];
+
+        while (top > 0) {
+            uint32_t pc = dfa->stack[--top];
+            if (dfa->marks[pc] == dfa->mark) continue;
+            dfa->marks[pc] = dfa->mark;
+
+            Inst* inst = &insts[pc];
+            switch (inst->op) {
+                case OP_JMP:
+                    dfa->stack[top++] = inst->x;
+                    break;
+                case OP_SPLIT:
+                    dfa->stack[top++] = inst->y;
+                    dfa->stack[top++] = inst->x;
+                    break;
+                case OP_SAVE:
+                    dfa->stack[top++] = pc + 1;
+                    break;
+                case OP_BOL:
+                    if (bol) dfa->stack[top++] = pc + 1;
+                    break;
+                case OP_EOL:
+                    if (eol) dfa->stack[top++] = pc + 1;
+                    break;
+                case OP_MATCH:
+                    *matched = true;
+                    // Leftmost-first: lower priority threads lose.
+                    if (!dfa->longest) return n;
+                    break;
+                default:
+                    dfa->list[n++] = pc;
+                    break;
+            }
+        }
+    }
+
+    return n;
+}
+
+// Threads of a state at the next step, with a new starting thread last.
+static
+uint32_t dfa_raw (Dfa* dfa, DfaState* state) {
+    memcpy(dfa->raw, state->pcs, state->size * sizeof(uint32_t));
+    uint32_t n = state->size;
+    if (!dfa->anchored && !(state->flags & DFA_STOP)) dfa->raw[n++] = 0;
+    return n;
+}
+
+// Whether a match ends before 'ch' (CH_EOT at the end of the text).
+static
+bool dfa_matches (Dfa* dfa, int32_t s, uint32_t ch) {
+    DfaState* state = dfa->states->data[s];
+    if (ch == CH_EOT && state->matched_eot >= 0) return state->matched_eot;
+
+    bool matched;
+    uint32_t nraw = dfa_raw(dfa, state);
+    dfa_closure(dfa, dfa->raw, nraw, state->flags & DFA_BOL, ch == '\n' || ch == CH_EOT, &matched);
+    if (ch == CH_EOT) state->matched_eot = matched;
+    return matched;
+}
+
+// State after 'ch'; *matched if a match ends before it.
+static
+int32_t dfa_step (Dfa* dfa, int32_t s, uint32_t ch, bool* matched) {
+    DfaState* state = dfa->states->data[s];
+    if (ch < DFA_ASCII && state->next[ch] >= 0) {
+        *matched = state->next[ch] & 1;
+        return state->next[ch] >> 1;
+    }
+
+    uint32_t nraw = dfa_raw(dfa, state);
+    uint32_t n = dfa_closure(dfa, dfa->raw, nraw, state->flags & DFA_BOL, ch == '\n', matched);
+
+    // Consume: threads stay in priority order, each pc once.
+    Inst* insts = dfa->prog->insts;
+    uint32_t size = 0;
+    dfa->mark++;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t pc = dfa->list[i];
+        if (inst_consumes(&insts[pc], dfa->classes, ch) && dfa->marks[pc + 1] != dfa->mark) {
+            dfa->marks[pc + 1] = dfa->mark;
+            dfa->raw[size++] = pc + 1;
+        }
+    }
+
+    uint32_t flags = 0;
+    if (ch == '\n') flags |= DFA_BOL;
+    if ((state->flags & DFA_STOP) || (*matched && !dfa->longest)) flags |= DFA_STOP;
+
+    bool flushed = false;
+    int32_t next = dfa_intern(dfa, dfa->raw, size, flags, &flushed);
+    if (!flushed && ch < DFA_ASCII) state->next[ch] = (next << 1) | *matched;
+    return next;
+}
+
+
+//
+// Regex Object.
+//
+
+struct regex {
+    Array* classes;
+    uint32_t groups;
+
+    Prog forward;
+    Prog reverse;
+
+    // Built on first use.
+    Dfa* dfa_find;
+    Dfa* dfa_start;
+    Dfa* dfa_find_reverse;
+    Dfa* dfa_end;
+};
+
+Regex* regex_create (const uint32_t* pattern, uint32_t len, const char** error) {
+    Parser ps = {
+        .p = pattern,
+        .len = len,
+        .nodes = array_create(),
+        .classes = array_create(),
+        .groups = 1,
+    };
+
+    Ast* root = parse_alt(&ps);
+    if (ps.error == NULL && ps.i < len) ps.error = "Unmatched )";
+
+    Regex* regex = calloc(1, sizeof(Regex));
+    regex->classes = ps.classes;
+    regex->groups = ps.groups;
+
+    if (ps.error == NULL) {
+        bool ok = compile(&regex->forward, root, false);
+        emit(&regex->forward, OP_MATCH, 0, 0);
+        ok = ok && compile(&regex->reverse, root, true);
+        emit(&regex->reverse, OP_MATCH, 0, 0);
+        if (!ok) ps.error = "Pattern too large";
+    }
+
+    for (int i = 0; i < ps.nodes->size; i++) free(ps.nodes->data[i]);
+    array_destroy(ps.nodes);
+
+    if (ps.error != NULL) {
+        if (error != NULL) *error = ps.error;
+        regex_destroy(regex);
+        return NULL;
+    }
+    return regex;
+}
+
+void regex_destroy (Regex* regex) {
+    if (regex->dfa_find != NULL) dfa_destroy(regex->dfa_find);
+    if (regex->dfa_start != NULL) dfa_destroy(regex->dfa_start);
+    if (regex->dfa_find_reverse != NULL) dfa_destroy(regex->dfa_find_reverse);
+    if (regex->dfa_end != NULL) dfa_destroy(regex->dfa_end);
+
+    for (int i = 0; i < regex->classes->size; i++) {
+        Class* cls = regex->classes->data[i];
+        free(cls->ranges);
+        free(cls);
+    }
+    array_destroy(regex->classes);
+    free(regex->forward.insts);
+    free(regex->reverse.insts);
+    free(regex);
+}
+
+uint32_t regex_groups (Regex* regex) {
+    return regex->groups;
+}
+
+
+//
+// Searching.
+//
+
+typedef struct {
+    Dfa* dfa;
+    int32_t s;
+    int64_t last;
+    bool done;
+} Scan;
+
+// Forward: note where matches end; stop once no match can continue.
+static
+bool scan_forward (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
+    Scan* scan = data;
+    for (uint32_t x = 0; x < n; x++) {
+        bool matched;
+        scan->s = dfa_step(scan->dfa, scan->s, chars[x], &matched);
+        if (matched) scan->last = i + x;
+        if (((DfaState*) scan->dfa->states->data[scan->s])->dead) {
+            scan->done = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Backward: positions are between characters, so a match is noted after x.
+static
+bool scan_backward (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
+    Scan* scan = data;
+    for (int64_t x = (int64_t) n - 1; x >= 0; x--) {
+        bool matched;
+        scan->s = dfa_step(scan->dfa, scan->s, chars[x], &matched);
+        if (matched) scan->last = i + x + 1;
+        if (((DfaState*) scan->dfa->states->data[scan->s])->dead) {
+            scan->done = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline
+uint32_t char_at (Rope* text, int64_t i) {
+    return i < 0 || i >= rope_len(text) ? CH_EOT : rope_get_char(text, i);
+}
+
+// Last match end of a forward scan over [from, to).
+static
+int64_t scan_to (Dfa* dfa, Rope* text, uint32_t from, uint32_t to) {
+    Scan scan = { .dfa = dfa, .last = -1 };
+    scan.s = dfa_start(dfa, from == 0 || char_at(text, from - 1) == '\n');
+
+    rope_foreach_chunk_substr(text, from, to, scan_forward, &scan);
+    if (!scan.done && dfa_matches(dfa, scan.s, char_at(text, to))) scan.last = to;
+    return scan.last;
+}
+
+// Last match start of a backward scan over [from, to).
+static
+int64_t scan_back (Dfa* dfa, Rope* text, uint32_t from, uint32_t to) {
+    Scan scan = { .dfa = dfa, .last = -1 };
+    scan.s = dfa_start(dfa, char_at(text, to) == '\n' || to == rope_len(text));
+
+    rope_foreach_chunk_reverse_substr(text, from, to, scan_backward, &scan);
+    if (!scan.done && dfa_matches(dfa, scan.s, char_at(text, (int64_t) from - 1))) scan.last = from;
+    return scan.last;
+}
+
+bool regex_search (Regex* regex, Rope* text, uint32_t from, uint32_t* start, uint32_t* end) {
+    if (regex->dfa_find == NULL) regex->dfa_find = dfa_create(&regex->forward, regex->classes, false, false);
+    if (regex->dfa_start == NULL) regex->dfa_start = dfa_create(&regex->reverse, regex->classes, true, true);
+
+    uint32_t len = rope_len(text);
+    if (from > len) return false;
+
+    // End of the leftmost match, then back to its start.
+    int64_t e = scan_to(regex->dfa_find, text, from, len);
+    if (e < 0) return false;
+
+    int64_t s = scan_back(regex->dfa_start, text, from, e);
+    *start = s < 0 ? e : s;
+    *end = e;
+    return true;
+}
+
+bool regex_search_reverse (Regex* regex, Rope* text, uint32_t before, uint32_t* start, uint32_t* end) {
+    if (regex->dfa_find_reverse == NULL) regex->dfa_find_reverse = dfa_create(&regex->reverse, regex->classes, false, false);
+    if (regex->dfa_end == NULL) regex->dfa_end = dfa_create(&regex->forward, regex->classes, true, false);
+
+    before = MIN(before, rope_len(text));
+
+    // Start of the match ending nearest 'before', then forward to its end.
+    int64_t s = scan_back(regex->dfa_find_reverse, text, 0, before);
+    if (s < 0) return false;
+
+    int64_t e = scan_to(regex->dfa_end, text, s, before);
+    if (e < 0) return false;
+
+    *start = s;
+    *end = e;
+    return true;
+}
+
+
+//
+// Pike VM.
+//  -> Threads carry group positions; used only for a match already found.
+//
+
+typedef struct {
+    Regex* regex;
+    Prog* prog;
+    uint32_t slots;
+
+    // Threads before following non-consuming instructions, and after.
+    uint32_t* raw;
+    uint32_t* raw_caps;
+    uint32_t nraw;
+    uint32_t* list;
+    uint32_t* list_caps;
+    uint32_t nlist;
+
+    uint32_t* marks;
+    uint32_t mark;
+    uint32_t* stack;
+    uint32_t* caps;
+
+    bool bol;
+    uint32_t* groups;
+    bool matched;
+} Pike;
+
+// Frames: explore a pc, or restore a group slot on the way back.
+#define PIKE_RESTORE 0x80000000u
+
+static
+void pike_closure (Pike* vm, uint32_t pos, bool eol) {
+    Inst* insts = vm->prog->insts;
+    vm->nlist = 0;
+    vm->mark++;
+
+    for (uint32_t r = 0; r < vm->nraw; r++) {
+        memcpy(vm->caps, vm->raw_caps + r * vm->slots, vm->slots * sizeof(uint32_t));
+
+        uint32_t top = 0;
+        vm->stack[top++] = vm->raw[r];
+        while (top > 0) {
+            uint32_t frame = vm->stack[--top];
+            if (frame & PIKE_RESTORE) {
+                uint32_t slot = frame & ~PIKE_RESTORE;
+                vm->caps[slot] = vm->stack[--top];
+                continue;
+            }
+
+            uint32_t pc = frame;
+            if (vm->marks[pc] == vm->mark) continue;
+            vm->marks[pc] = vm->mark;
+
+            Inst* inst = &insts[pc];
+            switch (inst->op) {
+                case OP_JMP:
+                    vm->stack[top++] = inst->x;
+                    break;
+                case OP_SPLIT:
+                    vm->stack[top++] = inst->y;
+                    vm->stack[top++] = inst->x;
+                    break;
+                case OP_SAVE:
+                    vm->stack[top++] = vm->caps[inst->x];
+                    vm->stack[top++] = inst->x | PIKE_RESTORE;
+                    vm->caps[inst->x] = pos;
+                    vm->stack[top++] = pc + 1;
+                    break;
+                case OP_BOL:
+                    if (vm->bol) vm->stack[top++] = pc + 1;
+                    break;
+                case OP_EOL:
+                    if (eol) vm->stack[top++] = pc + 1;
+                    break;
+                case OP_MATCH:
+                    memcpy(vm->groups, vm->caps, vm->slots * sizeof(uint32_t));
+                    vm->groups[1] = pos;
+                    vm->matched = true;
+                    return;
+                default:
+                    vm->list[vm->nlist] = pc;
+                    memcpy(vm->list_caps + vm->nlist * vm->slots, vm->caps, vm->slots * sizeof(uint32_t));
+                    vm->nlist++;
+                    break;
+            }
+        }
+    }
+}
+
+static
+bool pike_step (Pike* vm, uint32_t pos, uint32_t ch) {
+    pike_closure(vm, pos, ch == '\n' || ch == CH_EOT);
+
+    Inst* insts = vm->prog->insts;
+    vm->nraw = 0;
+    vm->mark++;
+    for (uint32_t i = 0; i < vm->nlist; i++) {
+        uint32_t pc = vm->list[i];
+        if (inst_consumes(&insts[pc], vm->regex->classes, ch) && vm->marks[pc + 1] != vm->mark) {
+            vm->marks[pc + 1] = vm->mark;
+            vm->raw[vm->nraw] = pc + 1;
+            memcpy(vm->raw_caps + vm->nraw * vm->slots, vm->list_caps + i * vm->slots, vm->slots * sizeof(uint32_t));
+            vm->nraw++;
+        }
+    }
+    vm->bol = ch == '\n';
+
+    return vm->nraw > 0;
+}
+
+static
+bool pike_chunk (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
+    Pike* vm = data;
+    for (uint32_t x = 0; x < n; x++)
+        if (!pike_step(vm, i + x, chars[x])) return false;
+    return true;
+}
+
+void regex_captures (Regex* regex, Rope* text, uint32_t start, uint32_t end, uint32_t* groups) {
+    Prog* prog = &regex->forward;
+    uint32_t slots = 2 * regex->groups;
+    uint32_t n = prog->size + 1;
+
+    Pike vm = {
+        .regex = regex,
+        .prog = prog,
+        .slots = slots,
+        .raw = malloc(n * sizeof(uint32_t)),
+        .raw_caps = malloc(n * slots * sizeof(uint32_t)),
+        .list = malloc(n * sizeof(uint32_t)),
+        .list_caps = malloc(n * slots * sizeof(uint32_t)),
+        .marks = calloc(n, sizeof(uint32_t)),
+        .stack = malloc(3 * n * sizeof(uint32_t)),
+        .caps = malloc(slots * sizeof(uint32_t)),
+        .bol = start == 0 || char_at(text, start - 1) == '\n',
+        .groups = groups,
+    };
+
+    for (uint32_t i = 0; i < slots; i++) groups[i] = UINT32_MAX;
+    for (uint32_t i = 0; i < slots; i++) vm.raw_caps[i] = UINT32_MAX;
+    vm.raw_caps[0] = start;
+    vm.raw[0] = 0;
+    vm.nraw = 1;
+
+    // Runs to the match's end, not the end of the text; the last match wins.
+    Pike* data = &vm;
+    rope_foreach_chunk_substr(text, start, end, pike_chunk, data);
+    uint32_t ch = char_at(text, end);
+    if (vm.nraw > 0) pike_closure(&vm, end, ch == '\n' || ch == CH_EOT);
+
+    free(vm.raw);
+    free(vm.raw_caps);
+    free(vm.list);
+    free(vm.list_caps);
+    free(vm.marks);
+    free(vm.stack);
+    free(vm.caps);
+}
+
+
+//
+// Replacement.
+//
+
+typedef struct {
+    Rope* text;
+    uint32_t* groups;
+    uint32_t ngroups;
+    RopeBuilder* out;
+    bool escape;
+    bool uses_groups;
+} Expand;
+
+static
+bool expand_char (uint32_t i, uint32_t ch, void* data) {
+    Expand* ex = data;
+
+    if (!ex->escape) {
+        if (ch == '\\') {
+            ex->escape = true;
+        } else if (ex->out != NULL) {
+            rope_builder_put(ex->out, &ch, 1);
+        }
+        return true;
+    }
+    ex->escape = false;
+
+    if (ch >= '0' && ch <= '9') {
+        uint32_t g = ch - '0';
+        if (g > 0) ex->uses_groups = true;
+        if (ex->out != NULL && g < ex->ngroups && ex->groups[2*g] != UINT32_MAX && ex->groups[2*g+1] != UINT32_MAX)
+            rope_builder_put_substr(ex->out, ex->text, ex->groups[2*g], ex->groups[2*g+1]);
+    } else if (ex->out != NULL) {
+        uint32_t c = unescape(ch);
+        rope_builder_put(ex->out, &c, 1);
+    }
+    return true;
+}
+
+Rope* regex_expand (Rope* text, Rope* replacement, uint32_t* groups, uint32_t ngroups) {
+    Expand ex = { .text = text, .groups = groups, .ngroups = ngroups, .out = rope_builder_create() };
+    rope_foreach(replacement, expand_char, &ex);
+    if (ex.escape) {
+        uint32_t c = '\\';
+        rope_builder_put(ex.out, &c, 1);
+    }
+    return rope_builder_finish(ex.out);
+}
+
+bool regex_expand_uses_groups (Rope* replacement) {
+    Expand ex = {};
+    rope_foreach(replacement, expand_char, &ex);
+    return ex.uses_groups;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "main.h"
+
+//
+// Regular Expressions.
+//  -> Syntax: literals, '.', [classes] with ranges and negation, \d \w \s
+//      (and \D \W \S), escapes \n \t \\, anchors ^ $ (at line boundaries),
+//      groups ( ) and (?: ), alternation |, and * + ? {m,n} with lazy
+//      variants (*? +? ?? {m,n}?).
+//  -> Matching is leftmost-first, as in Perl, and linear in the text:
+//      a lazily built DFA finds where a match ends, a DFA for the reversed
+//      pattern finds where it starts, and a Pike VM recovers groups only
+//      when asked for them.
+//  -> Text is read from the rope a content node at a time, never copied out.
+//
+
+
+Regex* regex_create (const uint32_t* pattern, uint32_t len, const char** error);
+
+void regex_destroy (Regex* regex);
+
+
+// Groups, counting the whole match as group 0.
+uint32_t regex_groups (Regex* regex);
+
+// First match starting at or after 'from'.
+bool regex_search (Regex* regex, Rope* text, uint32_t from, uint32_t* start, uint32_t* end);
+
+// Match ending nearest to 'before' (at or before it).
+bool regex_search_reverse (Regex* regex, Rope* text, uint32_t before, uint32_t* start, uint32_t* end);
+
+// Group bounds of the match [start, end), as 2 * regex_groups() positions
+//  (UINT32_MAX for groups that did not take part).
+//  -> Only [start, end) is run; groups[1] is not 'end' if no match ends there.
+void regex_captures (Regex* regex, Rope* text, uint32_t start, uint32_t end, uint32_t* groups);
+
+// A replacement with \0 - \9 taken from 'groups' and \n, \t, \\ unescaped.
+Rope* regex_expand (Rope* text, Rope* replacement, uint32_t* groups, uint32_t ngroups);
+
+// Whether a replacement refers to groups other than the whole match.
+bool regex_expand_uses_groups (Rope* replacement);
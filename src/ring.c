@@ -0,0 +1,81 @@
+#include "ring.h"
+
+
+// Capacity is a power of two, so positions wrap with a mask.
+static inline
+uint32_t ring_pos (Ring* ring, uint32_t index) {
+    return (ring->start + index) & (ring->capacity - 1);
+}
+
+static void ring_expand (Ring* ring) {
+    uint32_t new_capacity = ring->capacity * 2;
+    void** new_data = calloc(new_capacity, sizeof(void*));
+
+    for (int i = 0; i < ring->size; ++i)
+        new_data[i] = ring->data[ring_pos(ring, i)];
+
+    free(ring->data);
+    ring->data = new_data;
+    ring->start = 0;
+    ring->capacity = new_capacity;
+}
+
+Ring* ring_create () {
+    return ring_create_capacity(16);
+}
+
+Ring* ring_create_capacity (uint32_t capacity) {
+    uint32_t c = 1;
+    while (c < capacity) c *= 2;
+
+    Ring* ring = malloc(sizeof(Ring));
+    ring->data = calloc(c, sizeof(void*));
+    ring->start = 0;
+    ring->size = 0;
+    ring->capacity = c;
+
+    return ring;
+}
+
+void ring_destroy (Ring* ring) {
+    free(ring->data);
+    free(ring);
+}
+
+void ring_clear (Ring* ring) {
+    ring->start = 0;
+    ring->size = 0;
+}
+
+void ring_push (Ring* ring, void* item) {
+    if (ring->size >= ring->capacity) ring_expand(ring);
+
+    ring->data[ring_pos(ring, ring->size)] = item;
+    ring->size++;
+}
+
+void* ring_pop (Ring* ring) {
+    if (ring->size == 0) return NULL;
+
+    ring->size--;
+    return ring->data[ring_pos(ring, ring->size)];
+}
+
+void* ring_peek (Ring* ring) {
+    return ring->size > 0 ? ring->data[ring_pos(ring, ring->size - 1)] : NULL;
+}
+
+void* ring_shift (Ring* ring) {
+    if (ring->size == 0) return NULL;
+
+    void* r = ring->data[ring->start];
+    ring->start = ring_pos(ring, 1);
+    ring->size--;
+    return r;
+}
+
+void* ring_get (Ring* ring, int32_t index) {
+    if (index < 0 || index >= ring->size) return NULL;
+
+    return ring->data[ring_pos(ring, index)];
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "main.h"
+
+typedef struct ring Ring;
+
+//
+// Ring.
+//  -> Double-ended queue of pointers in a circular buffer.
+//  -> Push/pop at the back and shift at the front are O(1) (amortized on growth).
+//
+
+struct ring {
+    void** data;
+
+    uint32_t start;
+    uint32_t size;
+    uint32_t capacity;
+};
+
+Ring* ring_create ();
+Ring* ring_create_capacity (uint32_t capacity);
+
+void ring_destroy (Ring* ring);
+
+void ring_clear (Ring* ring);
+
+void  ring_push (Ring* ring, void* item);
+void* ring_pop  (Ring* ring);
+
+void* ring_peek (Ring* ring);
+
+void* ring_shift (Ring* ring);
+
+void* ring_get (Ring* ring, int32_t index);
@@ -1,9 +1,12 @@
 #include "rope.h"
 
 #include "array.h"
+#include "character.h"
 #include "intbuffer.h"
 #include "charbuffer.h"
 
+#include <stdatomic.h>
+
 typedef struct content Content;
 
 enum {
@@ -11,8 +14,10 @@ enum {
     NODE_CONTENT,
 };
 
+// Counts are atomic: a rope copied for another thread, such as a background
+//  save, may be dropped there while the editor copies or drops its own.
 struct content {
-    uint32_t rc;
+    atomic_uint rc;
     uint32_t len;
     uint32_t lines;
     uint32_t chars[NODE_CONTENT_SIZE];
@@ -20,7 +25,7 @@ struct content {
 
 struct rope_node {
     uint32_t type;
-    uint32_t rc;
+    atomic_uint rc;
     union {
         struct {
             Node* child[4];
@@ -46,7 +51,7 @@ struct rope_node {
 static
 Content* content_create () {
     Content* content = malloc(sizeof(Content));
-    content->rc = 1;
+    atomic_init(&content->rc, 1);
     content->len = 0;
     content->lines = 0;
     return content;
@@ -59,9 +64,7 @@ Content* content_create () {
 
 static
 void content_unref (Content* content) {
-    content->rc--;
-
-    if (content->rc == 0) {
+    if (atomic_fetch_sub(&content->rc, 1) == 1) {
         free(content);
     }
 }
@@ -78,16 +81,11 @@ void content_put (Content* content, int32_t* p, uint32_t len) {
     content->len += len;
 }
 
+// Characters after the last newline.
 static
 uint32_t content_rem (Content* content) {
     uint32_t rem = 0;
-    for (int i = 0; i < content->len; i++) {
-        char c = content->chars[i];
-        if (c == '\n')
-            rem = 0;
-        else
-            rem++;
-    }
+    while (rem < content->len && content->chars[content->len - 1 - rem] != '\n') rem++;
     return rem;
 }
 
@@ -100,7 +98,7 @@ static
 Node* node_create_internal () {
     Node* node = malloc(sizeof(Node));
     node->type = NODE_INTERNAL;
-    node->rc = 1;
+    atomic_init(&node->rc, 1);
     for (int i = 0; i < 4; i++)
         node->child[i] = NULL;
     node->len = 0;
@@ -113,7 +111,7 @@ static
 Node* node_create_content (Content* content) {
     Node* node = malloc(sizeof(Node));
     node->type = NODE_CONTENT;
-    node->rc = 1;
+    atomic_init(&node->rc, 1);
     node->content = content;
     node->len = content->len;
     node->lines = content->lines;
@@ -124,14 +122,12 @@ Node* node_create_content (Content* content) {
 
 static
 void node_ref (Node* node) {
-    node->rc++;
+    atomic_fetch_add_explicit(&node->rc, 1, memory_order_relaxed);
 }
 
 static
 void node_unref (Node* node) {
-    node->rc--;
-
-    if (node->rc == 0) {
+    if (atomic_fetch_sub(&node->rc, 1) == 1) {
         if (node->type == NODE_CONTENT) {
             content_unref(node->content);
         } else if (node->type == NODE_INTERNAL) {
@@ -203,17 +199,11 @@ void split_buffer (IntBuffer* src, Array* A) {
     }
 }
 
-Rope* rope_create (IntBuffer* src) {
-    // Create Empty Rope.
-    if (src == NULL || src->size == 0) {
-        return rope_new(NULL);
-    }
-
-    Array* A = array_create();
+// Rope over a list of content nodes, built level by level (consumes A).
+static
+Rope* rope_build (Array* A) {
     Array* B = array_create();
 
-    split_buffer(src, A);
-
     for (;;) {
 
         if (A->size == 1) {
@@ -259,6 +249,17 @@ Rope* rope_create (IntBuffer* src) {
     }
 }
 
+Rope* rope_create (IntBuffer* src) {
+    // Create Empty Rope.
+    if (src == NULL || src->size == 0) {
+        return rope_new(NULL);
+    }
+
+    Array* A = array_create();
+    split_buffer(src, A);
+    return rope_build(A);
+}
+
 Rope* rope_copy (Rope* rope) {
     if (rope->node != NULL)
         node_ref(rope->node);
@@ -266,6 +267,10 @@ Rope* rope_copy (Rope* rope) {
     return rope_new(rope->node);
 }
 
+bool rope_same (Rope* a, Rope* b) {
+    return a->node == b->node;
+}
+
 void rope_destroy (Rope* rope) {
     if (rope->node != NULL)
         node_unref(rope->node);
@@ -854,6 +859,58 @@ void rope_foreach_substr (Rope* rope, uint32_t i, uint32_t j, rope_foreach_fn fn
 }
 
 
+
+// Content of [i, j), a run of contiguous characters at a time.
+static
+bool node_foreach_chunk (Node* node, uint32_t i, uint32_t j, uint32_t offset, rope_chunk_fn fn, void* data) {
+    if (node->type == NODE_CONTENT) {
+        uint32_t x0 = i < offset ? 0 : i - offset;
+        uint32_t x1 = MIN(node->len, j - offset);
+        if (x0 < x1 && !fn(x0 + offset, node->content->chars + x0, x1 - x0, data)) return false;
+    } else if (node->type == NODE_INTERNAL) {
+        for (int x = 0; x < node->count && offset < j; x++) {
+            if (i < offset + node->child[x]->len) {
+                if (!node_foreach_chunk(node->child[x], i, j, offset, fn, data)) return false;
+            }
+            offset += node->child[x]->len;
+        }
+    }
+    return true;
+}
+
+void rope_foreach_chunk (Rope* rope, rope_chunk_fn fn, void* data) {
+    if (rope->node != NULL) node_foreach_chunk(rope->node, 0, rope->node->len, 0, fn, data);
+}
+
+void rope_foreach_chunk_substr (Rope* rope, uint32_t i, uint32_t j, rope_chunk_fn fn, void* data) {
+    if (rope->node != NULL) node_foreach_chunk(rope->node, i, j, 0, fn, data);
+}
+
+static
+bool node_foreach_chunk_reverse (Node* node, uint32_t i, uint32_t j, uint32_t offset, rope_chunk_fn fn, void* data) {
+    if (node->type == NODE_CONTENT) {
+        uint32_t x0 = i < offset ? 0 : i - offset;
+        uint32_t x1 = MIN(node->len, j - offset);
+        if (x0 < x1 && !fn(x0 + offset, node->content->chars + x0, x1 - x0, data)) return false;
+    } else if (node->type == NODE_INTERNAL) {
+        uint32_t end = offset + node->len;
+        for (int x = node->count - 1; x >= 0 && end > i; x--) {
+            uint32_t begin = end - node->child[x]->len;
+            if (begin < j) {
+                if (!node_foreach_chunk_reverse(node->child[x], i, j, begin, fn, data)) return false;
+            }
+            end = begin;
+        }
+    }
+    return true;
+}
+
+// Chunks of [i, j) from last to first; characters within a chunk stay in order.
+void rope_foreach_chunk_reverse_substr (Rope* rope, uint32_t i, uint32_t j, rope_chunk_fn fn, void* data) {
+    if (rope->node != NULL) node_foreach_chunk_reverse(rope->node, i, j, 0, fn, data);
+}
+
+
 void rope_foreach_reverse (Rope* rope, rope_foreach_fn fn, void* data) {
     if (rope->node != NULL) node_foreach_reverse(rope->node, 0, rope->node->len, rope->node->len, fn, data);
 }
@@ -870,6 +927,139 @@ void rope_foreach_reverse_substr (Rope* rope, uint32_t i, uint32_t j, rope_forea
     if (rope->node != NULL) node_foreach_reverse(rope->node, i, j, rope->node->len, fn, data);
 }
 
+//
+// Builder.
+//  -> Appends text left to right, then builds the tree once.
+//  -> Content nodes wholly inside an appended substring are shared, not copied.
+//
+
+struct rope_builder {
+    Array* leaves;
+    Content* pending;
+    uint32_t len;
+};
+
+RopeBuilder* rope_builder_create () {
+    RopeBuilder* builder = malloc(sizeof(RopeBuilder));
+    builder->leaves = array_create();
+    builder->pending = NULL;
+    builder->len = 0;
+    return builder;
+}
+
+static
+void builder_flush (RopeBuilder* builder) {
+    if (builder->pending == NULL) return;
+
+    if (builder->pending->len > 0) {
+        array_add(builder->leaves, node_create_content(builder->pending));
+    } else {
+        content_unref(builder->pending);
+    }
+    builder->pending = NULL;
+}
+
+// Copy characters, filling content nodes as split_buffer does.
+static
+void builder_put_chars (RopeBuilder* builder, const uint32_t* chars, uint32_t n) {
+    while (n > 0) {
+        if (builder->pending != NULL && builder->pending->len >= NODE_CONTENT_SIZE/2) builder_flush(builder);
+        if (builder->pending == NULL) builder->pending = content_create();
+
+        uint32_t k = MIN(n, NODE_CONTENT_SIZE/2 - builder->pending->len);
+        content_put(builder->pending, (int32_t*) chars, k);
+        chars += k;
+        n -= k;
+    }
+}
+
+static
+void builder_put_leaf (RopeBuilder* builder, Node* node) {
+    Content* pending = builder->pending;
+    if (pending != NULL && pending->len > 0 && pending->len + node->len <= NODE_CONTENT_SIZE) {
+        // Small pending text: absorb the leaf rather than leave a sliver.
+        content_put(pending, (int32_t*) node->content->chars, node->len);
+        if (pending->len >= NODE_CONTENT_SIZE/2) builder_flush(builder);
+        return;
+    }
+
+    builder_flush(builder);
+    node_ref(node);
+    array_add(builder->leaves, node);
+}
+
+static
+void builder_put_node (RopeBuilder* builder, Node* node, uint32_t i, uint32_t j, uint32_t offset) {
+    if (node->type == NODE_CONTENT) {
+        uint32_t x0 = i < offset ? 0 : i - offset;
+        uint32_t x1 = MIN(node->len, j - offset);
+        if (x0 == 0 && x1 == node->len) {
+            builder_put_leaf(builder, node);
+        } else if (x0 < x1) {
+            builder_put_chars(builder, node->content->chars + x0, x1 - x0);
+        }
+    } else if (node->type == NODE_INTERNAL) {
+        for (int x = 0; x < node->count && offset < j; x++) {
+            if (i < offset + node->child[x]->len) builder_put_node(builder, node->child[x], i, j, offset);
+            offset += node->child[x]->len;
+        }
+    }
+}
+
+void rope_builder_put (RopeBuilder* builder, const uint32_t* chars, uint32_t n) {
+    builder_put_chars(builder, chars, n);
+    builder->len += n;
+}
+
+void rope_builder_put_substr (RopeBuilder* builder, Rope* rope, uint32_t i, uint32_t j) {
+    if (rope->node == NULL || i >= j) return;
+
+    builder_put_node(builder, rope->node, i, j, 0);
+    builder->len += j - i;
+}
+
+// Decode straight into content nodes, filled as split_buffer does.
+size_t rope_builder_put_utf8 (RopeBuilder* builder, const char* text, size_t size) {
+    size_t read = 0;
+    while (read < size) {
+        if (builder->pending != NULL && builder->pending->len >= NODE_CONTENT_SIZE/2) builder_flush(builder);
+        if (builder->pending == NULL) builder->pending = content_create();
+
+        Content* content = builder->pending;
+        uint32_t n, lines;
+        size_t r = utf8_decode(text + read, size - read, content->chars + content->len, NODE_CONTENT_SIZE/2 - content->len, &n, &lines);
+        content->len += n;
+        content->lines += lines;
+        builder->len += n;
+        read += r;
+
+        // A sequence cut off by the end.
+        if (r == 0) break;
+    }
+    return read;
+}
+
+uint32_t rope_builder_len (RopeBuilder* builder) {
+    return builder->len;
+}
+
+// The built rope; frees the builder.
+Rope* rope_builder_finish (RopeBuilder* builder) {
+    builder_flush(builder);
+
+    Rope* rope;
+    if (builder->leaves->size == 0) {
+        array_destroy(builder->leaves);
+        rope = rope_new(NULL);
+    } else {
+        rope = rope_build(builder->leaves);
+    }
+
+    free(builder);
+    return rope;
+}
+
+
 //
 // Printing.
 //
@@ -895,13 +1085,13 @@ void node_print (Node* node, uint32_t level) {
     // Node.
     if (node->type == NODE_INTERNAL) {
         printf("[INTERNAL:len=%d,lines=%d,level=%d,rem=%d,rc=%d]\n",
-                node->len, node->lines, node->level, node->rem, node->rc);
+                node->len, node->lines, node->level, node->rem, atomic_load(&node->rc));
         for (int i = 0; i < node->count; i++) {
             node_print(node->child[i], level + 1);
         }
     } else if (node->type == NODE_CONTENT) {
         printf("[CONTENT:len=%d,lines=%d,level=%d,rem=%d,rc=%d|",
-                node->len, node->lines, node->level, node->rem, node->rc);
+                node->len, node->lines, node->level, node->rem, atomic_load(&node->rc));
         content_print(node->content);
         printf("]\n");
     }
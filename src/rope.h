@@ -6,6 +6,8 @@ typedef struct rope_node Node;
 
 typedef bool (*rope_foreach_fn) (uint32_t i, uint32_t ch, void* data);
 
+typedef bool (*rope_chunk_fn) (uint32_t i, const uint32_t* chars, uint32_t n, void* data);
+
 
 struct point {
     int32_t row, col;
@@ -20,6 +22,10 @@ Rope* rope_create (IntBuffer* src);
 
 Rope* rope_copy (Rope* rope);
 
+// Whether one rope is a copy of the other: same nodes, so the same text.
+//  -> Edits always make new nodes, so this tells an unchanged rope apart.
+bool rope_same (Rope* a, Rope* b);
+
 void rope_destroy (Rope* rope);
 
 
@@ -62,4 +68,27 @@ void rope_foreach_reverse_suffix (Rope* rope, uint32_t i, rope_foreach_fn fn, vo
 void rope_foreach_reverse_substr (Rope* rope, uint32_t i, uint32_t j, rope_foreach_fn fn, void* data);
 
 
+void rope_foreach_chunk (Rope* rope, rope_chunk_fn fn, void* data);
+
+void rope_foreach_chunk_substr (Rope* rope, uint32_t i, uint32_t j, rope_chunk_fn fn, void* data);
+
+void rope_foreach_chunk_reverse_substr (Rope* rope, uint32_t i, uint32_t j, rope_chunk_fn fn, void* data);
+
+
+RopeBuilder* rope_builder_create ();
+
+void rope_builder_put (RopeBuilder* builder, const uint32_t* chars, uint32_t n);
+
+void rope_builder_put_substr (RopeBuilder* builder, Rope* rope, uint32_t i, uint32_t j);
+
+// Decode UTF-8 onto the end, skipping invalid bytes.
+//  -> Returns the bytes read: all of them, short of a sequence cut off by the
+//      end, which the caller may pass again with the bytes after it.
+size_t rope_builder_put_utf8 (RopeBuilder* builder, const char* text, size_t size);
+
+uint32_t rope_builder_len (RopeBuilder* builder);
+
+Rope* rope_builder_finish (RopeBuilder* builder);
+
+
 void rope_print (Rope* rope);
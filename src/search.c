@@ -1,139 +1,667 @@
 #include "search.h"
 
-#include <dirent.h>
-
 #include "array.h"
 #include "charbuffer.h"
+#include "threadpool.h"
+#include "fileindex.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 //
-// Search for files recursively in a directory.
+// Scoring.
+//  -> Every matched character scores SCORE_MATCH, plus the bonus of where it
+//      falls; the query's first character counts its bonus twice.
+//  -> A character inside a run of matches gets at least the bonus of the
+//      run's first, so "edi" in "editor" scores like a boundary all along.
+//  -> Unmatched characters inside the window cost a gap penalty.
 //
 
+#define SCORE_MATCH 16
+#define SCORE_GAP_START -3
+#define SCORE_GAP_EXTEND -1
+#define SCORE_NAME 32
+
+#define BONUS_SLASH 10
+#define BONUS_BOUNDARY 8
+#define BONUS_CAMEL 7
+#define BONUS_CONSECUTIVE 4
+
+
+static inline
+char fold (char ch) {
+    return ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch;
+}
+
+static inline
+bool is_lower (char ch) { return ch >= 'a' && ch <= 'z'; }
+
+static inline
+bool is_upper (char ch) { return ch >= 'A' && ch <= 'Z'; }
 
+static inline
+bool is_digit (char ch) { return ch >= '0' && ch <= '9'; }
+
+// Bonus for a match at s[i], where the text starts at s[from].
+static inline
+int32_t bonus_at (const char* s, uint32_t from, uint32_t i) {
+    if (i == from) return BONUS_SLASH;
+
+    char prev = s[i - 1], ch = s[i];
+    if (prev == '/') return BONUS_SLASH;
+    if (prev == '_' || prev == '-' || prev == '.' || prev == ' ') return BONUS_BOUNDARY;
+    if (is_lower(prev) && is_upper(ch)) return BONUS_CAMEL;
+    if (!is_digit(prev) && is_digit(ch)) return BONUS_CAMEL;
+    return 0;
+}
+
+typedef struct {
+    const char* chars;
+    uint32_t size;
+    bool fold;
+} Query;
+
+// Score of the query in s[from, to), or INT32_MIN if it isn't there.
+//  -> The first match of the whole query, from the left, is then tightened
+//      from the right; the window between is scored.
 static
-bool filter_file (const char* filename) {
-    CharBuffer* buf = charbuffer_create();
-    charbuffer_astr(buf, filename);
-    bool r = true;
+int32_t score_text (const char* s, uint32_t from, uint32_t to, Query* query) {
+    uint32_t m = query->size;
+    const char* q = query->chars;
 
-    if (buf->size >= 2) {
-        // Ignore object (.o) files.
-        if (buf->buffer[buf->size-1] == 'o' && buf->buffer[buf->size - 2] == '.') r = false;
-        // Ignore static library (.a) files.
-        if (buf->buffer[buf->size-1] == 'a' && buf->buffer[buf->size - 2] == '.') r = false;
+    uint32_t x = 0, end = from;
+    for (uint32_t i = from; i < to && x < m; i++) {
+        char ch = query->fold ? fold(s[i]) : s[i];
+        if (ch == q[x]) {
+            x++;
+            end = i + 1;
+        }
     }
+    if (x < m) return INT32_MIN;
 
-    if (buf->size >= 3) {
-        // Ignore shared object (.so) files.
-        if (buf->buffer[buf->size-1] == 'o' && buf->buffer[buf->size - 2] == 's'
-            && buf->buffer[buf->size - 3] == '.') r = false;
+    uint32_t start = end;
+    for (int32_t y = m - 1; y >= 0; ) {
+        start--;
+        char ch = query->fold ? fold(s[start]) : s[start];
+        if (ch == q[y]) y--;
     }
 
-    charbuffer_destroy(buf);
-    return r;
+    int32_t score = 0, first = 0;
+    uint32_t run = 0;
+    bool gap = false;
+    x = 0;
+    for (uint32_t i = start; i < end; i++) {
+        char ch = query->fold ? fold(s[i]) : s[i];
+        if (x < m && ch == q[x]) {
+            int32_t bonus = bonus_at(s, from, i);
+            if (run == 0) {
+                first = bonus;
+            } else {
+                // A boundary inside a run starts it over.
+                if (bonus >= BONUS_BOUNDARY && bonus > first) first = bonus;
+                bonus = MAX(bonus, MAX(first, BONUS_CONSECUTIVE));
+            }
+            score += SCORE_MATCH + (x == 0 ? 2 * bonus : bonus);
+            run++;
+            gap = false;
+            x++;
+        } else {
+            score += gap ? SCORE_GAP_EXTEND : SCORE_GAP_START;
+            run = 0;
+            gap = true;
+        }
+    }
+    return score;
 }
 
+// Score of a file: in its name if the query fits there, else in its path
+//  under the root.
 static
-void get_files (Array* files, const char* path, uint32_t prefix) {
-    struct dirent** entry_list;
-    int n = scandir(path, &entry_list, NULL, alphasort);
-    if (n < 0) return;
+int32_t score_file (FileSearch* search, uint32_t n, Query* query) {
+    FileEntry* file = &search->files[n];
+    const char* path = search->arena + file->path;
 
-    for (int i = 0; i < n; i++) {
-        struct dirent* entry = entry_list[i];
-        if (*entry->d_name == '.') {
-            free(entry);
-            continue;
-        }
-        if (!filter_file(entry->d_name)) {
-            free(entry);
-            continue;
-        }
+    int32_t score = score_text(path, file->title, file->size, query);
+    if (score != INT32_MIN) return score + SCORE_NAME;
+    return score_text(path, MIN(search->prefix + 1, file->size), file->size, query);
+}
+
+static
+void query_prepare (Query* query, const char* chars) {
+    query->chars = chars;
+    query->size = strlen(chars);
+    query->fold = true;
+    for (uint32_t i = 0; i < query->size; i++)
+        if (is_upper(chars[i])) query->fold = false;
+}
+
+
+// -- Character Masks -- //
+
+// Bit of a character in a mask: letters (either case) and digits have one
+//  each, common punctuation shares the rest, and anything else the last.
+static inline
+uint32_t mask_bit (char ch) {
+    ch = fold(ch);
+    if (ch >= 'a' && ch <= 'z') return ch - 'a';
+    if (ch >= '0' && ch <= '9') return 26 + ch - '0';
+    if (ch > ' ' && ch < 0x7F) return 36 + ch % 27;
+    return 63;
+}
+
+static
+uint64_t mask_of (const char* s, uint32_t from, uint32_t to) {
+    uint64_t mask = 0;
+    for (uint32_t i = from; i < to; i++) mask |= (uint64_t) 1 << mask_bit(s[i]);
+    return mask;
+}
+
+// Files in [i, j) whose masks hold all of 'want', into 'out'.
+//  -> Returns how many.
+static
+uint32_t filter_masks (const uint64_t* masks, uint64_t want, uint32_t i, uint32_t j, uint32_t* out) {
+    uint32_t n = 0;
+
+#ifdef __SSE2__
+    // Two masks at a time: a file passes when none of the wanted bits is
+    //  missing, which is both 32-bit halves of its lane being zero.
+    __m128i w = _mm_set1_epi64x(want);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= j; i += 4) {
+        __m128i m0 = _mm_loadu_si128((__m128i*) &masks[i]);
+        __m128i m1 = _mm_loadu_si128((__m128i*) &masks[i + 2]);
+        int hit0 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_andnot_si128(m0, w), zero));
+        int hit1 = _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_andnot_si128(m1, w), zero));
+        int hits = hit0 | hit1 << 16;
+        if (hits == 0) continue;
 
-        CharBuffer* subdir = charbuffer_create();
-        charbuffer_astr(subdir, path);
-        int len = subdir->size;
+        if ((hits & 0x000000FF) == 0x000000FF) out[n++] = i;
+        if ((hits & 0x0000FF00) == 0x0000FF00) out[n++] = i + 1;
+        if ((hits & 0x00FF0000) == 0x00FF0000) out[n++] = i + 2;
+        if ((hits & 0xFF000000) == 0xFF000000) out[n++] = i + 3;
+    }
+#endif
+    for (; i < j; i++)
+        if ((masks[i] & want) == want) out[n++] = i;
+
+    return n;
+}
+
+
+// -- Top Heap -- //
+
+// Ranking order: best score, then shortest path, then tree order.
+static inline
+bool hit_better (FileSearch* search, SearchHit a, SearchHit b) {
+    if (a.score != b.score) return a.score > b.score;
+    uint32_t sa = search->files[a.file].size, sb = search->files[b.file].size;
+    if (sa != sb) return sa < sb;
+    return a.file < b.file;
+}
+
+// Put 'hit' at heap[k] or below, in a heap of 'size' with the worst on top.
+static inline
+void heap_sift_down (FileSearch* search, SearchHit* heap, uint32_t size, uint32_t k, SearchHit hit) {
+    while (true) {
+        uint32_t c = 2 * k + 1;
+        if (c >= size) break;
+        if (c + 1 < size && hit_better(search, heap[c], heap[c + 1])) c++;
+        if (!hit_better(search, hit, heap[c])) break;
+        heap[k] = heap[c];
+        k = c;
+    }
+    heap[k] = hit;
+}
 
-        if (subdir->size >= 1 && subdir->buffer[subdir->size - 1] != '/') {
-            charbuffer_achar(subdir, '/');
+// Keep 'hit' if it is among the best SEARCH_TOP_K so far.
+static inline
+void heap_push (FileSearch* search, SearchHit* heap, uint32_t* size, SearchHit hit) {
+    if (*size < SEARCH_TOP_K) {
+        uint32_t k = (*size)++;
+        while (k > 0 && hit_better(search, heap[(k - 1) / 2], hit)) {
+            heap[k] = heap[(k - 1) / 2];
+            k = (k - 1) / 2;
         }
-        charbuffer_astr(subdir, entry->d_name);
-
-        if (entry->d_type == DT_DIR) {
-            get_files(files, subdir->buffer, prefix);
-            charbuffer_destroy(subdir);
-        } else if (entry->d_type == DT_REG) {
-            FileEntry* file = malloc(sizeof(FileEntry));
-            file->path = subdir;
-            file->pos = files->size;
-            file->rank = 0;
-            file->prefix = prefix;
-            file->title = len;
-            array_add(files, file);
+        heap[k] = hit;
+    } else if (hit_better(search, hit, heap[0])) {
+        heap_sift_down(search, heap, *size, 0, hit);
+    }
+}
+
+// Order the heap best first, by taking the worst off to the back in turn.
+static
+void heap_sort (FileSearch* search, SearchHit* heap, uint32_t size) {
+    for (uint32_t end = size; end > 1; end--) {
+        SearchHit worst = heap[0];
+        heap_sift_down(search, heap, end - 1, 0, heap[end - 1]);
+        heap[end - 1] = worst;
+    }
+}
+
+
+//
+// Ranking Jobs.
+//
+
+typedef struct {
+    SearchJob* job;
+    uint32_t i, j;
+
+    SearchHit* hits;
+    uint32_t size;
+    SearchHit top[SEARCH_TOP_K];
+    uint32_t top_size;
+} RankTask;
+
+struct search_job {
+    FileSearch* search;
+    char* query;
+    Query q;
+    uint64_t want;
+
+    // Files to rank: these, or every file if NULL.
+    SearchHit* source;
+    uint32_t source_size;
+
+    RankTask* tasks;
+    uint32_t task_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    uint32_t left;
+    // Read by tasks without the lock.
+    atomic_bool cancel;
+};
+
+// Files scored between checks for cancellation.
+#define RANK_CANCEL_CHECK 1024
+
+static
+void rank_task (void* data) {
+    RankTask* task = data;
+    SearchJob* job = task->job;
+    FileSearch* search = job->search;
+
+    // Files passing the mask prefilter.
+    uint32_t* files = malloc(MAX(1, task->j - task->i) * sizeof(uint32_t));
+    uint32_t count = 0;
+    if (job->source == NULL) {
+        count = filter_masks(search->masks, job->want, task->i, task->j, files);
+    } else {
+        for (uint32_t x = task->i; x < task->j; x++) {
+            uint32_t n = job->source[x].file;
+            if ((search->masks[n] & job->want) == job->want) files[count++] = n;
         }
+    }
+
+    task->hits = malloc(MAX(1, count) * sizeof(SearchHit));
+    for (uint32_t x = 0; x < count; x++) {
+        if (x % RANK_CANCEL_CHECK == 0 && atomic_load(&job->cancel)) break;
+
+        SearchHit hit = { files[x], score_file(search, files[x], &job->q) };
+        if (hit.score == INT32_MIN) continue;
+        task->hits[task->size++] = hit;
+        heap_push(search, task->top, &task->top_size, hit);
+    }
+    free(files);
+
+    pthread_mutex_lock(&job->lock);
+    if (--job->left == 0) pthread_cond_signal(&job->done);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static
+SearchJob* job_start (FileSearch* search, const char* query, SearchHit* source, uint32_t source_size) {
+    SearchJob* job = malloc(sizeof(SearchJob));
+    job->search = search;
+    job->query = strdup(query);
+    query_prepare(&job->q, job->query);
+    job->want = mask_of(job->query, 0, job->q.size);
+    job->source = source;
+    job->source_size = source == NULL ? search->files_size : source_size;
 
-        free(entry);
+    job->task_count = MAX(1, (job->source_size + SEARCH_RANK_SPLIT - 1) / SEARCH_RANK_SPLIT);
+    job->tasks = calloc(job->task_count, sizeof(RankTask));
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
+    job->left = job->task_count;
+    atomic_store(&job->cancel, false);
+
+    for (uint32_t t = 0; t < job->task_count; t++) {
+        RankTask* task = &job->tasks[t];
+        task->job = job;
+        task->i = t * SEARCH_RANK_SPLIT;
+        task->j = MIN(job->source_size, task->i + SEARCH_RANK_SPLIT);
+    }
+    for (uint32_t t = 0; t < job->task_count; t++) thread_pool_submit(search->pool, rank_task, &job->tasks[t]);
+
+    return job;
+}
+
+// Wait until the job's tasks are done, at most until 'deadline' if given.
+//  -> Returns true if they are.
+static
+bool job_wait (SearchJob* job, struct timespec* deadline) {
+    pthread_mutex_lock(&job->lock);
+    while (job->left > 0) {
+        if (deadline == NULL) pthread_cond_wait(&job->done, &job->lock);
+        else if (pthread_cond_timedwait(&job->done, &job->lock, deadline) == ETIMEDOUT) break;
     }
+    bool done = job->left == 0;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
 
-    free(entry_list);
+// Free a job whose tasks are done.
+static
+void job_destroy (SearchJob* job) {
+    for (uint32_t t = 0; t < job->task_count; t++) free(job->tasks[t].hits);
+    free(job->tasks);
+    free(job->source);
+    free(job->query);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->done);
+    free(job);
 }
 
-void search_load_files (Array* files, const char* path) {
-    get_files(files, path, strlen(path));
+// Cancel the running job, leaving it to finish among the stale ones.
+static
+void job_cancel (FileSearch* search) {
+    if (search->job == NULL) return;
+    atomic_store(&search->job->cancel, true);
+    array_add(search->stale, search->job);
+    search->job = NULL;
 }
 
-void search_unload_files (Array* files) {
-    for (int i = 0; i < files->size; i++) {
-        FileEntry* file = files->data[i];
-        charbuffer_destroy(file->path);
-        free(file);
+// Free the stale jobs that are done, or wait for all of them.
+static
+void stale_sweep (FileSearch* search, bool wait) {
+    int n = 0;
+    for (int i = 0; i < search->stale->size; i++) {
+        SearchJob* job = search->stale->data[i];
+        struct timespec now = {0};
+        if (job_wait(job, wait ? NULL : &now)) job_destroy(job);
+        else search->stale->data[n++] = job;
     }
-    array_clear(files);
+    search->stale->size = n;
+}
+
+static
+void matches_reserve (FileSearch* search, uint32_t size) {
+    if (size <= search->matches_capacity) return;
+    while (size > search->matches_capacity) search->matches_capacity *= 2;
+    search->matches = realloc(search->matches, search->matches_capacity * sizeof(SearchHit));
+}
+
+// Take in the finished job's matches, and merge the tasks' top heaps.
+static
+void job_finish (FileSearch* search) {
+    SearchJob* job = search->job;
+    search->job = NULL;
+
+    uint32_t size = 0;
+    for (uint32_t t = 0; t < job->task_count; t++) size += job->tasks[t].size;
+    search->matches_size = 0;
+    matches_reserve(search, size);
+
+    search->top_size = 0;
+    for (uint32_t t = 0; t < job->task_count; t++) {
+        RankTask* task = &job->tasks[t];
+        memcpy(search->matches + search->matches_size, task->hits, task->size * sizeof(SearchHit));
+        search->matches_size += task->size;
+        for (uint32_t k = 0; k < task->top_size; k++) heap_push(search, search->top, &search->top_size, task->top[k]);
+    }
+    heap_sort(search, search->top, search->top_size);
+
+    charbuffer_clear(search->query);
+    charbuffer_astr(search->query, job->query);
+    job_destroy(job);
+}
+
+// A directory's listing, held until no job reads the files.
+typedef struct {
+    CharBuffer* path;
+    char* files;
+    uint32_t files_size;
+    uint32_t file_count;
+} PendingDir;
+
+static
+void pending_destroy (PendingDir* pending) {
+    charbuffer_destroy(pending->path);
+    free(pending->files);
+    free(pending);
 }
 
 
 //
-// Rank files relative to a search query.
+// File Search.
 //
 
+FileSearch* search_create (ThreadPool* pool) {
+    FileSearch* search = malloc(sizeof(FileSearch));
+    search->pool = pool;
+    search->arena_capacity = 1 << 16;
+    search->arena = malloc(search->arena_capacity);
+    search->arena_size = 0;
+    search->files_capacity = 1 << 10;
+    search->files = malloc(search->files_capacity * sizeof(FileEntry));
+    search->masks = malloc(search->files_capacity * sizeof(uint64_t));
+    search->files_size = 0;
+    search->matches_capacity = search->files_capacity;
+    search->matches = malloc(search->matches_capacity * sizeof(SearchHit));
+    search->matches_size = 0;
+    search->top = malloc(SEARCH_TOP_K * sizeof(SearchHit));
+    search->top_size = 0;
+    search->prefix = 0;
+    search->query = charbuffer_create();
+    search->job = NULL;
+    search->stale = array_create();
+    search->pending = array_create();
+    return search;
+}
+
+void search_destroy (FileSearch* search) {
+    job_cancel(search);
+    stale_sweep(search, true);
+    array_destroy(search->stale);
+    array_destroy_callback(search->pending, (array_callback) pending_destroy);
+
+    free(search->arena);
+    free(search->files);
+    free(search->masks);
+    free(search->matches);
+    free(search->top);
+    charbuffer_destroy(search->query);
+    free(search);
+}
+
+const char* search_path (FileSearch* search, uint32_t n) {
+    return search->arena + search->files[search->top[n].file].path;
+}
+
+
+// -- Files -- //
+
+// Add a match of the ranked query, to 'top' as well if it makes it.
 static
-uint32_t rank_file (FileEntry* file, const char* query) {
-    int x = 0;
-    uint32_t rank = 0;
-    for (int i = file->title; i < file->path->size; i++) {
-        char ch = query[x];
-        if (ch == '\0') return rank;
+void add_match (FileSearch* search, SearchHit hit) {
+    matches_reserve(search, search->matches_size + 1);
+    search->matches[search->matches_size++] = hit;
 
-        if (file->path->buffer[i] == ch) {
-            rank++;
-            x++;
+    // No query keeps tree order, so the new file can only go last.
+    if (search->query->size == 0) {
+        if (search->top_size < SEARCH_TOP_K) search->top[search->top_size++] = hit;
+        return;
+    }
+
+    // Insert in order, dropping the last if full.
+    uint32_t k = search->top_size;
+    while (k > 0 && hit_better(search, hit, search->top[k - 1])) k--;
+    if (k == SEARCH_TOP_K) return;
+    uint32_t size = MIN(search->top_size + 1, SEARCH_TOP_K);
+    memmove(search->top + k + 1, search->top + k, (size - k - 1) * sizeof(SearchHit));
+    search->top[k] = hit;
+    search->top_size = size;
+}
+
+// Files of a directory whose path, ending in '/', is 'dir_path'.
+static
+void add_listing (FileSearch* search, const char* dir_path, uint32_t dir_path_size, const char* files, uint32_t file_count, uint32_t files_size) {
+    // Room for the whole directory up front.
+    uint64_t bytes = (uint64_t) file_count * (dir_path_size + 1) + files_size;
+    while (search->arena_size + bytes > search->arena_capacity) search->arena_capacity *= 2;
+    search->arena = realloc(search->arena, search->arena_capacity);
+
+    uint32_t count = search->files_size + file_count;
+    if (count > search->files_capacity) {
+        while (count > search->files_capacity) search->files_capacity *= 2;
+        search->files = realloc(search->files, search->files_capacity * sizeof(FileEntry));
+        search->masks = realloc(search->masks, search->files_capacity * sizeof(uint64_t));
+    }
+
+    Query query;
+    query_prepare(&query, search->query->buffer);
+    uint64_t want = mask_of(query.chars, 0, query.size);
+
+    const char* name = files;
+    for (uint32_t i = 0; i < file_count; i++) {
+        uint32_t name_size = strlen(name);
+        char* path = search->arena + search->arena_size;
+        memcpy(path, dir_path, dir_path_size);
+        memcpy(path + dir_path_size, name, name_size + 1);
+        name += name_size + 1;
+
+        uint32_t n = search->files_size++;
+        FileEntry* file = &search->files[n];
+        file->path = search->arena_size;
+        file->size = dir_path_size + name_size;
+        file->title = dir_path_size;
+        search->masks[n] = mask_of(path, MIN(search->prefix + 1, file->size), file->size);
+        search->arena_size += file->size + 1;
+
+        SearchHit hit = { n, 0 };
+        if (query.size > 0) {
+            if ((search->masks[n] & want) != want) continue;
+            hit.score = score_file(search, n, &query);
+            if (hit.score == INT32_MIN) continue;
         }
+        add_match(search, hit);
     }
-    return rank;
 }
 
+// Add the held listings, in order, once no job is left to read the files.
 static
-int filecmp (const void* f1, const void* f2) {
-    const FileEntry* file1 = *(FileEntry**) f1;
-    const FileEntry* file2 = *(FileEntry**) f2;
+void pending_flush (FileSearch* search) {
+    if (search->job != NULL || search->stale->size > 0) return;
 
-    if (file1->rank == file2->rank) {
-        if (file1->pos == file2->pos) return  0;
-        if (file1->pos > file2->pos)  return  1;
-        if (file1->pos < file2->pos)  return -1;
+    for (int i = 0; i < search->pending->size; i++) {
+        PendingDir* pending = search->pending->data[i];
+        add_listing(search, pending->path->buffer, pending->path->size, pending->files, pending->file_count, pending->files_size);
+        pending_destroy(pending);
     }
-    if (file1->rank > file2->rank)    return -1;
-    if (file1->rank < file2->rank)    return  1;
+    array_clear(search->pending);
+}
 
-    return 0; // to make gcc happy.
+void search_add_files (FileSearch* search, FileIndex* index, IndexDir* dir) {
+    CharBuffer* dir_path = charbuffer_create();
+    file_index_path(index, dir, dir_path);
+    if (dir_path->size == 0 || dir_path->buffer[dir_path->size - 1] != '/') charbuffer_achar(dir_path, '/');
+    search->prefix = strlen(index->root);
+
+    // The tasks read the files, which may move as they grow.
+    if (search->job != NULL || search->stale->size > 0) {
+        PendingDir* pending = malloc(sizeof(PendingDir));
+        pending->path = dir_path;
+        pending->files = malloc(MAX(1, dir->files_size));
+        memcpy(pending->files, dir->files, dir->files_size);
+        pending->files_size = dir->files_size;
+        pending->file_count = dir->file_count;
+        array_add(search->pending, pending);
+        return;
+    }
+
+    add_listing(search, dir_path->buffer, dir_path->size, dir->files, dir->file_count, dir->files_size);
+    charbuffer_destroy(dir_path);
 }
 
-void search_rank_files (Array* files, const char* query) {
-    for (int i = 0; i < files->size; i++) {
-        FileEntry* file = files->data[i];
-        file->rank = rank_file(file, query);
+static
+void add_tree (FileSearch* search, FileIndex* index, IndexDir* dir) {
+    search_add_files(search, index, dir);
+    for (int i = 0; i < dir->subdirs->size; i++) add_tree(search, index, dir->subdirs->data[i]);
+}
+
+void search_load_files (FileSearch* search, FileIndex* index) {
+    add_tree(search, index, index->tree);
+}
+
+void search_unload_files (FileSearch* search) {
+    job_cancel(search);
+    stale_sweep(search, true);
+
+    for (int i = 0; i < search->pending->size; i++) pending_destroy(search->pending->data[i]);
+    array_clear(search->pending);
+    search->arena_size = 0;
+    search->files_size = 0;
+    search->matches_size = 0;
+    search->top_size = 0;
+    charbuffer_clear(search->query);
+}
+
+
+// -- Ranking -- //
+
+void search_rank_files (FileSearch* search, const char* query) {
+    if (search->job != NULL && strcmp(search->job->query, query) == 0) return;
+    job_cancel(search);
+    stale_sweep(search, false);
+    pending_flush(search);
+    if (strcmp(search->query->buffer, query) == 0) return;
+
+    uint32_t size = strlen(query);
+
+    // No query: every file matches, in tree order.
+    if (size == 0) {
+        matches_reserve(search, search->files_size);
+        for (uint32_t n = 0; n < search->files_size; n++) search->matches[n] = (SearchHit) { n, 0 };
+        search->matches_size = search->files_size;
+        search->top_size = MIN(search->files_size, SEARCH_TOP_K);
+        memcpy(search->top, search->matches, search->top_size * sizeof(SearchHit));
+        charbuffer_clear(search->query);
+        return;
+    }
+
+    // A longer query only matches what the shorter one did; the job takes
+    //  its own copy, as 'matches' may change while it runs.
+    //  After no query, that is every file anyway.
+    SearchHit* source = NULL;
+    if (search->query->size > 0 && strncmp(search->query->buffer, query, search->query->size) == 0) {
+        source = malloc(MAX(1, search->matches_size) * sizeof(SearchHit));
+        memcpy(source, search->matches, search->matches_size * sizeof(SearchHit));
+    }
+    search->job = job_start(search, query, source, search->matches_size);
+}
+
+bool search_rank_poll (FileSearch* search, int32_t wait) {
+    stale_sweep(search, false);
+    pending_flush(search);
+    if (search->job == NULL) return search->stale->size > 0;
+
+    struct timespec deadline = {0};
+    if (wait > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) wait * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
     }
+    if (job_wait(search->job, wait < 0 ? NULL : &deadline)) job_finish(search);
+    pending_flush(search);
 
-    qsort(files->data, files->size, sizeof(void*), filecmp);
+    return search->job != NULL || search->stale->size > 0;
 }
@@ -2,19 +2,105 @@
 
 #include "main.h"
 
+#include <pthread.h>
+
+//
+// File Search.
+//  -> Fuzzy matching of the file-open dialog's query against file paths:
+//      the query must be a subsequence of the path, and the tightest such
+//      window is scored, with bonuses for matches at word boundaries,
+//      camel-case humps and runs of consecutive characters.
+//  -> A match in the file name beats one spread over the directories.
+//  -> Smart case: the query matches either case unless it has capitals.
+//  -> Paths are packed into one arena. Each file also has a bitmask of the
+//      characters in it, and those lacking one of the query's are rejected
+//      from the masks alone, several at a time, before any scoring.
+//  -> Incremental: when the query only grows, only the files that matched
+//      the last one are rescored. Only the best SEARCH_TOP_K are kept in
+//      order, by a bounded heap rather than a full sort.
+//  -> Ranking runs on the thread pool, split into tasks that each keep their
+//      own matches and top heap, merged once all are done. A newer query
+//      cancels the running one, which is dropped when its tasks notice.
+//
+
+typedef struct search_job SearchJob;
 
 struct file_entry {
-    CharBuffer* path;
+    // Offset of the path in the arena, where it ends with a NUL.
+    uint64_t path;
+    uint32_t size;
+    // Start of the file name, within the path.
+    uint32_t title;
+};
+
+typedef struct {
+    uint32_t file;
+    int32_t score;
+} SearchHit;
+
+struct file_search {
+    ThreadPool* pool;
+
+    // Every path, back to back.
+    char* arena;
+    uint64_t arena_size;
+    uint64_t arena_capacity;
+
+    // Every file, in tree order, and a mask of the characters in each.
+    FileEntry* files;
+    uint64_t* masks;
+    uint32_t files_size;
+    uint32_t files_capacity;
+
+    // Files matching 'query', in no order.
+    SearchHit* matches;
+    uint32_t matches_size;
+    uint32_t matches_capacity;
+
+    // The best of 'matches', best first.
+    SearchHit* top;
+    uint32_t top_size;
 
-    uint32_t pos;
-    uint32_t rank;
+    // Length of the root, which starts every path.
     uint32_t prefix;
-    uint32_t title;
+    CharBuffer* query;
+
+    // Ranking for a newer query, or NULL; 'matches' and 'top' are still
+    //  those of 'query' until it is done.
+    SearchJob* job;
+    // Cancelled jobs whose tasks are still running.
+    Array* stale;
+    // Directories added while jobs read the files, copied, to add once none do.
+    Array* pending;
 };
 
-void search_load_files (Array* files, const char* path);
 
-void search_unload_files (Array* files);
+FileSearch* search_create (ThreadPool* pool);
+
+void search_destroy (FileSearch* search);
+
+
+// Every file in the index, in tree order.
+void search_load_files (FileSearch* search, FileIndex* index);
+
+// Files of one directory, at the end; those matching the current query are
+//  added to the matches, and show in 'top' from the next ranking.
+//  -> While a ranking reads the files, the listing is copied and added once
+//      it is done, by search_rank_poll or search_rank_files.
+void search_add_files (FileSearch* search, FileIndex* index, IndexDir* dir);
+
+// Drop every file, and the query with them.
+void search_unload_files (FileSearch* search);
+
+
+// Start ranking the files against 'query', cancelling any older ranking.
+//  -> The empty query, or the one already ranked, is done at once.
+void search_rank_files (FileSearch* search, const char* query);
 
+// Take in a finished ranking, waiting up to 'wait' milliseconds for it
+//  (or for as long as it takes, if negative).
+//  -> Returns true while a ranking is still running.
+bool search_rank_poll (FileSearch* search, int32_t wait);
 
-void search_rank_files (Array* files, const char* prompt);
+// Path of the n-th best match.
+const char* search_path (FileSearch* search, uint32_t n);
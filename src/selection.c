@@ -0,0 +1,158 @@
+#include "selection.h"
+
+
+static inline
+uint32_t head (Selection* sel) {
+    return MIN(sel->cursor, sel->anchor);
+}
+
+static inline
+uint32_t tail (Selection* sel) {
+    return MAX(sel->cursor, sel->anchor);
+}
+
+
+//
+// Storage.
+//
+
+// Reallocate with room for 'size' selections, centred so both ends have slack.
+static
+void selection_array_reserve (SelectionArray* A, uint32_t size) {
+    uint32_t front = A->data - A->base;
+    if (size <= A->capacity && front > 0 && front + A->size < A->capacity) return;
+
+    uint32_t capacity = MAX(4, A->capacity);
+    while (capacity < size + 2) capacity *= 2;
+
+    Selection* base = malloc(capacity * sizeof(Selection));
+    Selection* data = base + (capacity - A->size) / 2;
+    if (A->size > 0) memcpy(data, A->data, A->size * sizeof(Selection));
+
+    free(A->base);
+    A->base = base;
+    A->data = data;
+    A->capacity = capacity;
+}
+
+SelectionArray* selection_array_create () {
+    SelectionArray* A = malloc(sizeof(SelectionArray));
+    A->size = 0;
+    A->capacity = 0;
+    A->base = NULL;
+    A->data = NULL;
+    selection_array_reserve(A, 1);
+
+    return A;
+}
+
+void selection_array_destroy (SelectionArray* A) {
+    free(A->base);
+    free(A);
+}
+
+
+//
+// Bulk Operations.
+//
+
+void selection_array_clear (SelectionArray* A) {
+    A->size = 0;
+    A->data = A->base + A->capacity / 2;
+}
+
+// Drop all but the primary selection, which is returned.
+//  -> Only the first one marked primary is kept.
+Selection* selection_array_keep_primary (SelectionArray* A) {
+    Selection primary = { .primary = true };
+    for (int i = 0; i < A->size; i++) {
+        if (A->data[i].primary) {
+            primary = A->data[i];
+            break;
+        }
+    }
+
+    selection_array_clear(A);
+    return selection_array_push_back(A, primary);
+}
+
+void selection_array_copy (SelectionArray* src, SelectionArray* dst) {
+    selection_array_clear(dst);
+    selection_array_reserve(dst, src->size);
+    dst->data = dst->base + (dst->capacity - src->size) / 2;
+    if (src->size > 0) memcpy(dst->data, src->data, src->size * sizeof(Selection));
+    dst->size = src->size;
+}
+
+// Restore document order and merge selections that overlap or share a cursor.
+//  -> A merged selection keeps the direction of the first one, and is primary
+//      if either was.
+void selection_array_normalize (SelectionArray* A) {
+    // Nearly always sorted already: insertion sort.
+    for (int i = 1; i < A->size; i++) {
+        Selection sel = A->data[i];
+        int j = i - 1;
+        while (j >= 0 && head(&A->data[j]) > head(&sel)) {
+            A->data[j + 1] = A->data[j];
+            j--;
+        }
+        A->data[j + 1] = sel;
+    }
+
+    uint32_t n = 0;
+    for (int i = 0; i < A->size; i++) {
+        Selection* sel = &A->data[i];
+        Selection* last = n > 0 ? &A->data[n - 1] : NULL;
+
+        bool overlap = last != NULL && (head(sel) < tail(last) || head(sel) == head(last));
+        if (!overlap) {
+            A->data[n++] = *sel;
+            continue;
+        }
+
+        uint32_t h = head(last);
+        uint32_t t = MAX(tail(last), tail(sel));
+        bool forward = last->cursor >= last->anchor;
+        last->anchor = forward ? h : t;
+        last->cursor = forward ? t : h;
+        last->primary = last->primary || sel->primary;
+    }
+    A->size = n;
+}
+
+
+//
+// Ends.
+//
+
+Selection* selection_array_push_back (SelectionArray* A, Selection sel) {
+    if (A->data + A->size >= A->base + A->capacity) selection_array_reserve(A, A->size + 1);
+
+    A->data[A->size] = sel;
+    A->size++;
+    return &A->data[A->size - 1];
+}
+
+Selection* selection_array_push_front (SelectionArray* A, Selection sel) {
+    if (A->data == A->base) selection_array_reserve(A, A->size + 1);
+
+    A->data--;
+    A->size++;
+    A->data[0] = sel;
+    return &A->data[0];
+}
+
+void selection_array_pop_back (SelectionArray* A) {
+    if (A->size > 0) A->size--;
+}
+
+void selection_array_pop_front (SelectionArray* A) {
+    if (A->size == 0) return;
+
+    A->data++;
+    A->size--;
+}
+
+Selection* selection_array_peek (SelectionArray* A) {
+    return A->size > 0 ? &A->data[A->size - 1] : NULL;
+}
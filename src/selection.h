@@ -0,0 +1,50 @@
+#pragma once
+
+#include "main.h"
+
+struct selection {
+    int32_t cursor, anchor;
+    int32_t col_mem;
+
+    bool primary;
+};
+
+//
+// Selection Array.
+//  -> Selections by value, contiguous and in document order.
+//  -> Slack is kept at both ends, so adding a cursor before the first is as
+//      cheap as adding one after the last.
+//
+
+struct selection_array {
+    Selection* data;
+    uint32_t size;
+
+    Selection* base;
+    uint32_t capacity;
+};
+
+
+SelectionArray* selection_array_create ();
+
+void selection_array_destroy (SelectionArray* A);
+
+
+void selection_array_clear (SelectionArray* A);
+
+Selection* selection_array_keep_primary (SelectionArray* A);
+
+void selection_array_copy (SelectionArray* src, SelectionArray* dst);
+
+void selection_array_normalize (SelectionArray* A);
+
+
+Selection* selection_array_push_back (SelectionArray* A, Selection sel);
+
+Selection* selection_array_push_front (SelectionArray* A, Selection sel);
+
+void selection_array_pop_back (SelectionArray* A);
+
+void selection_array_pop_front (SelectionArray* A);
+
+Selection* selection_array_peek (SelectionArray* A);
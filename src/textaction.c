@@ -34,6 +34,14 @@ void textaction (InputEvent* event, TextBuffer* buffer, int32_t i, Array* clipbo
             textbuffer_redo(buffer);
             break;
         }
+        KEY_ALT('z'){
+            textbuffer_undo_branch(buffer, 1);
+            break;
+        }
+        KEY_ALT('Z'){
+            textbuffer_undo_branch(buffer, -1);
+            break;
+        }
 
         // Duplicate.
         KEY_CTRL('D') {
@@ -135,6 +143,12 @@ void textaction (InputEvent* event, TextBuffer* buffer, int32_t i, Array* clipbo
             break;
         }
 
+        // Matching Bracket.
+        KEY_CTRL('B') {
+            textbuffer_cursor_bracket(buffer, false);
+            break;
+        }
+
         // Move Lines.
         KEY_CTRL_UP {
             textbuffer_edit_move_lines(buffer, -i);
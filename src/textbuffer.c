@@ -1,11 +1,20 @@
 #include "textbuffer.h"
 
+#include <time.h>
+
 #include "array.h"
+#include "selection.h"
+#include "ring.h"
+#include "histlog.h"
 #include "charbuffer.h"
 #include "intbuffer.h"
 #include "character.h"
 #include "rope.h"
 #include "mode.h"
+#include "colorizer.h"
+#include "lineindex.h"
+#include "matchindex.h"
+#include "regex.h"
 
 
 //
@@ -14,6 +23,9 @@
 
 static void action_begin (TextBuffer*, uint32_t);
 static void action_end (TextBuffer*);
+static void hist_collect (TextBuffer*);
+static void history_goto (TextBuffer*);
+static void history_detach (TextBuffer*);
 
 
 //
@@ -40,38 +52,6 @@ enum {
 };
 
 
-//
-// Selection Object.
-//
-
-static
-Selection* selection_create () {
-    Selection* sel = malloc(sizeof(Selection));
-    sel->cursor = 0;
-    sel->anchor = 0;
-    sel->col_mem = 0;
-    sel->primary = false;
-
-    return sel;
-}
-
-static
-Selection* selection_copy (Selection* s) {
-    Selection* sel = malloc(sizeof(Selection));
-    sel->cursor = s->cursor;
-    sel->anchor = s->anchor;
-    sel->col_mem = s->col_mem;
-    sel->primary = false;
-
-    return sel;
-}
-
-static
-void selection_destroy (Selection* sel) {
-    free(sel);
-}
-
-
 //
 // Selection Macros,
 //
@@ -99,59 +79,166 @@ uint32_t selection_len (Selection* sel) {
 }
 
 static inline
-uint32_t selection_array_max_len (Array* A) {
+uint32_t selection_array_max_len (SelectionArray* A) {
     uint32_t len = 0;
     for (int i = 0; i < A->size; i++)
-        len = MAX(len, selection_len(A->data[i]));
+        len = MAX(len, selection_len(&A->data[i]));
     return len;
 }
 
+
+//
+// Delta Object.
+//  -> One replacement of text: [pos, pos + len(removed)) became 'inserted'.
+//  -> NULL ropes stand for empty text.
+//
+
 static inline
-void selection_array_copy (Array* src, Array* dst) {
-    for (int i = 0; i < src->size; i++) {
-        Selection* sel = src->data[i];
-        Selection* cpy = selection_copy(sel);
-        cpy->primary = sel->primary;
-        array_add(dst, cpy);
-    }
+uint32_t delta_rope_len (Rope* rope) {
+    return rope == NULL ? 0 : rope_len(rope);
+}
+
+static
+Delta* delta_create (uint32_t pos, Rope* removed, Rope* inserted) {
+    Delta* delta = malloc(sizeof(Delta));
+    delta->pos = pos;
+    delta->removed = removed;
+    delta->inserted = inserted;
+
+    return delta;
+}
+
+static
+void delta_destroy (Delta* delta) {
+    if (delta->removed != NULL) rope_destroy(delta->removed);
+    if (delta->inserted != NULL) rope_destroy(delta->inserted);
+    free(delta);
 }
 
-//  -> Returns Primary selection instead of destoying it.
-//      -> Only Returns the first one marked primary.
 static inline
-Selection* selection_array_clear (Array* A) {
-    Selection* primary_sel = NULL;
+void delta_array_clear (Array* A) {
     for (int i = 0; i < A->size; i++) {
-        Selection* sel = A->data[i];
-        if (sel->primary && primary_sel == NULL) {
-            primary_sel = sel;
-        } else {
-            selection_destroy(sel);
-        }
+        delta_destroy(A->data[i]);
     }
     array_clear(A);
-    return primary_sel;
+}
+
+// Text with [i, j) replaced by 'ins' (which may be NULL).
+static
+Rope* splice (Rope* text, uint32_t i, uint32_t j, Rope* ins) {
+    Rope* a = rope_prefix(text, i);
+    Rope* b = rope_suffix(text, j);
+    Rope* c;
+
+    if (ins == NULL) {
+        c = rope_append(a, b);
+    } else {
+        Rope* d = rope_append(a, ins);
+        c = rope_append(d, b);
+        rope_destroy(d);
+    }
+
+    rope_destroy(a);
+    rope_destroy(b);
+    return c;
+}
+
+// Apply a run of deltas (backwards: undo them) in one pass with a builder.
+//  -> Only for deltas in ascending, non-overlapping order, which leave each
+//      other's positions alone; returns NULL otherwise.
+static
+Rope* splice_all (Rope* text, Array* deltas, bool forward) {
+    uint32_t end = 0;
+    for (int i = 0; i < deltas->size; i++) {
+        Delta* delta = deltas->data[i];
+        if (delta->pos < end) return NULL;
+        end = delta->pos + delta_rope_len(delta->inserted);
+    }
+
+    // Positions are in the text after the earlier deltas; forwards, the source
+    //  is the text before them, so shift back by their growth.
+    RopeBuilder* out = rope_builder_create();
+    uint32_t last = 0;
+    int64_t shift = 0;
+    for (int i = 0; i < deltas->size; i++) {
+        Delta* delta = deltas->data[i];
+        Rope* from = forward ? delta->removed : delta->inserted;
+        Rope* to = forward ? delta->inserted : delta->removed;
+
+        uint32_t pos = forward ? delta->pos - shift : delta->pos;
+        rope_builder_put_substr(out, text, last, pos);
+        if (to != NULL) rope_builder_put_substr(out, to, 0, rope_len(to));
+        last = pos + delta_rope_len(from);
+        shift += (int64_t) delta_rope_len(delta->inserted) - delta_rope_len(delta->removed);
+    }
+    rope_builder_put_substr(out, text, last, rope_len(text));
+
+    return rope_builder_finish(out);
 }
 
 
 //
 // History Object.
+//  -> The state after an action: the deltas that produced it from its parent
+//      state, plus the selections on either side.
+//  -> States form a tree. The undo ring holds the path from the oldest state to
+//      the current one; 'branch' is the child that redo follows.
+//  -> Some states also keep a snapshot of the full text, so a step across them
+//      is a rope copy instead of replaying deltas. A snapshot shares leaves with
+//      its neighbours; what it pins beyond them is roughly the delta text
+//      since the last snapshot, which is already accounted for.
+//  -> States loaded from a history log keep a pointer to their record and are
+//      decoded on first use.
 //
 
 typedef struct hist Hist;
 struct hist {
-    Rope* text;
+    Hist* parent;
+    Array* children;
+    uint32_t branch;
+
+    uint32_t seq;
+    uint32_t log_gen;
 
-    Array* selections;
-    Array* pre_selections;
+    Array* deltas;
+    Rope* snapshot;
+
+    SelectionArray* selections;
+    SelectionArray* pre_selections;
+
+    const uint8_t* record;
+    const uint8_t* record_end;
+    uint64_t bytes;
 };
 
 static
-Hist* hist_create (TextBuffer* buffer) {
+Hist* hist_alloc (uint32_t seq) {
     Hist* hist = malloc(sizeof(Hist));
-    hist->text = rope_copy(buffer->text);
-    hist->selections = array_create();
-    hist->pre_selections = array_create();
+    hist->parent = NULL;
+    hist->children = array_create_capacity(1);
+    hist->branch = 0;
+    hist->seq = seq;
+    hist->log_gen = 0;
+    hist->deltas = NULL;
+    hist->snapshot = NULL;
+    hist->selections = NULL;
+    hist->pre_selections = NULL;
+    hist->record = NULL;
+    hist->record_end = NULL;
+    hist->bytes = sizeof(Hist);
+
+    return hist;
+}
+
+static
+Hist* hist_create (TextBuffer* buffer) {
+    Hist* hist = hist_alloc(buffer->hist_seq++);
+    hist->selections = selection_array_create();
+    hist->pre_selections = selection_array_create();
+
+    // Take over the deltas of the action.
+    hist->deltas = buffer->deltas;
+    buffer->deltas = array_create();
 
     selection_array_copy(buffer->selections, hist->selections);
     selection_array_copy(buffer->pre_selections, hist->pre_selections);
@@ -159,22 +246,89 @@ Hist* hist_create (TextBuffer* buffer) {
     return hist;
 }
 
+// Approximate bytes retained by a state.
+static
+uint64_t hist_size (Hist* hist) {
+    uint64_t bytes = sizeof(Hist) + 2 * sizeof(Array) + 2 * sizeof(SelectionArray);
+    if (hist->deltas == NULL) return bytes;
+
+    bytes += (hist->selections->capacity + hist->pre_selections->capacity) * sizeof(Selection);
+    for (int i = 0; i < hist->deltas->size; i++) {
+        Delta* delta = hist->deltas->data[i];
+        bytes += sizeof(Delta) + sizeof(void*);
+        bytes += ((uint64_t) delta_rope_len(delta->removed) + delta_rope_len(delta->inserted)) * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+// Decode a state loaded from the log.
+static
+void hist_materialize (TextBuffer* buffer, Hist* hist) {
+    if (hist->deltas != NULL) return;
+
+    hist->deltas = array_create();
+    hist->selections = selection_array_create();
+    hist->pre_selections = selection_array_create();
+    histlog_read_action(hist->record, hist->record_end, hist->deltas, hist->selections, hist->pre_selections);
+
+    uint64_t bytes = hist_size(hist);
+    buffer->hist_bytes += bytes - hist->bytes;
+    hist->bytes = bytes;
+}
+
 static
 void hist_destroy (Hist* hist) {
-    selection_destroy(selection_array_clear(hist->selections));
-    selection_destroy(selection_array_clear(hist->pre_selections));
-    array_destroy(hist->selections);
-    array_destroy(hist->pre_selections);
-    rope_destroy(hist->text);
+    if (hist->deltas != NULL) {
+        delta_array_clear(hist->deltas);
+        array_destroy(hist->deltas);
+        selection_array_destroy(hist->selections);
+        selection_array_destroy(hist->pre_selections);
+    }
+    if (hist->snapshot != NULL) rope_destroy(hist->snapshot);
+    array_destroy(hist->children);
     free(hist);
 }
 
-static inline
-void hist_array_clear (Array* A) {
-    for (int i = 0; i < A->size; i++) {
-        hist_destroy(A->data[i]);
+// Drop a state and its descendants, except the subtree at 'keep' (which may be NULL).
+//  -> They are freed later by hist_collect.
+static
+void hist_discard (TextBuffer* buffer, Hist* hist, Hist* keep) {
+    Array* stack = array_create();
+    array_push(stack, hist);
+    while (stack->size > 0) {
+        Hist* h = array_pop(stack);
+        for (int i = 0; i < h->children->size; i++) {
+            if (h->children->data[i] != keep) array_push(stack, h->children->data[i]);
+        }
+        buffer->hist_bytes -= h->bytes;
+        array_add(buffer->hist_garbage, h);
     }
-    array_clear(A);
+    array_destroy(stack);
+
+    if (keep != NULL) keep->parent = NULL;
+
+    // Buffers that never idle still need a bound.
+    if (buffer->hist_garbage->size > HIST_GARBAGE_LIMIT) hist_collect(buffer);
+}
+
+static
+void hist_collect (TextBuffer* buffer) {
+    for (int i = 0; i < buffer->hist_garbage->size; i++) {
+        hist_destroy(buffer->hist_garbage->data[i]);
+    }
+    array_clear(buffer->hist_garbage);
+}
+
+// Drop the whole tree.
+static
+void hist_clear (TextBuffer* buffer) {
+    if (buffer->undo->size > 0) hist_discard(buffer, ring_get(buffer->undo, 0), NULL);
+    ring_clear(buffer->undo);
+}
+
+static inline
+bool hist_logged (TextBuffer* buffer, Hist* hist) {
+    return buffer->log != NULL && hist->log_gen == buffer->log_gen;
 }
 
 
@@ -185,40 +339,53 @@ void hist_array_clear (Array* A) {
 TextBuffer* textbuffer_create (Rope* text) {
     TextBuffer* buffer = malloc(sizeof(TextBuffer));
     buffer->text = text;
-    buffer->undo = array_create();
-    buffer->redo = array_create();
+    buffer->undo = ring_create();
+    buffer->hist_garbage = array_create();
+    buffer->hist_seq = 0;
+    buffer->log = NULL;
+    buffer->log_gen = 1;
+    buffer->deltas = array_create();
+    buffer->action_base = NULL;
+    buffer->hist_bytes = 0;
+    buffer->hist_budget = HIST_BUDGET;
+    buffer->hist_unsnapped = 0;
     buffer->action_state = false;
     buffer->action_type = 0;
-    buffer->selections = array_create();
-    buffer->pre_selections = array_create();
+    buffer->action_start = 0;
+    buffer->action_time = 0;
+    buffer->selections = selection_array_create();
+    buffer->pre_selections = selection_array_create();
     buffer->tab_width = 4;
     buffer->hard_tabs = false;
 
-    Selection* primary_sel = selection_create();
-    primary_sel->primary = true;
-    array_add(buffer->selections, primary_sel);
+    Selection primary_sel = { .primary = true };
+    selection_array_push_back(buffer->selections, primary_sel);
 
     action_begin(buffer, ACTION_EDIT);
     action_end(buffer);
     buffer->cursor_dmg = false;
     buffer->text_dmg = false;
 
-    buffer->line_state = array_create();
+    buffer->line_state = line_index_create();
+    buffer->matches = NULL;
     buffer->mode = NULL;
 
     return buffer;
 }
 
 void textbuffer_destroy (TextBuffer* buffer) {
-    array_destroy(buffer->line_state);
-    selection_destroy(selection_array_clear(buffer->selections));
-    selection_destroy(selection_array_clear(buffer->pre_selections));
-    array_destroy(buffer->selections);
-    array_destroy(buffer->pre_selections);
-    hist_array_clear(buffer->undo);
-    hist_array_clear(buffer->redo);
-    array_destroy(buffer->undo);
-    array_destroy(buffer->redo);
+    line_index_destroy(buffer->line_state);
+    if (buffer->matches != NULL) match_index_destroy(buffer->matches);
+    selection_array_destroy(buffer->selections);
+    selection_array_destroy(buffer->pre_selections);
+    history_detach(buffer);
+    hist_clear(buffer);
+    hist_collect(buffer);
+    ring_destroy(buffer->undo);
+    array_destroy(buffer->hist_garbage);
+    delta_array_clear(buffer->deltas);
+    array_destroy(buffer->deltas);
+    if (buffer->action_base != NULL) rope_destroy(buffer->action_base);
     rope_destroy(buffer->text);
     free(buffer);
 }
@@ -243,17 +410,23 @@ void textbuffer_get_contents (TextBuffer* buffer, CharBuffer* contents) {
 
 static
 void textbuffer_reset (TextBuffer* buffer) {
-    Selection* sel = selection_array_clear(buffer->selections);
-    selection_destroy(selection_array_clear(buffer->pre_selections));
-    hist_array_clear(buffer->undo);
-    hist_array_clear(buffer->redo);
+    Selection* sel = selection_array_keep_primary(buffer->selections);
+    selection_array_clear(buffer->pre_selections);
+    hist_clear(buffer);
+    delta_array_clear(buffer->deltas);
+
+    // The log no longer describes this text.
+    history_detach(buffer);
+
+    if (buffer->action_base != NULL) rope_destroy(buffer->action_base);
+    buffer->action_base = NULL;
     buffer->action_state = false;
     buffer->action_type = 0;
 
     sel->cursor = sel->anchor = sel->col_mem = 0;
-    array_add(buffer->selections, sel);
 
-    array_clear(buffer->line_state);
+    line_index_clear(buffer->line_state);
+    if (buffer->matches != NULL) match_index_reset(buffer->matches);
 
     action_begin(buffer, ACTION_EDIT);
     action_end(buffer);
@@ -280,7 +453,7 @@ void textbuffer_set_contents (TextBuffer* buffer, CharBuffer* contents) {
 
 void textbuffer_primary_point (TextBuffer* buffer, Point* P) {
     for (int i = 0; i < buffer->selections->size; i++) {
-        Selection* sel = buffer->selections->data[i];
+        Selection* sel = &buffer->selections->data[i];
         if (sel->primary) {
             *P = rope_index_to_point(buffer->text, sel->cursor);
             return;
@@ -293,6 +466,214 @@ void textbuffer_set_mode (TextBuffer* buffer, Mode* mode) {
     if (mode != NULL && mode->force_hard_tabs) {
         buffer->hard_tabs = true;
     }
+    line_index_clear(buffer->line_state);
+}
+
+
+//
+// Line State.
+//
+
+static
+bool line_state_char (uint32_t i, uint32_t ch, void* data) {
+    colorize_next_char_fast(data, ch);
+    return true;
+}
+
+// Colorize one line from 'state', leaving its end state in 'state'.
+static
+void line_state_advance (TextBuffer* buffer, int32_t line, LineState* state) {
+    Colorizer colorizer = { .mode = buffer->mode };
+
+    int32_t start = rope_point_to_index(buffer->text, (Point) {line, 0});
+    int32_t end = rope_point_to_index(buffer->text, (Point) {line, INT_MAX});
+
+    colorize_begin_line(&colorizer, state);
+    rope_foreach_substr(buffer->text, start, end, line_state_char, &colorizer);
+    line_state_char(end, '\n', &colorizer);
+    colorize_end_line(&colorizer, state);
+}
+
+// Fill in line states for all lines before 'line'.
+void textbuffer_line_state_fill (TextBuffer* buffer, int32_t line) {
+    line = MIN(line, rope_lines(buffer->text) + 1);
+
+    LineState state = {0};
+    if (buffer->line_state->size > 0)
+        state = *line_index_get(buffer->line_state, buffer->line_state->size - 1);
+
+    while (buffer->line_state->size < line) {
+        line_state_advance(buffer, buffer->line_state->size, &state);
+        line_index_push(buffer->line_state, &state);
+    }
+}
+
+// Start state of 'line' for drawing.
+//  -> Exact if the filled prefix is within LINE_CHECKPOINT lines of it.
+//  -> Otherwise resyncs from the checkpoint at or above the line, guessing a
+//      default state if that checkpoint has not been seen yet. Either way at
+//      most LINE_CHECKPOINT lines are colorized.
+void textbuffer_line_state_view (TextBuffer* buffer, int32_t line, LineState* state) {
+    LineIndex* index = buffer->line_state;
+    line = MAX(0, MIN(line, rope_lines(buffer->text)));
+
+    if (line <= index->size + LINE_CHECKPOINT) {
+        textbuffer_line_state_fill(buffer, line);
+        LineState* exact = line_index_get(index, line - 1);
+        *state = exact != NULL ? *exact : (LineState) {0};
+        return;
+    }
+
+    int32_t check = line - line % LINE_CHECKPOINT;
+    LineState* guess = line_index_check_get(index, check);
+    *state = guess != NULL ? *guess : (LineState) {0};
+    if (guess == NULL) line_index_check_set(index, check, state);
+
+    for (int32_t n = check; n < line; n++)
+        line_state_advance(buffer, n, state);
+}
+
+// Record the end state of a drawn 'line' whose start came from textbuffer_line_state_view.
+void textbuffer_line_state_note (TextBuffer* buffer, int32_t line, LineState* end) {
+    LineIndex* index = buffer->line_state;
+
+    if (index->size == line) {
+        line_index_push(index, end);
+    } else if (index->size < line) {
+        line_index_check_set(index, line + 1, end);
+    }
+}
+
+// Background work: free discarded history, index find matches, then extend
+//  the exact line state prefix by up to LINE_IDLE_BUDGET lines.
+//  -> Returns true if work remains.
+bool textbuffer_idle (TextBuffer* buffer) {
+    hist_collect(buffer);
+
+    if (buffer->matches != NULL && match_index_scan(buffer->matches, buffer->text, MATCH_IDLE_BUDGET)) return true;
+
+    int32_t lines = rope_lines(buffer->text) + 1;
+    if (buffer->line_state->size >= lines) return false;
+
+    textbuffer_line_state_fill(buffer, MIN(lines, buffer->line_state->size + LINE_IDLE_BUDGET));
+    return buffer->line_state->size < lines;
+}
+
+// Bracket depth at the start of a line.
+//  -> A hint for indentation: the number of unclosed brackets before the line.
+int32_t textbuffer_indent_hint (TextBuffer* buffer, int32_t line) {
+    if (line <= 0) return 0;
+
+    textbuffer_line_state_fill(buffer, line);
+    LineState* state = line_index_get(buffer->line_state, line - 1);
+    return state == NULL ? 0 : MAX(0, state->bracket_depth);
+}
+
+
+//
+// Bracket Matching.
+//
+
+struct bracket_line_data {
+    Colorizer colorizer;
+    int32_t* depths;
+    int32_t start;
+};
+
+static
+bool bracket_line_char (uint32_t i, uint32_t ch, void* d) {
+    struct bracket_line_data* data = d;
+    colorize_next_char_fast(&data->colorizer, ch);
+    data->depths[i - data->start] = data->colorizer.bracket_depth;
+    return true;
+}
+
+// Bracket depth after each character of a line.
+//  -> Line states must be filled up to the line.
+//  -> Returns a malloc'd array of length *len; *depth is the depth at the line start.
+static
+int32_t* bracket_line (TextBuffer* buffer, int32_t line, int32_t* start, int32_t* len, int32_t* depth) {
+    *start = rope_point_to_index(buffer->text, (Point) {line, 0});
+    int32_t end = rope_point_to_index(buffer->text, (Point) {line, INT_MAX});
+    *len = end - *start;
+
+    struct bracket_line_data data = {
+        .colorizer = { .mode = buffer->mode },
+        .depths = malloc(MAX(1, *len) * sizeof(int32_t)),
+        .start = *start,
+    };
+    colorize_begin_line(&data.colorizer, line_index_get(buffer->line_state, line - 1));
+    *depth = data.colorizer.bracket_depth;
+    rope_foreach_substr(buffer->text, *start, end, bracket_line_char, &data);
+    return data.depths;
+}
+
+// +1 for an opening bracket at q, -1 for a closing bracket, else 0.
+static inline
+int32_t bracket_delta (int32_t* depths, int32_t q, int32_t len, int32_t d0) {
+    if (q < 0 || q >= len) return 0;
+    return depths[q] - (q > 0 ? depths[q-1] : d0);
+}
+
+// Index of the bracket matching the one at i (or just before i), or -1.
+int32_t textbuffer_match_bracket (TextBuffer* buffer, int32_t i) {
+    if (buffer->mode == NULL) return -1;
+
+    int32_t line = rope_index_to_point(buffer->text, i).row;
+    textbuffer_line_state_fill(buffer, line);
+
+    int32_t start, len, d0;
+    int32_t* depths = bracket_line(buffer, line, &start, &len, &d0);
+
+    // Bracket at the cursor, or just before it.
+    int32_t q = i - start;
+    int32_t delta = bracket_delta(depths, q, len, d0);
+    if (delta == 0) delta = bracket_delta(depths, --q, len, d0);
+
+    int32_t match = -1;
+    if (delta > 0) {
+        // Opening bracket: first point after it back at the outer depth.
+        int32_t d = depths[q] - 1;
+        for (int c = q + 1; c < len && match < 0; c++)
+            if (depths[c] <= d) match = start + c;
+
+        if (match < 0) {
+            // Fill line states only as far as the match, in doubling steps.
+            int32_t lines = rope_lines(buffer->text) + 1;
+            int32_t from = line + 1;
+            int32_t m = -1;
+            for (int32_t step = LINE_CHECKPOINT;; step = MIN(step, INT_MAX / 2) * 2) {
+                textbuffer_line_state_fill(buffer, from + MIN(lines - from, step));
+                m = line_index_next_below(buffer->line_state, from, d);
+                if (m >= 0 || buffer->line_state->size >= lines) break;
+                from = buffer->line_state->size;
+            }
+            if (m >= 0) {
+                free(depths);
+                depths = bracket_line(buffer, m, &start, &len, &d0);
+                for (int c = 0; c < len && match < 0; c++)
+                    if (depths[c] <= d) match = start + c;
+            }
+        }
+    } else if (delta < 0) {
+        // Closing bracket: last point before it at the outer depth; the match follows it.
+        int32_t d = depths[q];
+        for (int c = q - 1; c >= -1 && match < 0; c--)
+            if ((c >= 0 ? depths[c] : d0) <= d) match = start + c + 1;
+
+        if (match < 0) {
+            int32_t m = line_index_prev_below(buffer->line_state, line - 1, d);
+            if (m >= 0) {
+                free(depths);
+                depths = bracket_line(buffer, m, &start, &len, &d0);
+                for (int c = len - 1; c >= -1 && match < 0; c--)
+                    if ((c >= 0 ? depths[c] : d0) <= d) match = start + c + 1;
+            }
+        }
+    }
+
+    free(depths);
+    return match;
 }
 
 //
@@ -304,85 +685,505 @@ void action_begin (TextBuffer* buffer, uint32_t action) {
     if (buffer->action_state && buffer->action_type != action) {
         action_end(buffer);
     }
+    // A logged buffer cuts long actions short, so the log never trails the
+    //  text by more than HISTLOG_ACTION_DELAY seconds or HISTLOG_ACTION_EDITS edits.
+    if (buffer->action_state && buffer->log != NULL
+            && (now() - buffer->action_start >= HISTLOG_ACTION_DELAY || buffer->deltas->size >= HISTLOG_ACTION_EDITS)) {
+        action_end(buffer);
+    }
     if (!buffer->action_state) {
         assert(buffer->pre_selections->size == 0 && "Invalid Action-Begin");
         selection_array_copy(buffer->selections, buffer->pre_selections);
 
+        assert(buffer->deltas->size == 0 && "Invalid Action-Begin");
+        buffer->action_base = rope_copy(buffer->text);
+
         buffer->action_state = true;
         buffer->action_type = action;
+        buffer->action_start = now();
     }
 
+    buffer->action_time = now();
     buffer->text_dmg = true;
     buffer->cursor_dmg = true;
 }
 
 static
 void action_end (TextBuffer* buffer) {
+    // Cursors that ran into each other become one.
+    selection_array_normalize(buffer->selections);
+
     if (buffer->action_state) {
-        // Commit new State.
+        // Commit new State, as the newest branch of the current one.
         Hist* state = hist_create(buffer);
-        array_add(buffer->undo, state);
-        hist_array_clear(buffer->redo);
+        Hist* parent = ring_peek(buffer->undo);
+        if (parent != NULL) {
+            state->parent = parent;
+            array_add(parent->children, state);
+            parent->branch = parent->children->size - 1;
+
+            if (hist_logged(buffer, parent)) {
+                histlog_append_action(buffer->log, state->seq, parent->seq, state->deltas, state->selections, state->pre_selections);
+                state->log_gen = buffer->log_gen;
+            }
+        }
+
+        // Snapshots: on both sides of an action with many deltas, whose deltas
+        //  are then not needed, and periodically by delta bytes.
+        if (state->deltas->size > HIST_SNAPSHOT_DELTAS && buffer->undo->size > 0) {
+            Hist* prev = ring_peek(buffer->undo);
+            if (prev->snapshot == NULL) prev->snapshot = rope_copy(buffer->action_base);
+
+            delta_array_clear(state->deltas);
+        }
+        state->bytes = hist_size(state);
+        buffer->hist_unsnapped += state->bytes;
+        if (buffer->undo->size == 0 || state->deltas->size == 0 || buffer->hist_unsnapped > HIST_SNAPSHOT_BYTES) {
+            state->snapshot = rope_copy(buffer->text);
+            buffer->hist_unsnapped = 0;
+        }
+
+        ring_push(buffer->undo, state);
+        buffer->hist_bytes += state->bytes;
 
-        // History Limit.
-        while (buffer->undo->size > HIST_LIMIT) {
-            // Remove oldest.
-            hist_destroy(array_remove(buffer->undo, 0));
+        // History Budget.
+        while (buffer->hist_bytes > buffer->hist_budget && buffer->undo->size > 1) {
+            // Remove oldest, with any branches off the current path.
+            Hist* oldest = ring_shift(buffer->undo);
+            hist_discard(buffer, oldest, ring_get(buffer->undo, 0));
         }
 
-        selection_destroy(selection_array_clear(buffer->pre_selections));
+        rope_destroy(buffer->action_base);
+        buffer->action_base = NULL;
+
+        selection_array_clear(buffer->pre_selections);
         buffer->action_state = false;
     }
 
     buffer->cursor_dmg = true;
 }
 
+// Replay a state's deltas forward (to reach it) or backward (to leave it).
+static
+void hist_apply (TextBuffer* buffer, Hist* state, bool forward) {
+    // Many edits: one pass over the text rather than a splice each.
+    if (state->deltas->size > HIST_SPLICE_DELTAS) {
+        Rope* text = splice_all(buffer->text, state->deltas, forward);
+        if (text != NULL) {
+            rope_destroy(buffer->text);
+            buffer->text = text;
+            if (buffer->matches != NULL) match_index_reset(buffer->matches);
+            return;
+        }
+    }
+
+    Rope* text = rope_copy(buffer->text);
+
+    for (int i = 0; i < state->deltas->size; i++) {
+        Delta* delta = state->deltas->data[forward ? i : state->deltas->size - 1 - i];
+        Rope* from = forward ? delta->removed : delta->inserted;
+        Rope* to = forward ? delta->inserted : delta->removed;
+
+        Rope* next = splice(text, delta->pos, delta->pos + delta_rope_len(from), to);
+        rope_destroy(text);
+        text = next;
+
+        if (buffer->matches != NULL)
+            match_index_edit(buffer->matches, text, delta->pos, delta_rope_len(from), delta_rope_len(to));
+    }
+
+    rope_destroy(buffer->text);
+    buffer->text = text;
+}
+
+// Whether a state's deltas, replayed as hist_apply would, stay within a text
+//  of 'len' characters: a state decoded from a damaged log may not.
+static
+bool hist_fits (Hist* state, uint32_t len, bool forward) {
+    for (int i = 0; i < state->deltas->size; i++) {
+        Delta* delta = state->deltas->data[forward ? i : state->deltas->size - 1 - i];
+        uint32_t from = delta_rope_len(forward ? delta->removed : delta->inserted);
+        uint32_t to = delta_rope_len(forward ? delta->inserted : delta->removed);
+        if (delta->pos > len || from > len - delta->pos || to > INT32_MAX - (len - from)) return false;
+        len = len - from + to;
+    }
+    return true;
+}
+
+// The selections of a state, kept within the text.
+static
+void hist_restore_selections (TextBuffer* buffer, SelectionArray* selections) {
+    selection_array_clear(buffer->selections);
+    selection_array_copy(selections, buffer->selections);
+
+    int32_t len = rope_len(buffer->text);
+    for (int i = 0; i < buffer->selections->size; i++) {
+        Selection* sel = &buffer->selections->data[i];
+        sel->cursor = MIN(MAX(sel->cursor, 0), len);
+        sel->anchor = MIN(MAX(sel->anchor, 0), len);
+    }
+    selection_array_normalize(buffer->selections);
+    if (buffer->selections->size == 0) selection_array_push_back(buffer->selections, (Selection) { .primary = true });
+}
+
+static
+void hist_restore_text (TextBuffer* buffer, Hist* state, Hist* via, bool forward) {
+    if (state->snapshot != NULL) {
+        rope_destroy(buffer->text);
+        buffer->text = rope_copy(state->snapshot);
+        if (buffer->matches != NULL) match_index_reset(buffer->matches);
+    } else {
+        hist_apply(buffer, via, forward);
+    }
+    line_index_clear(buffer->line_state);
+}
+
 void textbuffer_undo (TextBuffer* buffer) {
     action_end(buffer);
 
-    // Current state is always top of undo stack.
-    // Pop off current state, push to redo, restore new current (new top of stack).
-    // This means there must be at least two states in the undo stack.
+    // Current state is always top of undo ring.
+    // Pop off current state, restore its parent (new top of ring).
+    // This means there must be at least two states in the undo ring.
     if (buffer->undo->size >= 2) {
+        Hist* current = ring_peek(buffer->undo);
+        hist_materialize(buffer, current);
+        Hist* state = ring_get(buffer->undo, buffer->undo->size - 2);
+        if (state->snapshot == NULL && !hist_fits(current, rope_len(buffer->text), false)) return;
+
         // Pop State.
-        Hist* current = array_pop(buffer->undo);
-        array_add(buffer->redo, current);
+        ring_pop(buffer->undo);
 
-        // Restore state.
-        Hist* state = array_peek(buffer->undo);
+        // Restore state, remembering the branch for redo.
+        for (int i = 0; i < state->children->size; i++)
+            if (state->children->data[i] == current) state->branch = i;
 
         // -> Text.
-        rope_destroy(buffer->text);
-        buffer->text = rope_copy(state->text);
-        array_clear(buffer->line_state);
+        hist_restore_text(buffer, state, current, false);
 
         // -> Selections.
-        selection_destroy(selection_array_clear(buffer->selections));
-        selection_array_copy(current->pre_selections, buffer->selections);
+        hist_restore_selections(buffer, current->pre_selections);
+
+        history_goto(buffer);
     }
 }
 
 void textbuffer_redo (TextBuffer* buffer) {
     action_end(buffer);
 
-    // Pop state off redo stack, resore it, and push to undo.
-    // Undo state must have size at least 1.
-    if (buffer->redo->size >= 1) {
+    // Follow the current state's branch and push it to the undo ring.
+    Hist* current = ring_peek(buffer->undo);
+    if (current != NULL && current->children->size > 0) {
         // Restore state.
-        Hist* state = array_pop(buffer->redo);
-        array_add(buffer->undo, state);
+        Hist* state = current->children->data[current->branch];
+        hist_materialize(buffer, state);
+        if (state->snapshot == NULL && !hist_fits(state, rope_len(buffer->text), true)) return;
+        ring_push(buffer->undo, state);
 
         // -> Text.
-        rope_destroy(buffer->text);
-        buffer->text = rope_copy(state->text);
-        array_clear(buffer->line_state);
+        hist_restore_text(buffer, state, state, true);
 
         // -> Selections.
-        selection_destroy(selection_array_clear(buffer->selections));
-        selection_array_copy(state->selections, buffer->selections);
+        hist_restore_selections(buffer, state->selections);
+
+        history_goto(buffer);
     }
 }
 
+// Move to a sibling of the current state: undo, switch branch, redo.
+void textbuffer_undo_branch (TextBuffer* buffer, int32_t i) {
+    action_end(buffer);
+
+    if (buffer->undo->size < 2) return;
+    Hist* parent = ring_get(buffer->undo, buffer->undo->size - 2);
+    if (parent->children->size < 2) return;
+
+    textbuffer_undo(buffer);
+    parent->branch = MOD(parent->branch + i, parent->children->size);
+    textbuffer_redo(buffer);
+}
+
+
+// -- Persistent History -- //
+
+// Log the current position after undo/redo, so recovery lands on it.
+static
+void history_goto (TextBuffer* buffer) {
+    if (buffer->log == NULL) return;
+
+    Hist* current = ring_peek(buffer->undo);
+    histlog_append_goto(buffer->log, hist_logged(buffer, current) ? current->seq : HISTLOG_NONE);
+}
+
+// Decode every state of the tree still read from the log.
+static
+void history_materialize_all (TextBuffer* buffer) {
+    Hist* root = ring_peek(buffer->undo);
+    while (root->parent != NULL) root = root->parent;
+
+    Array* stack = array_create();
+    array_add(stack, root);
+    while (stack->size > 0) {
+        Hist* hist = array_pop(stack);
+        hist_materialize(buffer, hist);
+        for (int c = 0; c < hist->children->size; c++) array_add(stack, hist->children->data[c]);
+    }
+    array_destroy(stack);
+}
+
+// End the session in the log and close it.
+static
+void history_detach (TextBuffer* buffer) {
+    if (buffer->log == NULL) return;
+
+    Hist* current = ring_peek(buffer->undo);
+    histlog_append_close(buffer->log, current == NULL ? HISTLOG_NONE : current->seq);
+    histlog_close(buffer->log);
+    buffer->log = NULL;
+}
+
+// Start the log over with the current state as its root.
+static
+void history_restart (TextBuffer* buffer, struct stat* st, uint64_t hash) {
+    Hist* current = ring_peek(buffer->undo);
+    hist_materialize(buffer, current);
+
+    histlog_reset(buffer->log);
+    buffer->log_gen++;
+
+    Array* none = array_create();
+    SelectionArray* no_selections = selection_array_create();
+    histlog_append_action(buffer->log, current->seq, HISTLOG_NONE, none, current->selections, no_selections);
+    histlog_append_save(buffer->log, current->seq, st, hash);
+    selection_array_destroy(no_selections);
+    array_destroy(none);
+
+    current->log_gen = buffer->log_gen;
+}
+
+// Walk from the current state to 'target' through their common ancestor.
+//  -> Deltas are replayed into the rope directly; no snapshots are needed.
+//  -> Only the destination is logged.
+static
+void history_recover (TextBuffer* buffer, Hist* target) {
+    HistLog* log = buffer->log;
+    buffer->log = NULL;
+
+    Array* path = array_create();
+    for (Hist* h = target; h != NULL; h = h->parent) array_add(path, h);
+
+    // Depth of the deepest state shared with the undo ring (both start at the root).
+    uint32_t shared = 0;
+    while (shared < buffer->undo->size && shared < path->size && ring_get(buffer->undo, shared) == path->data[path->size - 1 - shared])
+        shared++;
+
+    // A step that doesn't fit the text stops the walk short of 'target'.
+    bool moved = true;
+    while (buffer->undo->size > shared && moved) {
+        uint32_t size = buffer->undo->size;
+        textbuffer_undo(buffer);
+        moved = buffer->undo->size < size;
+    }
+    for (uint32_t d = shared; d < path->size && moved && buffer->undo->size == d; d++) {
+        Hist* parent = path->data[path->size - d];
+        Hist* child = path->data[path->size - 1 - d];
+        for (int c = 0; c < parent->children->size; c++)
+            if (parent->children->data[c] == child) parent->branch = c;
+        textbuffer_redo(buffer);
+    }
+
+    array_destroy(path);
+
+    buffer->log = log;
+    history_goto(buffer);
+}
+
+// State 'seq' among 'states', which are in ascending seq order; NULL if absent.
+static
+Hist* history_find (Array* states, uint32_t seq, int32_t* index) {
+    int32_t lo = 0, hi = states->size;
+    while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+        if (((Hist*) states->data[mid])->seq < seq) lo = mid + 1;
+        else hi = mid;
+    }
+    if (index != NULL) *index = lo;
+    if (lo < states->size && ((Hist*) states->data[lo])->seq == seq) return states->data[lo];
+    return NULL;
+}
+
+// Rebuild the tree from the log, if a save marker matches the file.
+//  -> Markers match on size and content hash: a touch or a copy changes the
+//      mtime but not the text, and the hash is at hand from reading it.
+//  -> If the log ends away from a saved state without a clean close, the
+//      editor died with unsaved edits: they are replayed onto the file's text.
+//  -> States are logged in ascending seq order, parents first; a record out
+//      of that order ends the log, so the states never outnumber its records.
+static
+bool history_load (TextBuffer* buffer, struct stat* st, uint64_t hash) {
+    Array* states = array_create();
+    Hist* saved = NULL;
+    uint32_t position = HISTLOG_NONE;
+    bool saved_last = false;
+
+    HistRecord rec;
+    while (histlog_next(buffer->log, &rec)) {
+        if (rec.type == HISTLOG_CLOSE) {
+            position = HISTLOG_NONE;
+        } else {
+            position = rec.seq;
+        }
+
+        if (rec.type == HISTLOG_ACTION) {
+            Hist* last = array_peek(states);
+            if (last != NULL && rec.seq <= last->seq) {
+                if (history_find(states, rec.seq, NULL) != NULL) continue;
+                break;
+            }
+
+            Hist* hist = hist_alloc(rec.seq);
+            hist->record = rec.payload;
+            hist->record_end = rec.end;
+            hist->log_gen = buffer->log_gen;
+            array_add(states, hist);
+
+            // Parents are always logged before their children.
+            Hist* parent = rec.parent == HISTLOG_NONE ? NULL : history_find(states, rec.parent, NULL);
+            if (parent != NULL && parent != hist) {
+                hist->parent = parent;
+                array_add(parent->children, hist);
+                parent->branch = parent->children->size - 1;
+            }
+        } else if (rec.type == HISTLOG_SAVE) {
+            Hist* hist = history_find(states, rec.seq, NULL);
+            if (hist != NULL && rec.size == st->st_size && rec.hash == hash) {
+                saved = hist;
+                saved_last = true;
+            } else {
+                saved_last = false;
+            }
+        }
+    }
+
+    // New states go on after every one in the log, kept or not.
+    Hist* last = array_peek(states);
+    uint32_t max_seq = last == NULL ? 0 : last->seq;
+
+    // Keep only the tree holding the saved state.
+    //  -> Roots are found before anything is freed, as parents come first.
+    Hist* root = saved;
+    while (root != NULL && root->parent != NULL) root = root->parent;
+    Array* roots = array_create_capacity(MAX(1, states->size));
+    for (int i = 0; i < states->size; i++) {
+        Hist* hist = states->data[i];
+        int32_t k;
+        if (hist->parent != NULL) history_find(states, hist->parent->seq, &k);
+        array_add(roots, hist->parent == NULL ? hist : roots->data[k]);
+    }
+    int n = 0;
+    for (int i = 0; i < states->size; i++) {
+        if (roots->data[i] == root) states->data[n++] = states->data[i];
+        else hist_destroy(states->data[i]);
+    }
+    states->size = n;
+    array_destroy(roots);
+    if (saved == NULL) {
+        array_destroy(states);
+        return false;
+    }
+
+    // Edits since a later save to other contents are not ours to replay.
+    Hist* unsaved = NULL;
+    if (saved_last && position != HISTLOG_NONE && position != saved->seq) unsaved = history_find(states, position, NULL);
+
+    // Replace the fresh history.
+    hist_clear(buffer);
+    for (int i = 0; i < states->size; i++) {
+        Hist* hist = states->data[i];
+        buffer->hist_bytes += hist->bytes;
+    }
+    buffer->hist_seq = max_seq + 1;
+    buffer->hist_unsnapped = 0;
+
+    // Undo ring is the path from the root to the saved state.
+    Array* path = array_create();
+    for (Hist* h = saved; h != NULL; h = h->parent) array_add(path, h);
+    for (int i = path->size - 1; i >= 0; i--) {
+        Hist* hist = path->data[i];
+        ring_push(buffer->undo, hist);
+        if (i > 0) {
+            for (int c = 0; c < hist->children->size; c++)
+                if (hist->children->data[c] == path->data[i - 1]) hist->branch = c;
+        }
+    }
+    array_destroy(path);
+    array_destroy(states);
+
+    if (unsaved != NULL) {
+        history_recover(buffer, unsaved);
+        buffer->text_dmg = true;
+    }
+
+    return true;
+}
+
+// Attach the history log at 'path' to a buffer holding the file described by
+//  'st', whose contents hash to 'hash' (see histlog_hash_update).
+//  -> A freshly loaded buffer takes its history from the log if a save marker
+//      matches the file, recovering unsaved edits. Otherwise the log starts
+//      over from the current state, and one holding unsaved edits it couldn't
+//      replay is first moved aside (see histlog_set_aside).
+//  -> Returns true if history was restored.
+bool textbuffer_history_attach (TextBuffer* buffer, const char* path, struct stat* st, uint64_t hash) {
+    action_end(buffer);
+
+    // States not yet decoded point into the old log's mapping, which goes.
+    if (buffer->log != NULL) history_materialize_all(buffer);
+    history_detach(buffer);
+    buffer->log = histlog_open(path);
+    if (buffer->log == NULL) return false;
+
+    Hist* current = ring_peek(buffer->undo);
+    bool fresh = buffer->undo->size == 1 && current->children->size == 0;
+    if (fresh && history_load(buffer, st, hash)) return true;
+
+    // Edits only the log holds are never truncated away.
+    if (histlog_pending(buffer->log) && !histlog_set_aside(buffer->log)) {
+        histlog_close(buffer->log);
+        buffer->log = NULL;
+        return false;
+    }
+    history_restart(buffer, st, hash);
+    return false;
+}
+
+// Record that the current state was saved to the file described by 'st'.
+void textbuffer_history_saved (TextBuffer* buffer, const char* path, struct stat* st, uint64_t hash) {
+    action_end(buffer);
+
+    if (buffer->log == NULL || strcmp(buffer->log->path->buffer, path) != 0) {
+        textbuffer_history_attach(buffer, path, st, hash);
+        return;
+    }
+
+    Hist* current = ring_peek(buffer->undo);
+    if (hist_logged(buffer, current)) {
+        histlog_append_save(buffer->log, current->seq, st, hash);
+        histlog_sync(buffer->log, true);
+    } else {
+        history_restart(buffer, st, hash);
+    }
+}
+
+// Flush the log's batched appends once they are due.
+//  -> An action left open through a pause in editing is committed first, so
+//      a burst of typing reaches the log once it stops.
+void textbuffer_history_sync (TextBuffer* buffer) {
+    if (buffer->log == NULL) return;
+
+    if (buffer->action_state && now() - buffer->action_time >= HISTLOG_SYNC_DELAY) action_end(buffer);
+    histlog_sync(buffer->log, false);
+}
+
 
 //
 // Edit Actions.
@@ -393,7 +1194,7 @@ void textbuffer_redo (TextBuffer* buffer) {
 static
 void update_selections (TextBuffer* buffer, uint32_t index, int32_t window, int32_t total) {
     for (int i = 0; i < buffer->selections->size; i++) {
-        Selection* sel = buffer->selections->data[i];
+        Selection* sel = &buffer->selections->data[i];
         if (sel->cursor >= index) {
             sel->cursor = MAX(index + total, sel->cursor + window);
             sel->col_mem = rope_index_to_point(buffer->text, sel->cursor).col;
@@ -404,6 +1205,26 @@ void update_selections (TextBuffer* buffer, uint32_t index, int32_t window, int3
     }
 }
 
+// Replace [i, j) with 'text', recording the change as a delta of the current action.
+static
+void text_replace (TextBuffer* buffer, uint32_t i, uint32_t j, Rope* text) {
+    assert(buffer->action_state && "Edit outside of an action");
+
+    Rope* removed = i < j ? rope_substr(buffer->text, i, j) : NULL;
+    Rope* inserted = text != NULL && rope_len(text) > 0 ? rope_copy(text) : NULL;
+    if (removed != NULL || inserted != NULL)
+        array_add(buffer->deltas, delta_create(i, removed, inserted));
+
+    Rope* c = splice(buffer->text, i, j, text);
+    rope_destroy(buffer->text);
+    buffer->text = c;
+
+    int32_t line = rope_index_to_point(buffer->text, i).row;
+    line_index_truncate(buffer->line_state, line);
+
+    if (buffer->matches != NULL) match_index_edit(buffer->matches, buffer->text, i, j - i, delta_rope_len(text));
+}
+
 static
 void textbuffer_edit (TextBuffer* buffer, uint32_t i, uint32_t j, Rope* text) {
     if (i > j) i = j;
@@ -411,32 +1232,14 @@ void textbuffer_edit (TextBuffer* buffer, uint32_t i, uint32_t j, Rope* text) {
     int32_t window = i - j;
     int32_t total = 0;
 
-    Rope* a = rope_prefix(buffer->text, i);
-    Rope* b = rope_suffix(buffer->text, j);
-    Rope* c;
-
-    if (text == NULL) {
-        c = rope_append(a, b);
-    } else {
-        Rope* d;
-        d = rope_append(a, text);
-        c = rope_append(d, b);
-        rope_destroy(d);
+    if (text != NULL) {
         total = rope_len(text);
         window += total;
     }
 
-    rope_destroy(a);
-    rope_destroy(b);
-
-    rope_destroy(buffer->text);
-    buffer->text = c;
+    text_replace(buffer, i, j, text);
 
     update_selections(buffer, i, window, total);
-
-    int32_t line = rope_index_to_point(buffer->text, i).row;
-    line = MIN(line, buffer->line_state->size);
-    buffer->line_state->size = line;
 }
 
 // - Text Actions - //
@@ -451,7 +1254,7 @@ void textbuffer_edit_char (TextBuffer* buffer, uint32_t ch, int32_t i) {
     intbuffer_destroy(itext);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         textbuffer_edit(buffer, head(sel), tail(sel), text);
     }
 
@@ -465,7 +1268,7 @@ void textbuffer_edit_text (TextBuffer* buffer, Rope* text, int32_t i) {
     action_begin(buffer, ACTION_EDIT);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         textbuffer_edit(buffer, head(sel), tail(sel), text);
     }
 
@@ -490,7 +1293,7 @@ void textbuffer_edit_tab (TextBuffer* buffer, int32_t i) {
             action_begin(buffer, ACTION_CHAR0);
             while (i > 0) {
                 for (int x = 0; x < buffer->selections->size; x++) {
-                    Selection* sel = buffer->selections->data[x];
+                    Selection* sel = &buffer->selections->data[x];
                     Point p = rope_index_to_point(buffer->text, sel->cursor);
                     int spaces = buffer->tab_width - MOD(p.col, buffer->tab_width);
                     IntBuffer* sp_buf = intbuffer_create();
@@ -538,7 +1341,7 @@ void textbuffer_edit_indent (TextBuffer* buffer, int32_t i) {
     while (i > 0) {
         Rope* text = get_indent_text(buffer);
         for (int x = 0; x < buffer->selections->size; x++) {
-            Selection* sel = buffer->selections->data[x];
+            Selection* sel = &buffer->selections->data[x];
             Point phead = rope_index_to_point(buffer->text, head(sel));
             Point ptail = rope_index_to_point(buffer->text, tail(sel));
             for (int32_t line = phead.row; line <= ptail.row; line++) {
@@ -553,7 +1356,7 @@ void textbuffer_edit_indent (TextBuffer* buffer, int32_t i) {
     // Unindent.
     while (i < 0) {
         for (int x = 0; x < buffer->selections->size; x++) {
-            Selection* sel = buffer->selections->data[x];
+            Selection* sel = &buffer->selections->data[x];
             Point phead = rope_index_to_point(buffer->text, head(sel));
             Point ptail = rope_index_to_point(buffer->text, tail(sel));
             for (int32_t line = phead.row; line <= ptail.row; line++) {
@@ -582,7 +1385,7 @@ void textbuffer_edit_delete (TextBuffer* buffer, int32_t i) {
     int32_t len = selection_array_max_len(buffer->selections);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         if (len > 0) {
             textbuffer_edit(buffer, head(sel), tail(sel), NULL);
         } else {
@@ -597,7 +1400,7 @@ void textbuffer_edit_delete (TextBuffer* buffer, int32_t i) {
 void textbuffer_edit_delete_lines (TextBuffer* buffer, int32_t i) {
     action_begin(buffer, ACTION_DELETE_LINES);
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         Point phead = rope_index_to_point(buffer->text, head(sel));
         Point ptail = rope_index_to_point(buffer->text, tail(sel));
         int32_t head = rope_point_to_index(buffer->text, (Point) {phead.row, 0});
@@ -616,7 +1419,7 @@ void textbuffer_edit_backspace (TextBuffer* buffer, int32_t i) {
     int32_t len = selection_array_max_len(buffer->selections);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         if (len > 0) {
             textbuffer_edit(buffer, head(sel), tail(sel), NULL);
         } else {
@@ -638,7 +1441,7 @@ void textbuffer_edit_duplicate (TextBuffer* buffer, int32_t i) {
     action_begin(buffer, ACTION_EDIT);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         Rope* text = rope_substr(buffer->text, head(sel), tail(sel));
         textbuffer_edit(buffer, head(sel), head(sel), text);
         rope_destroy(text);
@@ -652,7 +1455,7 @@ void textbuffer_edit_duplicate_lines (TextBuffer* buffer, int32_t i) {
     action_begin(buffer, ACTION_EDIT);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         Point phead = rope_index_to_point(buffer->text, head(sel));
         Point ptail = rope_index_to_point(buffer->text, tail(sel));
         int32_t head = rope_point_to_index(buffer->text, (Point) {phead.row, 0});
@@ -713,9 +1516,9 @@ void put_lines (TextBuffer* buffer, Rope* text, int32_t i) {
         // I might regret doing this but it works for move lines.
         // Don't make a habbit of this, all changes to buffer->text *should* be in textbuffer_edit.
         // Doing this the 'right' way breaks move lines up when the cursor is at the very end of the text.
-        Rope* t = rope_append(buffer->text, line);
-        rope_destroy(buffer->text);
-        buffer->text = t;
+        //  -> Still goes through text_replace so it is recorded, just without moving selections.
+        int32_t dst = rope_len(buffer->text);
+        text_replace(buffer, dst, dst, line);
         rope_destroy(line);
     }
     // Normal Case: Middle of text.
@@ -749,7 +1552,7 @@ void textbuffer_edit_move_lines (TextBuffer* buffer, int32_t i) {
         int32_t top = lines;
         int32_t bot = 0;
         for (int x = 0; x < buffer->selections->size; x++) {
-            Selection* sel = buffer->selections->data[x];
+            Selection* sel = &buffer->selections->data[x];
             Point phead = rope_index_to_point(buffer->text, head(sel));
             Point ptail = rope_index_to_point(buffer->text, tail(sel));
             top = MIN(phead.row, top);
@@ -777,7 +1580,7 @@ void textbuffer_edit_move_lines (TextBuffer* buffer, int32_t i) {
         int32_t top = lines;
         int32_t bot = 0;
         for (int x = 0; x < buffer->selections->size; x++) {
-            Selection* sel = buffer->selections->data[x];
+            Selection* sel = &buffer->selections->data[x];
             Point phead = rope_index_to_point(buffer->text, head(sel));
             Point ptail = rope_index_to_point(buffer->text, tail(sel));
             top = MIN(phead.row, top);
@@ -820,7 +1623,7 @@ void textbuffer_edit_yank (TextBuffer* buffer, Array* clipboard, bool cut) {
 
     // Copy Selections.
     for (int i = 0; i < buffer->selections->size; i++) {
-        Selection* sel = buffer->selections->data[i];
+        Selection* sel = &buffer->selections->data[i];
         Rope* text = rope_substr(buffer->text, head(sel), tail(sel));
         array_add(clipboard, text);
     }
@@ -829,7 +1632,7 @@ void textbuffer_edit_yank (TextBuffer* buffer, Array* clipboard, bool cut) {
     if (cut) {
         action_begin(buffer, ACTION_EDIT);
         for (int i = 0; i < buffer->selections->size; i++) {
-            Selection* sel = buffer->selections->data[i];
+            Selection* sel = &buffer->selections->data[i];
             textbuffer_edit(buffer, head(sel), tail(sel), NULL);
         }
         action_end(buffer);
@@ -841,7 +1644,7 @@ void textbuffer_edit_replace (TextBuffer* buffer, Array* clipboard, int32_t i) {
     action_begin(buffer, ACTION_EDIT);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         Rope* text = clipboard->data[clipboard->size >= buffer->selections->size ? x : 0];
         textbuffer_edit(buffer, head(sel), tail(sel), text);
     }
@@ -857,7 +1660,7 @@ void textbuffer_edit_replace (TextBuffer* buffer, Array* clipboard, int32_t i) {
 static inline
 void sync_cursors (TextBuffer* buffer, int32_t i) {
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         int32_t h = head(sel);
         int32_t t = tail(sel);
         if (i < 0) {
@@ -880,7 +1683,7 @@ void textbuffer_cursor_col (TextBuffer* buffer, int32_t i, bool s) {
     if (!s) sync_cursors(buffer, i);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         sel->cursor += i;
         if (sel->cursor < 0) sel->cursor = 0;
         if (sel->cursor > rope_len(buffer->text)) sel->cursor = rope_len(buffer->text);
@@ -894,7 +1697,7 @@ void textbuffer_cursor_row (TextBuffer* buffer, int32_t i, bool s) {
     if (!s) sync_cursors(buffer, i);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         Point p = rope_index_to_point(buffer->text, sel->cursor);
         sel->cursor = rope_point_to_index(buffer->text, (Point) {p.row + i, sel->col_mem});
         if (!s) sel->anchor = sel->cursor;
@@ -932,7 +1735,7 @@ void textbuffer_cursor_word (TextBuffer* buffer, int32_t i, bool s) {
     if (!s) sync_cursors(buffer, i);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         int32_t n = i;
 
         // Forwards.
@@ -971,7 +1774,7 @@ void textbuffer_cursor_line (TextBuffer* buffer, int32_t i, bool s) {
     if (!s) sync_cursors(buffer, i);
 
     for (int x = 0; x < buffer->selections->size; x++) {
-        Selection* sel = buffer->selections->data[x];
+        Selection* sel = &buffer->selections->data[x];
         int32_t n = i;
 
         // Forwards.
@@ -1003,12 +1806,25 @@ void textbuffer_cursor_paragraph (TextBuffer* buffer, int32_t i, bool s) {
 
 }
 
+void textbuffer_cursor_bracket (TextBuffer* buffer, bool s) {
+    action_end(buffer);
+
+    for (int x = 0; x < buffer->selections->size; x++) {
+        Selection* sel = &buffer->selections->data[x];
+        int32_t match = textbuffer_match_bracket(buffer, sel->cursor);
+        if (match < 0) continue;
+
+        sel->cursor = match;
+        if (!s) sel->anchor = sel->cursor;
+        sel->col_mem = rope_index_to_point(buffer->text, sel->cursor).col;
+    }
+}
+
 void textbuffer_cursor_goto (TextBuffer* buffer, int32_t row, int32_t col, bool s) {
     action_end(buffer);
 
     // Clear selection list except the primary selection.
-    Selection* sel = selection_array_clear(buffer->selections);
-    array_add(buffer->selections, sel);
+    Selection* sel = selection_array_keep_primary(buffer->selections);
 
     sel->cursor = rope_point_to_index(buffer->text, (Point) {row, col});
     if (!s) sel->anchor = sel->cursor;
@@ -1028,13 +1844,12 @@ void textbuffer_selection_clear (TextBuffer* buffer) {
     if (selection_array_max_len(buffer->selections) > 0) {
         // Remove Selection Region from all cursors.
         for (int x = 0; x < buffer->selections->size; x++) {
-            Selection* sel = buffer->selections->data[x];
+            Selection* sel = &buffer->selections->data[x];
             sel->anchor = sel->cursor;
         }
     } else {
         // Clear selection list except the primary selection.
-        Selection* sel = selection_array_clear(buffer->selections);
-        array_add(buffer->selections, sel);
+        selection_array_keep_primary(buffer->selections);
     }
 }
 
@@ -1047,7 +1862,7 @@ void textbuffer_selection_swap (TextBuffer* buffer) {
 void textbuffer_selection_next (TextBuffer* buffer, int32_t i) {
     action_end(buffer);
 
-    Selection* sel = buffer->selections-> data[buffer->selections->size - 1];
+    Selection* sel = &buffer->selections->data[buffer->selections->size - 1];
     Rope* text = rope_substr(buffer->text, head(sel), tail(sel));
     if (rope_len(text) > 0) {
         FindTarget* target = find_target_create(text);
@@ -1060,7 +1875,7 @@ void textbuffer_selection_next (TextBuffer* buffer, int32_t i) {
 void textbuffer_selection_add_next (TextBuffer* buffer, int32_t i) {
     action_end(buffer);
 
-    Selection* sel = buffer->selections-> data[buffer->selections->size - 1];
+    Selection* sel = &buffer->selections->data[buffer->selections->size - 1];
     Rope* text = rope_substr(buffer->text, head(sel), tail(sel));
     if (rope_len(text) > 0) {
         FindTarget* target = find_target_create(text);
@@ -1076,38 +1891,34 @@ void textbuffer_selection_add_next_row (TextBuffer* buffer, int32_t i) {
     action_end(buffer);
 
     while (i > 0) {
-        Selection* sel = array_peek(buffer->selections);
+        Selection* sel = selection_array_peek(buffer->selections);
         if (buffer->selections->size > 1 && sel->primary) {
             // Going Backwards: remove cursors.
-            selection_destroy(array_remove(buffer->selections, 0));
+            selection_array_pop_front(buffer->selections);
         } else {
             Point p = rope_index_to_point(buffer->text, sel->cursor);
             if (p.row >= rope_lines(buffer->text)) break;
             int32_t index = rope_point_to_index(buffer->text, (Point){p.row + 1, p.col});
 
-            Selection* new = selection_create();
-            new->anchor = new->cursor = index;
-            new->col_mem = sel->col_mem;
-            array_add(buffer->selections, new);
+            Selection new = { .cursor = index, .anchor = index, .col_mem = sel->col_mem };
+            selection_array_push_back(buffer->selections, new);
         }
         i--;
     }
 
     // Backwards.
     while (i < 0) {
-        Selection* sel = buffer->selections->data[0];
+        Selection* sel = &buffer->selections->data[0];
         if (buffer->selections->size > 1 && sel->primary) {
             // Going Backwards: remove cursors.
-            selection_destroy(array_pop(buffer->selections));
+            selection_array_pop_back(buffer->selections);
         } else {
             Point p = rope_index_to_point(buffer->text, sel->cursor);
             if (p.row <= 0) break;
             int32_t index = rope_point_to_index(buffer->text, (Point){p.row - 1, p.col});
 
-            Selection* new = selection_create();
-            new->anchor = new->cursor = index;
-            new->col_mem = sel->col_mem;
-            array_insert(buffer->selections, 0, new);
+            Selection new = { .cursor = index, .anchor = index, .col_mem = sel->col_mem };
+            selection_array_push_front(buffer->selections, new);
         }
         i++;
     }
@@ -1150,10 +1961,24 @@ FindTarget* find_target_create (Rope* text) {
     }
 
     // Compute prefix table.
-    //  ...
+    //  -> ptable[j]: longest proper border of codepoints[0, j), where a
+    //      forward match resumes after failing with j characters matched.
+    for (uint32_t j = 2; j < size; j++) {
+        uint32_t k = ptable[j - 1];
+        while (k > 0 && codepoints[j - 1] != codepoints[k]) k = ptable[k];
+        if (codepoints[j - 1] == codepoints[k]) k++;
+        ptable[j] = k;
+    }
 
     // Compute suffix table.
-    //  ...
+    //  -> The same for the reversed target, indexed from the end:
+    //      stable[size - 1 - j] for j characters matched backwards.
+    for (uint32_t j = 2; j < size; j++) {
+        uint32_t k = stable[size - j];
+        while (k > 0 && codepoints[size - j] != codepoints[size - 1 - k]) k = stable[size - 1 - k];
+        if (codepoints[size - j] == codepoints[size - 1 - k]) k++;
+        stable[size - 1 - j] = k;
+    }
 
     // Allocate and Initialize.
     FindTarget* target = malloc(sizeof(FindTarget));
@@ -1161,10 +1986,33 @@ FindTarget* find_target_create (Rope* text) {
     target->ptable = ptable;
     target->stable = stable;
     target->size = size;
+    target->regex = NULL;
+    return target;
+}
+
+FindTarget* find_target_create_regex (Rope* text, const char** error) {
+    uint32_t size = rope_len(text);
+    uint32_t* codepoints = calloc(MAX(1, size), sizeof(uint32_t));
+    {
+        uint32_t* cp = codepoints;
+        rope_foreach(text, rope_codepoint, &cp);
+    }
+
+    Regex* regex = regex_create(codepoints, size, error);
+    if (regex == NULL) {
+        free(codepoints);
+        return NULL;
+    }
+
+    FindTarget* target = calloc(1, sizeof(FindTarget));
+    target->codepoints = codepoints;
+    target->size = size;
+    target->regex = regex;
     return target;
 }
 
 void find_target_destroy (FindTarget* target) {
+    if (target->regex != NULL) regex_destroy(target->regex);
     free(target->codepoints);
     free(target->ptable);
     free(target->stable);
@@ -1182,68 +2030,131 @@ typedef struct {
     int32_t location;
 } Find;
 
+// KMP over whole content nodes; outside a partial match, the scan skips
+//  straight to the next occurrence of the target's first character.
 static
-bool rope_find_next (uint32_t i, uint32_t ch, void* data) {
+bool rope_find_next (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
     Find* find = data;
-
-    if (ch == find->target->codepoints[find->j]) {
-        find->j++;
-        if (find->j >= find->target->size) {
-            // Match found!
-            find->found = true;
-            find->location = i - find->target->size + 1;
-            return false;
+    FindTarget* target = find->target;
+    const uint32_t* codepoints = target->codepoints;
+    uint32_t first = codepoints[0];
+    int32_t j = find->j;
+
+    for (uint32_t x = 0; x < n; x++) {
+        if (j == 0) {
+            while (x < n && chars[x] != first) x++;
+            if (x == n) break;
+        }
+        uint32_t ch = chars[x];
+
+        while (j > 0 && ch != codepoints[j]) j = target->ptable[j];
+        if (ch == codepoints[j]) {
+            j++;
+            if (j >= target->size) {
+                // Match found!
+                find->found = true;
+                find->location = i + x - target->size + 1;
+                return false;
+            }
         }
-    } else {
-        find->j = find->target->ptable[find->j];
     }
 
+    find->j = j;
     return true;
 }
 
+// The same backwards, skipping to the target's last character.
 static
-bool rope_find_prev (uint32_t i, uint32_t ch, void* data) {
+bool rope_find_prev (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
     Find* find = data;
-
-    if (ch == find->target->codepoints[find->target->size - find->j - 1]) {
-        find->j++;
-        if (find->j >= find->target->size) {
-            // Match found!
-            find->found = true;
-            find->location = i;
-            return false;
+    FindTarget* target = find->target;
+    const uint32_t* codepoints = target->codepoints;
+    int32_t size = target->size;
+    uint32_t last = codepoints[size - 1];
+    int32_t j = find->j;
+
+    for (int64_t x = (int64_t) n - 1; x >= 0; x--) {
+        if (j == 0) {
+            while (x >= 0 && chars[x] != last) x--;
+            if (x < 0) break;
+        }
+        uint32_t ch = chars[x];
+
+        while (j > 0 && ch != codepoints[size - j - 1]) j = target->stable[size - j - 1];
+        if (ch == codepoints[size - j - 1]) {
+            j++;
+            if (j >= size) {
+                // Match found!
+                find->found = true;
+                find->location = i + x;
+                return false;
+            }
         }
-    } else {
-        find->j = find->target->stable[find->target->size - find->j - 1];
     }
 
+    find->j = j;
     return true;
 }
 
+// First match starting at or after 'from'.
+bool find_target_next (FindTarget* target, Rope* text, uint32_t from, uint32_t* start, uint32_t* end) {
+    if (target->regex != NULL) return regex_search(target->regex, text, from, start, end);
+
+    Find data = { .target = target };
+    rope_foreach_chunk_substr(text, from, rope_len(text), rope_find_next, &data);
+    *start = data.location;
+    *end = data.location + target->size;
+    return data.found;
+}
+
+// Match starting after the start of 'sel'.
+//  -> Regex matches may not overlap the selection, or it could select a
+//      part of its own match.
+static
+bool find_after (Rope* text, FindTarget* target, Selection* sel, uint32_t* start, uint32_t* end) {
+    uint32_t from = head(sel) + 1;
+    if (target->regex != NULL && tail(sel) > head(sel)) from = tail(sel);
+    return find_target_next(target, text, from, start, end);
+}
+
+// Match ending before the end of 'sel'.
+static
+bool find_before (Rope* text, FindTarget* target, Selection* sel, uint32_t* start, uint32_t* end) {
+    if (tail(sel) == 0) return false;
+    if (target->regex != NULL) {
+        uint32_t before = tail(sel) > head(sel) ? head(sel) : tail(sel) - 1;
+        return regex_search_reverse(target->regex, text, before, start, end);
+    }
+
+    Find data = { .target = target };
+    rope_foreach_chunk_reverse_substr(text, 0, tail(sel) - 1, rope_find_prev, &data);
+    *start = data.location;
+    *end = data.location + target->size;
+    return data.found;
+}
+
 void textbuffer_find_next (TextBuffer* buffer, FindTarget* target, int32_t i) {
     action_end(buffer);
     assert(target->size > 0);
 
     while (i > 0) {
-        Selection* sel = array_peek(buffer->selections);
+        Selection* sel = selection_array_peek(buffer->selections);
         int32_t sentinel = -1;
         if (buffer->selections->size > 1 && sel->primary) {
             // Going Backwards.
-            sel = buffer->selections->data[0];
-            sentinel = head(buffer->selections->data[1]);
+            sel = &buffer->selections->data[0];
+            sentinel = head(&buffer->selections->data[1]);
         }
 
-        Find data = { .target = target };
-        rope_foreach_suffix(buffer->text, head(sel) + 1, rope_find_next, &data);
-
-        if (data.found) {
-            if (sentinel >= 0 && data.location + target->size > sentinel) {
+        uint32_t start, end;
+        if (find_after(buffer->text, target, sel, &start, &end)) {
+            if (sentinel >= 0 && end > sentinel) {
                 // Sentinel boundary crossed: remove cursor.
                 //  -> must remove 'going backwards' cursor.
-                selection_destroy(array_remove(buffer->selections, 0));
+                selection_array_pop_front(buffer->selections);
             } else {
-                sel->anchor = data.location;
-                sel->cursor = data.location + target->size;
+                sel->anchor = start;
+                sel->cursor = end;
                 buffer->cursor_dmg = true;
             }
         } else {
@@ -1253,25 +2164,23 @@ void textbuffer_find_next (TextBuffer* buffer, FindTarget* target, int32_t i) {
         i--;
     }
     while (i < 0) {
-        Selection* sel = buffer->selections->data[0];
+        Selection* sel = &buffer->selections->data[0];
         int32_t sentinel = -1;
         if (buffer->selections->size > 1 && sel->primary) {
             // Going Backwards.
-            sel = array_peek(buffer->selections);
-            sentinel = tail(buffer->selections->data[buffer->selections->size - 2]);
+            sel = selection_array_peek(buffer->selections);
+            sentinel = tail(&buffer->selections->data[buffer->selections->size - 2]);
         }
 
-        Find data = { .target = target };
-        rope_foreach_reverse_prefix(buffer->text, tail(sel) - 1, rope_find_prev, &data);
-
-        if (data.found) {
-            if (sentinel >= 0 && data.location < sentinel) {
+        uint32_t start, end;
+        if (find_before(buffer->text, target, sel, &start, &end)) {
+            if (sentinel >= 0 && start < sentinel) {
                 // Sentinel boundary crossed: remove cursor.
                 //  -> must remove 'going backwards' cursor.
-                selection_destroy(array_pop(buffer->selections));
+                selection_array_pop_back(buffer->selections);
             } else {
-                sel->anchor = data.location;
-                sel->cursor = data.location + target->size;
+                sel->anchor = start;
+                sel->cursor = end;
                 buffer->cursor_dmg = true;
             }
         } else {
@@ -1287,18 +2196,18 @@ void textbuffer_find_add_next (TextBuffer* buffer, FindTarget* target, int32_t i
     assert(target->size > 0);
 
     while (i > 0) {
-        Selection* sel = array_peek(buffer->selections);
+        Selection* sel = selection_array_peek(buffer->selections);
         if (buffer->selections->size > 1 && sel->primary) {
             // Going Backwards: remove cursors.
-            selection_destroy(array_remove(buffer->selections, 0));
+            selection_array_pop_front(buffer->selections);
         } else {
-            Find data = { .target = target };
-            rope_foreach_suffix(buffer->text, head(sel) + 1, rope_find_next, &data);
-
-            if (data.found) {
-                array_add(buffer->selections, sel = selection_copy(sel));
-                sel->anchor = data.location;
-                sel->cursor = data.location + target->size;
+            uint32_t start, end;
+            if (find_after(buffer->text, target, sel, &start, &end)) {
+                Selection copy = *sel;
+                copy.primary = false;
+                sel = selection_array_push_back(buffer->selections, copy);
+                sel->anchor = start;
+                sel->cursor = end;
                 buffer->cursor_dmg = true;
             } else {
                 i = 0;
@@ -1308,18 +2217,18 @@ void textbuffer_find_add_next (TextBuffer* buffer, FindTarget* target, int32_t i
         i--;
     }
     while (i < 0) {
-        Selection* sel = buffer->selections->data[0];
+        Selection* sel = &buffer->selections->data[0];
         if (buffer->selections->size > 1 && sel->primary) {
             // Going Backwards: remove cursors.
-            selection_destroy(array_pop(buffer->selections));
+            selection_array_pop_back(buffer->selections);
         } else {
-            Find data = { .target = target };
-            rope_foreach_reverse_prefix(buffer->text, tail(sel) - 1, rope_find_prev, &data);
-
-            if (data.found) {
-                array_insert(buffer->selections, 0, sel = selection_copy(sel));
-                sel->anchor = data.location;
-                sel->cursor = data.location + target->size;
+            uint32_t start, end;
+            if (find_before(buffer->text, target, sel, &start, &end)) {
+                Selection copy = *sel;
+                copy.primary = false;
+                sel = selection_array_push_front(buffer->selections, copy);
+                sel->anchor = start;
+                sel->cursor = end;
                 buffer->cursor_dmg = true;
             } else {
                 i = 0;
@@ -1329,3 +2238,263 @@ void textbuffer_find_add_next (TextBuffer* buffer, FindTarget* target, int32_t i
         i++;
     }
 }
+
+
+// -- Replace All -- //
+
+typedef struct {
+    FindTarget* target;
+    uint32_t j;
+
+    // Source text, and the first position not yet in the result.
+    Rope* src;
+    uint32_t plain;
+
+    // Content node being scanned.
+    const uint32_t* chunk;
+    uint32_t chunk_at;
+
+    RopeBuilder* out;
+    Rope* inserted;
+
+    // Matches replaced, the source span from the first to the end of the
+    //  last, and their deltas while there are few enough to keep.
+    uint32_t count;
+    uint32_t first;
+    uint32_t last;
+    Array* deltas;
+
+    // Selection ends, in source and result positions.
+    uint32_t marks[2];
+    uint32_t moved[2];
+} ReplaceAll;
+
+// Pass the next n source characters through unchanged.
+//  -> Characters held in a partial match are the target's own prefix, so they
+//      are taken from the target when the match fails.
+static
+void replace_all_copy (ReplaceAll* r, uint32_t n, bool from_target) {
+    uint32_t out = rope_builder_len(r->out);
+    for (int m = 0; m < 2; m++)
+        if (r->marks[m] >= r->plain && r->marks[m] < r->plain + n) r->moved[m] = out + r->marks[m] - r->plain;
+
+    if (from_target) {
+        rope_builder_put(r->out, r->target->codepoints, n);
+    } else if (r->plain >= r->chunk_at && r->chunk != NULL) {
+        // Within the current content node: no need to find it again.
+        rope_builder_put(r->out, r->chunk + (r->plain - r->chunk_at), n);
+    } else {
+        rope_builder_put_substr(r->out, r->src, r->plain, r->plain + n);
+    }
+    r->plain += n;
+}
+
+// Note the match at source [start, end), replaced by 'inserted' at 'pos' in the result.
+//  -> Past HIST_SNAPSHOT_DELTAS matches the deltas are dropped: the action
+//      gets one delta spanning all of them instead.
+static
+void replace_all_note (ReplaceAll* r, uint32_t pos, uint32_t start, uint32_t end, Rope* inserted) {
+    if (r->count++ == 0) r->first = start;
+    r->last = end;
+
+    if (r->count > HIST_SNAPSHOT_DELTAS) {
+        delta_array_clear(r->deltas);
+        return;
+    }
+    Rope* removed = end > start ? rope_substr(r->src, start, end) : NULL;
+    array_add(r->deltas, delta_create(pos, removed, inserted == NULL ? NULL : rope_copy(inserted)));
+}
+
+// Streaming KMP over the source's content nodes; unmatched runs are copied
+//  into the result in bulk, sharing whole content nodes.
+static
+bool rope_replace_all (uint32_t i, const uint32_t* chars, uint32_t n, void* data) {
+    ReplaceAll* r = data;
+    FindTarget* target = r->target;
+    const uint32_t* codepoints = target->codepoints;
+    uint32_t first = codepoints[0];
+    uint32_t j = r->j;
+
+    r->chunk = chars;
+    r->chunk_at = i;
+
+    for (uint32_t x = 0; x < n; x++) {
+        // Outside a match: skip ahead to the target's first character.
+        if (j == 0) {
+            while (x < n && chars[x] != first) x++;
+            if (x == n) break;
+        }
+        uint32_t ch = chars[x];
+
+        while (j > 0 && ch != codepoints[j]) {
+            uint32_t keep = target->ptable[j];
+            replace_all_copy(r, j - keep, true);
+            j = keep;
+        }
+        if (ch != codepoints[j]) continue;
+
+        // Start of a possible match: flush the run before it.
+        if (j == 0) replace_all_copy(r, i + x - r->plain, false);
+
+        j++;
+        if (j == target->size) {
+            uint32_t pos = rope_builder_len(r->out);
+            for (int m = 0; m < 2; m++)
+                if (r->marks[m] >= r->plain && r->marks[m] < r->plain + target->size) r->moved[m] = pos;
+
+            replace_all_note(r, pos, r->plain, r->plain + target->size, r->inserted);
+            if (r->inserted != NULL) rope_builder_put_substr(r->out, r->inserted, 0, rope_len(r->inserted));
+
+            r->plain += target->size;
+            j = 0;
+        }
+    }
+
+    r->j = j;
+    return true;
+}
+
+// Regex matches, left to right: each found from the end of the last (or one
+//  past an empty match), with its replacement expanded from its groups.
+static
+void replace_all_regex (ReplaceAll* r, Rope* text) {
+    Regex* regex = r->target->regex;
+    uint32_t ngroups = regex_groups(regex);
+    uint32_t* groups = malloc(2 * ngroups * sizeof(uint32_t));
+    bool captures = text != NULL && regex_expand_uses_groups(text);
+
+    uint32_t len = rope_len(r->src);
+    uint32_t from = 0;
+    uint32_t start, end;
+    while (from <= len && regex_search(regex, r->src, from, &start, &end)) {
+        from = end > start ? end : end + 1;
+
+        Rope* inserted = NULL;
+        if (text != NULL) {
+            if (captures) {
+                regex_captures(regex, r->src, start, end, groups);
+            } else {
+                for (uint32_t g = 0; g < 2 * ngroups; g++) groups[g] = UINT32_MAX;
+                groups[0] = start;
+                groups[1] = end;
+            }
+            inserted = regex_expand(r->src, text, groups, ngroups);
+            if (rope_len(inserted) == 0) {
+                rope_destroy(inserted);
+                inserted = NULL;
+            }
+        }
+        if (end == start && inserted == NULL) continue;
+
+        replace_all_copy(r, start - r->plain, false);
+
+        uint32_t pos = rope_builder_len(r->out);
+        for (int m = 0; m < 2; m++)
+            if (r->marks[m] >= r->plain && r->marks[m] < end) r->moved[m] = pos;
+
+        replace_all_note(r, pos, start, end, inserted);
+        if (inserted != NULL) {
+            rope_builder_put_substr(r->out, inserted, 0, rope_len(inserted));
+            rope_destroy(inserted);
+        }
+        r->plain = end;
+    }
+
+    free(groups);
+}
+
+// Replace every occurrence of 'target' with 'text' (NULL for nothing), in one
+//  pass that builds the new rope, as a single undoable action.
+//  -> Many matches are recorded as one delta, from the first to the last.
+//  -> Matches are found left to right without overlap.
+//  -> Regex targets expand groups in 'text' for each match.
+//  -> Returns the number of occurrences replaced.
+uint32_t textbuffer_replace_all (TextBuffer* buffer, FindTarget* target, Rope* text) {
+    assert(target->size > 0);
+    action_end(buffer);
+
+    Selection* sel = selection_array_keep_primary(buffer->selections);
+
+    ReplaceAll r = {
+        .target = target,
+        .src = buffer->text,
+        .out = rope_builder_create(),
+        .inserted = text != NULL && rope_len(text) > 0 ? text : NULL,
+        .deltas = array_create(),
+        .marks = { sel->cursor, sel->anchor },
+        .moved = { UINT32_MAX, UINT32_MAX },
+    };
+
+    if (target->regex != NULL) {
+        replace_all_regex(&r, r.inserted);
+    } else {
+        rope_foreach_chunk(buffer->text, rope_replace_all, &r);
+    }
+    r.chunk = NULL;
+    replace_all_copy(&r, rope_len(buffer->text) - r.plain, false);
+    Rope* result = rope_builder_finish(r.out);
+
+    if (r.count == 0) {
+        rope_destroy(result);
+        array_destroy(r.deltas);
+        return 0;
+    }
+
+    action_begin(buffer, ACTION_EDIT);
+    if (r.count > HIST_SNAPSHOT_DELTAS) {
+        // The text before the first match and after the last is unchanged.
+        uint32_t end = rope_len(result) - (rope_len(buffer->text) - r.last);
+        Rope* removed = r.last > r.first ? rope_substr(buffer->text, r.first, r.last) : NULL;
+        Rope* inserted = end > r.first ? rope_substr(result, r.first, end) : NULL;
+        array_add(buffer->deltas, delta_create(r.first, removed, inserted));
+    } else {
+        for (int i = 0; i < r.deltas->size; i++) array_add(buffer->deltas, r.deltas->data[i]);
+    }
+    array_destroy(r.deltas);
+
+    rope_destroy(buffer->text);
+    buffer->text = result;
+    line_index_clear(buffer->line_state);
+    if (buffer->matches != NULL) match_index_reset(buffer->matches);
+
+    // Ends at the end of the text.
+    for (int m = 0; m < 2; m++)
+        if (r.moved[m] == UINT32_MAX) r.moved[m] = rope_len(buffer->text);
+    sel->cursor = r.moved[0];
+    sel->anchor = r.moved[1];
+    sel->col_mem = rope_index_to_point(buffer->text, sel->cursor).col;
+
+    action_end(buffer);
+    return r.count;
+}
+
+void textbuffer_find_expand (TextBuffer* buffer, FindTarget* target, Rope* text, Array* out) {
+    Regex* regex = target->regex;
+    uint32_t ngroups = regex == NULL ? 1 : regex_groups(regex);
+    uint32_t* groups = malloc(2 * ngroups * sizeof(uint32_t));
+
+    for (int x = 0; x < buffer->selections->size; x++) {
+        Selection* sel = &buffer->selections->data[x];
+        if (regex == NULL) {
+            array_add(out, rope_copy(text));
+            continue;
+        }
+
+        // Groups of the match at the selection, or just the selection itself.
+        regex_captures(regex, buffer->text, head(sel), tail(sel), groups);
+        if (groups[1] != tail(sel)) {
+            for (uint32_t g = 0; g < 2 * ngroups; g++) groups[g] = UINT32_MAX;
+            groups[0] = head(sel);
+            groups[1] = tail(sel);
+        }
+        array_add(out, regex_expand(buffer->text, text, groups, ngroups));
+    }
+
+    free(groups);
+}
+
+// Index every match of 'target' (taking it over) at idle; NULL drops the index.
+void textbuffer_find_index (TextBuffer* buffer, FindTarget* target) {
+    if (buffer->matches != NULL) match_index_destroy(buffer->matches);
+    buffer->matches = target == NULL ? NULL : match_index_create(target);
+}
@@ -2,24 +2,41 @@
 
 #include "main.h"
 
-struct selection {
-    int32_t cursor, anchor;
-    int32_t col_mem;
+#include <sys/stat.h>
 
-    bool primary;
-};
+#include "selection.h"
 
 struct textbuffer {
     Rope* text;
 
-    Array* undo;
-    Array* redo;
+    // Path from the oldest undo state to the current one.
+    Ring* undo;
+
+    // Discarded states, freed at idle.
+    Array* hist_garbage;
+
+    // Sequence number of the next state, and the log states are appended to.
+    uint32_t hist_seq;
+    HistLog* log;
+    uint32_t log_gen;
+
+    // Deltas of the action in progress, and the text before it.
+    Array* deltas;
+    Rope* action_base;
+
+    // Bytes retained by undo/redo states, and the cap on them.
+    uint64_t hist_bytes;
+    uint64_t hist_budget;
+    uint64_t hist_unsnapped;
 
     bool action_state;
     uint32_t action_type;
+    // When the open action began, and when it was last edited.
+    double action_start;
+    double action_time;
 
-    Array* selections;
-    Array* pre_selections;
+    SelectionArray* selections;
+    SelectionArray* pre_selections;
 
     uint32_t tab_width;
     bool hard_tabs;
@@ -27,8 +44,19 @@ struct textbuffer {
     bool cursor_dmg;
     bool text_dmg;
 
-    Array* line_state;
+    LineIndex* line_state;
     Mode* mode;
+
+    // Matches of the find query, while finding.
+    MatchIndex* matches;
+};
+
+// One replacement of text: [pos, pos + len(removed)) became 'inserted'.
+//  -> NULL ropes stand for empty text.
+struct delta {
+    uint32_t pos;
+    Rope* removed;
+    Rope* inserted;
 };
 
 struct find_target {
@@ -36,6 +64,9 @@ struct find_target {
     uint32_t* ptable;
     uint32_t* stable;
     int32_t size;
+
+    // Set when the target is a pattern rather than literal text.
+    Regex* regex;
 };
 
 
@@ -53,10 +84,32 @@ void textbuffer_primary_point (TextBuffer* buffer, Point* P);
 void textbuffer_set_mode (TextBuffer* buffer, Mode* mode);
 
 
+void textbuffer_line_state_fill (TextBuffer* buffer, int32_t line);
+
+void textbuffer_line_state_view (TextBuffer* buffer, int32_t line, LineState* state);
+
+void textbuffer_line_state_note (TextBuffer* buffer, int32_t line, LineState* end);
+
+bool textbuffer_idle (TextBuffer* buffer);
+
+int32_t textbuffer_indent_hint (TextBuffer* buffer, int32_t line);
+
+int32_t textbuffer_match_bracket (TextBuffer* buffer, int32_t i);
+
+
 void textbuffer_undo (TextBuffer* buffer);
 
 void textbuffer_redo (TextBuffer* buffer);
 
+void textbuffer_undo_branch (TextBuffer* buffer, int32_t i);
+
+
+bool textbuffer_history_attach (TextBuffer* buffer, const char* path, struct stat* st, uint64_t hash);
+
+void textbuffer_history_saved (TextBuffer* buffer, const char* path, struct stat* st, uint64_t hash);
+
+void textbuffer_history_sync (TextBuffer* buffer);
+
 
 
 void textbuffer_edit_char (TextBuffer* buffer, uint32_t ch, int32_t i);
@@ -103,6 +156,8 @@ void textbuffer_cursor_line (TextBuffer* buffer, int32_t i, bool s);
 
 void textbuffer_cursor_paragraph (TextBuffer* buffer, int32_t i, bool s);
 
+void textbuffer_cursor_bracket (TextBuffer* buffer, bool s);
+
 void textbuffer_cursor_goto (TextBuffer* buffer, int32_t row, int32_t col, bool s);
 
 
@@ -126,13 +181,27 @@ void textbuffer_selection_add_next_line (TextBuffer* buffer, int32_t i);
 
 FindTarget* find_target_create (Rope* text);
 
+// A target matching the regular expression in 'text'; NULL (with *error set)
+//  if it does not parse.
+FindTarget* find_target_create_regex (Rope* text, const char** error);
+
 void find_target_destroy (FindTarget* target);
 
+bool find_target_next (FindTarget* target, Rope* text, uint32_t from, uint32_t* start, uint32_t* end);
+
 
 void textbuffer_find_next (TextBuffer* buffer, FindTarget* target, int32_t i);
 
 void textbuffer_find_add_next (TextBuffer* buffer, FindTarget* target, int32_t i);
 
+uint32_t textbuffer_replace_all (TextBuffer* buffer, FindTarget* target, Rope* text);
+
+// Replacement text for each selection: 'text' with the groups of the
+//  target's match at the selection expanded (unchanged for literal targets).
+void textbuffer_find_expand (TextBuffer* buffer, FindTarget* target, Rope* text, Array* out);
+
+void textbuffer_find_index (TextBuffer* buffer, FindTarget* target);
+
 
 // void textbuffer_selection_split (TextBuffer* buffer, int32_t i);
 //
@@ -7,6 +7,7 @@
 #include "textbuffer.h"
 #include "colorizer.h"
 #include "mode.h"
+#include "matchindex.h"
 
 
 TextView* textview_create (TextBuffer* buffer) {
@@ -47,7 +48,11 @@ struct draw_char_data {
 
     uint32_t tab_width;
     Colorizer* colorizer;
-    Array* selections;
+    SelectionArray* selections;
+
+    // Find matches, and the first one that may cover the next character.
+    MatchIndex* matches;
+    uint32_t match;
 };
 
 static
@@ -58,11 +63,18 @@ bool char_style (uint32_t i, uint32_t ch, void* d) {
     // Cursor Style.
     int32_t style = 0;
     for (int x = 0; x < data->selections->size; x++) {
-        Selection* sel = data->selections->data[x];
+        Selection* sel = &data->selections->data[x];
         if (head(sel) <= i && i < tail(sel)) style |= STYLE_SELECTION;
         if (i == sel->cursor && !cursor_blink) style |= STYLE_CURSOR;
     }
 
+    // Match Style.
+    MatchIndex* matches = data->matches;
+    if (matches != NULL) {
+        while (data->match < matches->size && matches->bounds[2*data->match + 1] <= i) data->match++;
+        if (data->match < matches->size && matches->bounds[2*data->match] <= i) style |= STYLE_MATCH;
+    }
+
     // -- Emit Character and Style -- //
 
     // Special case: Hard Tab.
@@ -102,13 +114,6 @@ bool char_style (uint32_t i, uint32_t ch, void* d) {
     return true;
 }
 
-static
-bool char_style_fast (uint32_t i, uint32_t ch, void* d) {
-    Colorizer* colorizer = d;
-    colorize_next_char_fast(colorizer, ch);
-    return true;
-}
-
 static
 int scroll_len (double dtime) {
     int r = (int) (0.05/dtime);
@@ -157,8 +162,8 @@ void textview_draw (TextView* view, Box* window, MouseEvent* mstate) {
     // Update Scroll.
     if (buffer->cursor_dmg) {
         // Which cursor to follow.
-        Selection* sel = buffer->selections->data[0];
-        if (sel->primary) sel = array_peek(buffer->selections);
+        Selection* sel = &buffer->selections->data[0];
+        if (sel->primary) sel = selection_array_peek(buffer->selections);
 
         // Scroll Line.
         int32_t row = rope_index_to_point(buffer->text, sel->cursor).row;
@@ -188,26 +193,15 @@ void textview_draw (TextView* view, Box* window, MouseEvent* mstate) {
     // Colorizer data.
     Colorizer colorizer = { .mode = buffer->mode };
 
-    // Pre-fill buffer line-state array up to first line.
-    while (buffer->line_state->size < view->scroll_line) {
-        // Line number to fill in.
-        int32_t line = buffer->line_state->size;
-
-        // Line Start State.
-        int32_t start_state = 0;
-        if (line > 0) {
-            start_state = (int32_t)(intptr_t) buffer->line_state->data[line-1];
-        }
-
-        // Line Start and End.
-        int32_t start = rope_point_to_index(buffer->text, (Point) {line, 0});
-        int32_t end = rope_point_to_index(buffer->text, (Point) {line, INT_MAX});
+    // Start state of the first line; later lines carry on from the previous one.
+    LineState state;
+    textbuffer_line_state_view(buffer, view->scroll_line, &state);
 
-        // Fill in.
-        colorize_begin_line(&colorizer, start_state);
-        rope_foreach_substr(buffer->text, start, end, char_style_fast, &colorizer);
-        char_style_fast(end, '\n', &colorizer);
-        array_add(buffer->line_state, (void*)(intptr_t) colorizer.comment_depth);
+    // First match that can show.
+    uint32_t match = 0;
+    if (buffer->matches != NULL) {
+        int32_t first = rope_point_to_index(buffer->text, (Point) {view->scroll_line, 0});
+        match = match_index_find(buffer->matches, first);
     }
 
     for (int i = 0; i < text_height; i++) {
@@ -221,13 +215,6 @@ void textview_draw (TextView* view, Box* window, MouseEvent* mstate) {
         int32_t start = rope_point_to_index(buffer->text, (Point) {view->scroll_line + i, 0});
         int32_t end = rope_point_to_index(buffer->text, (Point) {view->scroll_line + i, INT_MAX});
 
-        // Line Start State.
-        int32_t start_state = 0;
-        assert(buffer->line_state->size >= view->scroll_line + i && "Invalid line state array");
-        if (view->scroll_line + i > 0) {
-            start_state = (int32_t)(intptr_t) buffer->line_state->data[view->scroll_line + i - 1];
-        }
-
         // Line number.
         output_cup(window->y + i, window->x);
         output_normal();
@@ -249,16 +236,19 @@ void textview_draw (TextView* view, Box* window, MouseEvent* mstate) {
             .tab_width = buffer->tab_width,
             .selections = buffer->selections,
             .colorizer = &colorizer,
+            .matches = buffer->matches,
+            .match = match,
         };
 
         // Get Line Content and Style.
-        colorize_begin_line(&colorizer, start_state);
+        colorize_begin_line(&colorizer, &state);
         rope_foreach_substr(buffer->text, start, end, char_style, &data);
         char_style(end, '\n', &data);
 
-        // Buffer line state if not filled in.
-        if (buffer->line_state->size <= view->scroll_line + i)
-            array_add(buffer->line_state, (void*) (intptr_t) colorizer.comment_depth);
+        // Keep the end state for the next line and the buffer's line index.
+        colorize_end_line(&colorizer, &state);
+        textbuffer_line_state_note(buffer, view->scroll_line + i, &state);
+        match = data.match;
 
         //  Write Line Content.
         int32_t current_style = 0;
@@ -276,6 +266,8 @@ void textview_draw (TextView* view, Box* window, MouseEvent* mstate) {
 
                 if (style & STYLE_SELECTION) {
                     output_setbg(12);
+                } else if (style & STYLE_MATCH) {
+                    output_setbg(8);
                 }
                 if (style & STYLE_CURSOR) {
                     output_underline();
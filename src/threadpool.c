@@ -0,0 +1,88 @@
+#include "threadpool.h"
+
+#include "ring.h"
+
+
+static
+void* thread_pool_worker (void* arg) {
+    ThreadPool* pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->tasks->size == 0 && !pool->stop) pthread_cond_wait(&pool->work, &pool->lock);
+        if (pool->tasks->size == 0) break;
+
+        thread_task_fn fn = (thread_task_fn) ring_shift(pool->tasks);
+        void* data = ring_shift(pool->tasks);
+
+        pthread_mutex_unlock(&pool->lock);
+        fn(data);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->active == 0) pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+ThreadPool* thread_pool_create (uint32_t threads) {
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+
+    ThreadPool* pool = malloc(sizeof(ThreadPool));
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    pool->count = 0;
+    pool->tasks = ring_create();
+    pool->active = 0;
+    pool->stop = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (uint32_t i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[pool->count], NULL, thread_pool_worker, pool) == 0) pool->count++;
+    }
+    return pool;
+}
+
+// Finishes the tasks already submitted first.
+void thread_pool_destroy (ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->count; i++) pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    ring_destroy(pool->tasks);
+    free(pool->threads);
+    free(pool);
+}
+
+
+void thread_pool_submit (ThreadPool* pool, thread_task_fn fn, void* data) {
+    // No threads to run it: run it here.
+    if (pool->count == 0) {
+        fn(data);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    ring_push(pool->tasks, (void*) fn);
+    ring_push(pool->tasks, data);
+    pool->active++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_wait (ThreadPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "main.h"
+
+#include <pthread.h>
+
+//
+// Thread Pool.
+//  -> Worker threads running submitted tasks in FIFO order.
+//  -> Tasks may submit further tasks; thread_pool_wait returns once every
+//      task, including those, has finished.
+//
+
+typedef void (*thread_task_fn) (void* data);
+
+struct thread_pool {
+    pthread_t* threads;
+    uint32_t count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+
+    // Pending tasks, as function/data pairs.
+    Ring* tasks;
+    // Tasks submitted but not finished.
+    uint32_t active;
+    bool stop;
+};
+
+
+// 'threads' of zero means one per online processor.
+ThreadPool* thread_pool_create (uint32_t threads);
+
+void thread_pool_destroy (ThreadPool* pool);
+
+
+void thread_pool_submit (ThreadPool* pool, thread_task_fn fn, void* data);
+
+void thread_pool_wait (ThreadPool* pool);